@@ -1,15 +1,22 @@
+#include <algorithm>
+#include <atomic>
 #include <filesystem>
 #include <iomanip>
 #include <sstream>
 
+#include <SFML/Audio.hpp>
 #include <SFML/Graphics.hpp>
 #include <SFML/Window.hpp>
 
 #include <imgui-SFML.h>
 #include <imgui.h>
 
+#include <core/Movie.hpp>
 #include <core/NES.hpp>
+#include <core/RomDatabase.hpp>
+#include <frontend/RomLibrary.hpp>
 #include <tools/CommandLine.hpp>
+#include <tools/SPSCRing.hpp>
 
 bool debug = false;
 bool step = true;
@@ -21,10 +28,68 @@ sf::Clock timing_clock;
 double    frame_time = 0;
 size_t    speed_update = 10;
 double    speed = 100;
-uint64_t  elapsed_cycles = 0;
 uint64_t  speed_mesure_cycles = 0;
 size_t    frame_count = 0;
 
+// Run-ahead: Emulates a few frames into the future each frame and displays the last one to hide the games internal input lag.
+int       run_ahead_frames = 0;
+SaveState run_ahead_state;
+sf::Clock emulation_clock;
+double    emulation_time = 0;     // Time spent emulating since the last speed update, in seconds
+double    run_ahead_time = 0;     // Part of emulation_time spent on run-ahead frames, in seconds
+size_t    run_ahead_count = 0;    // Frames followed by a run-ahead since the last speed update
+double    run_ahead_cost_ms = 0;  // Average run-ahead cost per frame, in ms
+double    run_ahead_cost_pct = 0; // Share of emulation time spent on run-ahead
+
+// Audio: The emulation pushes the samples of each frame to the ring, the SFML audio thread pulls them.
+// Its fill level paces the emulation, dynamic rate control keeps it around the target.
+constexpr unsigned int audio_sample_rate = 48000;
+constexpr size_t       audio_target_fill = 2 * audio_sample_rate / 60; // About 2 frames of latency
+constexpr double       audio_max_rate_adjustment = 0.005;
+SPSCRing<int16_t>      audio_ring(8192);
+std::vector<int16_t>   audio_frame;
+std::atomic<uint64_t>  audio_pulls{0}; // Incremented by the audio thread each time it pulls samples
+
+// Pacing without audio (no device, or a stalled stream): The ring would never drain, frames are timed by the wall clock instead.
+constexpr double frame_duration = 1.0 / 60.0988; // NTSC, seconds
+const sf::Time   audio_stall_timeout = sf::milliseconds(100);
+sf::Clock        audio_stall_clock;               // Since the last pull
+uint64_t         audio_last_pulls = 0;
+sf::Clock        wall_clock;                      // Since the last pacing wait
+
+class AudioSink : public sf::SoundStream {
+  public:
+    AudioSink() { initialize(1, audio_sample_rate); }
+    ~AudioSink() { stop(); }
+
+  private:
+    int16_t _chunk[512];
+    int16_t _last = 0;
+
+    // Audio thread
+    bool onGetData(Chunk& data) override {
+        const auto count = audio_ring.pop(_chunk, std::size(_chunk));
+        audio_pulls.fetch_add(1, std::memory_order_relaxed);
+        if(count > 0)
+            _last = _chunk[count - 1];
+        std::fill(_chunk + count, std::end(_chunk), _last); // Underrun: Holds the last level rather than clicking
+        data.samples = _chunk;
+        data.sampleCount = std::size(_chunk);
+        return true;
+    }
+    void onSeek(sf::Time) override {}
+};
+
+// Hands the samples of the last frame to the audio thread (dropped if the ring is full, when fast forwarding) and
+// adjusts the APU output rate by up to audio_max_rate_adjustment to bring the fill level back to the target.
+void push_audio(NES& nes) {
+    audio_frame.resize(nes.apu.samples_available());
+    nes.apu.read_samples(audio_frame.data(), audio_frame.size());
+    audio_ring.push(audio_frame.data(), audio_frame.size());
+    const double error = (double(audio_target_fill) - double(audio_ring.size())) / audio_target_fill;
+    nes.apu.set_rate_adjustment(1.0 + audio_max_rate_adjustment * std::clamp(error, -1.0, 1.0));
+}
+
 // Debug Display
 bool background_pattern = true;
 
@@ -32,30 +97,72 @@ const std::vector<std::string> single_roms{"01-basics.nes", "02-implied.nes", "0
                                            "07-abs_xy.nes", "08-ind_x.nes",   "09-ind_y.nes",     "10-branches.nes",  "11-stack.nes", "12-jmp_jsr.nes",
                                            "13-rts.nes",    "14-rti.nes",     "15-brk.nes",       "16-special.nes"};
 
-std::string explore(const std::string& path) {
-    std::string r;
-
-    // print all the files and directories within directory
-    for(const auto& entry : std::filesystem::directory_iterator(path)) {
-        if(entry.path().filename() == "." || entry.path().filename() == "..")
-            continue;
-        if(std::filesystem::is_directory(entry.path())) {
-            if(ImGui::TreeNode(entry.path().string().c_str())) {
-                r = explore(entry.path().string());
-                ImGui::TreePop();
-            }
-        } else {
-            if(ImGui::Button(entry.path().string().c_str())) {
-                return entry.path().string();
+// ROM library window: Filters the index by name and only lays out the visible rows.
+struct LibraryBrowser {
+    char                     filter[128] = "";
+    RomLibrary::snapshot_t   entries;
+    uint64_t                 generation = ~uint64_t(0);
+    std::string              applied_filter;
+    std::vector<uint32_t>    matches; ///< Indices into entries
+    std::vector<std::string> lowercase_names;
+
+    static std::string lowercase(std::string str) {
+        std::transform(str.begin(), str.end(), str.begin(), [](unsigned char c) { return std::tolower(c); });
+        return str;
+    }
+
+    /// Returns the path of the ROM clicked on, if any.
+    std::string draw(RomLibrary& library) {
+        ImGui::InputText("Filter", filter, sizeof(filter));
+        ImGui::SameLine();
+        if(ImGui::Button("Rescan"))
+            library.rescan();
+
+        // Only refiltered when the index or the filter changed, not every frame.
+        bool refilter = applied_filter != filter;
+        if(const auto g = library.generation(); g != generation) {
+            generation = g;
+            entries = library.entries();
+            lowercase_names.clear();
+            for(const auto& entry : *entries)
+                lowercase_names.push_back(lowercase(entry.name));
+            refilter = true;
+        }
+        if(refilter) {
+            applied_filter = filter;
+            const auto needle = lowercase(applied_filter);
+            matches.clear();
+            for(uint32_t i = 0; i < lowercase_names.size(); ++i)
+                if(lowercase_names[i].find(needle) != std::string::npos)
+                    matches.push_back(i);
+        }
+        ImGui::Text("%zu / %zu ROMs%s", matches.size(), entries->size(), library.scanning() ? " (scanning...)" : "");
+
+        std::string clicked;
+        ImGui::BeginChild("Library", ImVec2(0, 300), true);
+        ImGuiListClipper clipper(static_cast<int>(matches.size()));
+        while(clipper.Step()) {
+            for(int row = clipper.DisplayStart; row < clipper.DisplayEnd; ++row) {
+                const auto& entry = (*entries)[matches[row]];
+                ImGui::PushID(row);
+                if(ImGui::Selectable(entry.name.c_str(), false, entry.supported ? 0 : ImGuiSelectableFlags_Disabled))
+                    clicked = entry.path;
+                ImGui::PopID();
+                if(ImGui::IsItemHovered())
+                    ImGui::SetTooltip("%s\nMapper %u.%u%s, CRC32 %08X%s", entry.path.c_str(), unsigned(entry.mapper), unsigned(entry.submapper), entry.nes2 ? " (NES 2.0)" : "",
+                                      entry.crc32, entry.supported ? "" : "\nUnsupported mapper");
             }
         }
+        ImGui::EndChild();
+        return clicked;
     }
-
-    return r;
-}
+};
 
 int main(int argc, char* argv[]) {
     config::set_folder(argv[0]);
+    // Optional ROM database: Without it, cartridges are described by their headers only
+    if(const auto database = config::to_abs("data/romdb.txt"); std::filesystem::exists(database))
+        RomDatabase::load(database);
 
     NES         nes;
     std::string path = "tests/Super Mario Bros. (Europe) (Rev 0A).nes";
@@ -67,8 +174,31 @@ int main(int argc, char* argv[]) {
         Log::error("Error loading '", path, "'. Exiting...");
         return 0;
     }
+    nes.cartridge.open_battery_save(BatterySave::path_for(path));
 
     nes.reset();
+    nes.apu.set_sample_rate(audio_sample_rate);
+    AudioSink audio;
+    audio.play();
+
+    // Input recording ($record <file>), saved when the window is closed.
+    Movie                          movie;
+    std::unique_ptr<MovieRecorder> recorder;
+    const char*                    record_path = get_option(argc, argv, "$record");
+    if(record_path)
+        recorder = std::make_unique<MovieRecorder>(nes, movie);
+
+    // ROMs listed in the Controls window: ./tests/, and the directory given with $roms <dir>.
+    RomLibrary     library(config::to_abs("romlibrary.cache"));
+    LibraryBrowser library_browser;
+
+    // Active cheats and the codes they were entered as
+    char                     cheat_input[32] = "";
+    std::vector<std::string> cheat_codes;
+    std::vector<Cheat>       cheats;
+    library.add_directory("./tests/");
+    if(const char* roms = get_option(argc, argv, "$roms"))
+        library.add_directory(roms);
 
     float screen_scale = 2.0f;
 
@@ -170,17 +300,58 @@ int main(int argc, char* argv[]) {
             }
         }
 
-        double nes_time = double(elapsed_cycles) / nes.cpu.ClockRate;
-        double diff = nes_time - timing_clock.getElapsedTime().asSeconds();
-        if(real_speed && !debug && diff > 0)
-            sf::sleep(sf::seconds(diff));
+        // Audio drives the pacing: Waits until the device has played what exceeds the target fill.
+        if(const auto pulls = audio_pulls.load(std::memory_order_relaxed); pulls != audio_last_pulls) {
+            audio_last_pulls = pulls;
+            audio_stall_clock.restart();
+        }
+        const bool audio_playing = audio.getStatus() == sf::SoundSource::Playing && audio_stall_clock.getElapsedTime() < audio_stall_timeout;
+        if(real_speed && !debug) {
+            if(const auto audio_fill = audio_ring.size(); audio_playing && audio_fill > audio_target_fill)
+                sf::sleep(sf::seconds(double(audio_fill - audio_target_fill) / audio_sample_rate));
+            else if(!audio_playing && wall_clock.getElapsedTime() < sf::seconds(frame_duration))
+                sf::sleep(sf::seconds(frame_duration) - wall_clock.getElapsedTime());
+        }
+        wall_clock.restart();
         if(!debug || step) {
             step = false;
-            do {
-                nes.step();
-                elapsed_cycles += nes.cpu.get_cycles();
-                speed_mesure_cycles += nes.cpu.get_cycles();
-            } while(!debug && !nes.ppu.completed_frame);
+            emulation_clock.restart();
+            if(!debug && run_ahead_frames > 0) {
+                // The actual frame doesn't need to be displayed, only the last one emulated ahead of time does.
+                nes.ppu.set_render_mode(PPU::RenderMode::StatusOnly);
+                speed_mesure_cycles += nes.run_frame();
+                push_audio(nes);
+                if(recorder)
+                    recorder->frame();
+
+                sf::Clock run_ahead_clock;
+                nes.save_state(run_ahead_state);
+                nes.apu.set_muted(true);             // Frames emulated ahead are not heard, the actual ones will be
+                nes.cartridge.set_speculative(true); // nor saved to the battery save
+                for(int i = 0; i < run_ahead_frames; ++i) {
+                    if(i == run_ahead_frames - 1)
+                        nes.ppu.set_render_mode(PPU::RenderMode::Full);
+                    nes.run_frame();
+                }
+                nes.load_state(run_ahead_state);
+                nes.cartridge.set_speculative(false);
+                nes.apu.set_muted(false);
+                run_ahead_time += run_ahead_clock.getElapsedTime().asSeconds();
+                ++run_ahead_count;
+            } else {
+                nes.ppu.set_render_mode(PPU::RenderMode::Full);
+                do {
+                    nes.step();
+                    speed_mesure_cycles += nes.cpu.get_cycles();
+                } while(!debug && !nes.ppu.completed_frame);
+                if(nes.ppu.completed_frame) {
+                    nes.end_frame();
+                    push_audio(nes);
+                    if(recorder)
+                        recorder->frame();
+                }
+            }
+            emulation_time += emulation_clock.getElapsedTime().asSeconds();
 
             // Update screen
             nes_screen.update(reinterpret_cast<const uint8_t*>(nes.ppu.get_screen()));
@@ -271,6 +442,12 @@ int main(int argc, char* argv[]) {
                 speed = 100.0 * (double(speed_mesure_cycles) / nes.cpu.ClockRate) / (t - frame_time);
                 frame_time = t;
                 speed_mesure_cycles = 0;
+
+                run_ahead_cost_ms = run_ahead_count > 0 ? 1000.0 * run_ahead_time / run_ahead_count : 0;
+                run_ahead_cost_pct = emulation_time > 0 ? 100.0 * run_ahead_time / emulation_time : 0;
+                run_ahead_time = 0;
+                run_ahead_count = 0;
+                emulation_time = 0;
             }
         }
 
@@ -282,13 +459,47 @@ int main(int argc, char* argv[]) {
 
         if(draw_gui) {
             ImGui::Begin("Controls");
-            const auto file_path = explore("./tests/");
+            const auto file_path = library_browser.draw(library);
             if(file_path != "") {
                 if(!nes.load(file_path)) {
                     ImGui::Text("File not found.");
                 } else {
                     path = file_path;
+                    nes.cartridge.open_battery_save(BatterySave::path_for(path));
                     nes.reset();
+                    cheat_codes.clear();
+                    cheats.clear();
+                }
+            }
+            ImGui::End();
+
+            ImGui::Begin("Cheats");
+            bool add_cheat = ImGui::InputText("Code", cheat_input, sizeof(cheat_input), ImGuiInputTextFlags_EnterReturnsTrue);
+            ImGui::SameLine();
+            add_cheat |= ImGui::Button("Add");
+            if(add_cheat) {
+                if(const auto cheat = Cheat::parse(cheat_input)) {
+                    cheat_codes.push_back(cheat_input);
+                    cheats.push_back(*cheat);
+                    nes.set_cheats(cheats);
+                    cheat_input[0] = '\0';
+                }
+            }
+            ImGui::TextDisabled("Game Genie (6 or 8 letters), AAAA:VV or AAAA:CC:VV");
+            for(size_t i = 0; i < cheats.size(); ++i) {
+                ImGui::PushID(static_cast<int>(i));
+                const bool remove = ImGui::SmallButton("X");
+                ImGui::PopID();
+                ImGui::SameLine();
+                if(cheats[i].compare >= 0)
+                    ImGui::Text("%s: $%04X = $%02X (if $%02X)", cheat_codes[i].c_str(), cheats[i].address, cheats[i].value, cheats[i].compare);
+                else
+                    ImGui::Text("%s: $%04X = $%02X", cheat_codes[i].c_str(), cheats[i].address, cheats[i].value);
+                if(remove) {
+                    cheat_codes.erase(cheat_codes.begin() + i);
+                    cheats.erase(cheats.begin() + i);
+                    nes.set_cheats(cheats);
+                    break;
                 }
             }
             ImGui::End();
@@ -334,6 +545,9 @@ int main(int argc, char* argv[]) {
 
             ImGui::Begin("NES Status");
             ImGui::Text("Speed: %.2f\%%", speed);
+            ImGui::SliderInt("Run-ahead frames", &run_ahead_frames, 0, 3);
+            if(run_ahead_frames > 0)
+                ImGui::Text("Run-ahead cost: %.2f ms/frame (%.1f%% of emulation time)", run_ahead_cost_ms, run_ahead_cost_pct);
 
             ImGui::Separator();
             ImGui::BeginTabBar("Components");
@@ -382,4 +596,9 @@ int main(int argc, char* argv[]) {
     }
 
     delete[] tile_map;
+
+    if(recorder) {
+        if(movie.save(record_path))
+            Log::info("Movie saved to '", record_path, "' (", movie.frame_count(), " frames).");
+    }
 }
@@ -0,0 +1,229 @@
+#include "nesen.h"
+
+#include <exception>
+#include <new>
+
+#include <core/NES.hpp>
+
+struct nesen {
+    NES       nes;
+    SaveState state;
+    bool      loaded = false; ///< The last nesen_load_rom succeeded
+
+    nesen_reward_counter reward_counter = nullptr;
+    void*                reward_user_data = nullptr;
+};
+
+namespace {
+
+// C++ exceptions must not cross the C boundary.
+template<typename Function>
+nesen_result guarded(Function&& function) {
+    try {
+        return function();
+    } catch(const std::bad_alloc&) {
+        return NESEN_ERROR_OUT_OF_MEMORY;
+    } catch(const std::exception& e) {
+        Log::error("Error: ", e.what());
+        return NESEN_ERROR_INTERNAL;
+    } catch(...) {
+        return NESEN_ERROR_INTERNAL;
+    }
+}
+
+/// For functions returning a value: on_error is returned if function throws.
+template<typename Result, typename Function>
+Result guarded(Result on_error, Function&& function) {
+    Result result = on_error;
+    guarded([&] {
+        result = function();
+        return NESEN_OK;
+    });
+    return result;
+}
+
+/// Functions running the machine need a cartridge.
+nesen_result check_loaded(const nesen_t* nes) {
+    if(!nes)
+        return NESEN_ERROR_INVALID_ARGUMENT;
+    return nes->loaded ? NESEN_OK : NESEN_ERROR_INVALID_STATE;
+}
+
+PPU::RenderMode to_render_mode(nesen_render_mode mode) {
+    switch(mode) {
+        case NESEN_RENDER_INDEXED: return PPU::RenderMode::Indexed;
+        case NESEN_RENDER_NONE: return PPU::RenderMode::StatusOnly;
+        default: return PPU::RenderMode::Full;
+    }
+}
+
+NES::FrameObservation to_frame_observation(nesen_frame_observation observation) {
+    switch(observation) {
+        case NESEN_FRAME_OBSERVATION_NONE: return NES::FrameObservation::None;
+        case NESEN_FRAME_OBSERVATION_MAX_POOL: return NES::FrameObservation::MaxPool;
+        default: return NES::FrameObservation::Last;
+    }
+}
+
+} // namespace
+
+nesen_t* nesen_create(void) {
+    return guarded<nesen_t*>(nullptr, [] {
+        auto* handle = new nesen();
+        handle->nes.cpu.set_input_mode(CPU::InputMode::Direct);
+        return handle;
+    });
+}
+
+void nesen_destroy(nesen_t* nes) {
+    delete nes;
+}
+
+nesen_result nesen_load_rom(nesen_t* nes, const void* data, size_t size) {
+    if(!nes || !data)
+        return NESEN_ERROR_INVALID_ARGUMENT;
+    return guarded([&] {
+        nes->loaded = false;
+        if(!nes->nes.load_from_memory({static_cast<const uint8_t*>(data), size}))
+            return NESEN_ERROR_INVALID_ROM;
+        nes->nes.power();
+        nes->loaded = true;
+        return NESEN_OK;
+    });
+}
+
+nesen_result nesen_power(nesen_t* nes) {
+    if(const auto result = check_loaded(nes); result != NESEN_OK)
+        return result;
+    return guarded([&] {
+        nes->nes.power();
+        return NESEN_OK;
+    });
+}
+
+nesen_result nesen_reset(nesen_t* nes) {
+    if(const auto result = check_loaded(nes); result != NESEN_OK)
+        return result;
+    return guarded([&] {
+        nes->nes.reset();
+        return NESEN_OK;
+    });
+}
+
+nesen_result nesen_set_input(nesen_t* nes, int controller, uint8_t buttons) {
+    if(!nes || (controller != 0 && controller != 1))
+        return NESEN_ERROR_INVALID_ARGUMENT;
+    nes->nes.cpu.set_controller_input(controller, buttons);
+    return NESEN_OK;
+}
+
+uint64_t nesen_run_frame(nesen_t* nes) {
+    if(check_loaded(nes) != NESEN_OK)
+        return 0;
+    return guarded<uint64_t>(0, [&] { return nes->nes.run_frame(); });
+}
+
+nesen_result nesen_step_frames(nesen_t* nes, uint8_t buttons, size_t frames, nesen_frame_observation observation, int64_t* reward) {
+    if(const auto result = check_loaded(nes); result != NESEN_OK)
+        return result;
+    return guarded([&] {
+        const auto r = nes->nes.step_frames(buttons, frames, to_frame_observation(observation));
+        if(reward)
+            *reward = r;
+        return NESEN_OK;
+    });
+}
+
+nesen_result nesen_set_reward_counter(nesen_t* nes, nesen_reward_counter counter, void* user_data) {
+    if(!nes)
+        return NESEN_ERROR_INVALID_ARGUMENT;
+    return guarded([&] {
+        nes->reward_counter = counter;
+        nes->reward_user_data = user_data;
+        if(!counter)
+            nes->nes.set_reward_counter(nullptr);
+        else
+            nes->nes.set_reward_counter([nes](const NES&) { return nes->reward_counter(nesen_ram(nes, nullptr), nes->reward_user_data); });
+        return NESEN_OK;
+    });
+}
+
+nesen_result nesen_set_render_mode(nesen_t* nes, nesen_render_mode mode) {
+    if(!nes)
+        return NESEN_ERROR_INVALID_ARGUMENT;
+    return guarded([&] {
+        nes->nes.ppu.set_render_mode(to_render_mode(mode));
+        return NESEN_OK;
+    });
+}
+
+const uint8_t* nesen_framebuffer_rgba(const nesen_t* nes) {
+    static_assert(sizeof(color_t) == 4, "color_t must be tightly packed RGBA");
+    return nes ? reinterpret_cast<const uint8_t*>(nes->nes.ppu.get_screen()) : nullptr;
+}
+
+const uint8_t* nesen_framebuffer_indexed(const nesen_t* nes) {
+    return nes ? nes->nes.ppu.get_indexed_screen() : nullptr;
+}
+
+nesen_result nesen_set_observation(nesen_t* nes, uint8_t* buffer, size_t width, size_t height, nesen_observation_format format) {
+    if(!nes || (buffer && (width == 0 || width > PPU::ScreenWidth || height == 0 || height > PPU::ScreenHeight)))
+        return NESEN_ERROR_INVALID_ARGUMENT;
+    return guarded([&] {
+        nes->nes.ppu.set_observation(buffer, width, height, format == NESEN_OBSERVATION_PALETTE_INDEX ? PPU::ObservationFormat::PaletteIndex : PPU::ObservationFormat::Luma);
+        return NESEN_OK;
+    });
+}
+
+const uint8_t* nesen_ram(const nesen_t* nes, size_t* size) {
+    if(!nes)
+        return nullptr;
+    const auto& ram = nes->nes.cpu.get_ram();
+    if(size)
+        *size = ram.size();
+    // Machines created by this API are never forked: Their RAM is always a single block.
+    return ram.data();
+}
+
+size_t nesen_state_size(nesen_t* nes) {
+    if(check_loaded(nes) != NESEN_OK)
+        return 0;
+    return guarded<size_t>(0, [&] {
+        nes->nes.save_state(nes->state);
+        return nes->state.size();
+    });
+}
+
+nesen_result nesen_save_state(nesen_t* nes, void* buffer, size_t capacity, size_t* size) {
+    if(const auto result = check_loaded(nes); result != NESEN_OK)
+        return result;
+    return guarded([&] {
+        nes->nes.save_state(nes->state);
+        if(size)
+            *size = nes->state.size();
+        if(!buffer || capacity < nes->state.size())
+            return NESEN_ERROR_BUFFER_TOO_SMALL;
+        std::memcpy(buffer, nes->state.data(), nes->state.size());
+        return NESEN_OK;
+    });
+}
+
+nesen_result nesen_load_state(nesen_t* nes, const void* buffer, size_t size) {
+    if(!buffer)
+        return NESEN_ERROR_INVALID_ARGUMENT;
+    if(const auto result = check_loaded(nes); result != NESEN_OK)
+        return result;
+    return guarded([&] {
+        // States don't describe their own layout: Only a state of the exact same size can be read safely.
+        if(size != nesen_state_size(nes))
+            return NESEN_ERROR_INVALID_STATE;
+        nes->state.assign(buffer, size);
+        return nes->nes.load_state(nes->state) ? NESEN_OK : NESEN_ERROR_INVALID_STATE;
+    });
+}
+
+uint64_t nesen_state_hash(nesen_t* nes) {
+    if(check_loaded(nes) != NESEN_OK)
+        return 0;
+    return guarded<uint64_t>(0, [&] { return nes->nes.state_hash(); });
+}
@@ -0,0 +1,133 @@
+#ifndef NESEN_H
+#define NESEN_H
+
+/**
+ * NESen C API (libnesen)
+ *
+ * Stable C interface to the emulator core, for embedding in other runtimes.
+ * Buffers returned by the library are owned by the machine and stay valid until it is destroyed,
+ * unless stated otherwise: They always reflect the current state, no copy is made.
+ * A machine must only be used by one thread at a time.
+ * Errors are reported through return values: A NULL machine is NESEN_ERROR_INVALID_ARGUMENT, and functions running the
+ * machine return NESEN_ERROR_INVALID_STATE until a ROM is loaded (NULL or 0 for functions returning a value).
+ * After NESEN_ERROR_INTERNAL, the machine must be reset or given a new ROM.
+ **/
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(_WIN32)
+#if defined(NESEN_BUILD)
+#define NESEN_API __declspec(dllexport)
+#else
+#define NESEN_API __declspec(dllimport)
+#endif
+#elif defined(__GNUC__)
+#define NESEN_API __attribute__((visibility("default")))
+#else
+#define NESEN_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define NESEN_SCREEN_WIDTH 256
+#define NESEN_SCREEN_HEIGHT 240
+
+typedef struct nesen nesen_t;
+
+typedef enum nesen_result {
+    NESEN_OK = 0,
+    NESEN_ERROR_INVALID_ARGUMENT = -1,
+    NESEN_ERROR_INVALID_ROM = -2,
+    NESEN_ERROR_BUFFER_TOO_SMALL = -3,
+    NESEN_ERROR_INVALID_STATE = -4,
+    NESEN_ERROR_OUT_OF_MEMORY = -5,
+    NESEN_ERROR_INTERNAL = -6 /* Unexpected failure inside the emulator */
+} nesen_result;
+
+/* Controller buttons, combined in the input bitmasks */
+typedef enum nesen_button {
+    NESEN_BUTTON_A = 0x01,
+    NESEN_BUTTON_B = 0x02,
+    NESEN_BUTTON_SELECT = 0x04,
+    NESEN_BUTTON_START = 0x08,
+    NESEN_BUTTON_UP = 0x10,
+    NESEN_BUTTON_DOWN = 0x20,
+    NESEN_BUTTON_LEFT = 0x40,
+    NESEN_BUTTON_RIGHT = 0x80
+} nesen_button;
+
+typedef enum nesen_render_mode {
+    NESEN_RENDER_RGBA = 0,    /* 8 bits per channel, see nesen_framebuffer_rgba */
+    NESEN_RENDER_INDEXED = 1, /* Palette indices, see nesen_framebuffer_indexed */
+    NESEN_RENDER_NONE = 2     /* No framebuffer is produced, fastest */
+} nesen_render_mode;
+
+typedef enum nesen_observation_format {
+    NESEN_OBSERVATION_LUMA = 0,
+    NESEN_OBSERVATION_PALETTE_INDEX = 1
+} nesen_observation_format;
+
+typedef enum nesen_frame_observation {
+    NESEN_FRAME_OBSERVATION_NONE = 0,
+    NESEN_FRAME_OBSERVATION_LAST = 1,
+    NESEN_FRAME_OBSERVATION_MAX_POOL = 2
+} nesen_frame_observation;
+
+/* Returns NULL if out of memory. The machine starts in NESEN_RENDER_RGBA mode, without cartridge. */
+NESEN_API nesen_t* nesen_create(void);
+NESEN_API void     nesen_destroy(nesen_t* nes);
+
+/* Loads an iNES image (the data is copied, or shared with machines already running the same ROM) and powers the machine on. */
+NESEN_API nesen_result nesen_load_rom(nesen_t* nes, const void* data, size_t size);
+NESEN_API nesen_result nesen_power(nesen_t* nes);
+NESEN_API nesen_result nesen_reset(nesen_t* nes);
+
+/* Buttons held on controller (0 or 1) from now on, see nesen_button. */
+NESEN_API nesen_result nesen_set_input(nesen_t* nes, int controller, uint8_t buttons);
+
+/* Runs until the next frame is complete. Returns the number of CPU cycles elapsed, 0 on error. */
+NESEN_API uint64_t nesen_run_frame(nesen_t* nes);
+
+/*
+ * Runs frames with controller 0 held to buttons, only rendering the observed ones (see nesen_set_observation).
+ * reward (optional) receives the increase of the reward counter over the step.
+ */
+NESEN_API nesen_result nesen_step_frames(nesen_t* nes, uint8_t buttons, size_t frames, nesen_frame_observation observation, int64_t* reward);
+
+/* Value tracked by nesen_step_frames, typically a score read from ram (see nesen_ram). NULL disables it. */
+typedef int64_t (*nesen_reward_counter)(const uint8_t* ram, void* user_data);
+NESEN_API nesen_result nesen_set_reward_counter(nesen_t* nes, nesen_reward_counter counter, void* user_data);
+
+NESEN_API nesen_result nesen_set_render_mode(nesen_t* nes, nesen_render_mode mode);
+/* NESEN_SCREEN_WIDTH * NESEN_SCREEN_HEIGHT pixels, 4 bytes per pixel (R, G, B, A). NULL if never rendered in NESEN_RENDER_RGBA mode. */
+NESEN_API const uint8_t* nesen_framebuffer_rgba(const nesen_t* nes);
+/* NESEN_SCREEN_WIDTH * NESEN_SCREEN_HEIGHT palette indices (0x00-0x3F). NULL if never rendered in NESEN_RENDER_INDEXED mode. */
+NESEN_API const uint8_t* nesen_framebuffer_indexed(const nesen_t* nes);
+
+/*
+ * Downsampled width * height observation of each frame, written to buffer (owned by the caller, which must keep it
+ * alive) in any render mode. A NULL buffer disables it.
+ */
+NESEN_API nesen_result nesen_set_observation(nesen_t* nes, uint8_t* buffer, size_t width, size_t height, nesen_observation_format format);
+
+/* Internal CPU RAM (2 KB, without mirrors), size receives its size if not NULL. Read only: Writes would bypass the emulation. */
+NESEN_API const uint8_t* nesen_ram(const nesen_t* nes, size_t* size);
+
+/* Size of a save state of this machine, constant once a ROM is loaded. 0 on error. */
+NESEN_API size_t nesen_state_size(nesen_t* nes);
+/* Writes the state to buffer. size receives the state size (even if the buffer is too small) if not NULL. */
+NESEN_API nesen_result nesen_save_state(nesen_t* nes, void* buffer, size_t capacity, size_t* size);
+/* Restores a state saved by nesen_save_state on a machine running the same ROM. */
+NESEN_API nesen_result nesen_load_state(nesen_t* nes, const void* buffer, size_t size);
+
+/* Hash of the whole machine state, cheap enough to be called every frame. */
+NESEN_API uint64_t nesen_state_hash(nesen_t* nes);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,671 @@
+#include "APU.hpp"
+
+#include <algorithm>
+#include <array>
+
+namespace {
+
+constexpr word_t length_table[0x20] = {10, 254, 20, 2,  40, 4,  80, 6,  160, 8,  60, 10, 14, 12, 26, 14,
+                                       12, 16,  24, 18, 48, 20, 96, 22, 192, 24, 72, 26, 16, 28, 32, 30};
+
+constexpr word_t duty_table[4][8] = {
+    {0, 1, 0, 0, 0, 0, 0, 0},
+    {0, 1, 1, 0, 0, 0, 0, 0},
+    {0, 1, 1, 1, 1, 0, 0, 0},
+    {1, 0, 0, 1, 1, 1, 1, 1},
+};
+
+constexpr word_t triangle_table[32] = {15, 14, 13, 12, 11, 10, 9,  8,  7,  6,  5,  4,  3,  2,  1,  0,
+                                       0,  1,  2,  3,  4,  5,  6,  7,  8,  9,  10, 11, 12, 13, 14, 15};
+
+// NTSC, in CPU cycles
+constexpr uint16_t noise_periods[16] = {4, 8, 16, 32, 64, 96, 128, 160, 202, 254, 380, 508, 762, 1016, 2034, 4068};
+constexpr uint16_t dmc_periods[16] = {428, 380, 340, 320, 286, 254, 226, 214, 190, 160, 142, 128, 106, 84, 72, 54};
+
+// Frame counter steps, in CPU cycles since the start of the sequence. The last one ends the sequence.
+constexpr uint64_t four_step_sequence[4] = {7457, 14913, 22371, 29829};
+constexpr uint64_t five_step_sequence[5] = {7457, 14913, 22371, 29829, 37281};
+
+// Non-linear mixer, scaled to int16_t
+// @see https://www.nesdev.org/wiki/APU_Mixer
+struct Mixer {
+    std::array<int16_t, 31>  pulse;
+    std::array<int16_t, 203> tnd;
+
+    Mixer() {
+        pulse[0] = tnd[0] = 0;
+        for(size_t i = 1; i < pulse.size(); ++i)
+            pulse[i] = static_cast<int16_t>(32767.0 * 95.52 / (8128.0 / i + 100.0));
+        for(size_t i = 1; i < tnd.size(); ++i)
+            tnd[i] = static_cast<int16_t>(32767.0 * 163.67 / (24329.0 / i + 100.0));
+    }
+};
+
+const Mixer mixer;
+
+} // namespace
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+// Channels
+
+void APU::Envelope::clock() {
+    if(start) {
+        start = false;
+        decay = 15;
+        divider = period;
+    } else if(divider == 0) {
+        divider = period;
+        if(decay > 0)
+            --decay;
+        else if(loop)
+            decay = 15;
+    } else {
+        --divider;
+    }
+}
+
+uint16_t APU::Pulse::target(bool ones_complement) const {
+    const uint16_t change = period >> sweep_shift;
+    if(!sweep_negate)
+        return period + change;
+    const uint16_t decrease = change + (ones_complement ? 1 : 0);
+    return decrease > period ? 0 : period - decrease;
+}
+
+bool APU::Pulse::muted(bool ones_complement) const {
+    return length == 0 || period < 8 || target(ones_complement) > 0x7FF;
+}
+
+word_t APU::Pulse::level(bool ones_complement) const {
+    return (muted(ones_complement) || !duty_table[duty][step]) ? 0 : envelope.volume();
+}
+
+word_t APU::Triangle::level() const {
+    return triangle_table[step];
+}
+
+uint64_t APU::Noise::timer_period() const {
+    return noise_periods[period_index];
+}
+
+uint64_t APU::DMC::timer_period() const {
+    return dmc_periods[rate_index];
+}
+
+void APU::Envelope::save_state(SaveState& state) const {
+    state.write(start);
+    state.write(loop);
+    state.write(constant);
+    state.write(period);
+    state.write(divider);
+    state.write(decay);
+}
+
+void APU::Envelope::load_state(SaveState& state) {
+    state.read(start);
+    state.read(loop);
+    state.read(constant);
+    state.read(period);
+    state.read(divider);
+    state.read(decay);
+}
+
+void APU::Pulse::save_state(SaveState& state) const {
+    envelope.save_state(state);
+    state.write(duty);
+    state.write(step);
+    state.write(period);
+    state.write(length);
+    state.write(sweep_enabled);
+    state.write(sweep_negate);
+    state.write(sweep_reload);
+    state.write(sweep_period);
+    state.write(sweep_shift);
+    state.write(sweep_divider);
+    state.write(next);
+}
+
+void APU::Pulse::load_state(SaveState& state) {
+    envelope.load_state(state);
+    state.read(duty);
+    state.read(step);
+    state.read(period);
+    state.read(length);
+    state.read(sweep_enabled);
+    state.read(sweep_negate);
+    state.read(sweep_reload);
+    state.read(sweep_period);
+    state.read(sweep_shift);
+    state.read(sweep_divider);
+    state.read(next);
+}
+
+void APU::Triangle::save_state(SaveState& state) const {
+    state.write(control);
+    state.write(linear_reload);
+    state.write(linear_period);
+    state.write(linear);
+    state.write(step);
+    state.write(period);
+    state.write(length);
+    state.write(next);
+}
+
+void APU::Triangle::load_state(SaveState& state) {
+    state.read(control);
+    state.read(linear_reload);
+    state.read(linear_period);
+    state.read(linear);
+    state.read(step);
+    state.read(period);
+    state.read(length);
+    state.read(next);
+}
+
+void APU::Noise::save_state(SaveState& state) const {
+    envelope.save_state(state);
+    state.write(mode);
+    state.write(period_index);
+    state.write(shift);
+    state.write(length);
+    state.write(next);
+}
+
+void APU::Noise::load_state(SaveState& state) {
+    envelope.load_state(state);
+    state.read(mode);
+    state.read(period_index);
+    state.read(shift);
+    state.read(length);
+    state.read(next);
+}
+
+void APU::DMC::save_state(SaveState& state) const {
+    state.write(irq_enabled);
+    state.write(loop);
+    state.write(rate_index);
+    state.write(level);
+    state.write(start_address);
+    state.write(start_length);
+    state.write(address);
+    state.write(remaining);
+    state.write(buffer);
+    state.write(buffer_empty);
+    state.write(shift);
+    state.write(bits);
+    state.write(silence);
+    state.write(next);
+}
+
+void APU::DMC::load_state(SaveState& state) {
+    state.read(irq_enabled);
+    state.read(loop);
+    state.read(rate_index);
+    state.read(level);
+    state.read(start_address);
+    state.read(start_length);
+    state.read(address);
+    state.read(remaining);
+    state.read(buffer);
+    state.read(buffer_empty);
+    state.read(shift);
+    state.read(bits);
+    state.read(silence);
+    state.read(next);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+
+APU::APU() {
+    power();
+}
+
+void APU::power() {
+    _cycle = 0;
+    _pulse[0] = Pulse();
+    _pulse[1] = Pulse();
+    _triangle = Triangle();
+    _noise = Noise();
+    _dmc = DMC();
+    _dmc_irq = false;
+    _irq_inhibit = false;
+    _frame_irq = _irq_line = false;
+    _enabled = 0;
+    reset_frame_counter(0x00);
+    set_sample_rate(_sample_rate);
+    update_deadlines();
+}
+
+void APU::reset() {
+    write(0x15, 0x00, _cycle);
+}
+
+word_t APU::read(addr_t addr, uint64_t cycle) {
+    if(addr != 0x4015)
+        return 0;
+    run(cycle);
+    const word_t r = (_pulse[0].length > 0 ? 0x01 : 0) | (_pulse[1].length > 0 ? 0x02 : 0) | (_triangle.length > 0 ? 0x04 : 0) |
+                     (_noise.length > 0 ? 0x08 : 0) | (_dmc.remaining > 0 ? 0x10 : 0) | (_frame_irq ? 0x40 : 0) | (_dmc_irq ? 0x80 : 0);
+    _frame_irq = false;
+    _irq_line = _dmc_irq;
+    return r;
+}
+
+void APU::write(addr_t addr, word_t value, uint64_t cycle) {
+    run(cycle);
+    switch(addr) {
+        case 0x00:
+        case 0x04: {
+            auto& p = _pulse[addr >> 2];
+            p.duty = value >> 6;
+            p.envelope.loop = value & 0x20;
+            p.envelope.constant = value & 0x10;
+            p.envelope.period = value & 0x0F;
+            break;
+        }
+        case 0x01:
+        case 0x05: {
+            auto& p = _pulse[addr >> 2];
+            p.sweep_enabled = value & 0x80;
+            p.sweep_period = (value >> 4) & 0x07;
+            p.sweep_negate = value & 0x08;
+            p.sweep_shift = value & 0x07;
+            p.sweep_reload = true;
+            break;
+        }
+        case 0x02:
+        case 0x06: {
+            auto& p = _pulse[addr >> 2];
+            p.period = (p.period & 0x0700) | value;
+            break;
+        }
+        case 0x03:
+        case 0x07: {
+            auto& p = _pulse[addr >> 2];
+            p.period = (p.period & 0x00FF) | ((value & 0x07) << 8);
+            if(_enabled & (1 << (addr >> 2)))
+                p.length = length_table[value >> 3];
+            p.step = 0;
+            p.envelope.start = true;
+            break;
+        }
+        case 0x08:
+            _triangle.control = value & 0x80;
+            _triangle.linear_period = value & 0x7F;
+            break;
+        case 0x0A: _triangle.period = (_triangle.period & 0x0700) | value; break;
+        case 0x0B:
+            _triangle.period = (_triangle.period & 0x00FF) | ((value & 0x07) << 8);
+            if(_enabled & 0x04)
+                _triangle.length = length_table[value >> 3];
+            _triangle.linear_reload = true;
+            break;
+        case 0x0C:
+            _noise.envelope.loop = value & 0x20;
+            _noise.envelope.constant = value & 0x10;
+            _noise.envelope.period = value & 0x0F;
+            break;
+        case 0x0E:
+            _noise.mode = value & 0x80;
+            _noise.period_index = value & 0x0F;
+            break;
+        case 0x0F:
+            if(_enabled & 0x08)
+                _noise.length = length_table[value >> 3];
+            _noise.envelope.start = true;
+            break;
+        case 0x10:
+            _dmc.irq_enabled = value & 0x80;
+            _dmc.loop = value & 0x40;
+            _dmc.rate_index = value & 0x0F;
+            if(!_dmc.irq_enabled)
+                _dmc_irq = false;
+            break;
+        case 0x11: _dmc.level = value & 0x7F; break;
+        case 0x12: _dmc.start_address = 0xC000 + 64 * value; break;
+        case 0x13: _dmc.start_length = 16 * value + 1; break;
+        case 0x15:
+            _enabled = value & 0x1F;
+            if(!(value & 0x01))
+                _pulse[0].length = 0;
+            if(!(value & 0x02))
+                _pulse[1].length = 0;
+            if(!(value & 0x04))
+                _triangle.length = 0;
+            if(!(value & 0x08))
+                _noise.length = 0;
+            _dmc_irq = false;
+            if(!(value & 0x10))
+                _dmc.remaining = 0;
+            else if(_dmc.remaining == 0)
+                restart_dmc();
+            if(_dmc.buffer_empty)
+                fetch_dmc_sample();
+            if(_dmc.next == Never && _dmc.active())
+                _dmc.next = _cycle + _dmc.timer_period();
+            break;
+        case 0x17:
+            _irq_inhibit = value & 0x40;
+            if(_irq_inhibit)
+                _frame_irq = false;
+            reset_frame_counter(value);
+            break;
+        default: break;
+    }
+    _irq_line = _frame_irq || _dmc_irq;
+    update_channels();
+    update_deadlines();
+}
+
+void APU::set_sample_rate(size_t rate) {
+    _sample_rate = rate;
+    if(rate > 0)
+        _blip.set_rates(ClockRate, rate * _rate_adjustment);
+    restart_output();
+}
+
+void APU::set_rate_adjustment(double factor) {
+    _rate_adjustment = factor;
+    if(_sample_rate > 0)
+        _blip.adjust_rates(ClockRate, _sample_rate * factor);
+}
+
+void APU::set_muted(bool muted) {
+    _muted = muted;
+    restart_output();
+}
+
+size_t APU::read_samples(int16_t* dst, size_t count) {
+    return _blip.read_samples(dst, count);
+}
+
+void APU::end_frame(uint64_t cycle) {
+    run(cycle);
+    if(synthesizing()) {
+        _blip.end_frame(_cycle - _blip_start);
+        _blip_start = _cycle;
+    }
+}
+
+void APU::save_state(SaveState& state) const {
+    state.write(_cycle);
+    state.write(_enabled);
+    _pulse[0].save_state(state);
+    _pulse[1].save_state(state);
+    _triangle.save_state(state);
+    _noise.save_state(state);
+    _dmc.save_state(state);
+    state.write(_five_step);
+    state.write(_irq_inhibit);
+    state.write(_frame_irq);
+    state.write(_dmc_irq);
+    state.write(_irq_line);
+    state.write(_frame_step);
+    state.write(_frame_start);
+    state.write(_frame_next);
+    state.write(_dma_stall);
+    state.write(_oam_dma_start);
+    state.write(_oam_dma_end);
+}
+
+void APU::load_state(SaveState& state) {
+    state.read(_cycle);
+    state.read(_enabled);
+    _pulse[0].load_state(state);
+    _pulse[1].load_state(state);
+    _triangle.load_state(state);
+    _noise.load_state(state);
+    _dmc.load_state(state);
+    state.read(_five_step);
+    state.read(_irq_inhibit);
+    state.read(_frame_irq);
+    state.read(_dmc_irq);
+    state.read(_irq_line);
+    state.read(_frame_step);
+    state.read(_frame_start);
+    state.read(_frame_next);
+    state.read(_dma_stall);
+    state.read(_oam_dma_start);
+    state.read(_oam_dma_end);
+    update_deadlines();
+    restart_output();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+// Catching up
+
+void APU::run(uint64_t cycle) {
+    while(_cycle < cycle) {
+        uint64_t next = std::min({cycle, _frame_next, _dmc.next});
+        if(synthesizing())
+            next = std::min({next, _pulse[0].next, _pulse[1].next, _triangle.next, _noise.next});
+        _cycle = next;
+
+        bool changed = false;
+        if(synthesizing()) {
+            for(size_t i = 0; i < 2; ++i) {
+                auto& p = _pulse[i];
+                if(p.next == next) {
+                    p.step = (p.step + 1) & 7;
+                    p.next += p.timer_period();
+                    changed = true;
+                }
+            }
+            if(_triangle.next == next) {
+                _triangle.step = (_triangle.step + 1) & 31;
+                _triangle.next += _triangle.timer_period();
+                changed = true;
+            }
+            if(_noise.next == next) {
+                const uint16_t feedback = (_noise.shift ^ (_noise.shift >> (_noise.mode ? 6 : 1))) & 1;
+                _noise.shift = (_noise.shift >> 1) | (feedback << 14);
+                _noise.next += _noise.timer_period();
+                changed = true;
+            }
+        }
+        if(_dmc.next == next) {
+            clock_dmc();
+            changed = true;
+        }
+        if(_frame_next == next)
+            clock_frame_counter(); // Updates the output itself
+        else if(changed)
+            update_output();
+    }
+}
+
+unsigned int APU::take_dma_stall(uint64_t cycle) {
+    run(cycle);
+    const auto stall = _dma_stall;
+    _dma_stall = 0;
+    update_deadlines();
+    return stall;
+}
+
+bool APU::update_irq(uint64_t cycle) {
+    run(cycle);
+    update_deadlines();
+    return _irq_line;
+}
+
+void APU::update_deadlines() {
+    // Conservative: The APU catches up at every step of a sequence that raises the frame IRQ, and at every DMC clock
+    // while a sample that raises one is playing.
+    _irq_deadline = Never;
+    if(!_five_step && !_irq_inhibit)
+        _irq_deadline = _frame_next;
+    if(_dmc.irq_enabled && !_dmc.loop && _dmc.remaining > 0)
+        _irq_deadline = std::min(_irq_deadline, _dmc.next);
+
+    // Next fetch: When the output unit empties the buffer, at the end of its current byte.
+    if(_dma_stall > 0)
+        _dma_deadline = 0;
+    else if(_dmc.remaining > 0 && !_dmc.buffer_empty && _dmc.next != Never)
+        _dma_deadline = _dmc.next + (_dmc.bits - 1) * _dmc.timer_period();
+    else
+        _dma_deadline = Never;
+}
+
+void APU::reset_frame_counter(word_t value) {
+    _five_step = value & 0x80;
+    _frame_step = 0;
+    _frame_start = _cycle;
+    _frame_next = _frame_start + four_step_sequence[0];
+    if(_five_step) {
+        clock_quarter_frame();
+        clock_half_frame();
+    }
+}
+
+void APU::clock_frame_counter() {
+    const auto* sequence = _five_step ? five_step_sequence : four_step_sequence;
+    const size_t steps = _five_step ? 5 : 4;
+    switch(_frame_step) {
+        case 0:
+        case 2: clock_quarter_frame(); break;
+        case 1:
+            clock_quarter_frame();
+            clock_half_frame();
+            break;
+        case 3:
+            if(!_five_step) {
+                clock_quarter_frame();
+                clock_half_frame();
+                if(!_irq_inhibit)
+                    _frame_irq = _irq_line = true;
+            }
+            break;
+        case 4:
+            clock_quarter_frame();
+            clock_half_frame();
+            break;
+    }
+    if(++_frame_step == steps) {
+        _frame_step = 0;
+        _frame_start += sequence[steps - 1] + 1;
+    }
+    _frame_next = _frame_start + sequence[_frame_step];
+    update_channels();
+    update_deadlines();
+}
+
+void APU::clock_quarter_frame() {
+    _pulse[0].envelope.clock();
+    _pulse[1].envelope.clock();
+    _noise.envelope.clock();
+    if(_triangle.linear_reload)
+        _triangle.linear = _triangle.linear_period;
+    else if(_triangle.linear > 0)
+        --_triangle.linear;
+    if(!_triangle.control)
+        _triangle.linear_reload = false;
+}
+
+void APU::clock_half_frame() {
+    for(size_t i = 0; i < 2; ++i) {
+        auto& p = _pulse[i];
+        if(!p.envelope.loop && p.length > 0)
+            --p.length;
+        if(p.sweep_divider == 0 && p.sweep_enabled && p.sweep_shift > 0 && !p.muted(i == 0))
+            p.period = p.target(i == 0);
+        if(p.sweep_divider == 0 || p.sweep_reload) {
+            p.sweep_divider = p.sweep_period;
+            p.sweep_reload = false;
+        } else {
+            --p.sweep_divider;
+        }
+    }
+    if(!_triangle.control && _triangle.length > 0)
+        --_triangle.length;
+    if(!_noise.envelope.loop && _noise.length > 0)
+        --_noise.length;
+}
+
+void APU::clock_dmc() {
+    auto& d = _dmc;
+    if(!d.silence) {
+        if(d.shift & 1) {
+            if(d.level <= 125)
+                d.level += 2;
+        } else if(d.level >= 2) {
+            d.level -= 2;
+        }
+        d.shift >>= 1;
+    }
+    if(--d.bits == 0) {
+        d.bits = 8;
+        d.silence = d.buffer_empty;
+        if(!d.buffer_empty) {
+            d.shift = d.buffer;
+            d.buffer_empty = true;
+            fetch_dmc_sample();
+        }
+    }
+    d.next = d.active() ? d.next + d.timer_period() : Never;
+    update_deadlines();
+}
+
+void APU::fetch_dmc_sample() {
+    auto& d = _dmc;
+    if(!d.buffer_empty || d.remaining == 0)
+        return;
+    // The CPU is halted for 4 cycles, 2 if it was already halted by an OAM DMA
+    _dma_stall += (_cycle >= _oam_dma_start && _cycle < _oam_dma_end) ? 2 : 4;
+    d.buffer = cartridge ? static_cast<word_t>(cartridge->read(d.address)) : 0;
+    d.buffer_empty = false;
+    d.address = d.address == 0xFFFF ? 0x8000 : d.address + 1;
+    if(--d.remaining == 0) {
+        if(d.loop) {
+            restart_dmc();
+        } else if(d.irq_enabled) {
+            _dmc_irq = _irq_line = true;
+        }
+    }
+}
+
+void APU::restart_dmc() {
+    _dmc.address = _dmc.start_address;
+    _dmc.remaining = _dmc.start_length;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+// Output
+
+void APU::update_channels() {
+    if(synthesizing()) {
+        for(size_t i = 0; i < 2; ++i) {
+            auto& p = _pulse[i];
+            if(p.muted(i == 0) || p.envelope.volume() == 0)
+                p.next = Never;
+            else if(p.next == Never)
+                p.next = _cycle + p.timer_period();
+        }
+        if(!_triangle.running())
+            _triangle.next = Never;
+        else if(_triangle.next == Never)
+            _triangle.next = _cycle + _triangle.timer_period();
+        if(_noise.length == 0 || _noise.envelope.volume() == 0)
+            _noise.next = Never;
+        else if(_noise.next == Never)
+            _noise.next = _cycle + _noise.timer_period();
+    }
+    update_output();
+}
+
+void APU::update_output() {
+    const size_t pulse = _pulse[0].level(true) + _pulse[1].level(false);
+    const size_t tnd = 3 * _triangle.level() + 2 * _noise.level() + _dmc.level;
+    const auto amplitude = static_cast<int16_t>(std::min(32767, mixer.pulse[pulse] + mixer.tnd[tnd]));
+    if(synthesizing() && amplitude != _amplitude)
+        _blip.add_delta(_cycle - _blip_start, amplitude - _amplitude);
+    _amplitude = amplitude;
+}
+
+void APU::restart_output() {
+    _blip_start = _cycle;
+    // Timers are not running while synthesis is disabled: Those left behind are restarted.
+    for(auto* next : {&_pulse[0].next, &_pulse[1].next, &_triangle.next, &_noise.next})
+        if(*next < _cycle)
+            *next = Never;
+    update_channels();
+}
@@ -1,14 +1,217 @@
 #pragma once
 
+#include <cstdint>
+#include <limits>
+
+#include "Cartridge.hpp"
+#include "SaveState.hpp"
+#include <tools/BlipBuffer.hpp>
+
+/**
+ * NES Audio Processing Unit (2A03): Two pulse channels, a triangle, a noise channel, the DMC and the frame counter.
+ *
+ * Runs lazily, nothing is done per CPU instruction: Accesses carry the current CPU cycle and the APU catches up to it
+ * when a register is touched, when an IRQ may fire (see irq) and when a frame ends. Catching up is event driven: Time
+ * jumps from one timer expiration to the next.
+ * Synthesis is disabled until a sample rate is set, only what the CPU can observe (length counters, DMC fetches and
+ * IRQs) is emulated then. Otherwise, mixer output changes go to a BlipBuffer at their exact cycle.
+ *
+ * @see https://www.nesdev.org/wiki/APU
+ **/
 class APU {
   public:
-    using word_t = uint8_t;
-    using addr_t = uint16_t;
+    static constexpr size_t   ClockRate = 1789773; ///< Clocked by the CPU (NTSC), Hz
+    static constexpr uint64_t Never = std::numeric_limits<uint64_t>::max();
+
+    /// Source of the DMC samples ($8000-$FFFF)
+    Cartridge* cartridge = nullptr;
+
+    APU();
+
+    /// Power-on state, back to cycle 0. The output settings are kept.
+    void power();
+    /// Silences every channel, as the reset button does.
+    void reset();
+
+    /// Register read ($4015 is the only readable one).
+    /// @param cycle Current CPU cycle (see CPU::get_total_cycles)
+    word_t read(addr_t addr, uint64_t cycle);
+    /// Register write, addr is relative to $4000 ($00-$17).
+    void write(addr_t addr, word_t value, uint64_t cycle);
+
+    /// IRQ line (frame counter or DMC), catches up only if an IRQ could have been raised since the last access.
+    inline bool irq(uint64_t cycle) { return _irq_line || (cycle >= _irq_deadline && update_irq(cycle)); }
 
-    inline word_t read(addr_t addr) { return _registers[addr % 0x17]; }
+    /// Earliest cycle at which the DMC may have stolen CPU cycles, see take_dma_stall.
+    inline uint64_t dma_deadline() const { return _dma_deadline; }
+    /// Catches up, then returns the CPU cycles stolen by DMC sample fetches since the last call.
+    unsigned int take_dma_stall(uint64_t cycle);
+    /// An OAM DMA halts the CPU over [cycle, cycle + length): DMC fetches then take fewer cycles.
+    inline void oam_dma(uint64_t cycle, unsigned int length) {
+        _oam_dma_start = cycle;
+        _oam_dma_end = cycle + length;
+    }
 
-    inline void write(addr_t addr, word_t value) { _registers[addr % 0x17] = addr; }
+    /// Catches up to the end of the frame, making its samples available.
+    void end_frame(uint64_t cycle);
+
+    /// Output sample rate (Hz), 0 disables synthesis (default). Clears the samples not yet read.
+    void          set_sample_rate(size_t rate);
+    inline size_t get_sample_rate() const { return _sample_rate; }
+    /// Dynamic rate control: Samples produced per emulated second are multiplied by factor (close to 1), without
+    /// clearing anything.
+    void set_rate_adjustment(double factor);
+    /// Suspends synthesis (for frames that must not be heard, run-ahead...) without clearing the samples not yet read.
+    void set_muted(bool muted);
+
+    /// Mono samples synthesized and not yet read, up to the end of the last frame.
+    inline size_t samples_available() const { return _blip.samples_available(); }
+    /// Moves up to count samples to dst.
+    /// @return Number of samples read.
+    size_t read_samples(int16_t* dst, size_t count);
+
+    void save_state(SaveState& state) const;
+    void load_state(SaveState& state);
 
   private:
-    word_t _registers[0x17];
+    struct Envelope {
+        bool   start = false;
+        bool   loop = false; ///< Also halts the length counter
+        bool   constant = false;
+        word_t period = 0; ///< Also the constant volume
+        word_t divider = 0;
+        word_t decay = 0;
+
+        inline word_t volume() const { return constant ? period : decay; }
+        void          clock();
+        void          save_state(SaveState& state) const;
+        void          load_state(SaveState& state);
+    };
+
+    struct Pulse {
+        Envelope envelope;
+        word_t   duty = 0;
+        word_t   step = 0;
+        uint16_t period = 0;
+        word_t   length = 0;
+        bool     sweep_enabled = false;
+        bool     sweep_negate = false;
+        bool     sweep_reload = false;
+        word_t   sweep_period = 0;
+        word_t   sweep_shift = 0;
+        word_t   sweep_divider = 0;
+        uint64_t next = Never; ///< Next timer expiration, Never while muted
+
+        uint16_t target(bool ones_complement) const;
+        bool     muted(bool ones_complement) const;
+        word_t   level(bool ones_complement) const;
+        inline uint64_t timer_period() const { return 2 * (uint64_t(period) + 1); }
+        void            save_state(SaveState& state) const;
+        void            load_state(SaveState& state);
+    };
+
+    struct Triangle {
+        bool     control = false; ///< Also halts the length counter
+        bool     linear_reload = false;
+        word_t   linear_period = 0;
+        word_t   linear = 0;
+        word_t   step = 0;
+        uint16_t period = 0;
+        word_t   length = 0;
+        uint64_t next = Never; ///< Never while the sequencer is halted
+
+        /// Ultrasonic periods are not stepped: The channel holds its level instead, as it would after filtering.
+        inline bool     running() const { return length > 0 && linear > 0 && period >= 2; }
+        word_t          level() const;
+        inline uint64_t timer_period() const { return uint64_t(period) + 1; }
+        void            save_state(SaveState& state) const;
+        void            load_state(SaveState& state);
+    };
+
+    struct Noise {
+        Envelope envelope;
+        bool     mode = false;
+        word_t   period_index = 0;
+        uint16_t shift = 1;
+        word_t   length = 0;
+        uint64_t next = Never; ///< Never while silent
+
+        inline word_t level() const { return (length == 0 || (shift & 1)) ? 0 : envelope.volume(); }
+        uint64_t      timer_period() const;
+        void          save_state(SaveState& state) const;
+        void          load_state(SaveState& state);
+    };
+
+    struct DMC {
+        bool     irq_enabled = false;
+        bool     loop = false;
+        word_t   rate_index = 0;
+        word_t   level = 0;
+        uint16_t start_address = 0xC000;
+        uint16_t start_length = 1;
+        uint16_t address = 0xC000;
+        uint16_t remaining = 0; ///< Bytes left to fetch
+        word_t   buffer = 0;
+        bool     buffer_empty = true;
+        word_t   shift = 0;
+        word_t   bits = 8;
+        bool     silence = true;
+        uint64_t next = Never; ///< Never while idle
+
+        inline bool active() const { return remaining > 0 || !buffer_empty || !silence; }
+        uint64_t    timer_period() const;
+        void        save_state(SaveState& state) const;
+        void        load_state(SaveState& state);
+    };
+
+    uint64_t _cycle = 0; ///< CPU cycle the APU caught up to
+    word_t   _enabled = 0; ///< Channels enabled by $4015
+
+    Pulse    _pulse[2];
+    Triangle _triangle;
+    Noise    _noise;
+    DMC      _dmc;
+
+    bool     _five_step = false;
+    bool     _irq_inhibit = false;
+    bool     _frame_irq = false;
+    bool     _dmc_irq = false;
+    bool     _irq_line = false;
+    word_t   _frame_step = 0;
+    uint64_t _frame_start = 0;   ///< Start of the current frame counter sequence
+    uint64_t _frame_next = 0;    ///< Next frame counter step
+    uint64_t _irq_deadline = 0;  ///< Earliest cycle an IRQ could be raised at
+    uint64_t _dma_deadline = Never;
+    uint32_t _dma_stall = 0;     ///< Cycles stolen by DMC fetches, not yet taken by the CPU
+    uint64_t _oam_dma_start = 0;
+    uint64_t _oam_dma_end = 0;
+
+    // Output, not part of the state
+    size_t     _sample_rate = 0;
+    double     _rate_adjustment = 1.0;
+    bool       _muted = false;
+    uint64_t   _blip_start = 0;  ///< Cycle of the start of the BlipBuffer frame
+    int16_t    _amplitude = 0;   ///< Current mixer output
+    BlipBuffer _blip;
+
+    inline bool synthesizing() const { return _sample_rate > 0 && !_muted; }
+
+    /// Processes every event up to cycle (included).
+    void run(uint64_t cycle);
+    bool update_irq(uint64_t cycle);
+    void update_deadlines();
+
+    void clock_frame_counter();
+    void clock_quarter_frame();
+    void clock_half_frame();
+    void clock_dmc();
+    void fetch_dmc_sample();
+    void restart_dmc();
+    void reset_frame_counter(word_t value);
+
+    /// Schedules the timers of channels that became audible and stops the others, then updates the output.
+    void update_channels();
+    void update_output();
+    /// Synthesis continues from the current cycle.
+    void restart_output();
 };
@@ -0,0 +1,127 @@
+#include "BatterySave.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <vector>
+
+BatterySave::~BatterySave() {
+    if(!_writer.joinable())
+        return;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+    }
+    _wake.notify_one();
+    _writer.join();
+}
+
+std::string BatterySave::path_for(const std::string& rom_path) {
+    std::filesystem::path path(rom_path);
+    if(path.extension() == ".gz") // .nes.gz
+        path.replace_extension();
+    return path.replace_extension(".sav").string();
+}
+
+bool BatterySave::open(const std::string& path, size_t size) {
+    if(_writer.joinable())
+        return false;
+    if(!_file.open(path, MappedFile::Access::ReadWrite, size)) {
+        Log::error("Error: Could not map save file '", path, "'.");
+        return false;
+    }
+    _path = path;
+    _writer = std::thread(&BatterySave::run, this);
+    return true;
+}
+
+void BatterySave::load(PagedMemory& ram) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    const size_t                size = std::min(ram.size(), _file.size());
+    for(size_t i = 0; i < size; ++i)
+        ram.write(i, _file.data()[i]);
+}
+
+bool BatterySave::store(const PagedMemory& ram, bool wait) {
+    std::unique_lock<std::mutex> lock(_mutex, std::defer_lock);
+    if(wait)
+        lock.lock();
+    else if(!lock.try_lock())
+        return false;
+
+    // Pages already up to date are not written to: The OS has nothing to write back for them.
+    uint8_t*     dst = _file.writable_data();
+    const size_t size = std::min(ram.size(), _file.size());
+    bool         changed = false;
+    for(size_t offset = 0; offset < size; offset += PagedMemory::PageSize) {
+        const size_t  length = std::min(PagedMemory::PageSize, size - offset);
+        const word_t* page = ram.page(offset >> PagedMemory::PageBits);
+        if(std::memcmp(dst + offset, page, length) != 0) {
+            std::memcpy(dst + offset, page, length);
+            changed = true;
+        }
+    }
+    if(changed) {
+        ++_stored;
+        _last_store = clock::now();
+    }
+    return true;
+}
+
+void BatterySave::run() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    while(!_stop) {
+        _wake.wait_for(lock, SyncInterval / 4);
+        const auto now = clock::now();
+        if(_stored != _synced && now - _last_sync >= SyncInterval) {
+            // Only this thread swaps the mapping: It can be synced without holding the lock.
+            const uint64_t stored = _stored;
+            lock.unlock();
+            _file.flush(true);
+            lock.lock();
+            _synced = stored;
+            _last_sync = now;
+        }
+        if(_stored != _checkpointed && now - _last_store >= CheckpointDelay)
+            checkpoint(lock);
+    }
+    if(_stored != _checkpointed)
+        checkpoint(lock);
+}
+
+bool BatterySave::checkpoint(std::unique_lock<std::mutex>& lock) {
+    const uint64_t       stored = _stored;
+    std::vector<uint8_t> snapshot(_file.data(), _file.data() + _file.size());
+    lock.unlock();
+
+    const std::string temp_path = _path + ".tmp";
+    bool              ok = false;
+    {
+        MappedFile temp(temp_path, MappedFile::Access::ReadWrite, snapshot.size());
+        if(temp.is_open()) {
+            std::memcpy(temp.writable_data(), snapshot.data(), snapshot.size());
+            ok = temp.flush(true);
+        }
+    }
+
+    lock.lock();
+    _checkpointed = stored; // Not retried before the next change
+    // A mapped file can't be replaced on Windows: The save is unmapped during the rename, stores wait for the lock.
+    // Stores since the snapshot went to the previous file, they are carried over to the new one.
+    std::error_code error;
+    if(ok) {
+        snapshot.assign(_file.data(), _file.data() + _file.size());
+        _file.close();
+        std::filesystem::rename(temp_path, _path, error);
+        ok = !error;
+        if(!_file.open(_path, MappedFile::Access::ReadWrite, snapshot.size()))
+            ok = false;
+        else
+            std::memcpy(_file.writable_data(), snapshot.data(), snapshot.size());
+    }
+    if(!ok) {
+        Log::error("Error: Could not checkpoint save file '", _path, "'.");
+        return false;
+    }
+    return true;
+}
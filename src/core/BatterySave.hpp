@@ -0,0 +1,65 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "PagedMemory.hpp"
+#include <tools/MappedFile.hpp>
+
+/**
+ * Battery-backed PRG RAM kept in a memory-mapped save file.
+ *
+ * The emulation thread only copies the RAM pages that changed into the mapping (see store) and never waits for the
+ * disk: A writer thread syncs the file (msync, at most once per SyncInterval) and checkpoints it once the game stopped
+ * writing for CheckpointDelay. A checkpoint writes a temporary file and renames it over the save, which is then mapped
+ * again: A save is only replaced by a complete file, a crash during a checkpoint leaves the previous one intact.
+ **/
+class BatterySave {
+  public:
+    static constexpr auto SyncInterval = std::chrono::seconds(1);
+    static constexpr auto CheckpointDelay = std::chrono::seconds(2);
+
+    BatterySave() = default;
+    /// Writes a final checkpoint if the save changed since the last one, and stops the writer thread.
+    ~BatterySave();
+
+    BatterySave(const BatterySave&) = delete;
+    BatterySave& operator=(const BatterySave&) = delete;
+
+    /// Save file used for a ROM: Its path with the extension (.nes, .nes.gz, .zip) replaced by .sav.
+    static std::string path_for(const std::string& rom_path);
+
+    /// Maps the save file, created or resized to size bytes if needed, and starts the writer thread.
+    bool open(const std::string& path, size_t size);
+
+    inline const std::string& get_path() const { return _path; }
+
+    /// Copies the save content to ram.
+    void load(PagedMemory& ram);
+    /// Copies the pages of ram that differ from the save. Never blocks unless wait is true.
+    /// @return false if the save was busy (a checkpoint is swapping the mapping): Nothing was stored, try again later.
+    bool store(const PagedMemory& ram, bool wait = false);
+
+  private:
+    using clock = std::chrono::steady_clock;
+
+    std::string _path;
+    MappedFile  _file; ///< Swapped by checkpoints, guarded by _mutex
+
+    std::mutex              _mutex;
+    std::condition_variable _wake;
+    std::thread             _writer;
+    bool                    _stop = false;
+    uint64_t                _stored = 0;       ///< Number of stores that changed the save
+    uint64_t                _synced = 0;       ///< Value of _stored at the last msync
+    uint64_t                _checkpointed = 0; ///< Value of _stored at the last checkpoint
+    clock::time_point       _last_store;
+    clock::time_point       _last_sync;
+
+    void run();
+    /// Writes a snapshot of the save to a temporary file, renames it over the save and maps the new file.
+    bool checkpoint(std::unique_lock<std::mutex>& lock);
+};
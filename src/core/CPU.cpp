@@ -73,18 +73,72 @@ size_t CPU::instr_cycles[0x100] = {
     //  0  1  2  3  4  5  6  7  8  9  A  B  C  D  E  F
 };
 
-CPU::CPU(size_t _RAMSize) : RAMSize(_RAMSize), _ram(new word_t[RAMSize]) {}
+CPU::CPU(size_t _RAMSize) : RAMSize(_RAMSize), _ram(RAMSize) {}
 
-CPU::~CPU() {
-    delete _ram;
-}
+CPU::~CPU() {}
 
 void CPU::reset() {
     _reg_pc = read(0xFFFC) | (read(0xFFFD) << 8);
     _reg_sp = 0xFD; /// @TODO: Check
     _reg_ps = 0x34; /// @TODO: Check
     _reg_acc = _reg_x = _reg_y = 0x00;
-    std::memset(_ram, 0xFF, RAMSize);
+    _ram.fill(0xFF);
+}
+
+void CPU::power() {
+    _irq = false;
+    _total_cycles = 0;
+    reset();
+}
+
+void CPU::save_state(SaveState& state) const {
+    state.write(_reg_pc);
+    state.write(_reg_acc);
+    state.write(_reg_x);
+    state.write(_reg_y);
+    state.write(_reg_sp);
+    state.write(_reg_ps);
+    state.write(_irq);
+    state.write(_cycles);
+    state.write(_total_cycles);
+    _ram.save_state(state);
+    state.write(_refresh_controller);
+    state.write(_controller_states);
+    state.write(_current_controller_read);
+}
+
+void CPU::load_state(SaveState& state) {
+    state.read(_reg_pc);
+    state.read(_reg_acc);
+    state.read(_reg_x);
+    state.read(_reg_y);
+    state.read(_reg_sp);
+    state.read(_reg_ps);
+    state.read(_irq);
+    state.read(_cycles);
+    state.read(_total_cycles);
+    _ram.load_state(state);
+    state.read(_refresh_controller);
+    state.read(_controller_states);
+    state.read(_current_controller_read);
+}
+
+void CPU::fork_into(CPU& child) {
+    child.RAMSize = RAMSize;
+    for(size_t i = 0; i < 8; ++i) {
+        child.controller_callbacks[i] = controller_callbacks[i];
+        child.controller2_callbacks[i] = controller2_callbacks[i];
+    }
+    child.set_state(_reg_pc, _reg_acc, _reg_x, _reg_y, _reg_sp, _reg_ps);
+    child._irq = _irq;
+    child._cycles = _cycles;
+    child._total_cycles = _total_cycles;
+    child._ram = _ram.fork();
+    child._input_mode = _input_mode;
+    std::memcpy(child._controller_inputs, _controller_inputs, sizeof(_controller_inputs));
+    child._refresh_controller = _refresh_controller;
+    std::memcpy(child._controller_states, _controller_states, sizeof(_controller_states));
+    child._current_controller_read = _current_controller_read;
 }
 
 void CPU::step() {
@@ -95,7 +149,7 @@ void CPU::step() {
         _reg_pc = read16(0xFFFA);
     }
 
-    if(!(_reg_ps & Interrupt) && _irq) {
+    if(irq_pending()) {
         _irq = false;
         push16(_reg_pc);
         push(_reg_ps | 0b00100000);
@@ -108,20 +162,30 @@ void CPU::step() {
 
     word_t opcode = read(_reg_pc++);
     execute(opcode);
+    _total_cycles += _cycles;
+    steal_dma_cycles();
 }
 
 void CPU::refresh_controller_states() {
     _current_controller_read = 0;
+    if(_input_mode == InputMode::Direct) {
+        _controller_states[0] = _controller_inputs[0];
+        _controller_states[1] = _controller_inputs[1];
+        return;
+    }
+    _controller_states[0] = _controller_states[1] = 0;
     for(size_t i = 0; i < 8; ++i) {
-        _controller_states[i] = controller_callbacks[i] ? controller_callbacks[i]() : false;
-        _controller2_states[i] = controller2_callbacks[i] ? controller2_callbacks[i]() : false;
+        if(controller_callbacks[i] && controller_callbacks[i]())
+            _controller_states[0] |= 1 << i;
+        if(controller2_callbacks[i] && controller2_callbacks[i]())
+            _controller_states[1] |= 1 << i;
     }
 }
 
 word_t CPU::read_controller_state() {
     word_t r = 0x40;
     if(_current_controller_read < 8)
-        r |= _controller_states[_current_controller_read] ? 1 : 0;
+        r |= (_controller_states[0] >> _current_controller_read) & 1;
     else if(_current_controller_read == 19)
         r = 0x41;
     else
@@ -133,7 +197,7 @@ word_t CPU::read_controller_state() {
 word_t CPU::read_controller2_state() {
     word_t r = 0x40;
     if(_current_controller_read < 8)
-        r |= _controller2_states[_current_controller_read] ? 1 : 0;
+        r |= (_controller_states[1] >> _current_controller_read) & 1;
     else if(_current_controller_read == 18)
         r = 0x41;
     else
@@ -146,11 +210,16 @@ word_t CPU::read_controller2_state() {
     case C:                                                                      \
         O(A()); /* log << Hexa(_reg_pc) << " " #C " " #O " " #A << std::endl; */ \
         break;
-#define OPM(C, O, A)                                                                         \
-    case C: {                                                                                \
-        auto tmp = A();                                                                      \
-        write(tmp, O(tmp)); /* log << Hexa(_reg_pc) << " " #C " " #O " " #A << std::endl; */ \
-        break;                                                                               \
+#define OPM(C, O, A)                                                                             \
+    case C: {                                                                                    \
+        auto tmp = A();                                                                          \
+        if(tmp >= 0x8000) { /* Mappers see the unmodified value written back first */            \
+            const word_t unmodified = read(tmp);                                                 \
+            cartridge->write_rmw(tmp, unmodified, O(tmp));                                       \
+        } else {                                                                                 \
+            write(tmp, O(tmp)); /* log << Hexa(_reg_pc) << " " #C " " #O " " #A << std::endl; */ \
+        }                                                                                        \
+        break;                                                                                   \
     }
 #define OP_(C, O)                                                                 \
     case C:                                                                       \
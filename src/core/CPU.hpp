@@ -8,6 +8,8 @@
 #include "APU.hpp"
 #include "Cartridge.hpp"
 #include "PPU.hpp"
+#include "PagedMemory.hpp"
+#include "SaveState.hpp"
 
 /**
  * NES Central Processing Unit
@@ -30,14 +32,34 @@ class CPU {
     PPU*       ppu = nullptr;
     APU*       apu = nullptr;
 
+    /// Source of the controller states latched when the game strobes the controllers ($4016)
+    enum class InputMode {
+        Callbacks, ///< Polls controller_callbacks and controller2_callbacks
+        Direct     ///< Uses the states given to set_controller_input, no callback involved
+    };
+
     /// In order: A, B, Select, Start, Up, Down, Left, Right
     callback_t controller_callbacks[8];
     callback_t controller2_callbacks[8];
 
+    inline InputMode get_input_mode() const { return _input_mode; }
+    inline void      set_input_mode(InputMode mode) { _input_mode = mode; }
+    /// Buttons latched on the next strobe in InputMode::Direct, one bit per button in the controller_callbacks order (A is bit 0).
+    inline void set_controller_input(size_t controller, word_t buttons) { _controller_inputs[controller] = buttons; }
+    /// @return Buttons latched by the last strobe, same format as set_controller_input.
+    inline word_t get_controller_state(size_t controller) const { return _controller_states[controller]; }
+
     CPU(size_t _RAMSize = 0x0800);
     ~CPU();
 
     void reset();
+    /// Reset, clearing the cycle counter and any pending IRQ too.
+    void power();
+
+    void save_state(SaveState& state) const;
+    void load_state(SaveState& state);
+    /// Copies the state of this CPU into child, RAM pages are shared copy-on-write.
+    void fork_into(CPU& child);
 
     void step();
     void execute(word_t opcode);
@@ -98,6 +120,23 @@ class CPU {
     inline word_t get_next_operand1() { return read(_reg_pc + 2); }
 
     inline size_t get_cycles() const { return _cycles; }
+    /// Cycles elapsed since power-on, the APU clock.
+    inline uint64_t get_total_cycles() const { return _total_cycles; }
+
+    /// Charges the last instruction with the cycles stolen by DMC fetches, if any.
+    inline void steal_dma_cycles() {
+        if(_total_cycles >= apu->dma_deadline()) {
+            const auto stall = apu->take_dma_stall(_total_cycles);
+            _cycles += stall;
+            _total_cycles += stall;
+        }
+    }
+
+    /// An IRQ would be taken before the next instruction.
+    inline bool irq_pending() { return !(_reg_ps & Interrupt) && (_irq || cartridge->irq() || apu->irq(_total_cycles)); }
+
+    /// Internal RAM, without the $0800-$1FFF mirrors.
+    inline const PagedMemory& get_ram() const { return _ram; }
 
     static size_t instr_length[0x100];
     static size_t instr_cycles[0x100];
@@ -112,6 +151,9 @@ class CPU {
     }
 
   private:
+    template<size_t Lanes>
+    friend class WideCPU;
+
     // Registers
     addr_t _reg_pc = 0x0000; ///< Program Counter
     word_t _reg_acc = 0x00;  ///< Accumulator
@@ -123,14 +165,16 @@ class CPU {
     bool _irq = false;
 
     unsigned int _cycles = 0;
+    uint64_t     _total_cycles = 0;
 
     // Memory
-    word_t* _ram; ///< RAM
+    PagedMemory _ram; ///< RAM
 
-    bool   _refresh_controller = false;
-    bool   _controller_states[8] = {false};
-    bool   _controller2_states[8] = {false};
-    size_t _current_controller_read = 0;
+    InputMode _input_mode = InputMode::Callbacks;
+    word_t    _controller_inputs[2] = {0};
+    bool      _refresh_controller = false;
+    word_t    _controller_states[2] = {0};
+    size_t    _current_controller_read = 0;
     void   refresh_controller_states();
     word_t read_controller_state();
     word_t read_controller2_state();
@@ -11,7 +11,7 @@ word_t CPU::read(addr_t addr) {
     else if(addr < 0x4000) // PPU registers mirrors
         return ppu->read(addr);
     else if(addr < 0x4016) // pAPU
-        return apu->read(addr);
+        return apu->read(addr, _total_cycles);
     else if(addr == 0x4016) // Controllers registers
         return read_controller_state();
     else if(addr == 0x4017) // Controllers registers
@@ -36,9 +36,9 @@ addr_t CPU::read16(addr_t addr) {
 
 void CPU::write(addr_t addr, word_t value) {
     if(addr < RAMSize)
-        _ram[addr] = value;
+        _ram.write(addr, value);
     else if(addr < 0x2000) // RAM mirrors
-        _ram[addr % RAMSize] = value;
+        _ram.write(addr % RAMSize, value);
     else if(addr < 0x2008) // PPU registers
         ppu->write(addr, value);
     else if(addr == 0x4014) // OAMDMA
@@ -48,24 +48,33 @@ void CPU::write(addr_t addr, word_t value) {
     else if(addr == 0x4016) // Controllers registers
         _refresh_controller = value & 1;
     else if(addr < 0x4018) // APU registers
-        apu->write(addr - 0x4000, value);
+        apu->write(addr - 0x4000, value, _total_cycles);
     else
         cartridge->write(addr, value);
 }
 
 void CPU::oam_dma(word_t value) {
-    /// @todo Timing: Takes 513 or 514 (if on an odd cycle) Cycles
-    ppu->write(0x2003, 0x00); // Reset OAMADDR
-    addr_t start = (value << 8);
-    for(addr_t a = 0; a < 256; ++a)
-        ppu->write(0x2004, _ram[start + a]);
+    const addr_t start = (value << 8);
+    word_t       page[PPU::OAMSize];
+    if(start < 0x2000) // Internal RAM: Bulk copy
+        _ram.copy_to(page, start % RAMSize, PPU::OAMSize);
+    else
+        for(addr_t a = 0; a < PPU::OAMSize; ++a)
+            page[a] = read(start + a);
+    ppu->oam_dma(page);
+
+    // The CPU is halted for a read and a write per byte, plus one cycle to align on a read cycle if needed.
+    const auto     dma_start = _total_cycles + _cycles;
+    const unsigned stall = 513 + (dma_start & 1);
+    apu->oam_dma(dma_start, stall);
+    _cycles += stall;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////
 // Stack
 
 inline void CPU::push(word_t value) {
-    _ram[0x100 + _reg_sp--] = value;
+    _ram.write(0x100 + _reg_sp--, value);
 }
 
 inline void CPU::push16(addr_t value) {
@@ -1,80 +1,507 @@
 #include "Cartridge.hpp"
 
+#include <algorithm>
+#include <bit>
+
 Cartridge::Cartridge(const std::string& path) {
     load(path);
 }
 
 Cartridge::~Cartridge() {
-    delete _trainer;
-    delete _prg_rom;
-    delete _chr_rom;
-    delete _prg_ram;
-    delete _chr_ram;
+    close_battery_save();
 }
 
 bool Cartridge::load(const std::string& path) {
-    std::ifstream file(path, std::ios::binary);
+    if(!load(RomImage::load(path)))
+        return false;
+    log_info(path);
+    return true;
+}
 
-    if(!file) {
-        Log::error("Error: '", path, "' could not be opened.");
+bool Cartridge::load_from_memory(std::span<const uint8_t> data) {
+    if(!load(RomImage::load_from_memory(data)))
+        return false;
+    log_info("<memory>");
+    return true;
+}
+
+bool Cartridge::load(std::shared_ptr<const RomImage> rom) {
+    if(!rom)
+        return false;
+
+    close_battery_save();
+    _rom = std::move(rom);
+    _debug_prg_rom.reset();
+    _rom_patches.clear();
+    _patched_pages.clear();
+
+    // Exactly what the board has, see RomImage::Info
+    const auto& info = _rom->info();
+    _prg_rom_size = _rom->prg_rom_size();
+    _chr_rom_size = _rom->chr_rom_size();
+    _prg_ram_size = info.prg_ram_size + info.prg_nvram_size;
+    _battery = info.battery;
+    _trainer = _rom->trainer();
+
+    _prg_rom = _rom->prg_rom();
+    _chr_rom = _rom->chr_rom();
+
+    _use_chr_ram = _chr_rom_size == 0;
+    _chr_ram_size = _use_chr_ram ? std::max<size_t>(info.chr_ram_size + info.chr_nvram_size, 8192) : 0;
+    _chr_ram.allocate(_chr_ram_size);
+    _prg_ram.allocate(_prg_ram_size);
+
+    _rom_hash = _rom->get_rom_hash();
+
+    _mapper = info.mapper;
+
+    if(!is_supported(_mapper)) {
+        Log::error("Error: mapper ", _mapper, " is not supported.");
         return false;
     }
 
-    byte_t h[16]; // header
-    file.read(h, 16);
+    // The previous game may have left the mapper anywhere
+    reset_registers();
+    update_pages();
+    return true;
+}
+
+Cartridge::Mirroring Cartridge::header_mirroring() const {
+    switch(_rom->info().mirroring) {
+        case RomImage::Info::Vertical: return Vertical;
+        case RomImage::Info::FourScreens: return None;
+        default: return Horizontal;
+    }
+}
+
+void Cartridge::set_mirroring(Mirroring mirroring) {
+    static constexpr addr_t layouts[][4] = {
+        {0x2000, 0x2000, 0x2400, 0x2400}, // Horizontal
+        {0x2000, 0x2400, 0x2000, 0x2400}, // Vertical
+        {0x2000, 0x2400, 0x2800, 0x2C00}, // Four screens, the cartridge provides the other 2 KB
+        {0x2000, 0x2000, 0x2000, 0x2000}, // Single screen
+        {0x2400, 0x2400, 0x2400, 0x2400},
+    };
+    _mirrorring = mirroring;
+    std::memcpy(_nametables, layouts[mirroring], sizeof(_nametables));
+}
 
-    if(!(h[0] == 0x4E && h[1] == 0x45 && h[2] == 0x53 && h[3] == 0x1A)) {
-        Log::error("Error: '", path, "' is not a valid iNES file (wrong header).");
+bool Cartridge::open_battery_save(const std::string& path) {
+    close_battery_save();
+    if(!_battery || _prg_ram_size == 0)
+        return false;
+    auto save = std::make_shared<BatterySave>();
+    if(!save->open(path, _prg_ram_size))
         return false;
+    _battery_save = std::move(save);
+    _battery_save->load(_prg_ram);
+    _prg_ram_dirty = false;
+    Log::info("> Battery save: '", path, "'");
+    return true;
+}
+
+void Cartridge::set_speculative(bool speculative) {
+    if(speculative && !_speculative)
+        _speculative_dirty = _prg_ram_dirty;
+    else if(!speculative && _speculative)
+        _prg_ram_dirty = _speculative_dirty;
+    _speculative = speculative;
+}
+
+void Cartridge::close_battery_save() {
+    if(_battery_save && _prg_ram_dirty && !_speculative)
+        _battery_save->store(_prg_ram, true);
+    _battery_save.reset();
+    _prg_ram_dirty = false;
+}
+
+bool Cartridge::is_supported(size_t mapper) {
+    switch(mapper) {
+        case 0:
+        case 1:
+        case 2:
+        case 3:
+        case 4:
+        case 7:
+        case 66: return true;
+        default: return false;
+    }
+}
+
+void Cartridge::write_register(addr_t addr, word_t value) {
+    static constexpr Mirroring mmc1_mirroring[4] = {SingleScreenLower, SingleScreenUpper, Vertical, Horizontal};
+
+    if(addr < 0x8000) {
+        write_error(addr, value);
+        return;
+    }
+
+    switch(_mapper) {
+        case 0: // NROM
+            if(allow_debug_write) {
+                debug_write(addr - 0x8000, value);
+                return;
+            }
+            break;
+        case 1: // MMC1, registers are written one bit at a time through a serial port
+            if(value & 0x80) {
+                _shift_register = 0;
+                _shift_register_writes = 0;
+                _control_register |= 0x0C;
+                update_pages();
+                return;
+            }
+            _shift_register |= ((value & 1) << _shift_register_writes);
+            _shift_register_writes++;
+            if(_shift_register_writes == 5) {
+                switch(addr & 0xE000) {
+                    case 0x8000:
+                        _control_register = _shift_register;
+                        set_mirroring(mmc1_mirroring[_control_register & 3]);
+                        break;
+                    case 0xA000: _chr_rom_banks[0] = _shift_register; break;
+                    case 0xC000: _chr_rom_banks[1] = _shift_register; break;
+                    case 0xE000:
+                        _prg_rom_banks[0] = _shift_register & 0x0F;
+                        _prg_ram_writable = !(_shift_register & 0x10);
+                        break;
+                }
+                _shift_register = 0;
+                _shift_register_writes = 0;
+                update_pages();
+            }
+            return;
+        case 2: // UxROM
+            _prg_rom_banks[0] = value;
+            update_pages();
+            return;
+        case 3: // CNROM
+            _chr_rom_banks[0] = value;
+            update_pages();
+            return;
+        case 4: // MMC3, registers are selected by the address range and parity
+            switch(addr & 0xE001) {
+                case 0x8000: _bank_select = value; break;
+                case 0x8001: _bank_registers[_bank_select & 7] = value; break;
+                case 0xA000:
+                    if(_mirrorring != None)
+                        set_mirroring((value & 1) ? Horizontal : Vertical);
+                    break;
+                case 0xA001: _prg_ram_writable = (value & 0xC0) == 0x80; break; // Enabled and not write protected
+                case 0xC000: _irq_latch = value; break;
+                case 0xC001:
+                    _irq_counter = 0;
+                    _irq_reload = true;
+                    break;
+                case 0xE000:
+                    _irq_enabled = false;
+                    _irq_line = false;
+                    break;
+                case 0xE001: _irq_enabled = true; break;
+            }
+            update_pages();
+            return;
+        case 7: // AxROM
+            _prg_rom_banks[0] = value & 0x07;
+            set_mirroring((value & 0x10) ? SingleScreenUpper : SingleScreenLower);
+            update_pages();
+            return;
+        case 66: // GxROM
+            _prg_rom_banks[0] = (value >> 4) & 0x03;
+            _chr_rom_banks[0] = value & 0x03;
+            update_pages();
+            return;
+        case 0xFF: // Test
+            _prg_ram.write(addr, value);
+            return;
     }
+    write_error(addr, value);
+}
+
+void Cartridge::update_pages() {
+    if(!_rom && _mapper != 0xFF) // Nothing loaded
+        return;
+
+    // PRG RAM banks are resolved here too: Accesses to $6000-$7FFF only mask the address and add the offset.
+    _prg_ram_offset = 0;
+    _prg_ram_mask = _prg_ram_size ? std::min<size_t>(std::bit_floor(_prg_ram_size), 0x2000) - 1 : 0;
+
+    switch(_mapper) {
+        case 0: // NROM, 16 KB PRG ROMs are mirrored
+            map_prg(0x8000, 0x8000, 0);
+            map_chr(0x0000, 0x2000, 0);
+            break;
+        case 1: { // MMC1
+            // SUROM: The CHR bank 0 register also selects the 256 KB half of 512 KB PRG ROMs
+            const size_t outer = _prg_rom_size > 0x40000 ? (_chr_rom_banks[0] & 0x10) : 0;
+            const size_t bank = outer | _prg_rom_banks[0];
+            const size_t last = outer | (std::min<size_t>(_prg_rom_size / 0x4000, 16) - 1);
+            switch((_control_register >> 2) & 3) {
+                case 0:
+                case 1: map_prg(0x8000, 0x8000, bank >> 1); break; // 32 KB, ignoring the lowest bit
+                case 2: // First bank fixed at $8000
+                    map_prg(0x8000, 0x4000, outer);
+                    map_prg(0xC000, 0x4000, bank);
+                    break;
+                case 3: // Last bank fixed at $C000
+                    map_prg(0x8000, 0x4000, bank);
+                    map_prg(0xC000, 0x4000, last);
+                    break;
+            }
 
-    _prg_rom_size = 16384 * static_cast<size_t>(h[4]);
-    _chr_rom_size = 8192 * static_cast<size_t>(h[5]);
-    _prg_ram_size = 8192 * static_cast<size_t>(h[8]);
+            // CHR RAM boards have 8 KB, the upper bits of the CHR registers only select PRG banks there
+            const size_t chr_mask = _use_chr_ram ? 0x01 : 0x1F;
+            if(_control_register & 0x10) {
+                map_chr(0x0000, 0x1000, _chr_rom_banks[0] & chr_mask);
+                map_chr(0x1000, 0x1000, _chr_rom_banks[1] & chr_mask);
+            } else {
+                map_chr(0x0000, 0x2000, (_chr_rom_banks[0] & chr_mask) >> 1);
+            }
 
-    // Infers 8kb PRG RAM for compatibility.
-    if(_prg_ram_size == 0)
-        _prg_ram_size = 8192;
+            // SOROM (16 KB) and SXROM (32 KB) select the 8 KB PRG RAM bank through CHR bank 0 too
+            if(_prg_ram_size == 0x8000)
+                _prg_ram_offset = 0x2000 * ((_chr_rom_banks[0] >> 2) & 3);
+            else if(_prg_ram_size == 0x4000)
+                _prg_ram_offset = 0x2000 * ((_chr_rom_banks[0] >> 3) & 1);
+            break;
+        }
+        case 2: // UxROM, the last bank is fixed
+            map_prg(0x8000, 0x4000, _prg_rom_banks[0]);
+            map_prg(0xC000, 0x4000, _prg_rom_size / 0x4000 - 1);
+            map_chr(0x0000, 0x2000, 0);
+            break;
+        case 3: // CNROM
+            map_prg(0x8000, 0x8000, 0);
+            map_chr(0x0000, 0x2000, _chr_rom_banks[0]);
+            break;
+        case 4: { // MMC3
+            // $8000 and $C000 are swapped by the PRG mode, the last bank is fixed
+            const size_t last = _prg_rom_size / 0x2000 - 1;
+            const bool   prg_mode = _bank_select & 0x40;
+            map_prg(0x8000, 0x2000, prg_mode ? last - 1 : _bank_registers[6]);
+            map_prg(0xA000, 0x2000, _bank_registers[7]);
+            map_prg(0xC000, 0x2000, prg_mode ? _bank_registers[6] : last - 1);
+            map_prg(0xE000, 0x2000, last);
 
-    char flag6 = h[6];
-    // Trainer
-    if(flag6 & 0b00000100) {
-        _trainer = new byte_t[512];
-        file.read(_trainer, 512);
+            // R0 and R1 select 2 KB banks (ignoring their lowest bit), R2-R5 1 KB banks. Halves are swapped by the CHR A12 inversion.
+            const addr_t inversion = (_bank_select & 0x80) ? 0x1000 : 0;
+            map_chr(0x0000 ^ inversion, 0x800, _bank_registers[0] >> 1);
+            map_chr(0x0800 ^ inversion, 0x800, _bank_registers[1] >> 1);
+            for(size_t i = 0; i < 4; ++i)
+                map_chr((0x1000 + 0x400 * i) ^ inversion, 0x400, _bank_registers[2 + i]);
+            break;
+        }
+        case 7: // AxROM
+        case 66: // GxROM
+            map_prg(0x8000, 0x8000, _prg_rom_banks[0]);
+            map_chr(0x0000, 0x2000, _chr_rom_banks[0]);
+            break;
+        case 0xFF: // Test: Flat memory, never forked
+            for(size_t i = 0; i < 4; ++i)
+                _prg_pages[i] = reinterpret_cast<const byte_t*>(_prg_ram.data()) + 0x8000 + 0x2000 * i;
+            for(size_t i = 0; i < 8; ++i)
+                _chr_pages[i] = reinterpret_cast<const byte_t*>(_prg_ram.data()) + 0x400 * i;
+            return;
     }
 
-    if(flag6 & 0x8)
-        _mirrorring = None;
-    else
-        _mirrorring = (flag6 & 1) ? Vertical : Horizontal;
+    if(!_rom_patches.empty())
+        patch_prg_pages();
+}
+
+void Cartridge::set_rom_patches(const std::vector<Cheat>& cheats) {
+    _rom_patches.clear();
+    _patched_pages.clear();
+    for(const auto& cheat : cheats)
+        if(cheat.patches_rom())
+            _rom_patches.push_back(cheat);
+    update_pages();
+}
+
+void Cartridge::patch_prg_pages() {
+    for(size_t page = 0; page < 4; ++page) {
+        const byte_t* source = _prg_pages[page];
+        auto it = std::find_if(_patched_pages.begin(), _patched_pages.end(), [&](const PatchedPage& p) { return p.source == source && p.page == page; });
+        if(it == _patched_pages.end()) {
+            // Compare values are checked against the original ROM
+            std::shared_ptr<byte_t[]> data;
+            for(const auto& patch : _rom_patches) {
+                const size_t offset = patch.address & 0x1FFF;
+                if(static_cast<size_t>((patch.address - 0x8000) >> 13) != page || (patch.compare >= 0 && static_cast<word_t>(source[offset]) != patch.compare))
+                    continue;
+                if(!data) {
+                    data.reset(new byte_t[0x2000]);
+                    std::memcpy(data.get(), source, 0x2000);
+                }
+                data[offset] = static_cast<byte_t>(patch.value);
+            }
+            it = _patched_pages.insert(_patched_pages.end(), {source, page, std::move(data)});
+        }
+        if(it->data)
+            _prg_pages[page] = it->data.get();
+    }
+}
 
-    _prg_rom = new byte_t[_prg_rom_size];
-    file.read(_prg_rom, _prg_rom_size);
+void Cartridge::map_prg(addr_t addr, size_t size, size_t bank) {
+    for(size_t offset = 0; offset < size; offset += 0x2000)
+        _prg_pages[(addr - 0x8000 + offset) >> 13] = _prg_rom + (bank * size + offset) % _prg_rom_size;
+}
 
-    if(_chr_rom_size == 0) // CHR RAM
-    {
-        _use_chr_ram = true;
-        _chr_ram_size = 128 * 1024; /// @todo TEMP
-        _chr_ram = new byte_t[_chr_ram_size];
+void Cartridge::map_chr(addr_t addr, size_t size, size_t bank) {
+    for(size_t offset = 0; offset < size; offset += 0x400) {
+        const size_t page = (addr + offset) >> 10;
+        if(_use_chr_ram) {
+            _chr_ram_pages[page] = (bank * size + offset) % _chr_ram_size;
+            _chr_pages[page] = reinterpret_cast<const byte_t*>(_chr_ram.page(_chr_ram_pages[page] >> PagedMemory::PageBits));
+        } else {
+            _chr_pages[page] = _chr_rom + (bank * size + offset) % _chr_rom_size;
+        }
+    }
+}
+
+void Cartridge::clock_scanline() {
+    if(_irq_counter == 0 || _irq_reload) {
+        _irq_counter = _irq_latch;
+        _irq_reload = false;
     } else {
-        _chr_rom = new byte_t[_chr_rom_size];
-        file.read(_chr_rom, _chr_rom_size);
+        --_irq_counter;
     }
+    if(_irq_counter == 0 && _irq_enabled)
+        _irq_line = true;
+}
 
-    _prg_ram = new byte_t[_prg_ram_size];
+void Cartridge::log_info(const std::string& name) const {
+    Log::info("Loaded '", name, "' successfully! ");
+    const auto& info = _rom->info();
+    Log::info("> ", info.nes2 ? "NES 2.0" : "iNES", " header", info.from_database ? ", known dump (CRC32 " : " (CRC32 ", Hexa32(_rom->get_crc32()), ")");
+    Log::info("> Mapper: ", _mapper, ".", +info.submapper, ", Mirroring: ", ((_mirrorring == None) ? "None" : (_mirrorring == Vertical ? "Vertical" : "Horizontal")));
+    Log::info("> PRG Cartridge size: ", _prg_rom_size / 1024, "kB (", _prg_rom_size, "B)");
+    Log::info("> CHR Cartridge size: ", _chr_rom_size / 1024, "kB (", _chr_rom_size, "B)");
+    Log::info("> PRG RAM size: ", _prg_ram_size / 1024, "kB (", _prg_ram_size, "B)", _battery ? ", battery-backed" : "");
+    if(_use_chr_ram)
+        Log::info("> CHR RAM size: ", _chr_ram_size / 1024, "kB (", _chr_ram_size, "B)");
+}
 
-    _mapper = ((flag6 & 0b11110000) >> 4) | (h[7] & 0b11110000);
+void Cartridge::debug_write(size_t offset, word_t value) {
+    if(!_debug_prg_rom) {
+        _debug_prg_rom.reset(new byte_t[_prg_rom_size]);
+        std::memcpy(_debug_prg_rom.get(), _prg_rom, _prg_rom_size);
+        _prg_rom = _debug_prg_rom.get();
+        update_pages();
+    }
+    _debug_prg_rom[offset] = value;
+    if(!_patched_pages.empty()) { // Copied before this write
+        _patched_pages.clear();
+        update_pages();
+    }
+}
 
-    if(!_mappers_read_chr[_mapper]) {
-        Log::error("Error: mapper ", _mapper, " is not supported.");
-        return false;
+void Cartridge::power() {
+    reset_registers();
+    _prg_ram.fill(0);
+    _chr_ram.fill(0);
+    if(_battery_save) {
+        _battery_save->load(_prg_ram);
+        _prg_ram_dirty = false;
     }
+    update_pages();
+}
 
-    Log::info("Loaded '", path, "' successfully! ");
-    Log::info("> Mapper: ", _mapper, ", Mirroring: ", ((_mirrorring == None) ? "None" : (_mirrorring == Vertical ? "Vertical" : "Horizontal")));
-    Log::info("> PRG Cartridge size: ", 16 * h[4], "kB (", _prg_rom_size, "B)");
-    Log::info("> CHR Cartridge size: ", 8 * h[5], "kB (", _chr_rom_size, "B)");
-    Log::info("> PRG RAM size: ", 8 * h[8], "kB (", _prg_ram_size, "B)");
+void Cartridge::reset_registers() {
+    _control_register = 0x0C;
+    _shift_register = 0;
+    _shift_register_writes = 0;
+    std::memset(_chr_rom_banks, 0, sizeof(_chr_rom_banks));
+    std::memset(_prg_rom_banks, 0, sizeof(_prg_rom_banks));
+    _prg_ram_writable = true;
+    _bank_select = 0;
+    std::memset(_bank_registers, 0, sizeof(_bank_registers));
+    _irq_latch = 0;
+    _irq_counter = 0;
+    _irq_reload = false;
+    _irq_enabled = false;
+    _irq_line = false;
+    if(_rom)
+        set_mirroring(header_mirroring());
+}
 
-    return true;
+void Cartridge::save_state(SaveState& state) const {
+    state.write(_control_register);
+    state.write(_shift_register);
+    state.write(_shift_register_writes);
+    state.write(_chr_rom_banks);
+    state.write(_prg_rom_banks);
+    state.write(_mirrorring);
+    state.write(_bank_select);
+    state.write(_bank_registers);
+    state.write(_prg_ram_writable);
+    state.write(_irq_latch);
+    state.write(_irq_counter);
+    state.write(_irq_reload);
+    state.write(_irq_enabled);
+    state.write(_irq_line);
+    _prg_ram.save_state(state);
+    _chr_ram.save_state(state);
+}
+
+void Cartridge::load_state(SaveState& state) {
+    state.read(_control_register);
+    state.read(_shift_register);
+    state.read(_shift_register_writes);
+    state.read(_chr_rom_banks);
+    state.read(_prg_rom_banks);
+    state.read(_mirrorring);
+    state.read(_bank_select);
+    state.read(_bank_registers);
+    state.read(_prg_ram_writable);
+    state.read(_irq_latch);
+    state.read(_irq_counter);
+    state.read(_irq_reload);
+    state.read(_irq_enabled);
+    state.read(_irq_line);
+    _prg_ram.load_state(state);
+    _chr_ram.load_state(state);
+    // The restored RAM may differ from the battery save, unless this is the end of speculative frames (see set_speculative)
+    if(!_speculative)
+        _prg_ram_dirty = _battery_save != nullptr;
+    set_mirroring(_mirrorring);
+    update_pages();
+}
+
+void Cartridge::fork_into(Cartridge& child) {
+    child.allow_debug_write = allow_debug_write;
+    child._mirrorring = _mirrorring;
+    child._control_register = _control_register;
+    child._shift_register = _shift_register;
+    child._shift_register_writes = _shift_register_writes;
+    child._prg_rom_size = _prg_rom_size;
+    child._chr_rom_size = _chr_rom_size;
+    child._prg_ram_size = _prg_ram_size;
+    child._chr_ram_size = _chr_ram_size;
+    child._use_chr_ram = _use_chr_ram;
+    child._battery = _battery;
+    std::memcpy(child._chr_rom_banks, _chr_rom_banks, sizeof(_chr_rom_banks));
+    std::memcpy(child._prg_rom_banks, _prg_rom_banks, sizeof(_prg_rom_banks));
+    child._bank_select = _bank_select;
+    std::memcpy(child._bank_registers, _bank_registers, sizeof(_bank_registers));
+    child._prg_ram_writable = _prg_ram_writable;
+    child._irq_latch = _irq_latch;
+    child._irq_counter = _irq_counter;
+    child._irq_reload = _irq_reload;
+    child._irq_enabled = _irq_enabled;
+    child._irq_line = _irq_line;
+    if(_mapper == 0xFF)
+        child.load_test();
+    child._mapper = _mapper;
+    child._rom_hash = _rom_hash;
+    child._rom = _rom;
+    child._debug_prg_rom = _debug_prg_rom;
+    child._trainer = _trainer;
+    child._prg_rom = _prg_rom;
+    child._chr_rom = _chr_rom;
+    child._rom_patches = _rom_patches;
+    child._patched_pages = _patched_pages;
+    std::memcpy(child._nametables, _nametables, sizeof(_nametables));
+    child._prg_ram = _prg_ram.fork();
+    child._chr_ram = _chr_ram.fork();
+    child.update_pages();
 }
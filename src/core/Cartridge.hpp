@@ -1,11 +1,18 @@
 #pragma once
 
 #include <fstream>
-#include <functional>
 #include <iostream>
+#include <memory>
+#include <span>
 #include <string>
+#include <vector>
 
+#include "BatterySave.hpp"
+#include "Cheat.hpp"
 #include "Common.hpp"
+#include "PagedMemory.hpp"
+#include "RomImage.hpp"
+#include "SaveState.hpp"
 
 /**
  * NES Cartridge
@@ -16,7 +23,9 @@ class Cartridge {
     enum Mirroring {
         Horizontal,
         Vertical,
-        None // Four Screens
+        None, // Four Screens
+        SingleScreenLower,
+        SingleScreenUpper
     };
 
     bool allow_debug_write = false;
@@ -26,44 +35,108 @@ class Cartridge {
     ~Cartridge();
 
     bool load(const std::string& path);
+    /// Loads an iNES file already in memory. Data is copied, unless an identical ROM is already loaded.
+    bool load_from_memory(std::span<const uint8_t> data);
+    /// Uses an image already loaded, nothing is logged unless it fails.
+    bool load(std::shared_ptr<const RomImage> rom);
+    static bool is_supported(size_t mapper);
+
+    /// Battery-backed PRG RAM (iNES flag 6 bit 1) is kept in the save file at path (see BatterySave::path_for).
+    /// The RAM is loaded from it, then stored back at the end of each frame it was written to. Forks don't inherit it.
+    /// @return false if the cartridge has no battery or the file can't be mapped.
+    bool        open_battery_save(const std::string& path);
+    inline bool has_battery() const { return _battery; }
+    /// Stores the PRG RAM to the battery save if it was written to (see open_battery_save).
+    inline void end_frame() {
+        if(_prg_ram_dirty && _battery_save && !_speculative)
+            _prg_ram_dirty = !_battery_save->store(_prg_ram);
+    }
+    /// Frames run while speculative are rolled back to the state the cartridge was in when it was set (run-ahead):
+    /// Nothing is stored to the battery save, and the save is considered as up to date as it was once this is cleared.
+    void set_speculative(bool speculative);
+
+    /// Clears the mapper registers and the RAMs.
+    void power();
+
+    void save_state(SaveState& state) const;
+    void load_state(SaveState& state);
+    /// Copies the state of this cartridge into child. ROMs are always shared, RAM pages are shared copy-on-write.
+    void fork_into(Cartridge& child);
+    /// Mapper 0xFF for CPU tests: $8000-$FFFF is backed by the PRG RAM, as if it was a flat 64 KB memory.
     void load_test() {
         _mapper = 0xFF;
-        _mappers_read[0xFF] = _mappers_read_chr[0xFF] = _mappers_read_chr_ram[0xFF] = [&](addr_t addr) -> byte_t { return _prg_ram[addr]; };
-        _mappers_write[0xFF] = [&](addr_t addr, word_t value) { _prg_ram[addr] = value; };
         _prg_ram_size = 64 * 1024;
-        _prg_ram = new byte_t[_prg_ram_size];
+        _prg_ram.allocate(_prg_ram_size);
         allow_debug_write = true;
+        update_pages();
     }
 
-    inline Mirroring get_mirroring() const { return _mirrorring; }
+    /// Patches the PRG ROM as the CPU sees it with the codes at $8000-$FFFF, replacing the previous patches. Other codes are ignored.
+    /// Only the 8 KB pages holding a patch are redirected to patched copies (one per ROM bank and CPU page), through
+    /// the same bank pointers as other pages: Reads cost the same, patched or not. Cleared when a ROM is loaded.
+    void set_rom_patches(const std::vector<Cheat>& cheats);
+
+    inline Mirroring                              get_mirroring() const { return _mirrorring; }
+    inline const std::shared_ptr<const RomImage>& get_rom() const { return _rom; }
+    /// Hash of the PRG and CHR ROMs, identifies the game independently of the file name or header.
+    inline uint64_t get_rom_hash() const { return _rom_hash; }
 
     /// CPU Read
     inline byte_t read(addr_t addr) const {
-        assert(_mappers_read[_mapper]);
-        return _mappers_read[_mapper](addr);
+        if(addr >= 0x8000)
+            return _prg_pages[(addr >> 13) & 3][addr & 0x1FFF];
+        if(addr >= 0x6000) // Open bus without PRG RAM
+            return _prg_ram_size ? _prg_ram[_prg_ram_offset + (addr & _prg_ram_mask)] : 0;
+        read_error(addr);
+        return 0;
     }
 
     /// CPU Write
     inline void write(addr_t addr, word_t value) {
-        assert(_mappers_write[_mapper]);
-        _mappers_write[_mapper](addr, value);
+        if(addr >= 0x8000 || addr < 0x6000)
+            write_register(addr, value);
+        else if(_prg_ram_writable && _prg_ram_size) {
+            _prg_ram.write(_prg_ram_offset + (addr & _prg_ram_mask), value);
+            _prg_ram_dirty = true;
+        }
     }
 
-    /// PPU Read
-    inline byte_t read_chr(addr_t addr) {
-        if(_use_chr_ram) {
-            assert(_mappers_read_chr_ram[_mapper]);
-            return _mappers_read_chr_ram[_mapper](addr);
-        } else {
-            assert(_mappers_read_chr[_mapper]);
-            return _mappers_read_chr[_mapper](addr);
-        }
+    /// CPU Write of a read-modify-write instruction, the unmodified value is first written back on the previous cycle.
+    /// MMC1 ignores the second of two writes on consecutive cycles.
+    inline void write_rmw(addr_t addr, word_t unmodified, word_t value) {
+        write(addr, unmodified);
+        if(_mapper != 1 || addr < 0x8000)
+            write(addr, value);
+    }
+
+    /// Mapper IRQ line (MMC3 scanline counter), held until the game acknowledges it.
+    inline bool irq() const { return _irq_line; }
+    /// The mapper counts scanlines through the rising edges of the PPU address line A12 (see PPU::scanline_event).
+    inline bool counts_scanlines() const { return _mapper == 4; }
+    /// Filtered A12 rising edge, clocks the MMC3 scanline counter.
+    void clock_scanline();
+
+    /// PPU Read ($0000-$1FFF)
+    inline byte_t read_chr(addr_t addr) const { return _chr_pages[addr >> 10][addr & 0x3FF]; }
+
+    /// PPU Write ($0000-$1FFF), ignored by CHR ROMs.
+    inline void write_chr(addr_t addr, word_t value) {
+        if(!_use_chr_ram)
+            return;
+        const size_t offset = _chr_ram_pages[addr >> 10] + (addr & 0x3FF);
+        _chr_ram.write(offset, value);
+        // The RAM page was copied if it was shared with a fork
+        if(_chr_ram.page(offset >> PagedMemory::PageBits) != reinterpret_cast<const word_t*>(_chr_pages[addr >> 10]))
+            update_pages();
     }
 
+    /// PPU VRAM address ($2000-$2FFF) a nametable address ($2000-$3EFF) is mapped to, following the mirroring.
+    inline addr_t nametable(addr_t addr) const { return _nametables[(addr >> 10) & 3] | (addr & 0x3FF); }
+
   private:
     Mirroring _mirrorring;
 
-    word_t _control_register = 0;
+    word_t _control_register = 0x0C; // MMC1, PRG mode 3 at power
     word_t _shift_register = 0;
     size_t _shift_register_writes = 0;
 
@@ -73,132 +146,77 @@ class Cartridge {
     size_t _chr_ram_size = 0;
     bool   _use_chr_ram = false;
 
-    size_t _chr_rom_banks[8] = {0};
-    size_t _chr_ram_banks[8] = {0};
+    size_t _chr_rom_banks[8] = {0}; // Also used for CHR RAM
     size_t _prg_rom_banks[8] = {0};
-
-    size_t _mapper = 0;
-
-    byte_t* _trainer = nullptr;
-    byte_t* _prg_rom = nullptr;
-    byte_t* _chr_rom = nullptr;
-    byte_t* _chr_ram = nullptr;
-    byte_t* _prg_ram = nullptr;
+    bool   _prg_ram_writable = true;
+    size_t _prg_ram_offset = 0; // Switchable 8 KB PRG RAM bank at $6000 (MMC1)
+    size_t _prg_ram_mask = 0;   // Of the address in the bank, mirrors RAMs smaller than 8 KB
+    bool   _prg_ram_dirty = false;
+    bool   _speculative = false;
+    bool   _speculative_dirty = false; // _prg_ram_dirty before the speculative frames
+    bool   _battery = false;
+
+    // MMC3
+    word_t _bank_select = 0;
+    word_t _bank_registers[8] = {0};
+    word_t _irq_latch = 0;
+    word_t _irq_counter = 0;
+    bool   _irq_reload = false;
+    bool   _irq_enabled = false;
+    bool   _irq_line = false;
+
+    // Banks mapped to each 8 KB PRG window ($8000-$FFFF) and each 1 KB CHR window, only updated on bank switches (see update_pages):
+    // Accesses are a shift, an index and a load whatever the mapper.
+    const byte_t* _prg_pages[4] = {nullptr};
+    const byte_t* _chr_pages[8] = {nullptr};
+    size_t        _chr_ram_pages[8] = {0};                           // Offsets in _chr_ram
+    addr_t        _nametables[4] = {0x2000, 0x2000, 0x2400, 0x2400}; // VRAM of each nametable
+
+    size_t   _mapper = 0;
+    uint64_t _rom_hash = 0;
+
+    // ROMs point into the image, shared by all the cartridges running the same game
+    std::shared_ptr<const RomImage> _rom;
+    const byte_t*                   _trainer = nullptr;
+    const byte_t*                   _prg_rom = nullptr;
+    const byte_t*                   _chr_rom = nullptr;
+    std::shared_ptr<byte_t[]>       _debug_prg_rom; // Private copy of the PRG ROM, only allocated by debug writes
+    PagedMemory                     _chr_ram;
+    PagedMemory                     _prg_ram;
+    std::shared_ptr<BatterySave>    _battery_save;
+
+    /// Patched copy of a PRG ROM bank mapped in an 8 KB CPU page
+    struct PatchedPage {
+        const byte_t*                   source;
+        size_t                          page;
+        std::shared_ptr<const byte_t[]> data; ///< nullptr if no patch applies (compare values)
+    };
+    std::vector<Cheat>       _rom_patches;
+    std::vector<PatchedPage> _patched_pages; // Created on the first mapping of each bank, shared with forks
+
+    void      log_info(const std::string& name) const;
+    void      debug_write(size_t offset, word_t value);
+    Mirroring header_mirroring() const;
+    void      set_mirroring(Mirroring mirroring);
+    /// Mapper registers and mirroring as at power on, pages aren't updated.
+    void reset_registers();
+    /// Stores the last changes, the save is then released.
+    void close_battery_save();
+
+    /// Mapper registers ($4020-$5FFF, $8000-$FFFF)
+    void write_register(addr_t addr, word_t value);
+    /// Recomputes the PRG and CHR pages from the mapper registers.
+    void update_pages();
+    /// Redirects the PRG pages holding ROM patches to their patched copies.
+    void patch_prg_pages();
+    /// Maps size bytes of PRG ROM, starting at bank * size, at addr ($8000-$FFFF). Banks wrap around the ROM.
+    void map_prg(addr_t addr, size_t size, size_t bank);
+    /// Maps size bytes of CHR ROM (or RAM), starting at bank * size, at addr ($0000-$1FFF). Banks wrap around the ROM.
+    void map_chr(addr_t addr, size_t size, size_t bank);
 
     inline void read_error(addr_t addr) const { Log::error("Error: Trying to read cartridge (mapper: ", _mapper, ") at address ", Hexa(addr)); }
 
     inline void write_error(addr_t addr, word_t val) const {
         Log::error("Error: Trying to write value ", Hexa(val), " (", static_cast<char>(val), ") to cartridge (mapper: ", _mapper, ") at address ", Hexa(addr));
     }
-
-    std::function<byte_t(addr_t)> _mappers_read[0x100] = {[&](addr_t addr) -> byte_t // 000
-                                                          {
-                                                              if(addr >= 0x6000 && addr < 0x8000) {
-                                                                  return _prg_ram[(addr - 0x6000) % _prg_ram_size];
-                                                              } else if(addr >= 0x8000 && addr < 0xC000) { // First 16 KB of ROM.
-                                                                  return _prg_rom[addr - 0x8000];
-                                                              } else if(addr >= 0xC000) { // Last 16 KB of ROM (NROM-256) or mirror of $8000-$BFFF (NROM-128).
-                                                                  if(_prg_rom_size > 0x4000)
-                                                                      return _prg_rom[addr - 0x8000];
-                                                                  else
-                                                                      return _prg_rom[addr - 0xC000];
-                                                              }
-                                                              read_error(addr);
-                                                              return 0;
-                                                          },
-                                                          [&](addr_t addr) -> byte_t // 001
-                                                          {
-                                                              if(addr >= 0x6000 && addr < 0x8000) {
-                                                                  return _prg_ram[(addr - 0x6000) % _prg_ram_size];
-                                                              } else if(addr >= 0x8000 && addr < 0xC000) {
-                                                                  return _prg_rom[(addr - 0x8000) % _prg_rom_size + (_prg_rom_banks[0] & 0xF) * 0x4000];
-                                                              } else if(addr >= 0xC000) {
-                                                                  return _prg_rom[(addr - 0x8000) % _prg_rom_size + (_prg_rom_banks[1] & 0xF) * 0x4000];
-                                                              }
-                                                              read_error(addr);
-                                                              return 0;
-                                                          }};
-
-    std::function<void(addr_t, word_t)> _mappers_write[0x100] = {[&](addr_t addr, word_t value) -> void // 000
-                                                                 {
-                                                                     if(addr >= 0x6000 && addr < 0x8000) {
-                                                                         _prg_ram[(addr - 0x6000) % _prg_ram_size] = value;
-                                                                         return;
-                                                                     }
-
-                                                                     if(allow_debug_write && addr > 0x8000) {
-                                                                         _prg_rom[addr - 0x8000] = value;
-                                                                         return;
-                                                                     }
-
-                                                                     write_error(addr, value);
-                                                                 },
-                                                                 [&](addr_t addr, word_t value) -> void // 001
-                                                                 {
-                                                                     if(addr < 0x1000) { // PPU $0000-$0FFF: 4 KB switchable CHR bank
-                                                                         Log::warn("Warning: Unimplemented, trying to write value ", Hexa(value), " (", static_cast<char>(value),
-                                                                                   ") to cartridge (mapper: ", _mapper, ") at address ", Hexa(addr));
-                                                                     } else if(addr < 0x2000) { // PPU $1000-$1FFF: 4 KB switchable CHR bank
-                                                                         Log::warn("Warning: Unimplemented, trying to write value ", Hexa(value), " (", static_cast<char>(value),
-                                                                                   ") to cartridge (mapper: ", _mapper, ") at address ", Hexa(addr));
-                                                                     } else if(addr < 0x6000) { // Nothing
-                                                                         write_error(addr, value);
-                                                                     } else if(addr < 0x8000) { // CPU $6000-$7FFF: 8 KB PRG RAM bank, (optional)
-                                                                         _prg_ram[(addr - 0x6000) % _prg_ram_size] = value;
-                                                                         return;
-                                                                     } else {
-                                                                         // CPU $8000-$BFFF: 16 KB PRG ROM bank, either switchable or fixed to the first bank
-                                                                         // CPU $C000-$FFFF: 16 KB PRG ROM bank, either fixed to the last bank or switchable
-                                                                         if(value & 0x80) {
-                                                                             _shift_register = 0;
-                                                                             _shift_register_writes = 0;
-                                                                             return;
-                                                                         } else {
-                                                                             _shift_register |= ((value & 1) << _shift_register_writes);
-                                                                             _shift_register_writes++;
-                                                                             if(_shift_register_writes == 5) {
-                                                                                 switch(addr & 0xC000) {
-                                                                                     case 0x8000: _control_register = _shift_register; break;
-                                                                                     case 0xA000:
-                                                                                         if(_use_chr_ram)
-                                                                                             _chr_ram_banks[0] = _shift_register;
-                                                                                         else
-                                                                                             _chr_rom_banks[0] = _shift_register;
-                                                                                         break;
-                                                                                     case 0xC000:
-                                                                                         if(_use_chr_ram)
-                                                                                             _chr_ram_banks[1] = _shift_register;
-                                                                                         else
-                                                                                             _chr_rom_banks[1] = _shift_register;
-                                                                                         break;
-                                                                                     case 0xE000: _prg_rom_banks[0] = _shift_register; break;
-                                                                                 }
-                                                                                 _shift_register = 0;
-                                                                                 _shift_register_writes = 0;
-                                                                             }
-                                                                             return;
-                                                                         }
-                                                                     }
-                                                                     write_error(addr, value);
-                                                                 }};
-
-    std::function<byte_t(addr_t)> _mappers_read_chr[0x100] = {[&](addr_t addr) -> byte_t // 000
-                                                              { return _chr_rom[addr % _chr_rom_size]; },
-                                                              [&](addr_t addr) -> byte_t // 001
-                                                              {
-                                                                  if(addr < 0x1000)
-                                                                      return _chr_rom[addr % _chr_rom_size + 0x1000 * _chr_rom_banks[0]];
-                                                                  else
-                                                                      return _chr_rom[addr % _chr_rom_size + 0x1000 * _chr_rom_banks[1]];
-                                                              }};
-
-    std::function<byte_t(addr_t)> _mappers_read_chr_ram[0x100] = {[&](addr_t addr) // 000
-                                                                  { return _chr_ram[addr % _chr_ram_size]; },
-                                                                  [&](addr_t addr) // 001
-                                                                  {
-                                                                      if(addr < 0x1000)
-                                                                          return _chr_ram[addr % _chr_ram_size + 0x1000 * _chr_ram_banks[0]];
-                                                                      else
-                                                                          return _chr_ram[addr % _chr_ram_size + 0x1000 * _chr_ram_banks[1]];
-                                                                  }};
 };
@@ -0,0 +1,74 @@
+#include "Cheat.hpp"
+
+#include <cctype>
+
+namespace {
+/// Game Genie letters, by value.
+constexpr char GameGenieLetters[] = "APZLGITYEOXUKSVN";
+
+std::optional<Cheat> parse_game_genie(const std::string& code) {
+    int n[8];
+    for(size_t i = 0; i < code.size(); ++i) {
+        const char* letter = std::char_traits<char>::find(GameGenieLetters, 16, code[i]);
+        if(!letter)
+            return std::nullopt;
+        n[i] = static_cast<int>(letter - GameGenieLetters);
+    }
+
+    // Each letter holds 4 bits, the bits of the address and values are scattered across them.
+    Cheat cheat;
+    cheat.address = static_cast<addr_t>(0x8000 | ((n[3] & 7) << 12) | ((n[5] & 7) << 8) | ((n[4] & 8) << 8) | ((n[2] & 7) << 4) | ((n[1] & 8) << 4) | (n[4] & 7) | (n[3] & 8));
+    if(code.size() == 6) {
+        cheat.value = static_cast<word_t>(((n[1] & 7) << 4) | ((n[0] & 8) << 4) | (n[0] & 7) | (n[5] & 8));
+    } else {
+        cheat.value = static_cast<word_t>(((n[1] & 7) << 4) | ((n[0] & 8) << 4) | (n[0] & 7) | (n[7] & 8));
+        cheat.compare = static_cast<int16_t>(((n[7] & 7) << 4) | ((n[6] & 8) << 4) | (n[6] & 7) | (n[5] & 8));
+    }
+    return cheat;
+}
+
+bool parse_hex(const std::string& str, size_t max_digits, unsigned& value) {
+    if(str.empty() || str.size() > max_digits)
+        return false;
+    value = 0;
+    for(char c : str) {
+        if(!std::isxdigit(static_cast<unsigned char>(c)))
+            return false;
+        value = value * 16 + (std::isdigit(static_cast<unsigned char>(c)) ? c - '0' : std::toupper(static_cast<unsigned char>(c)) - 'A' + 10);
+    }
+    return true;
+}
+
+std::optional<Cheat> parse_raw(const std::string& code) {
+    const auto first = code.find(':');
+    const auto last = code.rfind(':');
+    unsigned   address, value, compare;
+    if(!parse_hex(code.substr(0, first), 4, address) || !parse_hex(code.substr(last + 1), 2, value))
+        return std::nullopt;
+    if(first != last && !parse_hex(code.substr(first + 1, last - first - 1), 2, compare))
+        return std::nullopt;
+    // RAM or ROM: Registers can't be frozen
+    if(address >= 0x2000 && address < 0x6000)
+        return std::nullopt;
+
+    Cheat cheat;
+    cheat.address = static_cast<addr_t>(address);
+    cheat.value = static_cast<word_t>(value);
+    if(first != last)
+        cheat.compare = static_cast<int16_t>(compare);
+    return cheat;
+}
+} // namespace
+
+std::optional<Cheat> Cheat::parse(const std::string& code) {
+    std::string normalized;
+    for(char c : code)
+        if(c != ' ' && c != '-')
+            normalized += static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+
+    if(normalized.find(':') != std::string::npos)
+        return parse_raw(normalized);
+    if(normalized.size() == 6 || normalized.size() == 8)
+        return parse_game_genie(normalized);
+    return std::nullopt;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <optional>
+#include <string>
+
+#include "Common.hpp"
+
+/**
+ * Cheat code: Game Genie (6 or 8 letters) or raw, as hexadecimal AAAA:VV or AAAA:CC:VV (address, compare, value).
+ *
+ * Codes at $8000-$FFFF patch the ROM as the CPU sees it (see Cartridge::set_rom_patches). With a compare value, the
+ * patch only applies to the banks holding that value at this address: Bank switched games map other code there too.
+ * Codes in RAM ($0000-$1FFF, $6000-$7FFF) freeze a value, written after each frame (see NES::set_cheats). With a
+ * compare value, it is only written while the RAM holds that value.
+ **/
+struct Cheat {
+    addr_t  address = 0;
+    word_t  value = 0;
+    int16_t compare = -1; ///< -1 for none
+
+    inline bool patches_rom() const { return address >= 0x8000; }
+
+    /// Letters are case insensitive, spaces and dashes are ignored.
+    /// @return std::nullopt if code isn't a valid code.
+    static std::optional<Cheat> parse(const std::string& code);
+};
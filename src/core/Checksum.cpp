@@ -0,0 +1,285 @@
+#include "Checksum.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define NESEN_CRC32_PCLMUL
+#include <immintrin.h>
+#endif
+
+namespace Checksum {
+
+namespace {
+
+constexpr uint32_t Polynomial = 0xEDB88320; // Reflected
+
+// Slicing-by-8: tables[k][b] is the CRC of byte b followed by k zero bytes.
+struct Tables {
+    uint32_t t[8][256];
+
+    constexpr Tables() : t() {
+        for(uint32_t b = 0; b < 256; ++b) {
+            uint32_t c = b;
+            for(int i = 0; i < 8; ++i)
+                c = (c >> 1) ^ ((c & 1) ? Polynomial : 0);
+            t[0][b] = c;
+        }
+        for(uint32_t b = 0; b < 256; ++b)
+            for(int k = 1; k < 8; ++k)
+                t[k][b] = (t[k - 1][b] >> 8) ^ t[0][t[k - 1][b] & 0xFF];
+    }
+};
+
+constexpr Tables tables;
+
+/// Works on the inverted CRC.
+uint32_t crc32_tables(const uint8_t* p, size_t size, uint32_t c) {
+    const auto& t = tables.t;
+    for(; size >= 8; p += 8, size -= 8) {
+        uint32_t lo, hi;
+        std::memcpy(&lo, p, 4);
+        std::memcpy(&hi, p + 4, 4);
+        lo ^= c;
+        c = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^ t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24] ^ t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF] ^
+            t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+    }
+    for(; size > 0; ++p, --size)
+        c = (c >> 8) ^ t[0][(c ^ *p) & 0xFF];
+    return c;
+}
+
+#ifdef NESEN_CRC32_PCLMUL
+
+__attribute__((target("pclmul,sse4.1"))) inline __m128i fold(__m128i x, __m128i k, __m128i next) {
+    return _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00), _mm_clmulepi64_si128(x, k, 0x11)), next);
+}
+
+__attribute__((target("pclmul,sse4.1"))) inline __m128i load(const uint8_t* p) {
+    return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+}
+
+/// Folds 64 then 16 bytes at a time, followed by a Barrett reduction (Intel, "Fast CRC Computation for Generic
+/// Polynomials Using PCLMULQDQ Instruction"). Works on the inverted CRC, size is a multiple of 16, at least 64.
+__attribute__((target("pclmul,sse4.1"))) uint32_t crc32_pclmul(const uint8_t* p, size_t size, uint32_t c) {
+    const __m128i k1k2 = _mm_set_epi64x(0x01C6E41596, 0x0154442BD4);
+    const __m128i k3k4 = _mm_set_epi64x(0x00CCAA009E, 0x01751997D0);
+    const __m128i k5 = _mm_set_epi64x(0, 0x0163CD6124);
+    const __m128i poly = _mm_set_epi64x(0x01F7011641, 0x01DB710641); // u, P(x)
+    const __m128i mask32 = _mm_set_epi32(0, 0, 0, -1);
+
+    __m128i x0 = _mm_xor_si128(load(p), _mm_cvtsi32_si128(static_cast<int>(c)));
+    __m128i x1 = load(p + 16);
+    __m128i x2 = load(p + 32);
+    __m128i x3 = load(p + 48);
+    for(p += 64, size -= 64; size >= 64; p += 64, size -= 64) {
+        x0 = fold(x0, k1k2, load(p));
+        x1 = fold(x1, k1k2, load(p + 16));
+        x2 = fold(x2, k1k2, load(p + 32));
+        x3 = fold(x3, k1k2, load(p + 48));
+    }
+    x0 = fold(x0, k3k4, x1);
+    x0 = fold(x0, k3k4, x2);
+    x0 = fold(x0, k3k4, x3);
+    for(; size >= 16; p += 16, size -= 16)
+        x0 = fold(x0, k3k4, load(p));
+
+    // 128 to 64 bits, then 64 to 32 bits
+    x0 = _mm_xor_si128(_mm_clmulepi64_si128(k3k4, x0, 0x01), _mm_srli_si128(x0, 8));
+    x0 = _mm_xor_si128(_mm_clmulepi64_si128(_mm_and_si128(x0, mask32), k5, 0x00), _mm_srli_si128(x0, 4));
+    // Barrett reduction
+    __m128i t = _mm_clmulepi64_si128(_mm_and_si128(x0, mask32), poly, 0x10);
+    t = _mm_clmulepi64_si128(_mm_and_si128(t, mask32), poly, 0x00);
+    return static_cast<uint32_t>(_mm_extract_epi32(_mm_xor_si128(x0, t), 1));
+}
+
+bool has_pclmul() {
+    static const bool supported = (__builtin_cpu_init(), __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1"));
+    return supported;
+}
+
+#endif
+
+inline uint32_t rotl(uint32_t x, int r) {
+    return (x << r) | (x >> (32 - r));
+}
+
+} // namespace
+
+uint32_t crc32(const void* data, size_t size, uint32_t crc) {
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    uint32_t       c = ~crc;
+#ifdef NESEN_CRC32_PCLMUL
+    if(size >= 64 && has_pclmul()) {
+        const size_t folded = size & ~size_t(15);
+        c = crc32_pclmul(p, folded, c);
+        p += folded;
+        size -= folded;
+    }
+#endif
+    return ~crc32_tables(p, size, c);
+}
+
+Sha1::Sha1() : _state{0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0} {}
+
+void Sha1::update(const void* data, size_t size) {
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    _length += size;
+    if(_block_size > 0) {
+        const size_t n = std::min(size, sizeof(_block) - _block_size);
+        std::memcpy(_block + _block_size, p, n);
+        _block_size += n;
+        p += n;
+        size -= n;
+        if(_block_size < sizeof(_block))
+            return;
+        process(_block);
+        _block_size = 0;
+    }
+    for(; size >= sizeof(_block); p += sizeof(_block), size -= sizeof(_block))
+        process(p);
+    std::memcpy(_block, p, size);
+    _block_size = size;
+}
+
+sha1_t Sha1::digest() {
+    const uint64_t bits = _length * 8;
+    const uint8_t  pad = 0x80;
+    const uint8_t  zero = 0;
+    update(&pad, 1);
+    while(_block_size != 56)
+        update(&zero, 1);
+    uint8_t length[8];
+    for(int i = 0; i < 8; ++i)
+        length[i] = static_cast<uint8_t>(bits >> (56 - 8 * i));
+    update(length, 8);
+
+    sha1_t r;
+    for(int i = 0; i < 20; ++i)
+        r[i] = static_cast<uint8_t>(_state[i / 4] >> (24 - 8 * (i % 4)));
+    return r;
+}
+
+void Sha1::process(const uint8_t* block) {
+    uint32_t w[80];
+    for(int i = 0; i < 16; ++i)
+        w[i] = (uint32_t(block[4 * i]) << 24) | (uint32_t(block[4 * i + 1]) << 16) | (uint32_t(block[4 * i + 2]) << 8) | block[4 * i + 3];
+    for(int i = 16; i < 80; ++i)
+        w[i] = rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+    uint32_t a = _state[0], b = _state[1], c = _state[2], d = _state[3], e = _state[4];
+    for(int i = 0; i < 80; ++i) {
+        uint32_t f, k;
+        if(i < 20) {
+            f = (b & c) | (~b & d);
+            k = 0x5A827999;
+        } else if(i < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ED9EBA1;
+        } else if(i < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8F1BBCDC;
+        } else {
+            f = b ^ c ^ d;
+            k = 0xCA62C1D6;
+        }
+        const uint32_t t = rotl(a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = rotl(b, 30);
+        b = a;
+        a = t;
+    }
+    _state[0] += a;
+    _state[1] += b;
+    _state[2] += c;
+    _state[3] += d;
+    _state[4] += e;
+}
+
+Md5::Md5() : _state{0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476} {}
+
+void Md5::update(const void* data, size_t size) {
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    _length += size;
+    if(_block_size > 0) {
+        const size_t n = std::min(size, sizeof(_block) - _block_size);
+        std::memcpy(_block + _block_size, p, n);
+        _block_size += n;
+        p += n;
+        size -= n;
+        if(_block_size < sizeof(_block))
+            return;
+        process(_block);
+        _block_size = 0;
+    }
+    for(; size >= sizeof(_block); p += sizeof(_block), size -= sizeof(_block))
+        process(p);
+    std::memcpy(_block, p, size);
+    _block_size = size;
+}
+
+md5_t Md5::digest() {
+    // Same padding as SHA-1, but the length and the digest are little-endian
+    const uint64_t bits = _length * 8;
+    const uint8_t  pad = 0x80;
+    const uint8_t  zero = 0;
+    update(&pad, 1);
+    while(_block_size != 56)
+        update(&zero, 1);
+    uint8_t length[8];
+    for(int i = 0; i < 8; ++i)
+        length[i] = static_cast<uint8_t>(bits >> (8 * i));
+    update(length, 8);
+
+    md5_t r;
+    for(int i = 0; i < 16; ++i)
+        r[i] = static_cast<uint8_t>(_state[i / 4] >> (8 * (i % 4)));
+    return r;
+}
+
+void Md5::process(const uint8_t* block) {
+    static constexpr int Shifts[4][4] = {{7, 12, 17, 22}, {5, 9, 14, 20}, {4, 11, 16, 23}, {6, 10, 15, 21}};
+    // floor(abs(sin(i + 1)) * 2^32)
+    static constexpr uint32_t K[64] = {
+        0xD76AA478, 0xE8C7B756, 0x242070DB, 0xC1BDCEEE, 0xF57C0FAF, 0x4787C62A, 0xA8304613, 0xFD469501, 0x698098D8, 0x8B44F7AF, 0xFFFF5BB1,
+        0x895CD7BE, 0x6B901122, 0xFD987193, 0xA679438E, 0x49B40821, 0xF61E2562, 0xC040B340, 0x265E5A51, 0xE9B6C7AA, 0xD62F105D, 0x02441453,
+        0xD8A1E681, 0xE7D3FBC8, 0x21E1CDE6, 0xC33707D6, 0xF4D50D87, 0x455A14ED, 0xA9E3E905, 0xFCEFA3F8, 0x676F02D9, 0x8D2A4C8A, 0xFFFA3942,
+        0x8771F681, 0x6D9D6122, 0xFDE5380C, 0xA4BEEA44, 0x4BDECFA9, 0xF6BB4B60, 0xBEBFBC70, 0x289B7EC6, 0xEAA127FA, 0xD4EF3085, 0x04881D05,
+        0xD9D4D039, 0xE6DB99E5, 0x1FA27CF8, 0xC4AC5665, 0xF4292244, 0x432AFF97, 0xAB9423A7, 0xFC93A039, 0x655B59C3, 0x8F0CCC92, 0xFFEFF47D,
+        0x85845DD1, 0x6FA87E4F, 0xFE2CE6E0, 0xA3014314, 0x4E0811A1, 0xF7537E82, 0xBD3AF235, 0x2AD7D2BB, 0xEB86D391,
+    };
+    uint32_t w[16];
+    for(int i = 0; i < 16; ++i)
+        w[i] = block[4 * i] | (uint32_t(block[4 * i + 1]) << 8) | (uint32_t(block[4 * i + 2]) << 16) | (uint32_t(block[4 * i + 3]) << 24);
+
+    uint32_t a = _state[0], b = _state[1], c = _state[2], d = _state[3];
+    for(int i = 0; i < 64; ++i) {
+        uint32_t f;
+        int      g;
+        if(i < 16) {
+            f = (b & c) | (~b & d);
+            g = i;
+        } else if(i < 32) {
+            f = (d & b) | (~d & c);
+            g = (5 * i + 1) % 16;
+        } else if(i < 48) {
+            f = b ^ c ^ d;
+            g = (3 * i + 5) % 16;
+        } else {
+            f = c ^ (b | ~d);
+            g = (7 * i) % 16;
+        }
+        const uint32_t t = d;
+        d = c;
+        c = b;
+        b = b + rotl(a + f + K[i] + w[g], Shifts[i / 16][i % 4]);
+        a = t;
+    }
+    _state[0] += a;
+    _state[1] += b;
+    _state[2] += c;
+    _state[3] += d;
+}
+
+} // namespace Checksum
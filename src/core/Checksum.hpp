@@ -0,0 +1,68 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Checksums used by ROM databases to identify dumps (CRC-32 and SHA-1 of the PRG and CHR ROMs, without header),
+ * and by FCEUX movies (MD5).
+ *
+ * Unlike Hash, these are standard algorithms: Values can be compared with the ones published for each game.
+ **/
+namespace Checksum {
+
+/// CRC-32 (as in zip and gzip). Continues from crc: crc32(b, size_b, crc32(a, size_a)) is the CRC of a followed by b.
+/// Folds 64 bytes per step with carry-less multiplications when the CPU supports them (x86-64 PCLMULQDQ),
+/// processes 8 bytes per step with lookup tables otherwise.
+uint32_t crc32(const void* data, size_t size, uint32_t crc = 0);
+
+using sha1_t = std::array<uint8_t, 20>;
+
+/// Incremental SHA-1.
+class Sha1 {
+  public:
+    Sha1();
+    void   update(const void* data, size_t size);
+    sha1_t digest();
+
+  private:
+    uint32_t _state[5];
+    uint8_t  _block[64];
+    size_t   _block_size = 0;
+    uint64_t _length = 0; ///< Bytes
+
+    void process(const uint8_t* block);
+};
+
+inline sha1_t sha1(const void* data, size_t size) {
+    Sha1 s;
+    s.update(data, size);
+    return s.digest();
+}
+
+using md5_t = std::array<uint8_t, 16>;
+
+/// Incremental MD5.
+class Md5 {
+  public:
+    Md5();
+    void  update(const void* data, size_t size);
+    md5_t digest();
+
+  private:
+    uint32_t _state[4];
+    uint8_t  _block[64];
+    size_t   _block_size = 0;
+    uint64_t _length = 0; ///< Bytes
+
+    void process(const uint8_t* block);
+};
+
+inline md5_t md5(const void* data, size_t size) {
+    Md5 m;
+    m.update(data, size);
+    return m.digest();
+}
+
+} // namespace Checksum
@@ -49,11 +49,18 @@ struct HexaGen {
 
 template<typename T>
 std::ostream& operator<<(std::ostream& os, const HexaGen<T>& t) {
-    return os << "0x" << std::hex << std::setw(sizeof(T) * 2) << std::setfill('0') << (int)t.v;
+    // The log stream is reused: Its format must be left as it was
+    const auto flags = os.flags();
+    const auto fill = os.fill();
+    os << "0x" << std::hex << std::setw(sizeof(T) * 2) << std::setfill('0') << static_cast<uint64_t>(t.v);
+    os.flags(flags);
+    os.fill(fill);
+    return os;
 }
 
 using Hexa = HexaGen<addr_t>;
 using Hexa8 = HexaGen<word_t>;
+using Hexa32 = HexaGen<uint32_t>;
 
 namespace config {
 extern std::string _executable_folder;
@@ -0,0 +1,182 @@
+#include "FM2.hpp"
+
+#include <cstdlib>
+#include <iomanip>
+#include <sstream>
+
+#include "Checksum.hpp"
+
+namespace {
+
+// FM2 command bits
+constexpr int SoftReset = 1;
+constexpr int HardReset = 2;
+
+// Gamepad fields are written from the last bit (Right) to the first (A)
+word_t parse_gamepad(const char* field, size_t length) {
+    word_t r = 0;
+    for(size_t i = 0; i < 8 && i < length; ++i)
+        if(field[i] != '.' && field[i] != ' ')
+            r |= 1 << (7 - i);
+    return r;
+}
+
+void write_gamepad(std::ofstream& file, word_t buttons) {
+    static const char names[] = "RLDUTSBA";
+    for(size_t i = 0; i < 8; ++i)
+        file.put((buttons & (1 << (7 - i))) ? names[i] : '.');
+}
+
+// As FCEUX computes it: PRG then CHR ROM, without header
+std::string rom_checksum(const RomImage& rom) {
+    Checksum::Md5 md5;
+    md5.update(rom.prg_rom(), rom.prg_rom_size());
+    if(rom.chr_rom())
+        md5.update(rom.chr_rom(), rom.chr_rom_size());
+    const auto digest = md5.digest();
+
+    static const char digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string       r = "base64:";
+    for(size_t i = 0; i < digest.size(); i += 3) {
+        uint32_t group = uint32_t(digest[i]) << 16;
+        if(i + 1 < digest.size())
+            group |= uint32_t(digest[i + 1]) << 8;
+        if(i + 2 < digest.size())
+            group |= digest[i + 2];
+        for(size_t c = 0; c < 4; ++c)
+            r += i + c <= digest.size() ? digits[(group >> (18 - 6 * c)) & 0x3F] : '=';
+    }
+    return r;
+}
+
+} // namespace
+
+bool FM2Reader::open(const std::string& path) {
+    _file.open(path, std::ios::binary);
+    if(!_file) {
+        Log::error("Error: '", path, "' could not be opened.");
+        return false;
+    }
+
+    _header.clear();
+    while(_file.peek() != '|' && std::getline(_file, _line)) {
+        if(!_line.empty() && _line.back() == '\r')
+            _line.pop_back();
+        const auto space = _line.find(' ');
+        if(space == std::string::npos)
+            _header[_line] = "";
+        else
+            _header[_line.substr(0, space)] = _line.substr(space + 1);
+    }
+    _file.clear();
+    _first_frame_position = tell();
+
+    if(get_header("binary") == "1") {
+        Log::error("Error: '", path, "' is a binary FM2 movie, only text movies are supported.");
+        return false;
+    }
+    if(!get_header("savestate").empty()) {
+        Log::error("Error: '", path, "' starts from a savestate, only movies starting from power-on are supported.");
+        return false;
+    }
+    return true;
+}
+
+std::string FM2Reader::get_header(const std::string& key) const {
+    auto it = _header.find(key);
+    return it == _header.end() ? "" : it->second;
+}
+
+bool FM2Reader::read(MovieFrame& frame) {
+    const auto position = tell();
+    do {
+        if(!std::getline(_file, _line))
+            return false;
+    } while(_line.empty() || _line[0] != '|');
+
+    // |commands|port0|port1|port2|
+    size_t fields[5];
+    size_t count = 0;
+    for(size_t i = 0; i < _line.size() && count < 5; ++i)
+        if(_line[i] == '|')
+            fields[count++] = i;
+    if(count < 2)
+        return false;
+
+    const int commands = std::atoi(_line.c_str() + 1);
+    frame.power = (commands & HardReset) || position == _first_frame_position;
+    frame.reset = commands & SoftReset;
+    for(size_t c = 0; c < 2; ++c)
+        frame.inputs[c] = c + 2 < count ? parse_gamepad(_line.c_str() + fields[c + 1] + 1, fields[c + 2] - fields[c + 1] - 1) : 0;
+    return true;
+}
+
+bool FM2Reader::seek(uint64_t position) {
+    _file.clear();
+    _file.seekg(static_cast<std::streamoff>(position));
+    return static_cast<bool>(_file);
+}
+
+bool export_fm2(MovieSource& source, const std::string& path, const RomImage& rom, const std::string& rom_filename) {
+    std::ofstream file(path, std::ios::binary);
+    if(!file) {
+        Log::error("Error: '", path, "' could not be opened for writing.");
+        return false;
+    }
+
+    std::stringstream guid;
+    const auto        hash = source.get_rom_hash();
+    guid << std::hex << std::uppercase << std::setfill('0') << std::setw(8) << (hash >> 32) << "-" << std::setw(4) << ((hash >> 16) & 0xFFFF) << "-"
+         << std::setw(4) << (hash & 0xFFFF) << "-0000-000000000000";
+
+    file << "version 3\n"
+         << "emuVersion 22020\n"
+         << "rerecordCount 0\n"
+         << "palFlag 0\n"
+         << "romFilename " << rom_filename << "\n"
+         << "romChecksum " << rom_checksum(rom) << "\n"
+         << "guid " << guid.str() << "\n"
+         << "fourscore 0\n"
+         << "microphone 0\n"
+         << "port0 1\n"
+         << "port1 1\n"
+         << "port2 0\n"
+         << "FDS 0\n"
+         << "NewPPU 0\n"
+         << "comment author NESen\n";
+
+    MovieFrame frame;
+    bool       first = true;
+    while(source.read(frame)) {
+        // Power-on is implicit on the first frame
+        const int commands = (frame.reset ? SoftReset : 0) | (frame.power && !first ? HardReset : 0);
+        file << '|' << commands << '|';
+        write_gamepad(file, frame.inputs[0]);
+        file << '|';
+        write_gamepad(file, frame.inputs[1]);
+        file << "||\n";
+        first = false;
+    }
+    return static_cast<bool>(file);
+}
+
+bool import_fm2(const std::string& path, Movie& movie) {
+    FM2Reader reader;
+    if(!reader.open(path))
+        return false;
+
+    movie.clear();
+    movie.rom_hash = 0;
+    movie.controllers = 2;
+    MovieFrame frame;
+    while(reader.read(frame)) {
+        const auto index = static_cast<uint32_t>(movie.frame_count());
+        if(frame.power)
+            movie.events.push_back({index, Movie::EventType::Power});
+        if(frame.reset)
+            movie.events.push_back({index, Movie::EventType::Reset});
+        movie.inputs.push_back(frame.inputs[0]);
+        movie.inputs.push_back(frame.inputs[1]);
+    }
+    return true;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <fstream>
+#include <map>
+#include <string>
+
+#include "Movie.hpp"
+
+/**
+ * FCEUX text movie format (FM2)
+ *
+ * Header lines ("key value") followed by one input line per frame: "|commands|port0|port1|port2|".
+ * Gamepad fields are 8 characters in the "RLDUTSBA" order, '.' or ' ' meaning released.
+ * Only text movies starting from power-on with standard gamepads are supported.
+ *
+ * @see https://fceux.com/web/help/fm2.html
+ **/
+
+/**
+ * Streams an FM2 file one line at a time, the movie is never fully loaded in memory.
+ **/
+class FM2Reader : public MovieSource {
+  public:
+    FM2Reader() = default;
+    FM2Reader(const std::string& path) { open(path); }
+
+    /// Parses the header, leaves the file on the first frame.
+    bool open(const std::string& path);
+
+    /// @return Value of a header key, empty if absent.
+    std::string get_header(const std::string& key) const;
+
+    bool     read(MovieFrame& frame) override;
+    uint64_t tell() override { return static_cast<uint64_t>(_file.tellg()); }
+    bool     seek(uint64_t position) override;
+
+  private:
+    std::ifstream                      _file;
+    std::map<std::string, std::string> _header;
+    std::string                        _line;
+    uint64_t                           _first_frame_position = 0;
+};
+
+/// Writes any movie source as an FM2 file, frame by frame. rom is the game it was recorded on:
+/// FCEUX identifies it by the MD5 of its PRG and CHR ROMs (romChecksum).
+bool export_fm2(MovieSource& source, const std::string& path, const RomImage& rom, const std::string& rom_filename);
+
+/// Reads a whole FM2 file into a Movie.
+bool import_fm2(const std::string& path, Movie& movie);
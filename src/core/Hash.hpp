@@ -0,0 +1,107 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+/**
+ * Non-cryptographic 64-bit hashing (XXH64 algorithm).
+ *
+ * Used to identify ROMs (movies, caches) and to compare machine states.
+ * Assumes a little-endian host, like the rest of the save state code.
+ **/
+namespace Hash {
+
+constexpr uint64_t Prime1 = 0x9E3779B185EBCA87ull;
+constexpr uint64_t Prime2 = 0xC2B2AE3D27D4EB4Full;
+constexpr uint64_t Prime3 = 0x165667B19E3779F9ull;
+constexpr uint64_t Prime4 = 0x85EBCA77C2B2AE63ull;
+constexpr uint64_t Prime5 = 0x27D4EB2F165667C5ull;
+
+inline uint64_t rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+inline uint64_t read64(const uint8_t* p) {
+    uint64_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline uint32_t read32(const uint8_t* p) {
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline uint64_t round(uint64_t acc, uint64_t input) {
+    acc += input * Prime2;
+    acc = rotl(acc, 31);
+    return acc * Prime1;
+}
+
+inline uint64_t merge_round(uint64_t acc, uint64_t val) {
+    acc ^= round(0, val);
+    return acc * Prime1 + Prime4;
+}
+
+inline uint64_t avalanche(uint64_t h) {
+    h ^= h >> 33;
+    h *= Prime2;
+    h ^= h >> 29;
+    h *= Prime3;
+    h ^= h >> 32;
+    return h;
+}
+
+inline uint64_t hash64(const void* data, size_t size, uint64_t seed = 0) {
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    const uint8_t* end = p + size;
+    uint64_t       h;
+
+    if(size >= 32) {
+        uint64_t v1 = seed + Prime1 + Prime2;
+        uint64_t v2 = seed + Prime2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - Prime1;
+        // Four independent lanes: The compiler keeps them in flight in parallel.
+        do {
+            v1 = round(v1, read64(p));
+            v2 = round(v2, read64(p + 8));
+            v3 = round(v3, read64(p + 16));
+            v4 = round(v4, read64(p + 24));
+            p += 32;
+        } while(p + 32 <= end);
+        h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+        h = merge_round(h, v1);
+        h = merge_round(h, v2);
+        h = merge_round(h, v3);
+        h = merge_round(h, v4);
+    } else {
+        h = seed + Prime5;
+    }
+
+    h += size;
+
+    for(; p + 8 <= end; p += 8) {
+        h ^= round(0, read64(p));
+        h = rotl(h, 27) * Prime1 + Prime4;
+    }
+    if(p + 4 <= end) {
+        h ^= static_cast<uint64_t>(read32(p)) * Prime1;
+        h = rotl(h, 23) * Prime2 + Prime3;
+        p += 4;
+    }
+    for(; p < end; ++p) {
+        h ^= (*p) * Prime5;
+        h = rotl(h, 11) * Prime1;
+    }
+
+    return avalanche(h);
+}
+
+/// Order dependent combination of two hashes.
+inline uint64_t combine(uint64_t h, uint64_t v) {
+    return merge_round(h, v);
+}
+
+} // namespace Hash
@@ -0,0 +1,262 @@
+#include "Inflate.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+namespace {
+constexpr uint16_t LengthBase[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+constexpr uint8_t  LengthExtra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+constexpr uint16_t DistanceBase[30] = {1,   2,   3,   4,   5,   7,    9,    13,   17,   25,   33,   49,   65,    97,    129,
+                                       193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+constexpr uint8_t  DistanceExtra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+/// Order in which the code length code lengths are stored.
+constexpr uint8_t CodeLengthOrder[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+} // namespace
+
+bool Inflate::Huffman::build(const uint8_t* lengths, size_t size) {
+    std::memset(count, 0, sizeof(count));
+    for(size_t s = 0; s < size; ++s)
+        ++count[lengths[s]];
+    count[0] = 0;
+
+    int left = 1;
+    for(int len = 1; len < 16; ++len) {
+        left = (left << 1) - count[len];
+        if(left < 0)
+            return false;
+    }
+
+    // First code and first index in symbol of each length
+    uint16_t offsets[16], codes[16];
+    offsets[1] = 0;
+    codes[1] = 0;
+    for(int len = 1; len < 15; ++len) {
+        offsets[len + 1] = offsets[len] + count[len];
+        codes[len + 1] = (codes[len] + count[len]) << 1;
+    }
+
+    std::memset(fast, 0, sizeof(fast));
+    for(size_t s = 0; s < size; ++s) {
+        const unsigned len = lengths[s];
+        if(len == 0)
+            continue;
+        symbol[offsets[len]++] = static_cast<uint16_t>(s);
+        const unsigned code = codes[len]++;
+        if(len > FastBits)
+            continue;
+        // Codes are stored most significant bit first, the bit buffer is read least significant bit first.
+        unsigned reversed = 0;
+        for(unsigned i = 0; i < len; ++i)
+            reversed |= ((code >> i) & 1) << (len - 1 - i);
+        for(unsigned i = reversed; i < (1u << FastBits); i += 1u << len)
+            fast[i] = static_cast<uint16_t>(s << 4 | len);
+    }
+    return true;
+}
+
+Inflate::Inflate(std::span<const uint8_t> input) : _in(input.data()), _in_end(input.data() + input.size()) {}
+
+void Inflate::refill() {
+    while(_bit_count <= 56) {
+        if(_in < _in_end) {
+            _bits |= uint64_t(*_in++) << _bit_count;
+        } else {
+            _padding += 8;
+        }
+        _bit_count += 8;
+    }
+}
+
+unsigned Inflate::bits(unsigned count) {
+    if(_bit_count < count)
+        refill();
+    const unsigned value = static_cast<unsigned>(_bits & ((uint64_t(1) << count) - 1));
+    _bits >>= count;
+    _bit_count -= count;
+    return value;
+}
+
+int Inflate::decode(const Huffman& h) {
+    if(_bit_count < 15)
+        refill();
+    if(const uint16_t entry = h.fast[_bits & ((1u << FastBits) - 1)]; entry != 0) {
+        _bits >>= entry & 0xF;
+        _bit_count -= entry & 0xF;
+        return entry >> 4;
+    }
+    // Longer codes: One bit at a time, canonical codes of a given length being consecutive.
+    int code = 0, first = 0, index = 0;
+    for(unsigned len = 1; len < 16; ++len) {
+        code |= static_cast<int>((_bits >> (len - 1)) & 1);
+        const int count = h.count[len];
+        if(code - first < count) {
+            _bits >>= len;
+            _bit_count -= len;
+            return h.symbol[index + code - first];
+        }
+        index += count;
+        first = (first + count) << 1;
+        code <<= 1;
+    }
+    return -1;
+}
+
+bool Inflate::read_block_header() {
+    _last_block = bits(1);
+    switch(bits(2)) {
+        case 0: {
+            // Stored: Byte aligned, the whole bytes left in the bit buffer are given back to the input.
+            bits(_bit_count % 8);
+            const unsigned length = bits(16);
+            const unsigned complement = bits(16);
+            if(_padding > _bit_count || length != (~complement & 0xFFFF))
+                return false;
+            _in -= (_bit_count - _padding) / 8;
+            _bits = 0;
+            _bit_count = 0;
+            _padding = 0;
+            _stored_remaining = length;
+            _state = State::Stored;
+            return true;
+        }
+        case 1: {
+            uint8_t lengths[288 + 30];
+            std::fill(lengths, lengths + 144, 8);
+            std::fill(lengths + 144, lengths + 256, 9);
+            std::fill(lengths + 256, lengths + 280, 7);
+            std::fill(lengths + 280, lengths + 288, 8);
+            std::fill(lengths + 288, lengths + 318, 5);
+            _literals.build(lengths, 288);
+            _distances.build(lengths + 288, 30);
+            _state = State::Codes;
+            return true;
+        }
+        case 2:
+            if(!read_dynamic_codes())
+                return false;
+            _state = State::Codes;
+            return true;
+        default: return false;
+    }
+}
+
+bool Inflate::read_dynamic_codes() {
+    const unsigned literal_count = bits(5) + 257;
+    const unsigned distance_count = bits(5) + 1;
+    const unsigned code_length_count = bits(4) + 4;
+    if(literal_count > 286 || distance_count > 30)
+        return false;
+
+    uint8_t lengths[286 + 30] = {};
+    for(unsigned i = 0; i < code_length_count; ++i)
+        lengths[CodeLengthOrder[i]] = static_cast<uint8_t>(bits(3));
+    Huffman& code_lengths = _distances; // Not needed until the next codes are read
+    if(!code_lengths.build(lengths, 19))
+        return false;
+
+    // Literal/length and distance code lengths form a single sequence: Repeats can cross from one to the other.
+    std::memset(lengths, 0, 19);
+    for(unsigned i = 0; i < literal_count + distance_count;) {
+        const int symbol = decode(code_lengths);
+        if(symbol < 0)
+            return false;
+        if(symbol < 16) {
+            lengths[i++] = static_cast<uint8_t>(symbol);
+            continue;
+        }
+        uint8_t  value = 0;
+        unsigned repeat;
+        if(symbol == 16) {
+            if(i == 0)
+                return false;
+            value = lengths[i - 1];
+            repeat = 3 + bits(2);
+        } else if(symbol == 17) {
+            repeat = 3 + bits(3);
+        } else {
+            repeat = 11 + bits(7);
+        }
+        if(i + repeat > literal_count + distance_count)
+            return false;
+        std::fill(lengths + i, lengths + i + repeat, value);
+        i += repeat;
+    }
+    if(lengths[256] == 0) // No end of block code
+        return false;
+    return _padding <= _bit_count && _literals.build(lengths, literal_count) && _distances.build(lengths + literal_count, distance_count);
+}
+
+size_t Inflate::read(uint8_t* out, size_t pos, size_t end) {
+    while(pos < end) {
+        switch(_state) {
+            case State::BlockHeader:
+                if(_last_block) {
+                    _state = State::Finished;
+                    break;
+                }
+                if(!read_block_header())
+                    _state = State::Failed;
+                break;
+            case State::Stored: {
+                const size_t size = std::min({_stored_remaining, end - pos, static_cast<size_t>(_in_end - _in)});
+                if(size == 0) {
+                    _state = _stored_remaining ? State::Failed : State::BlockHeader;
+                    break;
+                }
+                std::memcpy(out + pos, _in, size);
+                _in += size;
+                pos += size;
+                _stored_remaining -= size;
+                break;
+            }
+            case State::Codes: {
+                if(_copy_length > 0) {
+                    // Byte by byte if the source overlaps the bytes being written (runs of a repeated pattern).
+                    const size_t   size = std::min(_copy_length, end - pos);
+                    const uint8_t* src = out + pos - _copy_distance;
+                    if(_copy_distance >= size) {
+                        std::memcpy(out + pos, src, size);
+                    } else {
+                        for(size_t i = 0; i < size; ++i)
+                            out[pos + i] = src[i];
+                    }
+                    pos += size;
+                    _copy_length -= size;
+                    break;
+                }
+                const int symbol = decode(_literals);
+                if(symbol < 256) {
+                    if(symbol < 0) {
+                        _state = State::Failed;
+                        break;
+                    }
+                    out[pos++] = static_cast<uint8_t>(symbol);
+                } else if(symbol == 256) {
+                    _state = State::BlockHeader;
+                } else {
+                    const int length_symbol = symbol - 257;
+                    if(length_symbol >= 29) {
+                        _state = State::Failed;
+                        break;
+                    }
+                    _copy_length = LengthBase[length_symbol] + bits(LengthExtra[length_symbol]);
+                    const int distance_symbol = decode(_distances);
+                    if(distance_symbol < 0 || distance_symbol >= 30) {
+                        _state = State::Failed;
+                        break;
+                    }
+                    _copy_distance = DistanceBase[distance_symbol] + bits(DistanceExtra[distance_symbol]);
+                    if(_copy_distance > pos)
+                        _state = State::Failed;
+                }
+                // Reading past the end of the input
+                if(_padding > _bit_count)
+                    _state = State::Failed;
+                break;
+            }
+            case State::Finished:
+            case State::Failed: return pos;
+        }
+    }
+    return pos;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+/**
+ * DEFLATE decoder (RFC 1951), for compressed ROMs (gzip and zip).
+ *
+ * Decompresses directly into the caller's buffer, which also serves as the window: Back-references are copied from
+ * the output already written, so no other copy of the data is made. Decoding can stop at any position and resume
+ * (see read), which lets the caller check the start of the output before allocating room for the rest.
+ * Huffman codes of up to FastBits bits are decoded with a single table lookup.
+ **/
+class Inflate {
+  public:
+    static constexpr unsigned FastBits = 10;
+
+    explicit Inflate(std::span<const uint8_t> input);
+
+    /// Decompresses into out[pos, end). out[0, pos) must hold the previous output, unchanged.
+    /// @return The new position: end, unless the stream ended or is invalid before (see is_finished and has_failed).
+    size_t read(uint8_t* out, size_t pos, size_t end);
+
+    inline bool is_finished() const { return _state == State::Finished; }
+    inline bool has_failed() const { return _state == State::Failed; }
+
+  private:
+    enum class State {
+        BlockHeader,
+        Stored,
+        Codes,
+        Finished,
+        Failed
+    };
+
+    /// Canonical Huffman code.
+    struct Huffman {
+        uint16_t fast[1 << FastBits]; ///< By next FastBits input bits: symbol << 4 | length, 0 for longer codes
+        uint16_t count[16];           ///< Number of codes of each length
+        uint16_t symbol[288];         ///< Symbols ordered by code
+
+        /// @return false if the lengths describe an over-subscribed code.
+        bool build(const uint8_t* lengths, size_t size);
+    };
+
+    const uint8_t* _in;
+    const uint8_t* _in_end;
+    uint64_t       _bits = 0;
+    unsigned       _bit_count = 0;
+    unsigned       _padding = 0; ///< Zero bits added to _bits past the end of the input
+
+    State    _state = State::BlockHeader;
+    bool     _last_block = false;
+    size_t   _stored_remaining = 0;
+    size_t   _copy_length = 0; ///< Back-reference left to copy
+    size_t   _copy_distance = 0;
+    Huffman  _literals;
+    Huffman  _distances;
+
+    void     refill();
+    unsigned bits(unsigned count);
+    int      decode(const Huffman& h);
+    bool     read_block_header();
+    bool     read_dynamic_codes();
+};
@@ -0,0 +1,200 @@
+#include "Movie.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+
+namespace {
+
+template<typename T>
+void write_le(std::ofstream& file, T value) {
+    for(size_t i = 0; i < sizeof(T); ++i)
+        file.put(static_cast<char>((value >> (8 * i)) & 0xFF));
+}
+
+template<typename T>
+T read_le(std::ifstream& file) {
+    T r = 0;
+    for(size_t i = 0; i < sizeof(T); ++i)
+        r |= static_cast<T>(static_cast<uint8_t>(file.get())) << (8 * i);
+    return r;
+}
+
+const char Magic[4] = {'N', 'E', 'S', 'M'};
+
+} // namespace
+
+bool Movie::save(const std::string& path) const {
+    std::ofstream file(path, std::ios::binary);
+    if(!file) {
+        Log::error("Error: '", path, "' could not be opened for writing.");
+        return false;
+    }
+
+    file.write(Magic, 4);
+    write_le<uint16_t>(file, Version);
+    write_le<uint8_t>(file, static_cast<uint8_t>(controllers));
+    write_le<uint8_t>(file, 0);
+    write_le<uint64_t>(file, rom_hash);
+    write_le<uint32_t>(file, static_cast<uint32_t>(frame_count()));
+    write_le<uint32_t>(file, static_cast<uint32_t>(events.size()));
+    for(const auto& e : events) {
+        write_le<uint32_t>(file, e.frame);
+        write_le<uint8_t>(file, static_cast<uint8_t>(e.type));
+    }
+    file.write(reinterpret_cast<const char*>(inputs.data()), inputs.size());
+
+    return static_cast<bool>(file);
+}
+
+bool Movie::load(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    if(!file) {
+        Log::error("Error: '", path, "' could not be opened.");
+        return false;
+    }
+
+    char magic[4];
+    file.read(magic, 4);
+    if(!file || std::memcmp(magic, Magic, 4) != 0) {
+        Log::error("Error: '", path, "' is not a NESen movie (wrong header).");
+        return false;
+    }
+    const auto version = read_le<uint16_t>(file);
+    if(version != Version) {
+        Log::error("Error: '", path, "' uses an unsupported movie version (", version, ").");
+        return false;
+    }
+    controllers = read_le<uint8_t>(file);
+    read_le<uint8_t>(file);
+    rom_hash = read_le<uint64_t>(file);
+    const auto frames = read_le<uint32_t>(file);
+    const auto event_count = read_le<uint32_t>(file);
+    if(controllers < 1 || controllers > 2) {
+        Log::error("Error: '", path, "' has an invalid controller count (", controllers, ").");
+        return false;
+    }
+    // Counts are checked against what's left of the file before allocating anything: 5 bytes per event, 1 byte per input.
+    const auto position = file.tellg();
+    file.seekg(0, std::ios::end);
+    const auto remaining = static_cast<uint64_t>(file.tellg() - position);
+    file.seekg(position);
+    if(!file || uint64_t(event_count) * 5 + uint64_t(frames) * controllers > remaining) {
+        Log::error("Error: '", path, "' is truncated.");
+        return false;
+    }
+
+    events.resize(event_count);
+    for(auto& e : events) {
+        e.frame = read_le<uint32_t>(file);
+        e.type = static_cast<EventType>(read_le<uint8_t>(file));
+    }
+    inputs.resize(static_cast<size_t>(frames) * controllers);
+    file.read(reinterpret_cast<char*>(inputs.data()), inputs.size());
+
+    if(!file) {
+        Log::error("Error: '", path, "' is truncated.");
+        return false;
+    }
+    return true;
+}
+
+MovieRecorder::MovieRecorder(NES& nes, Movie& movie) : _nes(nes), _movie(movie) {
+    _movie.clear();
+    _movie.rom_hash = _nes.cartridge.get_rom_hash();
+    _movie.events.push_back({0, Movie::EventType::Power});
+    _nes.power();
+}
+
+void MovieRecorder::reset() {
+    _movie.events.push_back({static_cast<uint32_t>(_movie.frame_count()), Movie::EventType::Reset});
+    _nes.reset();
+}
+
+bool MovieReader::read(MovieFrame& frame) {
+    if(_frame >= _movie.frame_count())
+        return false;
+
+    frame.reset = frame.power = false;
+    while(_next_event < _movie.events.size() && _movie.events[_next_event].frame <= _frame) {
+        switch(_movie.events[_next_event].type) {
+            case Movie::EventType::Reset: frame.reset = true; break;
+            case Movie::EventType::Power: frame.power = true; break;
+        }
+        ++_next_event;
+    }
+    for(size_t c = 0; c < 2; ++c)
+        frame.inputs[c] = c < _movie.controllers ? _movie.get_input(_frame, c) : 0;
+    ++_frame;
+    return true;
+}
+
+bool MovieReader::seek(uint64_t position) {
+    if(position > _movie.frame_count())
+        return false;
+    _frame = position;
+    _next_event = std::lower_bound(_movie.events.begin(), _movie.events.end(), position, [](const Movie::Event& e, uint64_t f) { return e.frame < f; }) -
+                  _movie.events.begin();
+    return true;
+}
+
+MoviePlayer::MoviePlayer(NES& nes, const Movie& movie) : _nes(nes), _reader(std::make_unique<MovieReader>(movie)), _source(*_reader) {
+    _nes.cpu.set_input_mode(CPU::InputMode::Direct);
+}
+
+MoviePlayer::MoviePlayer(NES& nes, MovieSource& source) : _nes(nes), _source(source) {
+    _nes.cpu.set_input_mode(CPU::InputMode::Direct);
+}
+
+size_t MoviePlayer::step_frame() {
+    if(_done)
+        return 0;
+
+    if(_keyframe_interval > 0 && _frame % _keyframe_interval == 0 && (_keyframes.empty() || _keyframes.back().frame < _frame)) {
+        _keyframes.push_back({_frame, _source.tell(), {}});
+        _nes.save_state(_keyframes.back().state);
+    }
+
+    MovieFrame frame;
+    if(!_source.read(frame)) {
+        _done = true;
+        return 0;
+    }
+
+    if(frame.power)
+        _nes.power();
+    if(frame.reset)
+        _nes.reset();
+    _nes.cpu.set_controller_input(0, frame.inputs[0]);
+    _nes.cpu.set_controller_input(1, frame.inputs[1]);
+    ++_frame;
+    return _nes.run_frame();
+}
+
+size_t MoviePlayer::run() {
+    size_t cycles = 0;
+    while(!_done)
+        cycles += step_frame();
+    return cycles;
+}
+
+bool MoviePlayer::seek(size_t frame) {
+    // Restart from the closest keyframe if we have to go back in time, or if it allows to skip ahead.
+    auto it = std::upper_bound(_keyframes.begin(), _keyframes.end(), frame, [](size_t f, const Keyframe& k) { return f < k.frame; });
+    if(it != _keyframes.begin() && (frame < _frame || std::prev(it)->frame > _frame)) {
+        auto& keyframe = *std::prev(it);
+        if(!_source.seek(keyframe.position))
+            return false;
+        _nes.load_state(keyframe.state);
+        _frame = keyframe.frame;
+        _done = false;
+    } else if(frame < _frame) {
+        Log::error("Error: No keyframe to seek back to frame ", frame, ".");
+        return false;
+    }
+
+    while(_frame < frame)
+        if(step_frame() == 0)
+            return false;
+    return true;
+}
@@ -0,0 +1,163 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "NES.hpp"
+
+/**
+ * Recorded input session
+ *
+ * One byte per controller per frame (same bit layout as CPU::set_controller_input), plus reset/power events.
+ * The ROM hash ties a movie to the game it was recorded on.
+ *
+ * File layout (little-endian):
+ *   "NESM", u16 version, u8 controller count, u8 reserved, u64 ROM hash, u32 frame count, u32 event count,
+ *   events (u32 frame, u8 type), inputs (frame count * controller count bytes).
+ **/
+class Movie {
+  public:
+    static constexpr uint16_t Version = 1;
+
+    enum class EventType : uint8_t {
+        Reset = 1,
+        Power = 2
+    };
+
+    /// Events apply before the input of their frame.
+    struct Event {
+        uint32_t  frame;
+        EventType type;
+    };
+
+    uint64_t            rom_hash = 0;
+    size_t              controllers = 2;
+    std::vector<word_t> inputs; ///< Frame major
+    std::vector<Event>  events; ///< Sorted by frame
+
+    inline size_t frame_count() const { return inputs.size() / controllers; }
+    inline word_t get_input(size_t frame, size_t controller) const { return inputs[frame * controllers + controller]; }
+
+    inline void clear() {
+        inputs.clear();
+        events.clear();
+    }
+
+    bool save(const std::string& path) const;
+    bool load(const std::string& path);
+};
+
+/**
+ * Records the controller states latched by the game, once per frame.
+ **/
+class MovieRecorder {
+  public:
+    /// Starts a new movie with a power event on its first frame (the machine is powered on).
+    MovieRecorder(NES& nes, Movie& movie);
+
+    /// Resets the machine and records it.
+    void reset();
+
+    /// To be called after each emulated frame.
+    inline void frame() {
+        for(size_t c = 0; c < _movie.controllers; ++c)
+            _movie.inputs.push_back(_nes.cpu.get_controller_state(c));
+    }
+
+  private:
+    NES&   _nes;
+    Movie& _movie;
+};
+
+/**
+ * One frame of a movie
+ **/
+struct MovieFrame {
+    word_t inputs[2] = {0, 0};
+    bool   reset = false; ///< Applied before the inputs
+    bool   power = false; ///< Applied before the inputs
+};
+
+/**
+ * Sequential source of movie frames, possibly streamed from disk.
+ **/
+class MovieSource {
+  public:
+    virtual ~MovieSource() = default;
+
+    /// @return false once there are no more frames.
+    virtual bool read(MovieFrame& frame) = 0;
+
+    /// Opaque position of the next frame, to go back to it with seek.
+    virtual uint64_t tell() = 0;
+    virtual bool     seek(uint64_t position) = 0;
+
+    /// @return Hash of the ROM the movie was recorded on (see Cartridge::get_rom_hash), 0 if unknown.
+    virtual uint64_t get_rom_hash() const { return 0; }
+};
+
+/**
+ * Reads a Movie already in memory.
+ **/
+class MovieReader : public MovieSource {
+  public:
+    MovieReader(const Movie& movie) : _movie(movie) {}
+
+    bool     read(MovieFrame& frame) override;
+    uint64_t tell() override { return _frame; }
+    bool     seek(uint64_t position) override;
+    uint64_t get_rom_hash() const override { return _movie.rom_hash; }
+
+  private:
+    const Movie& _movie;
+    size_t       _frame = 0;
+    size_t       _next_event = 0;
+};
+
+/**
+ * Feeds a movie to the machine, bypassing the controller callbacks.
+ *
+ * Optionally keeps a snapshot of the machine every N frames while playing, so seeking to any frame
+ * only replays at most N frames.
+ **/
+class MoviePlayer {
+  public:
+    /// Switches the CPU to CPU::InputMode::Direct. Does not check the ROM hash, see matches_rom.
+    MoviePlayer(NES& nes, const Movie& movie);
+    MoviePlayer(NES& nes, MovieSource& source);
+
+    inline bool   matches_rom() const { return _source.get_rom_hash() == 0 || _source.get_rom_hash() == _nes.cartridge.get_rom_hash(); }
+    inline bool   done() const { return _done; }
+    inline size_t get_frame() const { return _frame; }
+
+    /// Applies the events and input of the next frame and emulates it.
+    /// @return CPU cycles elapsed, 0 if the movie is over.
+    size_t step_frame();
+
+    /// Plays the rest of the movie as fast as possible.
+    /// @return CPU cycles elapsed.
+    size_t run();
+
+    /// Records a keyframe every interval frames from now on, 0 disables it. Keyframes already recorded are kept.
+    inline void   set_keyframe_interval(size_t interval) { _keyframe_interval = interval; }
+    inline size_t get_keyframe_count() const { return _keyframes.size(); }
+
+    /// Puts the machine in the state it had before emulating the given frame.
+    /// @return false if the movie ends before that frame.
+    bool seek(size_t frame);
+
+  private:
+    struct Keyframe {
+        size_t    frame;
+        uint64_t  position; ///< In the movie source
+        SaveState state;
+    };
+
+    NES&                         _nes;
+    std::unique_ptr<MovieReader> _reader; ///< Owned source when playing a Movie
+    MovieSource&                 _source;
+    size_t                       _frame = 0;
+    bool                         _done = false;
+    size_t                       _keyframe_interval = 0;
+    std::vector<Keyframe>        _keyframes; ///< Sorted by frame
+};
@@ -1,6 +1,13 @@
 #pragma once
 
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <vector>
+
 #include "CPU.hpp"
+#include "Hash.hpp"
+#include "ResetSnapshots.hpp"
 
 class NES {
   public:
@@ -10,6 +17,8 @@ class NES {
     Cartridge cartridge;
 
     NES(size_t RAMSize = 0x800) : cpu(RAMSize) { init(); }
+    /// The screen buffers are only allocated once needed, see PPU::set_render_mode.
+    NES(size_t RAMSize, PPU::RenderMode mode) : cpu(RAMSize), ppu(mode) { init(); }
 
     NES(const std::string& path) {
         init();
@@ -22,16 +31,50 @@ class NES {
         cpu.ppu = &ppu;
         cpu.cartridge = &cartridge;
         cpu.apu = &apu;
+        apu.cartridge = &cartridge;
         ppu.cartridge = &cartridge;
     }
 
-    bool load(const std::string& path) { return cartridge.load(path); }
+    // Cheats are cleared: They are made for a single game.
+    bool load(const std::string& path) {
+        _ram_freezes.clear();
+        return cartridge.load(path);
+    }
+    bool load_from_memory(std::span<const uint8_t> data) {
+        _ram_freezes.clear();
+        return cartridge.load_from_memory(data);
+    }
+    bool load(std::shared_ptr<const RomImage> rom) {
+        _ram_freezes.clear();
+        return cartridge.load(std::move(rom));
+    }
+
+    /// Activates cheat codes, replacing the previous ones (see Cheat). ROM patches apply right away, through the
+    /// cartridge bank pointers (see Cartridge::set_rom_patches). RAM values are written now, then after each frame.
+    /// Without cheats, emulation runs exactly as it does without this feature: Nothing is checked per access.
+    void set_cheats(const std::vector<Cheat>& cheats) {
+        cartridge.set_rom_patches(cheats);
+        _ram_freezes.clear();
+        for(const auto& cheat : cheats)
+            if(!cheat.patches_rom())
+                _ram_freezes.push_back(cheat);
+        apply_ram_freezes();
+    }
 
     void reset() {
+        apu.reset();
         cpu.reset();
         ppu.reset();
     }
 
+    /// Puts the whole machine, cartridge included, back into its power-on state.
+    void power() {
+        apu.power();
+        ppu.power();
+        cartridge.power();
+        cpu.power();
+    }
+
     void run() {
         reset();
         while(!_shutdown) {
@@ -44,7 +87,147 @@ class NES {
         ppu.step(cpu.get_cycles());
     }
 
+    /// Runs until the PPU completes a frame.
+    /// @return Number of CPU cycles elapsed.
+    size_t run_frame() {
+        const auto start = cpu.get_total_cycles();
+        do {
+            step();
+        } while(!ppu.completed_frame);
+        end_frame();
+        return cpu.get_total_cycles() - start;
+    }
+
+    /// Work done once the PPU completes a frame: Flushes the audio, applies the RAM cheats and stores the battery save.
+    /// Called by run_frame, and by anything else running frames (see WideCPU::run_frame).
+    void end_frame() {
+        apu.end_frame(cpu.get_total_cycles());
+        if(!_ram_freezes.empty())
+            apply_ram_freezes();
+        cartridge.end_frame();
+    }
+
+    /// Frames of a step_frames call that are rasterized
+    enum class FrameObservation {
+        None,   ///< Every frame only updates what the CPU can observe
+        Last,   ///< Only the last frame is rendered
+        MaxPool ///< The last two frames are rendered, the observation is their per-pixel maximum (hides sprite flickering)
+    };
+
+    /// Value tracked by step_frames, typically a score read from RAM.
+    inline void set_reward_counter(std::function<int64_t(const NES&)> counter) { _reward_counter = std::move(counter); }
+
+    /**
+     * Agent step: Runs frames with controller 1 held to input (see CPU::set_controller_input, callbacks are not used).
+     * Frames that are not observed run in RenderMode::StatusOnly, observed ones are rendered with the current render
+     * mode and to the PPU observation (see PPU::set_observation), which holds the result of the step on return.
+     * @return Reward: Increase of the reward counter over the step, 0 if there's none.
+     **/
+    int64_t step_frames(word_t input, size_t frames, FrameObservation observation = FrameObservation::Last) {
+        const auto input_mode = cpu.get_input_mode();
+        const auto render_mode = ppu.get_render_mode();
+        const auto obs_buffer = ppu.get_observation();
+        const auto pool = observation == FrameObservation::MaxPool && frames >= 2 && obs_buffer;
+        if(pool)
+            _max_pool.resize(ppu.get_observation_size());
+
+        // Outputs of each frame. The last one restores the current outputs for the frames after the step.
+        auto output = [&](size_t frame, bool next_frame) {
+            if(frame == frames)
+                ppu.set_output(render_mode, obs_buffer, next_frame);
+            else if(observation == FrameObservation::None || frame + (pool ? 2 : 1) < frames)
+                ppu.set_output(PPU::RenderMode::StatusOnly, nullptr, next_frame);
+            else // The last frame of a max pool goes to a scratch buffer, then is pooled into the observation
+                ppu.set_output(render_mode, pool && frame + 1 == frames ? _max_pool.data() : obs_buffer, next_frame);
+        };
+
+        const int64_t before = _reward_counter ? _reward_counter(*this) : 0;
+        cpu.set_input_mode(CPU::InputMode::Direct);
+        cpu.set_controller_input(0, input);
+        output(0, false);
+        for(size_t f = 0; f < frames; ++f) {
+            output(f + 1, true); // Applied by the PPU as this frame completes
+            run_frame();
+        }
+        cpu.set_input_mode(input_mode);
+
+        if(pool)
+            for(size_t i = 0; i < _max_pool.size(); ++i)
+                obs_buffer[i] = std::max(obs_buffer[i], _max_pool[i]);
+        return _reward_counter ? _reward_counter(*this) - before : 0;
+    }
+
+    /// Creates a copy of this machine for tree searches.
+    /// Memory pages are shared copy-on-write with the parent and ROMs are always shared: The cost of a branch is
+    /// proportional to what each side writes afterwards rather than to the size of the machine.
+    std::unique_ptr<NES> fork() {
+        auto child = std::unique_ptr<NES>(new NES(cpu.RAMSize, ppu.get_render_mode()));
+        cpu.fork_into(child->cpu);
+        child->apu = apu;
+        child->apu.cartridge = &child->cartridge;
+        ppu.fork_into(child->ppu);
+        cartridge.fork_into(child->cartridge);
+        child->_ram_freezes = _ram_freezes;
+        return child;
+    }
+
+    /// Snapshot of the whole machine (the ROM itself is not included).
+    void save_state(SaveState& state) const {
+        state.clear();
+        cpu.save_state(state);
+        apu.save_state(state);
+        ppu.save_state(state);
+        cartridge.save_state(state);
+    }
+
+    /// @return false if the state doesn't match this machine (another game, a truncated file...), its state is then undefined.
+    bool load_state(SaveState& state) {
+        state.rewind();
+        cpu.load_state(state);
+        apu.load_state(state);
+        ppu.load_state(state);
+        cartridge.load_state(state);
+        return state.complete();
+    }
+
+    /// Records the current state as a snapshot of the loaded game, shared with every machine running it (see ResetSnapshots).
+    /// @return Snapshot id, for reset_to
+    size_t record_snapshot() {
+        SaveState state;
+        save_state(state);
+        return ResetSnapshots::of(cartridge.get_rom_hash()).add(state);
+    }
+
+    /// Puts the machine back into a snapshot of the loaded game, in place: Unlike reset or power, the game doesn't boot again.
+    /// @return false if the snapshot doesn't exist (see ResetSnapshots::clear), the machine is then left untouched.
+    bool reset_to(size_t snapshot_id) {
+        const auto snapshot = ResetSnapshots::of(cartridge.get_rom_hash()).get(snapshot_id);
+        if(!snapshot)
+            return false;
+        auto state = SaveState::view(*snapshot);
+        return load_state(state);
+    }
+
+    /// Hash of the whole machine state, equal for two machines if and only if their save states are (barring collisions).
+    /// Cheap enough to be called every frame: Only the memory pages written to since the last call are hashed again.
+    uint64_t state_hash() {
+        save_state(_digest);
+        return Hash::hash64(_digest.data(), _digest.size());
+    }
+
   private:
-    bool  _shutdown = false;
+    bool      _shutdown = false;
+    SaveState _digest{true};
+
+    std::function<int64_t(const NES&)> _reward_counter;
+    std::vector<word_t>                _max_pool;    // Last frame of a FrameObservation::MaxPool step
+    std::vector<Cheat>                 _ram_freezes; // RAM cheats, see set_cheats
+
+    void apply_ram_freezes() {
+        for(const auto& cheat : _ram_freezes)
+            if(cheat.compare < 0 || cpu.read(cheat.address) == cheat.compare)
+                cpu.write(cheat.address, cheat.value);
+    }
+
     float _ppucpuRatio = 3.0;
 };
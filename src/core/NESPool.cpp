@@ -0,0 +1,204 @@
+#include "NESPool.hpp"
+
+NESPool::NESPool(size_t count, size_t workers, bool pinned) : _threads(workers, pinned), _start_states(_threads.worker_count()) {
+    _instances.resize(count);
+}
+
+bool NESPool::load(const std::string& path) {
+    if(_instances.empty())
+        return false;
+
+    auto first = std::make_unique<NES>();
+    first->ppu.set_render_mode(_observation == Observation::Screen ? PPU::RenderMode::Indexed : PPU::RenderMode::StatusOnly);
+    first->cpu.set_input_mode(CPU::InputMode::Direct);
+    if(!first->load(path))
+        return false;
+    first->power();
+
+    if(_threads.is_pinned()) {
+        create_local_instances(*first);
+        return true;
+    }
+
+    // Forks share the ROM, and their memory pages until they first write to them.
+    for(size_t i = 1; i < _instances.size(); ++i) {
+        _instances[i] = first->fork();
+        _instances[i]->ppu.set_render_mode(first->ppu.get_render_mode());
+        _instances[i]->cpu.set_input_mode(CPU::InputMode::Direct);
+    }
+    _instances[0] = std::move(first);
+    set_start_state(0);
+    return true;
+}
+
+void NESPool::create_local_instances(NES& first) {
+    // One copy of the ROM per node, made by the first worker of the node.
+    std::vector<std::shared_ptr<const RomImage>> roms(_threads.node_count());
+    _threads.parallel_for(
+        _threads.worker_count(),
+        [&](size_t, size_t worker) {
+            const auto node = _threads.worker_node(worker);
+            for(size_t w = 0; w < worker; ++w)
+                if(_threads.worker_node(w) == node)
+                    return;
+            roms[node] = first.cartridge.get_rom()->copy();
+        },
+        false);
+
+    // Fresh machines rather than forks: Forks would share the pages of first, allocated on the node of the calling thread.
+    first.save_state(_start_states[0]);
+    copy_start_state();
+    _threads.parallel_for(
+        size(),
+        [&](size_t index, size_t worker) {
+            auto nes = std::make_unique<NES>(first.cpu.RAMSize, first.ppu.get_render_mode());
+            nes->cpu.set_input_mode(CPU::InputMode::Direct);
+            nes->load(roms[_threads.worker_node(worker)]);
+            std::memcpy(nes->ppu.rgb_palette, first.ppu.rgb_palette, sizeof(first.ppu.rgb_palette));
+            nes->load_state(_start_states[worker]);
+            _instances[index] = std::move(nes);
+        },
+        false);
+}
+
+void NESPool::set_observation(Observation observation, size_t ram_offset, size_t ram_size) {
+    _observation = observation;
+    _ram_offset = ram_offset;
+    _ram_size = ram_size;
+    for(auto& nes : _instances)
+        if(nes)
+            nes->ppu.set_render_mode(_observation == Observation::Screen ? PPU::RenderMode::Indexed : PPU::RenderMode::StatusOnly);
+}
+
+size_t NESPool::observation_size() const {
+    switch(_observation) {
+        case Observation::Screen: return PPU::ScreenHeight * PPU::ScreenWidth;
+        case Observation::RAM: return _ram_size;
+        default: return 0;
+    }
+}
+
+void NESPool::set_start_state(size_t index) {
+    _instances[index]->save_state(_start_states[0]);
+    copy_start_state();
+}
+
+bool NESPool::set_start_snapshot(size_t snapshot_id) {
+    const auto snapshot = ResetSnapshots::of(_instances[0]->cartridge.get_rom_hash()).get(snapshot_id);
+    if(!snapshot)
+        return false;
+    _start_states[0].assign(snapshot->data(), snapshot->size());
+    copy_start_state();
+    return true;
+}
+
+void NESPool::copy_start_state() {
+    // Copied by each worker, for the same reason as the instances (see create_local_instances)
+    _threads.parallel_for(
+        _start_states.size(),
+        [&](size_t w, size_t) {
+            if(w > 0)
+                _start_states[w] = _start_states[0];
+        },
+        false);
+}
+
+void NESPool::reset(size_t index, size_t worker) {
+    _instances[index]->load_state(_start_states[worker]);
+}
+
+void NESPool::step(std::span<const word_t> inputs, size_t frames, std::span<word_t> observations, std::span<uint8_t> resets) {
+    assert(inputs.size() >= 2 * size());
+    assert(observations.size() >= size() * observation_size());
+    assert(resets.empty() || resets.size() >= size());
+
+    const auto obs_size = observation_size();
+    const std::function<void(size_t, bool)> finish = [&](size_t index, bool reset_done) {
+        if(!resets.empty())
+            resets[index] = reset_done;
+        if(obs_size > 0)
+            observe(index, observations.data() + index * obs_size);
+    };
+
+    const auto steal = !_threads.is_pinned();
+    if(!_lockstep) {
+        _threads.parallel_for(
+            size(),
+            [&](size_t index, size_t worker) {
+                _instances[index]->cpu.set_controller_input(0, inputs[2 * index]);
+                _instances[index]->cpu.set_controller_input(1, inputs[2 * index + 1]);
+                finish(index, run_frames(index, worker, frames));
+            },
+            steal);
+        return;
+    }
+
+    // Lockstep: Groups of LockstepLanes consecutive instances
+    if(steal) {
+        const auto groups = (size() + LockstepLanes - 1) / LockstepLanes;
+        _threads.parallel_for(groups, [&](size_t group, size_t worker) {
+            const auto first = group * LockstepLanes;
+            run_group(first, std::min(LockstepLanes, size() - first), inputs, frames, worker, finish);
+        });
+    } else {
+        // Groups are made within each worker share, so instances stay on their worker
+        _threads.parallel_for(
+            _threads.worker_count(),
+            [&](size_t w, size_t worker) {
+                const auto end = _threads.share_begin(size(), w + 1);
+                for(auto first = _threads.share_begin(size(), w); first < end; first += LockstepLanes)
+                    run_group(first, std::min(LockstepLanes, end - first), inputs, frames, worker, finish);
+            },
+            false);
+    }
+}
+
+void NESPool::run_group(size_t first, size_t count, std::span<const word_t> inputs, size_t frames, size_t worker, const std::function<void(size_t, bool)>& finish) {
+    for(size_t index = first; index < first + count; ++index) {
+        _instances[index]->cpu.set_controller_input(0, inputs[2 * index]);
+        _instances[index]->cpu.set_controller_input(1, inputs[2 * index + 1]);
+    }
+
+    size_t frame = 0;
+    bool   reset_done[LockstepLanes] = {false};
+    if(count == LockstepLanes) {
+        std::array<NES*, LockstepLanes> lanes;
+        for(size_t l = 0; l < LockstepLanes; ++l)
+            lanes[l] = _instances[first + l].get();
+        WideCPU<LockstepLanes> wide(lanes);
+
+        bool any_reset = false;
+        for(; frame < frames && !any_reset; ++frame) {
+            wide.run_frame();
+            for(size_t l = 0; l < LockstepLanes; ++l)
+                if(_auto_reset && _auto_reset(*lanes[l], first + l)) {
+                    reset(first + l, worker);
+                    reset_done[l] = any_reset = true;
+                }
+        }
+    }
+    // Smaller group, or some instances were reset: The others finish on their own
+    for(size_t l = 0; l < count; ++l)
+        finish(first + l, reset_done[l] || run_frames(first + l, worker, frames - frame));
+}
+
+bool NESPool::run_frames(size_t index, size_t worker, size_t frames) {
+    auto& nes = *_instances[index];
+    for(size_t f = 0; f < frames; ++f) {
+        nes.run_frame();
+        if(_auto_reset && _auto_reset(nes, index)) {
+            reset(index, worker);
+            return true;
+        }
+    }
+    return false;
+}
+
+void NESPool::observe(size_t index, word_t* dst) const {
+    const auto& nes = *_instances[index];
+    switch(_observation) {
+        case Observation::Screen: std::memcpy(dst, nes.ppu.get_indexed_screen(), PPU::ScreenHeight * PPU::ScreenWidth); break;
+        case Observation::RAM: nes.cpu.get_ram().copy_to(dst, _ram_offset, _ram_size); break;
+        default: break;
+    }
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <span>
+#include <vector>
+
+#include <tools/ThreadPool.hpp>
+
+#include "NES.hpp"
+#include "WideCPU.hpp"
+
+/**
+ * Batch of machines running the same game, stepped together on a thread pool.
+ *
+ * Meant for reinforcement learning: Every step takes one input per instance and writes one observation per instance
+ * into a single contiguous buffer provided by the caller.
+ * All instances share the ROM loaded once by load (see NES::fork).
+ *
+ * Pinned pools are meant for multi-socket machines: Every instance stays on the same worker thread, pinned to a core,
+ * and is created by that thread so its memory is local to the worker NUMA node. Instances get their own memory
+ * instead of sharing pages with a parent, and read a copy of the ROM local to their node.
+ **/
+class NESPool {
+  public:
+    enum class Observation {
+        None,
+        Screen, ///< Palette indices of the last frame, PPU::ScreenHeight * PPU::ScreenWidth bytes (see PPU::RenderMode::Indexed)
+        RAM     ///< Slice of the internal RAM, see set_observation
+    };
+
+    /// @return true if the instance must be reset (game over, time limit...). Called after every frame, from any worker thread.
+    using predicate_t = std::function<bool(NES& nes, size_t index)>;
+
+    /// @param workers Number of threads stepping the instances, calling thread included unless pinned.
+    /// @param pinned  See ThreadPool: Workers are pinned to cores and instances never move to another worker.
+    NESPool(size_t count, size_t workers = std::thread::hardware_concurrency(), bool pinned = false);
+
+    /// Loads the ROM in every instance and powers them on.
+    bool load(const std::string& path);
+
+    inline size_t size() const { return _instances.size(); }
+    inline NES&   operator[](size_t index) { return *_instances[index]; }
+
+    void   set_observation(Observation observation, size_t ram_offset = 0, size_t ram_size = 0x800);
+    size_t observation_size() const;
+
+    /// Experimental: Runs groups of consecutive instances on a WideCPU, worth it if they often execute the same code.
+    inline void set_lockstep(bool lockstep) { _lockstep = lockstep; }
+
+    inline void set_auto_reset(predicate_t predicate) { _auto_reset = std::move(predicate); }
+    /// The current state of an instance becomes the state all instances are reset to (power-on state by default).
+    void set_start_state(size_t index);
+    /// All instances are now reset to a snapshot of the game (see NES::record_snapshot).
+    /// @return false if the snapshot doesn't exist, the start state is then unchanged.
+    bool set_start_snapshot(size_t snapshot_id);
+    /// Puts an instance back into the start state.
+    inline void reset(size_t index) { reset(index, 0); }
+
+    /**
+     * Holds the input of each instance for the given number of frames, then writes their observations.
+     *
+     * @param inputs       2 bytes per instance (controller 1 then controller 2), see CPU::set_controller_input.
+     * @param observations size() * observation_size() bytes, instance major.
+     * @param resets       Optional, one byte per instance, set to 1 if the instance was reset during this step and 0 otherwise.
+     *                     A reset instance stops at the reset: Its RAM observation is the one of the start state,
+     *                     but its screen observation still shows the last frame before the reset.
+     **/
+    void step(std::span<const word_t> inputs, size_t frames, std::span<word_t> observations, std::span<uint8_t> resets = {});
+
+  private:
+    static constexpr size_t LockstepLanes = 8;
+
+    std::vector<std::unique_ptr<NES>> _instances;
+    ThreadPool                        _threads;
+
+    Observation _observation = Observation::None;
+    size_t      _ram_offset = 0;
+    size_t      _ram_size = 0;
+    predicate_t _auto_reset;
+    bool        _lockstep = false;
+
+    std::vector<SaveState> _start_states; ///< One copy per worker: Loading a state moves its read cursor.
+
+    /// Creates every instance on the worker that will step it, from the state of first.
+    void create_local_instances(NES& first);
+    /// Copies the start state of worker 0 to the others.
+    void copy_start_state();
+    /// Steps instances [first, first + count) on a WideCPU if there are enough of them.
+    void run_group(size_t first, size_t count, std::span<const word_t> inputs, size_t frames, size_t worker, const std::function<void(size_t, bool)>& finish);
+
+    void reset(size_t index, size_t worker);
+    /// @return true if the instance was reset, it then stops early.
+    bool run_frames(size_t index, size_t worker, size_t frames);
+    void observe(size_t index, word_t* dst) const;
+};
@@ -1,13 +1,14 @@
 #include "PPU.hpp"
 
-PPU::PPU() : _mem(new word_t[MemSize]), _oam(new word_t[OAMSize]), _screen(new color_t[240 * 256]) {
-    reset();
+// Everything starts zeroed.
+PPU::PPU(RenderMode mode) : _mem(MemSize), _oam(new word_t[OAMSize]()) {
+    set_render_mode(mode);
 }
 
 PPU::~PPU() {
-    delete[] _screen;
+    std::free(_screen);
+    std::free(_indexed_screen);
     delete[] _oam;
-    delete[] _mem;
 }
 
 bool PPU::load_palette(const std::string& path) {
@@ -25,16 +26,254 @@ bool PPU::load_palette(const std::string& path) {
             rgb_palette[c] = color_t(r, g, b);
             ++c;
         }
+        update_luma();
         return true;
     }
 }
 
+void PPU::set_render_mode(RenderMode mode) {
+    // The screen is only allocated once needed: Machines that never rasterize (see NES::fork) are much cheaper to create.
+    if(mode == RenderMode::Full && !_screen)
+        _screen = static_cast<color_t*>(std::calloc(ScreenWidth * ScreenHeight, sizeof(color_t)));
+    if(mode == RenderMode::Indexed && !_indexed_screen)
+        _indexed_screen = static_cast<word_t*>(std::calloc(ScreenWidth * ScreenHeight, sizeof(word_t)));
+    _render_mode = mode;
+}
+
+void PPU::set_observation(word_t* buffer, size_t width, size_t height, ObservationFormat format) {
+    assert(!buffer || (width > 0 && width <= ScreenWidth && height > 0 && height <= ScreenHeight));
+    _obs_buffer = buffer;
+    _obs_format = format;
+    _obs_width = buffer ? width : 0;
+    _obs_height = buffer ? height : 0;
+    if(!buffer)
+        return;
+
+    update_luma();
+
+    // Each screen column belongs to exactly one observation column: Boxes are 3 or 4 pixels wide for 84 columns.
+    _obs_column_width.assign(width, 0);
+    for(size_t x = 0; x < ScreenWidth; ++x) {
+        _obs_column[x] = static_cast<uint8_t>(x * width / ScreenWidth);
+        ++_obs_column_width[_obs_column[x]];
+    }
+    _obs_sums.assign(width, 0);
+}
+
+void PPU::set_output(RenderMode mode, word_t* observation_buffer, bool next_frame) {
+    assert(!observation_buffer || get_observation_size() > 0);
+    if(next_frame) {
+        _next_output = true;
+        _next_render_mode = mode;
+        _next_obs_buffer = observation_buffer;
+    } else {
+        _next_output = false;
+        set_render_mode(mode);
+        _obs_buffer = observation_buffer;
+    }
+}
+
+void PPU::update_luma() {
+    // ITU-R BT.601
+    for(size_t i = 0; i < _luma.size(); ++i)
+        _luma[i] = static_cast<word_t>((299 * rgb_palette[i].r + 587 * rgb_palette[i].g + 114 * rgb_palette[i].b) / 1000);
+}
+
+void PPU::observe_line() {
+    const size_t row = _line * _obs_height / ScreenHeight;
+    const bool   first_line = _line == 0 || (_line - 1) * _obs_height / ScreenHeight != row;
+    const bool   last_line = _line + 1 == ScreenHeight || (_line + 1) * _obs_height / ScreenHeight != row;
+    auto*        dst = _obs_buffer + row * _obs_width;
+
+    if(_obs_format == ObservationFormat::PaletteIndex) {
+        // Point sampling: Averaging indices would be meaningless. Keeps the line at the middle of the box.
+        const size_t begin = (row * ScreenHeight + _obs_height - 1) / _obs_height;
+        const size_t end = ((row + 1) * ScreenHeight + _obs_height - 1) / _obs_height;
+        if(_line == (begin + end - 1) / 2) {
+            size_t x = 0;
+            for(size_t col = 0; col < _obs_width; x += _obs_column_width[col], ++col)
+                dst[col] = _line_pixels[x + _obs_column_width[col] / 2];
+        }
+        return;
+    }
+
+    // Luma: Box filter, sums the columns of each box for every line of the row, then divides by the area.
+    if(first_line) {
+        std::fill(_obs_sums.begin(), _obs_sums.end(), 0);
+        _obs_lines = 0;
+    }
+    for(size_t x = 0; x < ScreenWidth; ++x)
+        _obs_sums[_obs_column[x]] += _luma[_line_pixels[x]];
+    ++_obs_lines;
+
+    if(last_line) {
+        for(size_t col = 0; col < _obs_width; ++col)
+            dst[col] = static_cast<word_t>(_obs_sums[col] / (_obs_column_width[col] * _obs_lines));
+    }
+}
+
 void PPU::reset() {
-    std::memset(_screen, 0, 240 * 256);
-    std::memset(_mem, 0, MemSize);
+    if(_screen)
+        std::memset(_screen, 0, 240 * 256);
+    if(_indexed_screen)
+        std::memset(_indexed_screen, 0, ScreenWidth * ScreenHeight);
+    _mem.fill(0);
+}
+
+void PPU::power() {
+    _cycles = 0;
+    _frame = 0;
+    _line = 261;
+    _dot = 0;
+    _ppu_control = _ppu_mask = _ppu_status = _oam_addr = 0;
+    _nmi = false;
+    _v = _t = 0;
+    _x = 0;
+    _w = 0;
+    _read_buffer = 0;
+    _bg_attribute = _bg_tile_data0 = _bg_tile_data1 = 0;
+    std::memset(_oam, 0, OAMSize);
+    _a12_high_end = 0;
+    update_scanline_event();
+    reset();
+}
+
+void PPU::save_state(SaveState& state) const {
+    state.write(_cycles);
+    state.write(_frame);
+    state.write(_line);
+    state.write(_dot);
+    state.write(_ppu_control);
+    state.write(_ppu_mask);
+    state.write(_ppu_status);
+    state.write(_oam_addr);
+    state.write(_nmi);
+    state.write(_v);
+    state.write(_t);
+    state.write(_x);
+    state.write(_w);
+    state.write(_read_buffer);
+    state.write(_bg_attribute);
+    state.write(_bg_tile_data0);
+    state.write(_bg_tile_data1);
+    state.write(_a12_high_end);
+    _mem.save_state(state);
+    state.write(_oam, OAMSize);
 }
 
-static bool background_transparency[PPU::ScreenWidth];
+void PPU::load_state(SaveState& state) {
+    state.read(_cycles);
+    state.read(_frame);
+    state.read(_line);
+    state.read(_dot);
+    state.read(_ppu_control);
+    state.read(_ppu_mask);
+    state.read(_ppu_status);
+    state.read(_oam_addr);
+    state.read(_nmi);
+    state.read(_v);
+    state.read(_t);
+    state.read(_x);
+    state.read(_w);
+    state.read(_read_buffer);
+    state.read(_bg_attribute);
+    state.read(_bg_tile_data0);
+    state.read(_bg_tile_data1);
+    state.read(_a12_high_end);
+    _mem.load_state(state);
+    state.read(_oam, OAMSize);
+    update_scanline_event();
+}
+
+void PPU::fork_into(PPU& child) {
+    std::memcpy(child.rgb_palette, rgb_palette, sizeof(rgb_palette));
+    child._cycles = _cycles;
+    child._frame = _frame;
+    child._line = _line;
+    child._dot = _dot;
+    child._ppu_control = _ppu_control;
+    child._ppu_mask = _ppu_mask;
+    child._ppu_status = _ppu_status;
+    child._oam_addr = _oam_addr;
+    child._nmi = _nmi;
+    child._v = _v;
+    child._t = _t;
+    child._x = _x;
+    child._w = _w;
+    child._read_buffer = _read_buffer;
+    child._bg_attribute = _bg_attribute;
+    child._bg_tile_data0 = _bg_tile_data0;
+    child._bg_tile_data1 = _bg_tile_data1;
+    child._scanline_dot = _scanline_dot;
+    child._a12_exact = _a12_exact;
+    child._a12_high_end = _a12_high_end;
+    child._mem = _mem.fork();
+    std::memcpy(child._oam, _oam, OAMSize);
+}
+
+void PPU::update_scanline_event() {
+    if(!cartridge || !cartridge->counts_scanlines()) {
+        _scanline_dot = NoScanlineEvent;
+        return;
+    }
+    // Background at $0000 and 8x8 sprites at $1000, as intended by the MMC3: A12 only rises as the sprite patterns are fetched,
+    // once per line. Otherwise, each group of pattern fetches is tracked to find the edges.
+    _a12_exact = (_ppu_control & (BackgoundPatternTableAddress | SpritePatternTableAddress | SpriteSize)) != SpritePatternTableAddress;
+    if(!_a12_exact || (_cycles > A12BackgroundDot && _cycles <= A12SpritesDot))
+        _scanline_dot = A12SpritesDot;
+    else if(_cycles > A12SpritesDot && _cycles <= A12PrefetchDot)
+        _scanline_dot = A12PrefetchDot;
+    else
+        _scanline_dot = A12BackgroundDot;
+}
+
+void PPU::scanline_event() {
+    const bool         rendering = (_ppu_mask & (BackgroundMask | SpriteMask)) && (_line < ScreenHeight || _line == 261);
+    const unsigned int now = _line * LineDots + _cycles;
+    if(!_a12_exact) {
+        if(rendering) {
+            cartridge->clock_scanline();
+            _a12_high_end = now + 8 * 7 + 4;
+        }
+        return;
+    }
+
+    const bool background = _ppu_control & BackgoundPatternTableAddress;
+    if(_cycles == A12BackgroundDot) {
+        if(rendering)
+            a12_fetch(background, now, now + ScreenWidth - A12BackgroundDot);
+        _scanline_dot = A12SpritesDot;
+    } else if(_cycles == A12SpritesDot) {
+        if(rendering) {
+            // 8x16 sprites select their pattern table with their tile index, empty slots fetch the tile $FF.
+            bool slots[8];
+            std::fill(std::begin(slots), std::end(slots), (_ppu_control & SpriteSize) || (_ppu_control & SpritePatternTableAddress));
+            if((_ppu_control & SpriteSize) && _line < ScreenHeight) {
+                size_t slot = 0;
+                for(size_t i = 0; i < OAMSize && slot < 8; i += 4) {
+                    const unsigned int y = _oam[i];
+                    if(y <= _line && y + 16 > _line)
+                        slots[slot++] = _oam[i + 1] & 1;
+                }
+            }
+            for(size_t s = 0; s < 8; ++s)
+                a12_fetch(slots[s], now + 8 * s, now + 8 * s + 4);
+        }
+        _scanline_dot = A12PrefetchDot;
+    } else {
+        if(rendering)
+            a12_fetch(background, now, now + 12);
+        _scanline_dot = A12BackgroundDot;
+    }
+}
+
+void PPU::a12_fetch(bool high, unsigned int start, unsigned int end) {
+    if(!high)
+        return;
+    if((start + FrameDots - _a12_high_end) % FrameDots >= A12Filter)
+        cartridge->clock_scanline();
+    _a12_high_end = end;
+}
 
 void PPU::draw_line_sprites() {
     word_t              size = (_ppu_control & SpriteSize) ? 16 : 8;
@@ -48,16 +287,12 @@ void PPU::draw_line_sprites() {
             break;
     }
 
-    color_t universal_background_color = rgb_palette[_mem[0x3F00] & 0x3F];
-    color_t color_cache[4][3]; // 4 palettes of 3 colors each
-    for(int i = 0; i < 4; ++i)
-        for(int j = 0; j < 3; ++j) {
-            word_t val = _mem[0x3F11 + 4 * i + j];
-            color_cache[i][j] = rgb_palette[val & 0x3F];
-        }
-
     // Reverse order?
     for(const size_t& s : sprites) {
+        // Only Sprite 0 Hit is observable without a screen.
+        if(!rasterizing() && s != 0)
+            break;
+
         word_t x = _oam[s + 3];
         word_t y = _oam[s] - _line;
         word_t t = _oam[s + 1];
@@ -86,20 +321,16 @@ void PPU::draw_line_sprites() {
             word_t shift = ((7 - c_x) % 4) * 2;
             word_t color = ((c_x > 3 ? tile_data1 : tile_data0) >> shift) & 0b11;
 
-            if(s == 0 && color > 0 && !background_transparency[x + p])
+            if(s == 0 && color > 0 && !_background_transparency[x + p])
                 _ppu_status |= Sprite0Hit;
 
-            if(color > 0 && (!(attribute & Priority) || background_transparency[x + p])) {
-                _screen[_line * ScreenWidth + x + p] = color_cache[attribute & Palette][color - 1];
-            }
+            if(rasterizing() && color > 0 && x + p < ScreenWidth && (!(attribute & Priority) || _background_transparency[x + p]))
+                put_pixel(x + p, _mem[0x3F11 + 4 * (attribute & Palette) + color - 1]);
         }
     }
 }
 
 void PPU::background_step() {
-    static word_t attribute;
-    static word_t tile_data0 = 0, tile_data1 = 0;
-
     auto coarse_x = (_v & 0x1f) * 8;
 
     auto bg_tile_pixel = (_cycles - 1 + coarse_x + _x) & 7;
@@ -107,18 +338,18 @@ void PPU::background_step() {
         auto   fine_y = (_v >> 12) & 7;
         addr_t tile_addr = 0x2000 | (_v & 0x0FFF);
         addr_t attribute_addr = 0x23C0 | (_v & 0x0C00) | ((_v >> 4) & 0x38) | ((_v >> 2) & 0x07);
-        auto   tile = mem_read(tile_addr);
+        auto   tile = read_nametable(tile_addr);
         addr_t patterns = (_ppu_control & BackgoundPatternTableAddress) ? 0x1000 : 0;
-        auto   tile_l = mem_read(patterns + tile * 16 + fine_y);
-        auto   tile_h = mem_read(patterns + tile * 16 + fine_y + 8);
-        tile_translation(tile_l, tile_h, tile_data0, tile_data1);
-        attribute = mem_read(attribute_addr);
+        auto   tile_l = cartridge->read_chr(patterns + tile * 16 + fine_y);
+        auto   tile_h = cartridge->read_chr(patterns + tile * 16 + fine_y + 8);
+        tile_translation(tile_l, tile_h, _bg_tile_data0, _bg_tile_data1);
+        _bg_attribute = read_nametable(attribute_addr);
 
         bool top = ((((_v >> 5) & 0x1f) * 8 + fine_y) % 32) < 16;
         bool left = ((coarse_x + _x) % 32) < 16; // Each byte contains the palette index for 4 blocks of 2x2 tiles
         auto shift = (top ? 0 : 4) + (left ? 0 : 2);
-        attribute = attribute >> shift;
-        attribute &= 3;
+        _bg_attribute = _bg_attribute >> shift;
+        _bg_attribute &= 3;
 
         if((_v & 0x001F) == 31) { // if coarse X == 31
             _v &= ~0x001F;        // coarse X = 0
@@ -129,15 +360,14 @@ void PPU::background_step() {
     }
 
     word_t shift = ((7 - bg_tile_pixel) & 3) << 1;
-    word_t color = ((bg_tile_pixel > 3 ? tile_data1 : tile_data0) >> shift) & 0b11;
-    if(color > 0) {
-        background_transparency[_cycles - 1] = false;
-        word_t val = mem_read(0x3F01 + 4 * attribute + (color - 1));
-        _screen[_line * ScreenWidth + _cycles - 1] = rgb_palette[val & 0x3F];
-    } else {
-        background_transparency[_cycles - 1] = true;
-        _screen[_line * ScreenWidth + _cycles - 1] = rgb_palette[_mem[0x3F00] & 0x3F];
-    }
+    word_t color = ((bg_tile_pixel > 3 ? _bg_tile_data1 : _bg_tile_data0) >> shift) & 0b11;
+    _background_transparency[_cycles - 1] = (color == 0);
+    if(!rasterizing())
+        return;
+    if(color > 0)
+        put_pixel(_cycles - 1, _mem[0x3F01 + 4 * _bg_attribute + (color - 1)]);
+    else
+        put_pixel(_cycles - 1, _mem[0x3F00]);
 }
 
 void PPU::step() {
@@ -145,6 +375,10 @@ void PPU::step() {
     const auto sprites_enabled = (_ppu_mask & SpriteMask);
     const auto rendering_enabled = bg_enabled || sprites_enabled;
 
+    // Backdrop, for the pixels neither the background nor the sprites are going to cover
+    if(_obs_buffer && _cycles == 0 && _line < ScreenHeight)
+        _line_pixels.fill(_mem[0x3F00] & 0x3F);
+
     if(rendering_enabled && _line < ScreenHeight) {
         if(bg_enabled && _cycles > 0 && _cycles <= ScreenWidth) {
             background_step();
@@ -176,9 +410,14 @@ void PPU::step() {
     if(rendering_enabled && _line == 261 && (_cycles >= 280 && _cycles <= 304))
         _v = (_v & 0b000010000011111) | (_t & 0b111101111100000);
 
+    if(_cycles == _scanline_dot)
+        scanline_event();
+
     ++_cycles;
 
     if(_cycles > 340) {
+        if(_obs_buffer && _line < ScreenHeight)
+            observe_line();
         _cycles = 0;
         _line = (_line + 1) % 262;
         // VBlank at 241 (to 260)
@@ -189,6 +428,8 @@ void PPU::step() {
             _ppu_status &= ~Sprite0Hit; // Clear Sprite0Hit Bit
             _v = (_v & 0x841F) | (_t & 0x7BE0);
         } else if(_line == 0) {
+            if(_next_output)
+                set_output(_next_render_mode, _next_obs_buffer, false);
             completed_frame = true;
             _ppu_status &= ~VBlank;
         }
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <array>
 #include <cassert>
 #include <cstring>
 #include <fstream>
@@ -7,6 +8,8 @@
 
 #include "Cartridge.hpp"
 #include "Common.hpp"
+#include "PagedMemory.hpp"
+#include "SaveState.hpp"
 
 /**
  * NES Picture Processing Unit
@@ -56,18 +59,65 @@ class PPU {
         FlipY = 0x80
     };
 
+    /// What the PPU produces while rendering
+    enum class RenderMode {
+        Full,      ///< Rasterize the whole frame to the screen buffer
+        Indexed,   ///< Rasterize palette indices (0x00-0x3F, one byte per pixel) to the indexed screen buffer, for machine consumers
+        StatusOnly ///< Only update what the CPU can observe (registers, VBlank, Sprite 0 Hit), the screen buffers are left untouched
+    };
+
+    /// Pixel format of the low resolution observation (see set_observation)
+    enum class ObservationFormat {
+        Luma,        ///< Average luminance (0-255) of the screen pixels covered by each observation pixel
+        PaletteIndex ///< Palette index (0x00-0x3F) of the screen pixel at the center of each observation pixel
+    };
+
     Cartridge* cartridge = nullptr;
 
     bool                  completed_frame = false;
+    inline RenderMode     get_render_mode() const { return _render_mode; }
+    void                  set_render_mode(RenderMode mode);
+    /// @return nullptr if the PPU has never been in RenderMode::Full
     inline const color_t* get_screen() const { return _screen; }
-    inline word_t         get_mem(addr_t addr) const { return _mem[addr]; }
+    /// @return nullptr if the PPU has never been in RenderMode::Indexed
+    inline const word_t* get_indexed_screen() const { return _indexed_screen; }
+    /// Nametables ($2000-$3EFF) are seen through the cartridge mirroring.
+    inline word_t         get_mem(addr_t addr) const { return _mem[addr >= 0x2000 && addr < 0x3F00 ? cartridge->nametable(addr) : addr]; }
 
-    PPU();
+    /**
+     * Downsamples every frame to a width x height image (one byte per pixel, row major) written to buffer while the
+     * scanlines are rendered: The observation of a frame is complete once completed_frame is set.
+     * Independent of the render mode: With RenderMode::StatusOnly, the full resolution screen is never produced.
+     * The luminance table is derived from rgb_palette at this point (and by load_palette).
+     * @param buffer Provided by the caller, must stay valid until the observation is disabled (nullptr).
+     **/
+    void set_observation(word_t* buffer, size_t width = 84, size_t height = 84, ObservationFormat format = ObservationFormat::Luma);
+    /// @return nullptr if there's no observation
+    inline word_t* get_observation() const { return _obs_buffer; }
+    /// Bytes written to the observation buffer per frame
+    inline size_t            get_observation_size() const { return _obs_width * _obs_height; }
+    inline ObservationFormat get_observation_format() const { return _obs_format; }
+    /**
+     * Switches the render mode and the observation buffer (same size and format) together.
+     * @param next_frame Waits for the next frame to start: It is then entirely rendered with the new outputs, whereas
+     *                   an immediate switch usually happens a few dots into the first line (see NES::run_frame).
+     **/
+    void set_output(RenderMode mode, word_t* observation_buffer, bool next_frame);
+
+    PPU(RenderMode mode = RenderMode::Full);
     ~PPU();
     bool load_palette(const std::string& path);
     void reset();
+    /// Clears all registers on top of reset().
+    void power();
     void step(size_t cpu_cycles);
 
+    void save_state(SaveState& state) const;
+    void load_state(SaveState& state);
+    /// Copies the state of this PPU into child, VRAM pages are shared copy-on-write.
+    /// The screen buffers, render mode and observation are not copied.
+    void fork_into(PPU& child);
+
     /// Access from CPU
     inline word_t read(addr_t addr) {
         if(addr < 0x2000) // CHR ROM (Or re-routed by cartridge)
@@ -86,15 +136,15 @@ class PPU {
             case 0x04: return _oam[_oam_addr];
             case 0x07: {
                 // PPUDATA read
-                static word_t internal_buffer = 0; // Delayed read
-                word_t        r;
-                if(_v < 0x3F00) {
-                    r = internal_buffer;
-                    internal_buffer = mem_read(_v);
+                const addr_t vram_addr = _v & 0x3FFF; // 14 bits address bus (v can hold a fine Y scroll if rendering is enabled)
+                word_t       r;
+                if(vram_addr < 0x3F00) {
+                    r = _read_buffer;
+                    _read_buffer = mem_read(vram_addr);
                 } else {
                     // Palette Mirroring
-                    r = mem_read((_v & 0x1F) + 0x3F00);
-                    internal_buffer = mem_read((_v & 0x1F) + 0x2000); // ??
+                    r = mem_read((vram_addr & 0x1F) + 0x3F00);
+                    _read_buffer = mem_read((vram_addr & 0x1F) + 0x2000); // ??
                 }
                 _v += (_ppu_control & VerticalWrite) ? 32 : 1;
                 return r;
@@ -111,6 +161,7 @@ class PPU {
             case 0x00:
                 _ppu_control = value;
                 _t = (_t & 0b0111001111111111) | ((value & 3) << 10);
+                update_scanline_event();
                 break;
             case 0x01: _ppu_mask = value; break;
             case 0x02: _ppu_status = value; break;
@@ -136,48 +187,35 @@ class PPU {
                     _w = 0;
                 }
                 break;
-            case 0x07: // PPU data read/write
-                _mem[_v] = value;
-                /// Nametables range - Mirroring
-                if(_v >= 0x2000 && _v <= 0x2EFF) {
-                    if(cartridge->get_mirroring() == Cartridge::Horizontal) {
-                        if(_v < 0x2400 || (_v >= 0x2800 && _v < 0x2C00))
-                            _mem[_v + 0x400] = value;
-                        else
-                            _mem[_v - 0x400] = value;
-                    } else if(cartridge->get_mirroring() == Cartridge::Vertical) {
-                        if(_v < 0x2800)
-                            _mem[_v + 0x800] = value;
-                        else
-                            _mem[_v - 0x800] = value;
-                    }
-                }
-
-                // 0x3000 - 0x3EFF Mirrors 0x2000 - 0x2EFF
-                if(_v >= 0x3000 && _v <= 0x3EFF)
-                    _mem[_v - 0x1000] = value;
-
-                // Palettes
-                if(_v >= 0x3F00) {
-                    // 0x3F20 - 0x3FFF Mirrors 0x3F00 - 0x3F1F
-                    auto addr = (_v & 0x1f) + 0x3F00;
-                    _mem[addr] = value;
+            case 0x07: { // PPU data read/write
+                const addr_t vram_addr = _v & 0x3FFF; // 14 bits address bus (v can hold a fine Y scroll if rendering is enabled)
+                if(vram_addr < 0x2000) {
+                    cartridge->write_chr(vram_addr, value);
+                } else if(vram_addr < 0x3F00) {
+                    // Nametables, 0x3000 - 0x3EFF Mirrors 0x2000 - 0x2EFF
+                    _mem.write(cartridge->nametable(vram_addr), value);
+                } else {
+                    // Palettes, 0x3F20 - 0x3FFF Mirrors 0x3F00 - 0x3F1F
+                    auto addr = (vram_addr & 0x1f) + 0x3F00;
+                    _mem.write(addr, value);
 
                     // Palette Mirroring, double the write to simplify the reads
                     if(addr % 4 == 0)
                         if(addr < 0x3F10)
-                            _mem[addr + 0x10] = value;
+                            _mem.write(addr + 0x10, value);
                         else
-                            _mem[addr - 0x10] = value;
+                            _mem.write(addr - 0x10, value);
                 }
 
                 _v += (_ppu_control & VerticalWrite) ? 32 : 1;
                 // std::cout << "PPU Write: " << Hexa(_ppu_addr) << " = " << Hexa8(value) << std::endl;
                 break;
+            }
             default: std::cerr << "Write on unsupported PPU address: " << Hexa(addr) << std::endl; break;
         }
     }
 
+    inline bool nmi_pending() const { return _nmi; }
     inline bool check_nmi() {
         bool r = _nmi;
         _nmi = false;
@@ -223,6 +261,12 @@ class PPU {
     inline word_t get_mask_reg() const { return _ppu_mask; }
     inline word_t get_status_reg() const { return _ppu_status; }
     inline word_t get_oam_addr_reg() const { return _oam_addr; }
+
+    /// OAM DMA ($4014): Writes a whole page through $2004, starting at OAMADDR.
+    inline void oam_dma(const word_t* page) {
+        std::memcpy(_oam + _oam_addr, page, OAMSize - _oam_addr);
+        std::memcpy(_oam, page + OAMSize - _oam_addr, _oam_addr);
+    }
     inline word_t get_scroll_x() const { return _x; }
     inline word_t get_scroll_y() const { return (_v >> 12) & 7; }
 
@@ -235,6 +279,8 @@ class PPU {
     }
 
   private:
+    RenderMode _render_mode = RenderMode::Full;
+
     unsigned int _cycles = 0;
     unsigned int _frame = 0;
     unsigned int _line = 261;
@@ -254,19 +300,87 @@ class PPU {
     word_t _x = 0;
     bool   _w = 0;
 
-    word_t* _mem = nullptr; // Access by $2007
-    word_t* _oam = nullptr; // Access by $2004
+    word_t _read_buffer = 0; // Delayed PPUDATA read
+
+    // Mapper scanline counter (MMC3), clocked by the rising edges of the address line A12: Pattern tables at $1000 are fetched.
+    // Fetches are not inspected one by one, the edges are derived from the pattern table selection in _ppu_control instead.
+    static constexpr unsigned int LineDots = 341;
+    static constexpr unsigned int FrameDots = 262 * LineDots;
+    static constexpr unsigned int NoScanlineEvent = LineDots; ///< Never reached by _cycles
+    static constexpr unsigned int A12Filter = 10;             ///< Dots A12 has to stay low for its next rise to be seen by the mapper
+    // Dots at which each group of pattern fetches starts: Background, sprites (8 slots, 8 dots apart), first tiles of the next line
+    static constexpr unsigned int A12BackgroundDot = 4;
+    static constexpr unsigned int A12SpritesDot = 260;
+    static constexpr unsigned int A12PrefetchDot = 324;
+
+    unsigned int _scanline_dot = NoScanlineEvent; ///< Dot of the next scanline_event
+    bool         _a12_exact = false;              ///< Irregular configuration: Every group of pattern fetches is tracked
+    unsigned int _a12_high_end = 0;               ///< Dot of the frame the last fetch from $1000-$1FFF ended at
+
+    // Background fetch state
+    word_t _bg_attribute = 0;
+    word_t _bg_tile_data0 = 0;
+    word_t _bg_tile_data1 = 0;
+    bool   _background_transparency[ScreenWidth + 8] = {false}; // Sprites can overflow on the right edge
+
+    PagedMemory _mem;           // Access by $2007
+    word_t*     _oam = nullptr; // Access by $2004
+
+    color_t* _screen = nullptr;
+    word_t*  _indexed_screen = nullptr;
 
-    color_t* _screen;
+    // Low resolution observation
+    word_t*                          _obs_buffer = nullptr;
+    ObservationFormat                _obs_format = ObservationFormat::Luma;
+    size_t                           _obs_width = 0;
+    size_t                           _obs_height = 0;
+    size_t                           _obs_lines = 0;    // Scanlines accumulated in _obs_sums
+    std::array<word_t, 0x40>         _luma{};           // Luminance of each palette entry
+    std::array<word_t, ScreenWidth>  _line_pixels{};    // Palette indices of the current scanline
+    std::array<uint8_t, ScreenWidth> _obs_column{};     // Observation column of each screen column
+    std::vector<uint8_t>             _obs_column_width; // Screen columns covered by each observation column
+    std::vector<uint32_t>            _obs_sums;         // Luminance sums of the current observation row
+
+    // Outputs of the next frame (see set_output)
+    bool       _next_output = false;
+    RenderMode _next_render_mode = RenderMode::Full;
+    word_t*    _next_obs_buffer = nullptr;
+
+    /// Pixels have to be computed: Some buffer is going to use them.
+    inline bool rasterizing() const { return _render_mode != RenderMode::StatusOnly || _obs_buffer; }
+    void update_luma();
+    /// Accumulates the last scanline into the observation.
+    void observe_line();
+
+    /// Schedules the next scanline_event, on pattern table or mapper changes.
+    void update_scanline_event();
+    void scanline_event();
+    /// Pattern fetch over the dots [start, end) of the frame, from $1000-$1FFF if high.
+    void a12_fetch(bool high, unsigned int start, unsigned int end);
 
     void step();
     void background_step();
     void draw_line_sprites(); // Not cycle accurate
 
+    /// @param palette_value Content of a palette entry ($3F00-$3F1F)
+    inline void put_pixel(size_t x, word_t palette_value) {
+        palette_value &= 0x3F;
+        if(_obs_buffer)
+            _line_pixels[x] = palette_value;
+        if(_render_mode == RenderMode::Full)
+            _screen[_line * ScreenWidth + x] = rgb_palette[palette_value];
+        else if(_render_mode == RenderMode::Indexed)
+            _indexed_screen[_line * ScreenWidth + x] = palette_value;
+    }
+
     inline word_t mem_read(addr_t addr) {
         if(addr < 0x2000) // CHR ROM (Or re-routed by cartridge)
             return cartridge->read_chr(addr);
+        else if(addr < 0x3F00)
+            return read_nametable(addr);
         else
             return _mem[addr];
     }
+
+    inline word_t read_nametable(addr_t addr) const { return _mem[cartridge->nametable(addr)]; }
 };
@@ -0,0 +1,100 @@
+#include "PagedMemory.hpp"
+
+#include <algorithm>
+
+#include "Hash.hpp"
+
+void PagedMemory::allocate(size_t size) {
+    const auto count = (size + PageMask) >> PageBits;
+    _size = size;
+    _pages.resize(count);
+    _writable.assign(count, true);
+    _shared.assign(count, false);
+    _owners.resize(count);
+    _hashes.resize(count);
+    _hash_valid.assign(count, false);
+
+    // Pages start in a single contiguous block, but each one gets its own reference count.
+    // The block is released once the last of its pages is.
+    std::shared_ptr<word_t[]> block(new word_t[count * PageSize]());
+    for(size_t p = 0; p < count; ++p) {
+        _pages[p] = block.get() + p * PageSize;
+        _owners[p] = page_ref_t(_pages[p], [block](word_t*) {});
+    }
+}
+
+void PagedMemory::fill(word_t value) {
+    for(size_t p = 0; p < _pages.size(); ++p) {
+        if(!_writable[p])
+            make_writable(p);
+        std::memset(_pages[p], value, PageSize);
+    }
+}
+
+const word_t* PagedMemory::data() const {
+    for(size_t p = 1; p < _pages.size(); ++p)
+        if(_pages[p] != _pages[0] + p * PageSize || _shared[p])
+            return nullptr;
+    return _pages.empty() || _shared[0] ? nullptr : _pages[0];
+}
+
+void PagedMemory::copy_to(word_t* dst, size_t addr, size_t size) const {
+    while(size > 0) {
+        const auto chunk = std::min(size, PageSize - (addr & PageMask));
+        std::memcpy(dst, _pages[addr >> PageBits] + (addr & PageMask), chunk);
+        dst += chunk;
+        addr += chunk;
+        size -= chunk;
+    }
+}
+
+PagedMemory PagedMemory::fork() {
+    PagedMemory child;
+    child._size = _size;
+    child._pages = _pages;
+    child._owners = _owners;
+    child._hashes = _hashes;
+    child._hash_valid = _hash_valid;
+    _writable.assign(_pages.size(), false);
+    _shared.assign(_pages.size(), true);
+    child._writable.assign(_pages.size(), false);
+    child._shared.assign(_pages.size(), true);
+    return child;
+}
+
+void PagedMemory::save_state(SaveState& state) const {
+    for(size_t p = 0; p < _pages.size(); ++p)
+        if(state.is_digest())
+            state.write(page_hash(p));
+        else
+            state.write(_pages[p], std::min(PageSize, _size - p * PageSize));
+}
+
+void PagedMemory::load_state(SaveState& state) {
+    for(size_t p = 0; p < _pages.size(); ++p) {
+        if(!_writable[p])
+            make_writable(p);
+        state.read(_pages[p], std::min(PageSize, _size - p * PageSize));
+    }
+}
+
+uint64_t PagedMemory::page_hash(size_t page) const {
+    if(!_hash_valid[page]) {
+        _hashes[page] = Hash::hash64(_pages[page], std::min(PageSize, _size - page * PageSize));
+        _hash_valid[page] = true;
+        _writable[page] = false;
+    }
+    return _hashes[page];
+}
+
+void PagedMemory::make_writable(size_t page) {
+    if(_shared[page]) {
+        page_ref_t copy(new word_t[PageSize]);
+        std::memcpy(copy.get(), _pages[page], PageSize);
+        _pages[page] = copy.get();
+        _owners[page] = std::move(copy);
+        _shared[page] = false;
+    }
+    _writable[page] = true;
+    _hash_valid[page] = false;
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include "Common.hpp"
+#include "SaveState.hpp"
+
+/**
+ * Byte addressable memory split into fixed size pages.
+ *
+ * Pages are reference counted and can be shared copy-on-write between machines (see NES::fork):
+ * a shared page is only duplicated on its first write, so a fork costs one pointer copy per page
+ * and each child only pays for the pages it actually modifies.
+ * Each side of a fork copies a shared page before writing to it without checking if it is still shared by anyone else:
+ * Machines sharing pages can then run on different threads.
+ *
+ * The hash of each page is cached and only recomputed after the page has been written to: once hashed, a page
+ * goes back to the checked write path so its first write invalidates the cached hash.
+ **/
+class PagedMemory {
+  public:
+    static constexpr size_t PageBits = 10;
+    static constexpr size_t PageSize = 1 << PageBits; // 1 KB
+    static constexpr size_t PageMask = PageSize - 1;
+
+    PagedMemory() = default;
+    PagedMemory(size_t size) { allocate(size); }
+
+    /// Discards the current content and allocates fresh, private pages (size is rounded up to a whole number of pages).
+    void allocate(size_t size);
+
+    inline size_t size() const { return _size; }
+    inline size_t page_count() const { return _pages.size(); }
+    inline bool   empty() const { return _size == 0; }
+
+    inline word_t operator[](size_t addr) const { return _pages[addr >> PageBits][addr & PageMask]; }
+    /// Content of a page. A shared page (see fork) is copied by its next write, fill or load_state: The pointer is then outdated.
+    inline const word_t* page(size_t page) const { return _pages[page]; }
+
+    inline void write(size_t addr, word_t value) {
+        const auto page = addr >> PageBits;
+        if(!_writable[page])
+            make_writable(page);
+        _pages[page][addr & PageMask] = value;
+    }
+
+    void fill(word_t value);
+
+    /// @return The whole memory as a single block, or nullptr if some pages were copied since the last allocate (see fork).
+    /// Reflects later writes, unless the memory is forked.
+    const word_t* data() const;
+
+    /// Copies size bytes starting at addr to dst.
+    void copy_to(word_t* dst, size_t addr, size_t size) const;
+
+    /// @return A memory sharing all of its pages with this one. Both sides will copy a page on their first write to it.
+    PagedMemory fork();
+
+    /// Writes the page hashes instead of the content if the state is a digest.
+    void save_state(SaveState& state) const;
+    void load_state(SaveState& state);
+
+    /// Hash of a page content, only recomputed if the page was written to since the last call.
+    uint64_t page_hash(size_t page) const;
+
+  private:
+    using page_ref_t = std::shared_ptr<word_t[]>;
+
+    size_t                        _size = 0;
+    std::vector<word_t*>          _pages;      ///< Fast access, mirrors _owners
+    mutable std::vector<uint8_t>  _writable;   ///< False if the page is shared or has a cached hash, and must be checked before writing
+    std::vector<uint8_t>          _shared;     ///< True if the page may be shared with another memory, it is copied on its next write
+    std::vector<page_ref_t>       _owners;     ///< One reference per page, keeps it alive while it is shared
+    mutable std::vector<uint64_t> _hashes;     ///< Cached page hashes
+    mutable std::vector<uint8_t>  _hash_valid; ///< Cleared on the first write following a page_hash call
+
+    void make_writable(size_t page);
+};
@@ -0,0 +1,36 @@
+#include "ResetSnapshots.hpp"
+
+#include <memory>
+#include <unordered_map>
+
+ResetSnapshots& ResetSnapshots::of(uint64_t rom_hash) {
+    static std::mutex                                                    mutex;
+    static std::unordered_map<uint64_t, std::unique_ptr<ResetSnapshots>> games;
+    std::lock_guard<std::mutex>                                          lock(mutex);
+    auto&                                                                snapshots = games[rom_hash];
+    if(!snapshots)
+        snapshots.reset(new ResetSnapshots());
+    return *snapshots;
+}
+
+size_t ResetSnapshots::add(const SaveState& state) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _snapshots.push_back(std::make_shared<const SaveState>(state));
+    return _first_id + _snapshots.size() - 1;
+}
+
+std::shared_ptr<const SaveState> ResetSnapshots::get(size_t id) const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return id >= _first_id && id - _first_id < _snapshots.size() ? _snapshots[id - _first_id] : nullptr;
+}
+
+size_t ResetSnapshots::size() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _snapshots.size();
+}
+
+void ResetSnapshots::clear() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _first_id += _snapshots.size();
+    _snapshots.clear();
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "SaveState.hpp"
+
+/**
+ * Machine states to start episodes from (after the boot and title screens, a scripted input prefix...).
+ *
+ * Snapshots are recorded once per game and shared by every machine running it, from any thread: They are immutable
+ * and restored through read-only views, so resetting a machine neither copies the snapshot nor allocates.
+ * Users hold a reference to the snapshot while reading it: Clearing never frees a snapshot still in use.
+ **/
+class ResetSnapshots {
+  public:
+    /// Snapshots of a game (see Cartridge::get_rom_hash), kept until the end of the process.
+    static ResetSnapshots& of(uint64_t rom_hash);
+
+    /// @return Id of the new snapshot, never reused: Ids of cleared snapshots stay invalid
+    size_t add(const SaveState& state);
+    /// @return nullptr if the id is invalid. Keep it alive while reading the snapshot (see SaveState::view).
+    std::shared_ptr<const SaveState> get(size_t id) const;
+    size_t                           size() const;
+    /// Invalidates all the ids of this game.
+    void clear();
+
+  private:
+    mutable std::mutex                            _mutex;
+    std::vector<std::shared_ptr<const SaveState>> _snapshots;
+    size_t                                        _first_id = 0; ///< Of _snapshots[0], advanced by clear
+};
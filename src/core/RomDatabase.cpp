@@ -0,0 +1,98 @@
+#include "RomDatabase.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+#include "Common.hpp"
+
+namespace {
+
+bool by_crc32(const RomDatabase::Record& l, const RomDatabase::Record& r) {
+    return l.crc32 < r.crc32;
+}
+
+std::vector<RomDatabase::Record>& records() {
+    static std::vector<RomDatabase::Record> r;
+    return r;
+}
+
+bool parse_sha1(const std::string& str, Checksum::sha1_t& sha1) {
+    sha1 = {};
+    if(str == "-")
+        return true;
+    if(str.size() != 2 * sha1.size())
+        return false;
+    for(size_t i = 0; i < sha1.size(); ++i) {
+        const auto byte = str.substr(2 * i, 2);
+        if(byte.find_first_not_of("0123456789abcdefABCDEF") != std::string::npos)
+            return false;
+        sha1[i] = static_cast<uint8_t>(std::stoul(byte, nullptr, 16));
+    }
+    return true;
+}
+
+bool parse_record(const std::string& line, RomDatabase::Record& record) {
+    std::istringstream in(line);
+    std::string        sha1;
+    char               mirroring;
+    unsigned int       crc32, mapper, submapper, prg_ram, prg_nvram, chr_ram, chr_nvram, region;
+    if(!(in >> std::hex >> crc32 >> sha1 >> std::dec >> mapper >> submapper >> prg_ram >> prg_nvram >> chr_ram >> chr_nvram >> region >> mirroring))
+        return false;
+    if(!parse_sha1(sha1, record.sha1) || mapper > 4095 || submapper > 15 || region > 3 || std::max({prg_ram, prg_nvram, chr_ram, chr_nvram}) > 15)
+        return false;
+    switch(mirroring) {
+        case 'H': record.mirroring = 0; break;
+        case 'V': record.mirroring = 1; break;
+        case '4': record.mirroring = 2; break;
+        default: return false;
+    }
+    record.crc32 = crc32;
+    record.mapper = static_cast<uint16_t>(mapper);
+    record.submapper = static_cast<uint8_t>(submapper);
+    record.prg_ram_shift = static_cast<uint8_t>(prg_ram);
+    record.prg_nvram_shift = static_cast<uint8_t>(prg_nvram);
+    record.chr_ram_shift = static_cast<uint8_t>(chr_ram);
+    record.chr_nvram_shift = static_cast<uint8_t>(chr_nvram);
+    record.region = static_cast<uint8_t>(region);
+    return true;
+}
+
+} // namespace
+
+std::span<const RomDatabase::Record> RomDatabase::find(uint32_t crc32) {
+    const auto& r = records();
+    Record      key{};
+    key.crc32 = crc32;
+    const auto [first, last] = std::equal_range(r.begin(), r.end(), key, by_crc32);
+    return {first, last};
+}
+
+size_t RomDatabase::load(const std::string& path) {
+    std::ifstream file(path);
+    if(!file) {
+        Log::error("Error: ROM database '", path, "' could not be opened.");
+        return 0;
+    }
+    auto&       r = records();
+    size_t      count = 0;
+    std::string line;
+    for(size_t number = 1; std::getline(file, line); ++number) {
+        if(line.empty() || line[0] == '#' || line.find_first_not_of(" \t\r") == std::string::npos)
+            continue;
+        Record record;
+        if(!parse_record(line, record)) {
+            Log::warn("Warning: ", path, ":", number, ": Invalid ROM database record.");
+            continue;
+        }
+        r.push_back(record);
+        ++count;
+    }
+    std::stable_sort(r.begin(), r.end(), by_crc32);
+    return count;
+}
+
+size_t RomDatabase::size() {
+    return records().size();
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+#include <string>
+
+#include "Checksum.hpp"
+
+/**
+ * Cartridge descriptions of known dumps, for headers that are missing information (iNES) or wrong.
+ *
+ * Records are kept sorted by CRC-32 of the PRG and CHR ROMs (without header) and found by binary search; the SHA-1
+ * resolves CRC collisions. Sizes use the NES 2.0 encoding: 64 << shift bytes, 0 for none.
+ * No records are built in: They are loaded from text files (the frontend reads data/romdb.txt), one record per line:
+ *   crc32 sha1 mapper submapper prg_ram prg_nvram chr_ram chr_nvram region mirroring
+ * Checksums are hexadecimal ('-' for an unknown SHA-1), region is 0 (NTSC), 1 (PAL), 2 (both) or 3 (Dendy),
+ * mirroring H, V or 4 (four screens). Lines starting with '#' are comments.
+ **/
+class RomDatabase {
+  public:
+    struct Record {
+        uint32_t         crc32;
+        Checksum::sha1_t sha1; ///< All zeros if unknown
+        uint16_t         mapper;
+        uint8_t          submapper;
+        uint8_t          prg_ram_shift;
+        uint8_t          prg_nvram_shift; ///< Battery-backed
+        uint8_t          chr_ram_shift;
+        uint8_t          chr_nvram_shift;
+        uint8_t          region;
+        uint8_t          mirroring; ///< 0: Horizontal, 1: Vertical, 2: Four screens
+    };
+
+    /// Records with this CRC-32, usually one or none.
+    static std::span<const Record> find(uint32_t crc32);
+
+    /// Adds the records of a text database. Not thread safe: Meant to be called at startup, before any ROM is loaded.
+    /// @return Number of records read, invalid lines are skipped.
+    static size_t load(const std::string& path);
+
+    static size_t size();
+};
@@ -0,0 +1,410 @@
+#include "RomImage.hpp"
+
+#include <algorithm>
+#include <mutex>
+#include <cctype>
+#include <optional>
+#include <string_view>
+#include <unordered_map>
+
+#include "Hash.hpp"
+#include "Inflate.hpp"
+#include "RomDatabase.hpp"
+
+namespace {
+std::mutex                                                    cache_mutex;
+std::unordered_map<uint64_t, std::weak_ptr<const RomImage>> cache;
+std::unordered_map<uint64_t, std::weak_ptr<const RomImage>> sources; ///< By hash of the compressed file
+
+/// NES 2.0 ROM size: A count of units, or an exponent and a multiplier if the most significant nibble is $F.
+size_t nes2_rom_size(size_t lsb, size_t msb, size_t unit) {
+    if(msb != 0xF)
+        return ((msb << 8) | lsb) * unit;
+    const size_t exponent = lsb >> 2;
+    return exponent < 40 ? (size_t(1) << exponent) * ((lsb & 3) * 2 + 1) : ~size_t(0);
+}
+
+/// NES 2.0 RAM size: 64 << shift bytes, 0 for none.
+size_t ram_size(size_t shift) {
+    return shift ? size_t(64) << shift : 0;
+}
+
+bool is_ines(const uint8_t* h) {
+    return h[0] == 0x4E && h[1] == 0x45 && h[2] == 0x53 && h[3] == 0x1A;
+}
+
+/// PRG and CHR ROM sizes given by a header.
+void rom_sizes(const uint8_t* h, size_t& prg_rom_size, size_t& chr_rom_size) {
+    if((h[7] & 0x0C) == 0x08) {
+        prg_rom_size = nes2_rom_size(h[4], h[9] & 0x0F, 16384);
+        chr_rom_size = nes2_rom_size(h[5], h[9] >> 4, 8192);
+    } else {
+        prg_rom_size = 16384 * static_cast<size_t>(h[4]);
+        chr_rom_size = 8192 * static_cast<size_t>(h[5]);
+    }
+}
+
+uint16_t read16(const uint8_t* p) {
+    return static_cast<uint16_t>(p[0] | (p[1] << 8));
+}
+
+uint32_t read32(const uint8_t* p) {
+    return uint32_t(p[0]) | (uint32_t(p[1]) << 8) | (uint32_t(p[2]) << 16) | (uint32_t(p[3]) << 24);
+}
+
+/// Compressed content of a gzip file or zip archive.
+struct Compressed {
+    std::span<const uint8_t> data;
+    bool                     deflated = true; ///< Stored otherwise
+    uint32_t                 crc32 = 0;       ///< Of the decompressed content
+    size_t                   size = 0;        ///< Decompressed
+};
+
+std::string locate_gzip(std::span<const uint8_t> file, Compressed& c) {
+    const uint8_t* f = file.data();
+    const size_t   size = file.size();
+    if(size < 18 || f[2] != 8) // Deflate is the only method
+        return "is not a valid gzip file.";
+    const uint8_t flags = f[3];
+    size_t        offset = 10;
+    if((flags & 0x04) && offset + 2 <= size) // Extra field
+        offset += 2 + read16(f + offset);
+    for(uint8_t zero_terminated : {0x08, 0x10}) // Name, comment
+        if(flags & zero_terminated)
+            while(offset < size && f[offset++] != 0) {}
+    if(flags & 0x02) // Header CRC
+        offset += 2;
+    if(offset + 8 > size)
+        return "is not a valid gzip file.";
+    c.data = file.subspan(offset, size - 8 - offset);
+    c.crc32 = read32(f + size - 8);
+    c.size = read32(f + size - 4); // Modulo 4 GB
+    return {};
+}
+
+/// Finds the first .nes file of the archive in its central directory.
+std::string locate_zip(std::span<const uint8_t> file, Compressed& c) {
+    const uint8_t* f = file.data();
+    const size_t   size = file.size();
+    // End of central directory record, followed by a comment of up to 64 KB
+    size_t end = std::string::npos;
+    if(size >= 22) {
+        const size_t first = size - 22 > 0xFFFF ? size - 22 - 0xFFFF : 0;
+        for(size_t i = size - 22 + 1; i-- > first;) {
+            if(read32(f + i) == 0x06054B50) {
+                end = i;
+                break;
+            }
+        }
+    }
+    if(end == std::string::npos)
+        return "is not a valid zip archive.";
+
+    size_t offset = read32(f + end + 16);
+    for(unsigned entry = 0, count = read16(f + end + 10); entry < count; ++entry) {
+        if(offset + 46 > size || read32(f + offset) != 0x02014B50)
+            return "is not a valid zip archive.";
+        const uint8_t*   h = f + offset;
+        const size_t     name_size = read16(h + 28);
+        const size_t     next = offset + 46 + name_size + read16(h + 30) + read16(h + 32);
+        std::string_view name(reinterpret_cast<const char*>(h + 46), std::min(name_size, size - offset - 46));
+        offset = next;
+        if(name.size() < 4 || !std::equal(name.end() - 4, name.end(), ".nes", [](char a, char b) { return std::tolower(static_cast<unsigned char>(a)) == b; }))
+            continue;
+
+        const unsigned method = read16(h + 10);
+        if(read16(h + 8) & 0x01)
+            return "is encrypted.";
+        if(method != 0 && method != 8)
+            return "uses an unsupported compression method (" + std::to_string(method) + ").";
+        const size_t compressed_size = read32(h + 20);
+        const size_t local = read32(h + 42);
+        if(local + 30 > size || read32(f + local) != 0x04034B50)
+            return "is not a valid zip archive.";
+        const size_t data = local + 30 + read16(f + local + 26) + read16(f + local + 28);
+        if(data > size || compressed_size > size - data)
+            return "is truncated.";
+        c.data = file.subspan(data, compressed_size);
+        c.deflated = method == 8;
+        c.crc32 = read32(h + 16);
+        c.size = read32(h + 24);
+        return {};
+    }
+    return "contains no .nes file.";
+}
+} // namespace
+
+std::shared_ptr<const RomImage> RomImage::load(const std::string& path) {
+    MappedFile file(path);
+    if(!file.is_open()) {
+        Log::error("Error: '", path, "' could not be opened.");
+        return nullptr;
+    }
+    if(is_compressed({file.data(), file.size()}))
+        return load_compressed({file.data(), file.size()}, &file, path);
+    const auto hash = Hash::hash64(file.data(), file.size());
+    return share(
+        hash, file.size(),
+        [&] {
+            std::unique_ptr<RomImage> image(new RomImage());
+            image->_data = file.data();
+            image->_size = file.size();
+            image->_file = std::move(file);
+            return image;
+        },
+        path);
+}
+
+std::shared_ptr<const RomImage> RomImage::load_from_memory(std::span<const uint8_t> data, const std::string& name) {
+    if(is_compressed(data))
+        return load_compressed(data, nullptr, name);
+    const auto hash = Hash::hash64(data.data(), data.size());
+    return share(
+        hash, data.size(),
+        [&] {
+            std::unique_ptr<RomImage> image(new RomImage());
+            image->_copy.reset(new uint8_t[data.size()]);
+            std::memcpy(image->_copy.get(), data.data(), data.size());
+            image->_data = image->_copy.get();
+            image->_size = data.size();
+            return image;
+        },
+        name);
+}
+
+size_t RomImage::cached_count() {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    size_t                      count = 0;
+    for(const auto& [hash, image] : cache)
+        count += !image.expired();
+    return count;
+}
+
+std::shared_ptr<const RomImage> RomImage::copy() const {
+    std::shared_ptr<RomImage> image(new RomImage());
+    image->_copy.reset(new uint8_t[_size]);
+    std::memcpy(image->_copy.get(), _data, _size);
+    image->_data = image->_copy.get();
+    image->_size = _size;
+    image->_trainer_offset = _trainer_offset;
+    image->_prg_rom_offset = _prg_rom_offset;
+    image->_chr_rom_offset = _chr_rom_offset;
+    image->_prg_rom_size = _prg_rom_size;
+    image->_chr_rom_size = _chr_rom_size;
+    image->_hash = _hash;
+    image->_rom_hash = _rom_hash;
+    image->_crc32 = _crc32;
+    image->_info = _info;
+    return image;
+}
+
+std::shared_ptr<const RomImage> RomImage::share(uint64_t hash, size_t size, const std::function<std::unique_ptr<RomImage>()>& create, const std::string& name) {
+    // Outlives the lock: If this is the last reference, the deleter locks the cache.
+    std::shared_ptr<const RomImage> cached;
+    // Held while parsing too: Concurrent loads of the same game end up with a single image.
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    if(auto it = cache.find(hash); it != cache.end())
+        if(cached = it->second.lock(); cached && cached->_size == size)
+            return cached;
+
+    auto image = create();
+    if(const auto error = image->parse(); !error.empty()) {
+        Log::error("Error: '", name, "' ", error);
+        return nullptr;
+    }
+    image->_hash = hash;
+    return insert(std::move(image));
+}
+
+std::shared_ptr<const RomImage> RomImage::insert(std::unique_ptr<RomImage> image) {
+    // The last user removes the entries, unless they have already been replaced by a new image of the same content.
+    std::shared_ptr<const RomImage> shared(image.release(), [](const RomImage* ptr) {
+        {
+            std::lock_guard<std::mutex> lock(cache_mutex);
+            if(auto it = cache.find(ptr->_hash); it != cache.end() && it->second.expired())
+                cache.erase(it);
+            for(const auto source_hash : ptr->_source_hashes)
+                if(auto it = sources.find(source_hash); it != sources.end() && it->second.expired())
+                    sources.erase(it);
+        }
+        delete ptr;
+    });
+    cache[shared->_hash] = shared;
+    return shared;
+}
+
+bool RomImage::is_compressed(std::span<const uint8_t> data) {
+    return data.size() >= 4 && ((data[0] == 0x1F && data[1] == 0x8B) || (data[0] == 'P' && data[1] == 'K' && ((data[2] == 3 && data[3] == 4) || (data[2] == 5 && data[3] == 6))));
+}
+
+std::shared_ptr<const RomImage> RomImage::load_compressed(std::span<const uint8_t> source, MappedFile* file, const std::string& name) {
+    const auto source_hash = Hash::hash64(source.data(), source.size());
+    // Outlive the lock: If one is the last reference, the deleter locks the cache.
+    std::shared_ptr<const RomImage> shared, cached;
+    // Held while decompressing too: Concurrent loads of the same file decompress it once.
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    if(auto it = sources.find(source_hash); it != sources.end())
+        if(shared = it->second.lock(); shared)
+            return shared;
+
+    std::unique_ptr<RomImage> image(new RomImage());
+    auto                      error = image->extract(source, file != nullptr);
+    if(error.empty())
+        error = image->parse();
+    if(!error.empty()) {
+        Log::error("Error: '", name, "' ", error);
+        return nullptr;
+    }
+    if(file && !image->_copy) // Stored entry, used in place
+        image->_file = std::move(*file);
+    image->_hash = Hash::hash64(image->_data, image->_size);
+
+    // The same game may already be loaded, from an uncompressed file or another archive.
+    if(auto it = cache.find(image->_hash); it != cache.end())
+        if(cached = it->second.lock(); cached && cached->_size == image->_size)
+            shared = cached;
+    if(!shared)
+        shared = insert(std::move(image));
+    shared->_source_hashes.push_back(source_hash);
+    sources[source_hash] = shared;
+    return shared;
+}
+
+std::string RomImage::extract(std::span<const uint8_t> source, bool borrow) {
+    Compressed c;
+    if(auto error = source[0] == 0x1F ? locate_gzip(source, c) : locate_zip(source, c); !error.empty())
+        return error;
+
+    if(!c.deflated) {
+        if(c.data.size() != c.size || Checksum::crc32(c.data.data(), c.data.size()) != c.crc32)
+            return "is corrupted (CRC-32 mismatch).";
+        if(!borrow) {
+            _copy.reset(new uint8_t[c.data.size()]);
+            std::memcpy(_copy.get(), c.data.data(), c.data.size());
+        }
+        _data = borrow ? c.data.data() : _copy.get();
+        _size = c.data.size();
+        return {};
+    }
+
+    // The header gives the size of the image: Nothing is allocated before it is checked against the decompressed size.
+    Inflate inflate(c.data);
+    uint8_t header[HeaderSize];
+    if(inflate.read(header, 0, HeaderSize) != HeaderSize || !is_ines(header))
+        return inflate.has_failed() ? "is corrupted (invalid compressed data)." : "is not a valid iNES file (wrong header).";
+    size_t prg_rom_size, chr_rom_size;
+    rom_sizes(header, prg_rom_size, chr_rom_size);
+    const size_t trainer_size = (header[6] & 0b00000100) ? TrainerSize : 0;
+    if(prg_rom_size > c.size || chr_rom_size > c.size || HeaderSize + trainer_size + prg_rom_size + chr_rom_size > c.size)
+        return "is truncated (" + std::to_string(c.size) + "B, expected at least " + std::to_string(HeaderSize + trainer_size + prg_rom_size + chr_rom_size) + "B).";
+
+    // Anything after the CHR ROM is not decompressed.
+    const size_t size = HeaderSize + trainer_size + prg_rom_size + chr_rom_size;
+    _copy.reset(new uint8_t[size]);
+    std::memcpy(_copy.get(), header, HeaderSize);
+    if(inflate.read(_copy.get(), HeaderSize, size) != size)
+        return inflate.has_failed() ? "is corrupted (invalid compressed data)." : "is truncated.";
+    _data = _copy.get();
+    _size = size;
+    if(size == c.size && Checksum::crc32(_data, _size) != c.crc32)
+        return "is corrupted (CRC-32 mismatch).";
+    return {};
+}
+
+std::string RomImage::inspect(std::span<const uint8_t> data, Info& info, uint32_t& crc32) {
+    RomImage    image;
+    std::string error;
+    if(is_compressed(data)) {
+        error = image.extract(data, true);
+    } else {
+        image._data = data.data();
+        image._size = data.size();
+    }
+    if(error.empty())
+        error = image.parse();
+    info = image._info;
+    crc32 = image._crc32;
+    return error;
+}
+
+std::string RomImage::parse() {
+    const auto* h = _data;
+    if(_size < HeaderSize || !is_ines(h)) {
+        return "is not a valid iNES file (wrong header).";
+    }
+    rom_sizes(h, _prg_rom_size, _chr_rom_size);
+    // Banks are mapped through 8 KB PRG and 1 KB CHR pages.
+    if(_prg_rom_size == 0 || _prg_rom_size % 0x2000 != 0)
+        return "has an unsupported PRG ROM size (" + std::to_string(_prg_rom_size) + "B).";
+    if(_chr_rom_size % 0x400 != 0)
+        return "has an unsupported CHR ROM size (" + std::to_string(_chr_rom_size) + "B).";
+
+    size_t offset = HeaderSize;
+    if(h[6] & 0b00000100) {
+        _trainer_offset = offset;
+        offset += TrainerSize;
+    }
+    if(offset > _size || _prg_rom_size > _size || _chr_rom_size > _size || _size - offset < _prg_rom_size + _chr_rom_size) {
+        return "is truncated (" + std::to_string(_size) + "B, expected at least " + std::to_string(offset + _prg_rom_size + _chr_rom_size) + "B).";
+    }
+    _prg_rom_offset = offset;
+    offset += _prg_rom_size;
+    _chr_rom_offset = offset;
+
+    _rom_hash = Hash::combine(Hash::hash64(prg_rom(), _prg_rom_size), chr_rom() ? Hash::hash64(chr_rom(), _chr_rom_size) : 0);
+    _crc32 = Checksum::crc32(_data + _chr_rom_offset, _chr_rom_size, Checksum::crc32(_data + _prg_rom_offset, _prg_rom_size));
+    parse_info();
+    return {};
+}
+
+void RomImage::parse_info() {
+    const auto* h = _data;
+    _info = Info();
+    _info.nes2 = (h[7] & 0x0C) == 0x08;
+    _info.battery = h[6] & 0x02;
+    _info.mirroring = (h[6] & 0x08) ? Info::FourScreens : ((h[6] & 0x01) ? Info::Vertical : Info::Horizontal);
+    if(_info.nes2) {
+        _info.mapper = static_cast<uint16_t>((h[6] >> 4) | (h[7] & 0xF0) | ((h[8] & 0x0F) << 8));
+        _info.submapper = h[8] >> 4;
+        _info.region = static_cast<Info::Region>(h[12] & 0x03);
+        _info.prg_ram_size = ram_size(h[10] & 0x0F);
+        _info.prg_nvram_size = ram_size(h[10] >> 4);
+        _info.chr_ram_size = ram_size(h[11] & 0x0F);
+        _info.chr_nvram_size = ram_size(h[11] >> 4);
+    } else {
+        // Old dumping tools left garbage (such as "DiskDude!") in bytes 7-15: The upper mapper nibble is only trusted if 12-15 are clear.
+        const bool garbage = h[12] || h[13] || h[14] || h[15];
+        _info.mapper = static_cast<uint16_t>((h[6] >> 4) | (garbage ? 0 : (h[7] & 0xF0)));
+        _info.region = (!garbage && (h[9] & 0x01)) ? Info::PAL : Info::NTSC;
+        // 8 KB of PRG RAM is assumed if the size is 0, for compatibility. Boards with CHR RAM have 8 KB.
+        const size_t prg_ram = 8192 * std::max<size_t>(garbage ? 1 : h[8], 1);
+        (_info.battery ? _info.prg_nvram_size : _info.prg_ram_size) = prg_ram;
+        _info.chr_ram_size = _chr_rom_size ? 0 : 8192;
+    }
+
+    // Known dumps: The database wins over the header
+    std::optional<Checksum::sha1_t> sha1;
+    for(const auto& record : RomDatabase::find(_crc32)) {
+        if(record.sha1 != Checksum::sha1_t{}) {
+            if(!sha1) {
+                Checksum::Sha1 s;
+                s.update(_data + _prg_rom_offset, _prg_rom_size);
+                s.update(_data + _chr_rom_offset, _chr_rom_size);
+                sha1 = s.digest();
+            }
+            if(record.sha1 != *sha1)
+                continue;
+        }
+        _info.mapper = record.mapper;
+        _info.submapper = record.submapper;
+        _info.mirroring = static_cast<Info::Mirroring>(record.mirroring);
+        _info.region = static_cast<Info::Region>(record.region);
+        _info.prg_ram_size = ram_size(record.prg_ram_shift);
+        _info.prg_nvram_size = ram_size(record.prg_nvram_shift);
+        _info.chr_ram_size = ram_size(record.chr_ram_shift);
+        _info.chr_nvram_size = ram_size(record.chr_nvram_shift);
+        _info.battery = _info.prg_nvram_size > 0 || _info.chr_nvram_size > 0;
+        _info.from_database = true;
+        break;
+    }
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <span>
+#include <string>
+#include <vector>
+
+#include "Common.hpp"
+#include <tools/MappedFile.hpp>
+
+/**
+ * Read-only content of an iNES or NES 2.0 file.
+ *
+ * Images are cached process-wide by content hash: Every cartridge running the same game shares a single image,
+ * which is released with its last user. Files are memory-mapped rather than read.
+ * Compressed files (gzip, or the first .nes file of a zip archive, stored or deflated) are decompressed directly
+ * into the image. They are also cached by compressed content: An archive is only decompressed once per process.
+ **/
+class RomImage {
+  public:
+    static constexpr size_t HeaderSize = 16;
+    static constexpr size_t TrainerSize = 512;
+
+    /// What the cartridge is made of: From the ROM database if the dump is known (see RomDatabase), from the header
+    /// otherwise. NES 2.0 headers give exact RAM sizes, they are guessed for iNES ones.
+    struct Info {
+        enum Mirroring : uint8_t {
+            Horizontal,
+            Vertical,
+            FourScreens
+        };
+        enum Region : uint8_t {
+            NTSC,
+            PAL,
+            Multiple,
+            Dendy
+        };
+
+        uint16_t  mapper = 0;
+        uint8_t   submapper = 0;
+        Mirroring mirroring = Horizontal;
+        Region    region = NTSC;
+        bool      battery = false;
+        bool      nes2 = false; ///< NES 2.0 header
+        bool      from_database = false;
+        size_t    prg_ram_size = 0;
+        size_t    prg_nvram_size = 0; ///< Battery-backed
+        size_t    chr_ram_size = 0;
+        size_t    chr_nvram_size = 0;
+    };
+
+    /// @return nullptr if the file can't be opened or isn't a valid iNES file, compressed or not.
+    static std::shared_ptr<const RomImage> load(const std::string& path);
+    /// Data is copied, unless an identical image is already loaded. name is only used in error messages.
+    static std::shared_ptr<const RomImage> load_from_memory(std::span<const uint8_t> data, const std::string& name = "<memory>");
+
+    /// Checks an image without loading it (header, size, cartridge info and ROM CRC-32). Nothing is cached or logged.
+    /// @return The reason the image is invalid, empty if it is valid.
+    static std::string inspect(std::span<const uint8_t> data, Info& info, uint32_t& crc32);
+
+    /// Number of distinct images currently alive.
+    static size_t cached_count();
+
+    /// Private copy, not shared through the cache. Its memory is allocated and first touched by the calling thread,
+    /// which makes it local to the NUMA node of that thread.
+    std::shared_ptr<const RomImage> copy() const;
+
+    RomImage(const RomImage&) = delete;
+    RomImage& operator=(const RomImage&) = delete;
+
+    inline const word_t* header() const { return _data; }
+    /// nullptr if there's no trainer.
+    inline const byte_t* trainer() const { return _trainer_offset ? reinterpret_cast<const byte_t*>(_data + _trainer_offset) : nullptr; }
+    inline const byte_t* prg_rom() const { return reinterpret_cast<const byte_t*>(_data + _prg_rom_offset); }
+    /// nullptr if the cartridge uses CHR RAM.
+    inline const byte_t* chr_rom() const { return _chr_rom_size ? reinterpret_cast<const byte_t*>(_data + _chr_rom_offset) : nullptr; }
+    inline size_t        prg_rom_size() const { return _prg_rom_size; }
+    inline size_t        chr_rom_size() const { return _chr_rom_size; }
+    inline const Info&   info() const { return _info; }
+
+    /// Hash of the whole file, header included, once decompressed (cache key).
+    inline uint64_t get_hash() const { return _hash; }
+    /// Hash of the PRG and CHR ROMs, identifies the game independently of the file name or header.
+    inline uint64_t get_rom_hash() const { return _rom_hash; }
+    /// CRC-32 of the PRG and CHR ROMs, as listed by ROM databases.
+    inline uint32_t get_crc32() const { return _crc32; }
+
+  private:
+    RomImage() = default;
+
+    MappedFile                 _file;
+    std::unique_ptr<uint8_t[]> _copy;
+    const uint8_t*             _data = nullptr;
+    size_t                     _size = 0;
+
+    size_t   _trainer_offset = 0;
+    size_t   _prg_rom_offset = 0;
+    size_t   _chr_rom_offset = 0;
+    size_t   _prg_rom_size = 0;
+    size_t   _chr_rom_size = 0;
+    uint64_t _hash = 0;
+    uint64_t _rom_hash = 0;
+    uint32_t _crc32 = 0;
+    Info     _info;
+
+    mutable std::vector<uint64_t> _source_hashes; ///< Compressed files this image was loaded from, guarded by the cache lock
+
+    /// Checks the header and the file size, computes the offsets, the ROM hashes and the cartridge info.
+    /// @return The reason the image is invalid, empty if it is valid.
+    std::string parse();
+    void parse_info();
+    /// Decompresses a gzip file or a zip archive into the image. Stored zip entries are used in place if borrow is
+    /// true: The caller then keeps source alive as long as the image.
+    /// @return The reason the file can't be decompressed, empty on success.
+    std::string extract(std::span<const uint8_t> source, bool borrow);
+
+    static bool is_compressed(std::span<const uint8_t> data);
+    /// Cached image decompressed from this source, or decompresses it. file, if any, is the mapping of source.
+    static std::shared_ptr<const RomImage> load_compressed(std::span<const uint8_t> source, MappedFile* file, const std::string& name);
+
+    /// Caches an image. The cache lock must be held.
+    static std::shared_ptr<const RomImage> insert(std::unique_ptr<RomImage> image);
+    /// Returns the cached image with this content, or takes ownership of image and caches it (nullptr if it is invalid).
+    static std::shared_ptr<const RomImage> share(uint64_t hash, size_t size, const std::function<std::unique_ptr<RomImage>()>& create, const std::string& name);
+};
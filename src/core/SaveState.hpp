@@ -0,0 +1,100 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <vector>
+
+/**
+ * Flat binary snapshot of the machine state.
+ *
+ * Components append their state in a fixed order (see NES::save_state) and read it back in the same order.
+ * The buffer keeps its capacity between uses, so saving the same machine every frame does not allocate.
+ *
+ * A digest only stores the hash of each memory page instead of its content (see PagedMemory::save_state):
+ * it can't be loaded back, but it is much smaller and two machines in the same state produce the same digest.
+ *
+ * A view reads the content of another state without copying it, so several machines can load the same state at once.
+ *
+ * Reads never go past the end of the state: A state too short for the machine loading it is reported by complete.
+ **/
+class SaveState {
+  public:
+    SaveState(bool digest = false) : _digest(digest) {}
+
+    /// Read-only view of src, which must outlive it and stay unchanged.
+    static SaveState view(const SaveState& src) {
+        SaveState state;
+        state._view = src.data();
+        state._view_size = src.size();
+        return state;
+    }
+
+    inline bool is_digest() const { return _digest; }
+
+    inline void clear() {
+        _data.clear();
+        _view = nullptr;
+        _cursor = 0;
+        _overrun = false;
+    }
+
+    inline void rewind() {
+        _cursor = 0;
+        _overrun = false;
+    }
+
+    /// @return true if everything read since the last rewind was in the state, and the whole state was read.
+    inline bool complete() const { return !_overrun && _cursor == size(); }
+
+    /// Replaces the content with a copy of size bytes from src, for example a state saved to a file.
+    inline void assign(const void* src, size_t size) {
+        _data.assign(static_cast<const uint8_t*>(src), static_cast<const uint8_t*>(src) + size);
+        _view = nullptr;
+        _cursor = 0;
+        _overrun = false;
+    }
+
+    inline size_t         size() const { return _view ? _view_size : _data.size(); }
+    inline const uint8_t* data() const { return _view ? _view : _data.data(); }
+
+    inline void write(const void* src, size_t size) {
+        assert(!_view);
+        const auto offset = _data.size();
+        _data.resize(offset + size);
+        std::memcpy(_data.data() + offset, src, size);
+    }
+
+    /// Past the end of the state, dst is zeroed instead (see complete).
+    inline void read(void* dst, size_t size) {
+        if(size > this->size() - _cursor) {
+            std::memset(dst, 0, size);
+            _cursor = this->size();
+            _overrun = true;
+            return;
+        }
+        std::memcpy(dst, data() + _cursor, size);
+        _cursor += size;
+    }
+
+    template<typename T>
+    inline void write(const T& value) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        write(&value, sizeof(T));
+    }
+
+    template<typename T>
+    inline void read(T& value) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        read(&value, sizeof(T));
+    }
+
+  private:
+    std::vector<uint8_t> _data;
+    const uint8_t*       _view = nullptr;
+    size_t               _view_size = 0;
+    size_t               _cursor = 0;
+    bool                 _overrun = false;
+    bool                 _digest = false;
+};
@@ -0,0 +1,631 @@
+#include "WideCPU.hpp"
+
+namespace {
+
+enum class Op : uint8_t {
+    None, // Not supported in lockstep
+    LDA,
+    LDX,
+    LDY,
+    STA,
+    STX,
+    STY,
+    ADC,
+    SBC,
+    AND,
+    ORA,
+    EOR,
+    CMP,
+    CPX,
+    CPY,
+    BIT,
+    INC,
+    DEC,
+    ASL,
+    LSR,
+    ROL,
+    ROR,
+    INX,
+    INY,
+    DEX,
+    DEY,
+    TAX,
+    TAY,
+    TXA,
+    TYA,
+    TSX,
+    TXS,
+    CLC,
+    SEC,
+    CLI,
+    SEI,
+    CLD,
+    SED,
+    CLV,
+    NOP,
+    BPL,
+    BMI,
+    BVC,
+    BVS,
+    BCC,
+    BCS,
+    BNE,
+    BEQ,
+    JMP,
+    JSR,
+    RTS,
+    PHA,
+    PLA,
+    PHP,
+    PLP
+};
+
+enum class Mode : uint8_t {
+    Implied,
+    Accumulator,
+    Immediate,
+    Relative,
+    Zero,
+    ZeroX,
+    ZeroY,
+    Abs,
+    AbsX,
+    AbsY,
+    IndirectX,
+    IndirectY
+};
+
+struct Instruction {
+    Op   op = Op::None;
+    Mode mode = Mode::Implied;
+};
+
+constexpr size_t length(Mode mode) {
+    switch(mode) {
+        case Mode::Implied:
+        case Mode::Accumulator: return 1;
+        case Mode::Abs:
+        case Mode::AbsX:
+        case Mode::AbsY: return 3;
+        default: return 2;
+    }
+}
+
+// Subset of the instructions handled by CPU::execute, with the same semantics.
+constexpr std::array<Instruction, 0x100> make_decode_table() {
+    std::array<Instruction, 0x100> t{};
+    // Opcodes of the form aaabbb01: ORA, AND, EOR, ADC, STA, LDA, CMP, SBC
+    const Op group1[8] = {Op::ORA, Op::AND, Op::EOR, Op::ADC, Op::STA, Op::LDA, Op::CMP, Op::SBC};
+    for(int i = 0; i < 8; ++i) {
+        const int base = i << 5;
+        t[base + 0x01] = {group1[i], Mode::IndirectX};
+        t[base + 0x05] = {group1[i], Mode::Zero};
+        if(group1[i] != Op::STA)
+            t[base + 0x09] = {group1[i], Mode::Immediate};
+        t[base + 0x0D] = {group1[i], Mode::Abs};
+        t[base + 0x11] = {group1[i], Mode::IndirectY};
+        t[base + 0x15] = {group1[i], Mode::ZeroX};
+        t[base + 0x19] = {group1[i], Mode::AbsY};
+        t[base + 0x1D] = {group1[i], Mode::AbsX};
+    }
+    t[0xEB] = {Op::SBC, Mode::Immediate};
+    // Read-Modify-Write
+    const Op group2[8] = {Op::ASL, Op::ROL, Op::LSR, Op::ROR, Op::None, Op::None, Op::DEC, Op::INC};
+    for(int i = 0; i < 8; ++i) {
+        if(group2[i] == Op::None)
+            continue;
+        const int base = i << 5;
+        t[base + 0x06] = {group2[i], Mode::Zero};
+        t[base + 0x16] = {group2[i], Mode::ZeroX};
+        t[base + 0x0E] = {group2[i], Mode::Abs};
+        t[base + 0x1E] = {group2[i], Mode::AbsX};
+        if(i < 4)
+            t[base + 0x0A] = {group2[i], Mode::Accumulator};
+    }
+
+    t[0xA2] = {Op::LDX, Mode::Immediate};
+    t[0xA6] = {Op::LDX, Mode::Zero};
+    t[0xB6] = {Op::LDX, Mode::ZeroY};
+    t[0xAE] = {Op::LDX, Mode::Abs};
+    t[0xBE] = {Op::LDX, Mode::AbsY};
+    t[0xA0] = {Op::LDY, Mode::Immediate};
+    t[0xA4] = {Op::LDY, Mode::Zero};
+    t[0xB4] = {Op::LDY, Mode::ZeroX};
+    t[0xAC] = {Op::LDY, Mode::Abs};
+    t[0xBC] = {Op::LDY, Mode::AbsX};
+    t[0x86] = {Op::STX, Mode::Zero};
+    t[0x96] = {Op::STX, Mode::ZeroY};
+    t[0x8E] = {Op::STX, Mode::Abs};
+    t[0x84] = {Op::STY, Mode::Zero};
+    t[0x94] = {Op::STY, Mode::ZeroX};
+    t[0x8C] = {Op::STY, Mode::Abs};
+    t[0xE0] = {Op::CPX, Mode::Immediate};
+    t[0xE4] = {Op::CPX, Mode::Zero};
+    t[0xEC] = {Op::CPX, Mode::Abs};
+    t[0xC0] = {Op::CPY, Mode::Immediate};
+    t[0xC4] = {Op::CPY, Mode::Zero};
+    t[0xCC] = {Op::CPY, Mode::Abs};
+    t[0x24] = {Op::BIT, Mode::Zero};
+    t[0x2C] = {Op::BIT, Mode::Abs};
+
+    t[0xE8] = {Op::INX, Mode::Implied};
+    t[0xC8] = {Op::INY, Mode::Implied};
+    t[0xCA] = {Op::DEX, Mode::Implied};
+    t[0x88] = {Op::DEY, Mode::Implied};
+    t[0xAA] = {Op::TAX, Mode::Implied};
+    t[0xA8] = {Op::TAY, Mode::Implied};
+    t[0x8A] = {Op::TXA, Mode::Implied};
+    t[0x98] = {Op::TYA, Mode::Implied};
+    t[0xBA] = {Op::TSX, Mode::Implied};
+    t[0x9A] = {Op::TXS, Mode::Implied};
+    t[0x18] = {Op::CLC, Mode::Implied};
+    t[0x38] = {Op::SEC, Mode::Implied};
+    t[0x58] = {Op::CLI, Mode::Implied};
+    t[0x78] = {Op::SEI, Mode::Implied};
+    t[0xD8] = {Op::CLD, Mode::Implied};
+    t[0xF8] = {Op::SED, Mode::Implied};
+    t[0xB8] = {Op::CLV, Mode::Implied};
+    for(int opcode : {0xEA, 0x1A, 0x3A, 0x5A, 0x7A, 0xDA, 0xFA})
+        t[opcode] = {Op::NOP, Mode::Implied};
+
+    t[0x10] = {Op::BPL, Mode::Relative};
+    t[0x30] = {Op::BMI, Mode::Relative};
+    t[0x50] = {Op::BVC, Mode::Relative};
+    t[0x70] = {Op::BVS, Mode::Relative};
+    t[0x90] = {Op::BCC, Mode::Relative};
+    t[0xB0] = {Op::BCS, Mode::Relative};
+    t[0xD0] = {Op::BNE, Mode::Relative};
+    t[0xF0] = {Op::BEQ, Mode::Relative};
+
+    t[0x4C] = {Op::JMP, Mode::Abs};
+    t[0x20] = {Op::JSR, Mode::Abs};
+    t[0x60] = {Op::RTS, Mode::Implied};
+    t[0x48] = {Op::PHA, Mode::Implied};
+    t[0x68] = {Op::PLA, Mode::Implied};
+    t[0x08] = {Op::PHP, Mode::Implied};
+    t[0x28] = {Op::PLP, Mode::Implied};
+    return t;
+}
+
+constexpr auto DecodeTable = make_decode_table();
+
+// Reads from internal RAM and PRG ROM have no side effect.
+inline bool pure_read(addr_t addr) {
+    return addr < 0x2000 || addr >= 0x8000;
+}
+
+inline bool pure_write(addr_t addr) {
+    return addr < 0x2000;
+}
+
+inline bool is_store(Op op) {
+    return op == Op::STA || op == Op::STX || op == Op::STY;
+}
+
+inline bool is_read_modify_write(Op op) {
+    return op == Op::INC || op == Op::DEC || op == Op::ASL || op == Op::LSR || op == Op::ROL || op == Op::ROR;
+}
+
+} // namespace
+
+template<size_t Lanes>
+void WideCPU<Lanes>::run_frame() {
+    _done.fill(false);
+    size_t remaining = Lanes;
+    while(remaining > 0) {
+        if(!_loaded && remaining == Lanes && can_lockstep())
+            load();
+
+        if(_loaded) {
+            bool interrupt = false;
+            for(size_t l = 0; l < Lanes; ++l)
+                interrupt |= _lanes[l]->ppu.nmi_pending() || _lanes[l]->cpu._irq ||
+                             (!(_ps[l] & CPU::Interrupt) && (_lanes[l]->cartridge.irq() || _lanes[l]->apu.irq(_lanes[l]->cpu._total_cycles)));
+            if(!interrupt && step_wide()) {
+                ++_wide_instructions;
+                for(size_t l = 0; l < Lanes; ++l) {
+                    _lanes[l]->ppu.step(_lanes[l]->cpu._cycles);
+                    if(_lanes[l]->ppu.completed_frame) {
+                        _lanes[l]->end_frame();
+                        _done[l] = true;
+                        --remaining;
+                    }
+                }
+                if(remaining < Lanes)
+                    store();
+                continue;
+            }
+            store();
+        }
+
+        for(size_t l = 0; l < Lanes; ++l) {
+            if(_done[l])
+                continue;
+            _lanes[l]->step();
+            ++_scalar_instructions;
+            if(_lanes[l]->ppu.completed_frame) {
+                _lanes[l]->end_frame();
+                _done[l] = true;
+                --remaining;
+            }
+        }
+    }
+    if(_loaded)
+        store();
+}
+
+template<size_t Lanes>
+bool WideCPU<Lanes>::can_lockstep() const {
+    const auto pc = _lanes[0]->cpu._reg_pc;
+    for(size_t l = 0; l < Lanes; ++l) {
+        const auto& cpu = _lanes[l]->cpu;
+        if(cpu._reg_pc != pc || cpu._irq || cpu._refresh_controller || _lanes[l]->ppu.nmi_pending() || _lanes[l]->cpu.irq_pending())
+            return false;
+    }
+    return true;
+}
+
+template<size_t Lanes>
+void WideCPU<Lanes>::load() {
+    for(size_t l = 0; l < Lanes; ++l) {
+        const auto& cpu = _lanes[l]->cpu;
+        _pc[l] = cpu._reg_pc;
+        _acc[l] = cpu._reg_acc;
+        _x[l] = cpu._reg_x;
+        _y[l] = cpu._reg_y;
+        _sp[l] = cpu._reg_sp;
+        _ps[l] = cpu._reg_ps;
+    }
+    _loaded = true;
+}
+
+template<size_t Lanes>
+void WideCPU<Lanes>::store() {
+    for(size_t l = 0; l < Lanes; ++l)
+        _lanes[l]->cpu.set_state(_pc[l], _acc[l], _x[l], _y[l], _sp[l], _ps[l]);
+    _loaded = false;
+}
+
+template<size_t Lanes>
+word_t WideCPU<Lanes>::read(size_t lane, addr_t addr) const {
+    auto& cpu = _lanes[lane]->cpu;
+    if(addr < 0x2000)
+        return cpu._ram[addr % cpu.RAMSize];
+    return _lanes[lane]->cartridge.read(addr);
+}
+
+template<size_t Lanes>
+void WideCPU<Lanes>::write(size_t lane, addr_t addr, word_t value) {
+    auto& cpu = _lanes[lane]->cpu;
+    cpu._ram.write(addr % cpu.RAMSize, value);
+}
+
+template<size_t Lanes>
+void WideCPU<Lanes>::push(size_t lane, word_t value) {
+    _lanes[lane]->cpu._ram.write(0x100 + _sp[lane]--, value);
+}
+
+template<size_t Lanes>
+word_t WideCPU<Lanes>::pop(size_t lane) {
+    return _lanes[lane]->cpu._ram[0x100 + ++_sp[lane]];
+}
+
+template<size_t Lanes>
+void WideCPU<Lanes>::set_neg_zero(size_t lane, word_t value) {
+    _ps[lane] = (_ps[lane] & ~(CPU::Negative | CPU::Zero)) | (value & CPU::Negative) | (value == 0 ? CPU::Zero : 0);
+}
+
+template<size_t Lanes>
+void WideCPU<Lanes>::set_flag(size_t lane, word_t mask, bool value) {
+    _ps[lane] = value ? (_ps[lane] | mask) : (_ps[lane] & ~mask);
+}
+
+template<size_t Lanes>
+bool WideCPU<Lanes>::step_wide() {
+    const addr_t pc = _pc[0];
+    for(size_t l = 1; l < Lanes; ++l)
+        if(_pc[l] != pc)
+            return false;
+
+    // Fetch: The code must be the same for every lane (PRG banks or code in RAM may differ)
+    if(!pure_read(pc))
+        return false;
+    const word_t opcode = read(0, pc);
+    const auto   instr = DecodeTable[opcode];
+    if(instr.op == Op::None)
+        return false;
+    const auto len = length(instr.mode);
+    word_t     operands[2] = {0, 0};
+    for(size_t i = 1; i < len; ++i) {
+        if(!pure_read(pc + i))
+            return false;
+        operands[i - 1] = read(0, pc + i);
+    }
+    for(size_t l = 1; l < Lanes; ++l) {
+        if(read(l, pc) != opcode)
+            return false;
+        for(size_t i = 1; i < len; ++i)
+            if(read(l, pc + i) != operands[i - 1])
+                return false;
+    }
+
+    // Effective addresses
+    const addr_t abs = operands[0] | (operands[1] << 8);
+    lane_addr_t  addr;
+    switch(instr.mode) {
+        case Mode::Zero: addr.fill(operands[0]); break;
+        case Mode::ZeroX:
+            for(size_t l = 0; l < Lanes; ++l)
+                addr[l] = (operands[0] + _x[l]) & 0xFF;
+            break;
+        case Mode::ZeroY:
+            for(size_t l = 0; l < Lanes; ++l)
+                addr[l] = (operands[0] + _y[l]) & 0xFF;
+            break;
+        case Mode::Abs: addr.fill(abs); break;
+        case Mode::AbsX:
+            for(size_t l = 0; l < Lanes; ++l)
+                addr[l] = abs + _x[l];
+            break;
+        case Mode::AbsY:
+            for(size_t l = 0; l < Lanes; ++l)
+                addr[l] = abs + _y[l];
+            break;
+        case Mode::IndirectX:
+            for(size_t l = 0; l < Lanes; ++l)
+                addr[l] = read(l, (_x[l] + operands[0]) & 0xFF) | (read(l, (_x[l] + operands[0] + 1) & 0xFF) << 8);
+            break;
+        case Mode::IndirectY:
+            for(size_t l = 0; l < Lanes; ++l)
+                addr[l] = ((read(l, operands[0]) | (read(l, (operands[0] + 1) & 0xFF) << 8)) + _y[l]) & 0xFFFF;
+            break;
+        default: break;
+    }
+
+    // Operands
+    const bool  memory = instr.mode >= Mode::Zero;
+    lane_word_t value;
+    if(memory) {
+        const bool writes = is_store(instr.op) || is_read_modify_write(instr.op);
+        for(size_t l = 0; l < Lanes; ++l)
+            if(!pure_read(addr[l]) || (writes && !pure_write(addr[l])))
+                return false;
+        if(!is_store(instr.op))
+            for(size_t l = 0; l < Lanes; ++l)
+                value[l] = read(l, addr[l]);
+    } else if(instr.mode == Mode::Immediate) {
+        value.fill(operands[0]);
+    } else if(instr.mode == Mode::Accumulator) {
+        value = _acc;
+    }
+
+    // From here on, the instruction is committed.
+    for(size_t l = 0; l < Lanes; ++l)
+        _pc[l] = pc + len;
+
+    // Shared by the Read-Modify-Write instructions
+    auto store_result = [&](const lane_word_t& result) {
+        if(instr.mode == Mode::Accumulator)
+            _acc = result;
+        else
+            for(size_t l = 0; l < Lanes; ++l)
+                write(l, addr[l], result[l]);
+    };
+    auto branch = [&](word_t mask, bool set) {
+        const addr_t target = pc + len + from_2c_to_signed(operands[0]);
+        for(size_t l = 0; l < Lanes; ++l)
+            if(((_ps[l] & mask) != 0) == set)
+                _pc[l] = target;
+    };
+    auto compare = [&](const lane_word_t& lhs) {
+        for(size_t l = 0; l < Lanes; ++l) {
+            set_flag(l, CPU::Carry, lhs[l] >= value[l]);
+            set_neg_zero(l, lhs[l] - value[l]);
+        }
+    };
+    auto add = [&](bool subtract) {
+        for(size_t l = 0; l < Lanes; ++l) {
+            const word_t   operand = subtract ? static_cast<word_t>(~value[l]) : value[l];
+            const uint16_t sum = _acc[l] + operand + (_ps[l] & CPU::Carry);
+            set_flag(l, CPU::Carry, sum > 0xFF);
+            set_flag(l, CPU::Overflow, (~(_acc[l] ^ operand) & (_acc[l] ^ sum)) & 0x80);
+            _acc[l] = static_cast<word_t>(sum & 0xFF);
+            set_neg_zero(l, _acc[l]);
+        }
+    };
+    auto load_register = [&](lane_word_t& reg, const lane_word_t& src) {
+        reg = src;
+        for(size_t l = 0; l < Lanes; ++l)
+            set_neg_zero(l, reg[l]);
+    };
+
+    lane_word_t result;
+    switch(instr.op) {
+        case Op::LDA: load_register(_acc, value); break;
+        case Op::LDX: load_register(_x, value); break;
+        case Op::LDY: load_register(_y, value); break;
+        case Op::STA: store_result(_acc); break;
+        case Op::STX: store_result(_x); break;
+        case Op::STY: store_result(_y); break;
+        case Op::ADC: add(false); break;
+        case Op::SBC: add(true); break;
+        case Op::AND:
+            for(size_t l = 0; l < Lanes; ++l)
+                result[l] = _acc[l] & value[l];
+            load_register(_acc, result);
+            break;
+        case Op::ORA:
+            for(size_t l = 0; l < Lanes; ++l)
+                result[l] = _acc[l] | value[l];
+            load_register(_acc, result);
+            break;
+        case Op::EOR:
+            for(size_t l = 0; l < Lanes; ++l)
+                result[l] = _acc[l] ^ value[l];
+            load_register(_acc, result);
+            break;
+        case Op::CMP: compare(_acc); break;
+        case Op::CPX: compare(_x); break;
+        case Op::CPY: compare(_y); break;
+        case Op::BIT:
+            for(size_t l = 0; l < Lanes; ++l) {
+                set_flag(l, CPU::Negative, value[l] & CPU::Negative);
+                set_flag(l, CPU::Overflow, value[l] & CPU::Overflow);
+                set_flag(l, CPU::Zero, (_acc[l] & value[l]) == 0);
+            }
+            break;
+        case Op::INC:
+            for(size_t l = 0; l < Lanes; ++l) {
+                result[l] = value[l] + 1;
+                set_neg_zero(l, result[l]);
+            }
+            store_result(result);
+            break;
+        case Op::DEC:
+            for(size_t l = 0; l < Lanes; ++l) {
+                result[l] = value[l] - 1;
+                set_neg_zero(l, result[l]);
+            }
+            store_result(result);
+            break;
+        case Op::ASL:
+            for(size_t l = 0; l < Lanes; ++l) {
+                set_flag(l, CPU::Carry, value[l] & 0x80);
+                result[l] = value[l] << 1;
+                set_neg_zero(l, result[l]);
+            }
+            store_result(result);
+            break;
+        case Op::LSR:
+            for(size_t l = 0; l < Lanes; ++l) {
+                set_flag(l, CPU::Carry, value[l] & 0x01);
+                result[l] = value[l] >> 1;
+                set_neg_zero(l, result[l]);
+            }
+            store_result(result);
+            break;
+        case Op::ROL:
+            for(size_t l = 0; l < Lanes; ++l) {
+                result[l] = (value[l] << 1) | (_ps[l] & CPU::Carry);
+                set_flag(l, CPU::Carry, value[l] & 0x80);
+                set_neg_zero(l, result[l]);
+            }
+            store_result(result);
+            break;
+        case Op::ROR:
+            for(size_t l = 0; l < Lanes; ++l) {
+                result[l] = (value[l] >> 1) | ((_ps[l] & CPU::Carry) ? 0x80 : 0);
+                set_flag(l, CPU::Carry, value[l] & 0x01);
+                set_neg_zero(l, result[l]);
+            }
+            store_result(result);
+            break;
+        case Op::INX:
+            for(size_t l = 0; l < Lanes; ++l)
+                result[l] = _x[l] + 1;
+            load_register(_x, result);
+            break;
+        case Op::INY:
+            for(size_t l = 0; l < Lanes; ++l)
+                result[l] = _y[l] + 1;
+            load_register(_y, result);
+            break;
+        case Op::DEX:
+            for(size_t l = 0; l < Lanes; ++l)
+                result[l] = _x[l] - 1;
+            load_register(_x, result);
+            break;
+        case Op::DEY:
+            for(size_t l = 0; l < Lanes; ++l)
+                result[l] = _y[l] - 1;
+            load_register(_y, result);
+            break;
+        case Op::TAX: load_register(_x, _acc); break;
+        case Op::TAY: load_register(_y, _acc); break;
+        case Op::TXA: load_register(_acc, _x); break;
+        case Op::TYA: load_register(_acc, _y); break;
+        case Op::TSX: load_register(_x, _sp); break;
+        case Op::TXS: _sp = _x; break;
+        case Op::CLC:
+            for(size_t l = 0; l < Lanes; ++l)
+                _ps[l] &= ~CPU::Carry;
+            break;
+        case Op::SEC:
+            for(size_t l = 0; l < Lanes; ++l)
+                _ps[l] |= CPU::Carry;
+            break;
+        case Op::CLI:
+            for(size_t l = 0; l < Lanes; ++l)
+                _ps[l] &= ~CPU::Interrupt;
+            break;
+        case Op::SEI:
+            for(size_t l = 0; l < Lanes; ++l)
+                _ps[l] |= CPU::Interrupt;
+            break;
+        case Op::CLD:
+            for(size_t l = 0; l < Lanes; ++l)
+                _ps[l] &= ~CPU::Decimal;
+            break;
+        case Op::SED:
+            for(size_t l = 0; l < Lanes; ++l)
+                _ps[l] |= CPU::Decimal;
+            break;
+        case Op::CLV:
+            for(size_t l = 0; l < Lanes; ++l)
+                _ps[l] &= ~CPU::Overflow;
+            break;
+        case Op::NOP: break;
+        case Op::BPL: branch(CPU::Negative, false); break;
+        case Op::BMI: branch(CPU::Negative, true); break;
+        case Op::BVC: branch(CPU::Overflow, false); break;
+        case Op::BVS: branch(CPU::Overflow, true); break;
+        case Op::BCC: branch(CPU::Carry, false); break;
+        case Op::BCS: branch(CPU::Carry, true); break;
+        case Op::BNE: branch(CPU::Zero, false); break;
+        case Op::BEQ: branch(CPU::Zero, true); break;
+        case Op::JMP: _pc.fill(abs); break;
+        case Op::JSR:
+            for(size_t l = 0; l < Lanes; ++l) {
+                const addr_t ret = pc + len - 1;
+                push(l, ret >> 8);
+                push(l, ret & 0xFF);
+                _pc[l] = abs;
+            }
+            break;
+        case Op::RTS:
+            for(size_t l = 0; l < Lanes; ++l) {
+                const addr_t lo = pop(l);
+                const addr_t hi = pop(l);
+                _pc[l] = ((hi << 8) | lo) + 1;
+            }
+            break;
+        case Op::PHA:
+            for(size_t l = 0; l < Lanes; ++l)
+                push(l, _acc[l]);
+            break;
+        case Op::PHP:
+            for(size_t l = 0; l < Lanes; ++l)
+                push(l, _ps[l] | 0b00110000);
+            break;
+        case Op::PLA:
+            for(size_t l = 0; l < Lanes; ++l)
+                result[l] = pop(l);
+            load_register(_acc, result);
+            break;
+        case Op::PLP:
+            for(size_t l = 0; l < Lanes; ++l)
+                _ps[l] = pop(l);
+            break;
+        case Op::None: break;
+    }
+
+    for(size_t l = 0; l < Lanes; ++l) {
+        _lanes[l]->cpu._cycles = CPU::instr_cycles[opcode];
+        _lanes[l]->cpu._total_cycles += CPU::instr_cycles[opcode];
+        _lanes[l]->cpu.steal_dma_cycles();
+    }
+    return true;
+}
+
+template class WideCPU<8>;
+template class WideCPU<16>;
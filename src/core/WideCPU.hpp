@@ -0,0 +1,66 @@
+#pragma once
+
+#include <array>
+
+#include "NES.hpp"
+
+/**
+ * Experimental: Runs the CPUs of several machines in lockstep.
+ *
+ * Registers are kept as a structure of arrays, one lane per machine. While every lane is at the same PC (same game
+ * in similar states: title screens, common game loops...), an instruction is fetched and decoded once, then executed
+ * for all lanes by plain loops over the lanes the compiler can vectorize.
+ * RAM stays in each machine, memory operands are gathered/scattered per lane through its pages.
+ *
+ * Lanes peel off to the scalar path (NES::step) as soon as their PCs differ, an interrupt is pending, or the
+ * instruction could have side effects beyond RAM and the CPU itself (PPU/APU registers, controllers, mapper registers,
+ * unusual opcodes). PPUs are always stepped per lane.
+ **/
+template<size_t Lanes>
+class WideCPU {
+  public:
+    WideCPU(const std::array<NES*, Lanes>& lanes) : _lanes(lanes) {}
+
+    /// Runs every lane until its PPU completes a frame, same result as calling NES::run_frame on each of them.
+    void run_frame();
+
+    /// Instructions executed once for all lanes
+    inline size_t get_wide_instructions() const { return _wide_instructions; }
+    /// Instructions executed by a single lane
+    inline size_t get_scalar_instructions() const { return _scalar_instructions; }
+
+  private:
+    using lane_word_t = std::array<word_t, Lanes>;
+    using lane_addr_t = std::array<addr_t, Lanes>;
+
+    std::array<NES*, Lanes> _lanes;
+    std::array<bool, Lanes> _done;
+
+    // Registers of every lane, only valid while _loaded (the CPUs themselves are then out of date)
+    bool                _loaded = false;
+    alignas(32) lane_addr_t _pc;
+    alignas(32) lane_word_t _acc;
+    alignas(32) lane_word_t _x;
+    alignas(32) lane_word_t _y;
+    alignas(32) lane_word_t _sp;
+    alignas(32) lane_word_t _ps;
+
+    size_t _wide_instructions = 0;
+    size_t _scalar_instructions = 0;
+
+    /// All lanes are running, at the same PC, and no interrupt or controller strobe would divert them.
+    bool can_lockstep() const;
+    void load();
+    void store();
+
+    /// Executes the next instruction on all lanes.
+    /// @return false if it can't be done in lockstep, nothing has been modified.
+    bool step_wide();
+
+    inline word_t read(size_t lane, addr_t addr) const;
+    inline void   write(size_t lane, addr_t addr, word_t value);
+    inline void   push(size_t lane, word_t value);
+    inline word_t pop(size_t lane);
+    inline void   set_neg_zero(size_t lane, word_t value);
+    inline void   set_flag(size_t lane, word_t mask, bool value);
+};
@@ -0,0 +1,272 @@
+#include "RomLibrary.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+
+#include <core/Cartridge.hpp>
+#include <core/RomImage.hpp>
+#include <tools/MappedFile.hpp>
+#include <tools/ThreadPool.hpp>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+namespace fs = std::filesystem;
+
+namespace {
+constexpr const char* CacheHeader = "NESen ROM library 1";
+
+enum CacheFlags : unsigned {
+    Valid = 1,
+    Nes2 = 2,
+    Known = 4,
+};
+
+bool less_case_insensitive(const std::string& a, const std::string& b) {
+    return std::lexicographical_compare(a.begin(), a.end(), b.begin(), b.end(), [](unsigned char l, unsigned char r) { return std::tolower(l) < std::tolower(r); });
+}
+} // namespace
+
+RomLibrary::RomLibrary(const std::string& cache_path, size_t workers)
+    : _cache_path(cache_path), _workers(std::max<size_t>(workers, 1)), _snapshot(std::make_shared<const std::vector<Entry>>()) {
+#ifdef __linux__
+    _watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#endif
+    _scanner = std::thread(&RomLibrary::run, this);
+}
+
+RomLibrary::~RomLibrary() {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+    }
+    _wake.notify_one();
+    _scanner.join();
+#ifdef __linux__
+    if(_watch_fd >= 0)
+        close(_watch_fd);
+#endif
+}
+
+void RomLibrary::add_directory(const std::string& path) {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if(std::find(_directories.begin(), _directories.end(), path) == _directories.end())
+            _directories.push_back(path);
+        _scan_requested = true;
+    }
+    _wake.notify_one();
+}
+
+void RomLibrary::rescan() {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _scan_requested = true;
+    }
+    _wake.notify_one();
+}
+
+RomLibrary::snapshot_t RomLibrary::entries() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _snapshot;
+}
+
+bool RomLibrary::is_rom_file(const std::string& path) {
+    auto name = fs::path(path).filename().string();
+    std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c) { return std::tolower(c); });
+    return name.ends_with(".nes") || name.ends_with(".nes.gz") || name.ends_with(".zip");
+}
+
+void RomLibrary::run() {
+    ThreadPool pool(_workers);
+    load_cache();
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    while(!_stop) {
+        if(!_scan_requested) {
+            wait(lock);
+            continue;
+        }
+        _scan_requested = false;
+        const auto directories = _directories;
+        _scanning = true;
+        lock.unlock();
+
+        // Files are read by the pool, the scanner thread taking part as worker 0.
+        if(scan(directories, pool)) {
+            publish();
+            save_cache();
+        }
+
+        lock.lock();
+        _scanning = false;
+    }
+}
+
+bool RomLibrary::scan(const std::vector<std::string>& directories, ThreadPool& pool) {
+    // Directories are only listed: Files with the same size and modification time as in the index are not opened.
+    std::unordered_map<std::string, Entry> index;
+    std::vector<Entry>                     pending;
+    for(const auto& directory : directories) {
+        std::error_code ec;
+        if(!fs::is_directory(directory, ec))
+            continue;
+        watch(directory);
+        for(fs::recursive_directory_iterator it(directory, fs::directory_options::skip_permission_denied, ec), end; !ec && it != end; it.increment(ec)) {
+            if(it->is_directory(ec)) {
+                watch(it->path().string());
+                continue;
+            }
+            if(!it->is_regular_file(ec) || !is_rom_file(it->path().string()))
+                continue;
+            Entry entry;
+            entry.path = it->path().string();
+            entry.size = it->file_size(ec);
+            entry.mtime = static_cast<int64_t>(it->last_write_time(ec).time_since_epoch().count());
+            if(ec || index.contains(entry.path))
+                continue;
+            if(auto cached = _index.find(entry.path); cached != _index.end() && cached->second.size == entry.size && cached->second.mtime == entry.mtime)
+                index.emplace(entry.path, cached->second);
+            else
+                pending.push_back(std::move(entry));
+        }
+    }
+
+    pool.parallel_for(pending.size(), [&](size_t i, size_t) {
+        if(_stop)
+            return;
+        auto&      entry = pending[i];
+        MappedFile file(entry.path);
+        if(!file.is_open())
+            return;
+        RomImage::Info info;
+        entry.valid = RomImage::inspect({file.data(), file.size()}, info, entry.crc32).empty();
+        entry.mapper = static_cast<uint16_t>(info.mapper);
+        entry.submapper = static_cast<uint8_t>(info.submapper);
+        entry.nes2 = info.nes2;
+        entry.known = info.from_database;
+    });
+    if(_stop)
+        return false;
+
+    for(auto& entry : pending)
+        index.emplace(entry.path, std::move(entry));
+    for(auto& [path, entry] : index) {
+        entry.name = fs::path(path).stem().string();
+        if(fs::path(path).extension() == ".gz") // .nes.gz
+            entry.name = fs::path(entry.name).stem().string();
+        entry.supported = entry.valid && Cartridge::is_supported(entry.mapper);
+    }
+    _index = std::move(index);
+    return true;
+}
+
+void RomLibrary::wait(std::unique_lock<std::mutex>& lock) {
+#ifdef __linux__
+    if(_watch_fd >= 0) {
+        // The watch descriptor is only used by this thread: It is polled without holding the lock.
+        lock.unlock();
+        pollfd fd{_watch_fd, POLLIN, 0};
+        bool   events = false;
+        if(poll(&fd, 1, static_cast<int>(PollInterval.count())) > 0) {
+            // The events themselves don't matter, the directories are listed again.
+            alignas(inotify_event) char buffer[4096];
+            while(read(_watch_fd, buffer, sizeof(buffer)) > 0)
+                events = true;
+        }
+        const auto now = clock::now();
+        if(events) {
+            _changed = true;
+            _last_change = now;
+        }
+        lock.lock();
+        // Waits for the directories to settle: A copy in progress would trigger a scan per file otherwise.
+        if(_changed && now - _last_change >= SettleDelay) {
+            _changed = false;
+            _scan_requested = true;
+        }
+        return;
+    }
+#endif
+    _wake.wait(lock);
+}
+
+void RomLibrary::watch(const std::string& directory) {
+#ifdef __linux__
+    // Watching a directory again only updates the watch.
+    if(_watch_fd >= 0)
+        inotify_add_watch(_watch_fd, directory.c_str(), IN_CREATE | IN_DELETE | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF);
+#else
+    (void)directory;
+#endif
+}
+
+void RomLibrary::load_cache() {
+    if(_cache_path.empty())
+        return;
+    std::ifstream file(_cache_path);
+    std::string   line;
+    if(!std::getline(file, line) || line != CacheHeader)
+        return;
+    // size mtime crc32 mapper submapper flags path, tab separated. The path is last: It is the only field that can contain spaces.
+    while(std::getline(file, line)) {
+        std::istringstream ss(line);
+        Entry              entry;
+        unsigned           mapper, submapper, flags;
+        if(!(ss >> entry.size >> entry.mtime >> std::hex >> entry.crc32 >> std::dec >> mapper >> submapper >> flags) || ss.get() != '\t' || !std::getline(ss, entry.path))
+            continue;
+        entry.mapper = static_cast<uint16_t>(mapper);
+        entry.submapper = static_cast<uint8_t>(submapper);
+        entry.valid = flags & Valid;
+        entry.nes2 = flags & Nes2;
+        entry.known = flags & Known;
+        _index.emplace(entry.path, std::move(entry));
+    }
+}
+
+void RomLibrary::save_cache() const {
+    if(_cache_path.empty())
+        return;
+    // Written to a temporary file first: An interrupted write leaves the previous cache intact.
+    const auto temp_path = _cache_path + ".tmp";
+    {
+        std::ofstream file(temp_path, std::ios::trunc);
+        file << CacheHeader << '\n';
+        for(const auto& [path, entry] : _index) {
+            if(path.find('\n') != std::string::npos)
+                continue;
+            const unsigned flags = (entry.valid ? Valid : 0u) | (entry.nes2 ? Nes2 : 0u) | (entry.known ? Known : 0u);
+            file << entry.size << '\t' << entry.mtime << '\t' << std::hex << entry.crc32 << std::dec << '\t' << entry.mapper << '\t' << unsigned(entry.submapper) << '\t'
+                 << flags << '\t' << path << '\n';
+        }
+        if(!file.flush())
+            return;
+    }
+    std::error_code ec;
+    fs::rename(temp_path, _cache_path, ec);
+}
+
+void RomLibrary::publish() {
+    auto entries = std::make_shared<std::vector<Entry>>();
+    for(const auto& [path, entry] : _index)
+        if(entry.valid)
+            entries->push_back(entry);
+    std::sort(entries->begin(), entries->end(), [](const Entry& a, const Entry& b) {
+        if(less_case_insensitive(a.name, b.name))
+            return true;
+        if(less_case_insensitive(b.name, a.name))
+            return false;
+        return a.path < b.path;
+    });
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _snapshot = std::move(entries);
+    }
+    _generation.fetch_add(1, std::memory_order_release);
+}
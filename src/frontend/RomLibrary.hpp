@@ -0,0 +1,103 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+class ThreadPool;
+
+/**
+ * Index of the ROMs found in a set of directories, kept up to date in the background.
+ *
+ * A scanner thread walks the directories, then checks the headers and hashes new or modified files in parallel.
+ * Files already indexed with the same size and modification time are not read again, the index being saved to a
+ * cache file and reloaded on startup. On Linux, directories are watched with inotify and rescanned after changes.
+ * Readers get immutable snapshots (see entries): Nothing is scanned or read on the calling thread.
+ **/
+class RomLibrary {
+  public:
+    struct Entry {
+        std::string path;
+        std::string name;          ///< File name without directory and extension
+        uint64_t    size = 0;
+        int64_t     mtime = 0;     ///< Modification time, in file clock ticks
+        uint32_t    crc32 = 0;     ///< PRG and CHR ROMs (see RomImage::get_crc32)
+        uint16_t    mapper = 0;
+        uint8_t     submapper = 0;
+        bool        valid = false; ///< Readable iNES file, invalid ones are only kept in the cache
+        bool        nes2 = false;
+        bool        known = false;     ///< In the ROM database
+        bool        supported = false; ///< Mapper implemented by Cartridge
+    };
+    using snapshot_t = std::shared_ptr<const std::vector<Entry>>;
+
+    /// Rescans start once directories stopped changing for this long.
+    static constexpr auto SettleDelay = std::chrono::milliseconds(500);
+
+    /// @param cache_path Index cache file, none if empty.
+    /// @param workers    Threads checking the files, scanner thread included.
+    explicit RomLibrary(const std::string& cache_path = "", size_t workers = std::thread::hardware_concurrency());
+    /// Stops the scanner thread, abandoning the current scan.
+    ~RomLibrary();
+
+    RomLibrary(const RomLibrary&) = delete;
+    RomLibrary& operator=(const RomLibrary&) = delete;
+
+    /// Adds a directory, searched recursively, and scans it in the background.
+    void add_directory(const std::string& path);
+    /// Scans every directory again, in the background.
+    void rescan();
+
+    /// Valid ROMs sorted by name. Shared until the index changes: Keeping a snapshot costs nothing.
+    snapshot_t entries() const;
+    /// Incremented each time the index changes.
+    inline uint64_t generation() const { return _generation.load(std::memory_order_acquire); }
+    inline bool     scanning() const { return _scanning.load(std::memory_order_acquire); }
+
+    /// ROM files the library indexes, by extension: .nes, .nes.gz and .zip.
+    static bool is_rom_file(const std::string& path);
+
+  private:
+    using clock = std::chrono::steady_clock;
+
+    /// Period at which the scanner checks the watched directories and the stop flag.
+    static constexpr auto PollInterval = std::chrono::milliseconds(100);
+
+    std::string _cache_path;
+    size_t      _workers;
+
+    mutable std::mutex       _mutex;
+    std::condition_variable  _wake;
+    std::vector<std::string> _directories;
+    bool                     _scan_requested = false;
+    std::atomic<bool>        _stop{false}; ///< Also checked by the workers, to abandon a scan
+    snapshot_t               _snapshot;
+
+    std::atomic<uint64_t> _generation{0};
+    std::atomic<bool>     _scanning{false};
+
+    // Scanner thread only
+    std::unordered_map<std::string, Entry> _index; ///< By path, invalid files included
+    int                                    _watch_fd = -1;
+    bool                                   _changed = false; ///< The watched directories changed since the last scan
+    clock::time_point                      _last_change;
+    std::thread                            _scanner;
+
+    void run();
+    /// @return false if the scan was abandoned.
+    bool scan(const std::vector<std::string>& directories, ThreadPool& pool);
+    /// Waits for a scan request, or for the watched directories to settle after a change. Called with _mutex locked.
+    void wait(std::unique_lock<std::mutex>& lock);
+    void watch(const std::string& directory);
+
+    void load_cache();
+    void save_cache() const;
+    void publish();
+};
@@ -0,0 +1,326 @@
+/* Compressed ROMs: DEFLATE decoding, gzip files and zip archives, round trips and corrupt inputs.
+ *
+ * archive_test
+ */
+
+#include <string>
+#include <vector>
+
+#include <core/Checksum.hpp>
+#include <core/Inflate.hpp>
+#include <core/RomImage.hpp>
+
+size_t failures = 0;
+
+void check(bool condition, const char* what) {
+    if(!condition) {
+        Log::error("Failed: ", what);
+        ++failures;
+    }
+}
+
+/// Bits are written least significant first, Huffman codes most significant first (RFC 1951, 3.1.1).
+struct BitWriter {
+    std::vector<uint8_t> out;
+    unsigned             count = 0;
+
+    void bits(unsigned value, unsigned size) {
+        for(unsigned i = 0; i < size; ++i) {
+            if(count % 8 == 0)
+                out.push_back(0);
+            out.back() |= static_cast<uint8_t>(((value >> i) & 1) << (count % 8));
+            ++count;
+        }
+    }
+    void code(unsigned value, unsigned size) {
+        for(unsigned i = size; i-- > 0;)
+            bits((value >> i) & 1, 1);
+    }
+    void align() { count = static_cast<unsigned>(8 * out.size()); }
+};
+
+/// Single fixed Huffman block, greedy matches of the last occurrence of each 3 bytes prefix.
+std::vector<uint8_t> deflate_fixed(const std::vector<uint8_t>& data) {
+    constexpr uint16_t LengthBase[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+    constexpr uint8_t  LengthExtra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+    constexpr uint16_t DistanceBase[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+    constexpr uint8_t  DistanceExtra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+    BitWriter w;
+    auto      symbol = [&](unsigned s) {
+        if(s < 144)
+            w.code(0x30 + s, 8);
+        else if(s < 256)
+            w.code(0x190 + s - 144, 9);
+        else if(s < 280)
+            w.code(s - 256, 7);
+        else
+            w.code(0xC0 + s - 280, 8);
+    };
+    w.bits(1, 1); // Last block
+    w.bits(1, 2); // Fixed codes
+    std::vector<size_t> last(1 << 16, ~size_t(0));
+    for(size_t pos = 0; pos < data.size();) {
+        size_t length = 0, distance = 0;
+        if(pos + 3 <= data.size()) {
+            const size_t key = (data[pos] << 8 ^ data[pos + 1] << 4 ^ data[pos + 2]) & 0xFFFF;
+            const size_t candidate = last[key];
+            last[key] = pos;
+            if(candidate != ~size_t(0) && pos - candidate <= 32768) {
+                while(length < 258 && pos + length < data.size() && data[candidate + length] == data[pos + length])
+                    ++length;
+                distance = pos - candidate;
+            }
+        }
+        if(length < 3) {
+            symbol(data[pos++]);
+            continue;
+        }
+        unsigned l = 28;
+        while(LengthBase[l] > length)
+            --l;
+        symbol(257 + l);
+        w.bits(static_cast<unsigned>(length - LengthBase[l]), LengthExtra[l]);
+        unsigned d = 29;
+        while(DistanceBase[d] > distance)
+            --d;
+        w.code(d, 5);
+        w.bits(static_cast<unsigned>(distance - DistanceBase[d]), DistanceExtra[d]);
+        pos += length;
+    }
+    symbol(256);
+    return w.out;
+}
+
+/// Stored blocks of at most block_size bytes, followed by an empty last block.
+std::vector<uint8_t> deflate_stored(const std::vector<uint8_t>& data, size_t block_size) {
+    BitWriter w;
+    for(size_t pos = 0, size;; pos += size) {
+        size = std::min(block_size, data.size() - pos);
+        w.bits(size == 0, 1);
+        w.bits(0, 2);
+        w.align();
+        w.bits(static_cast<unsigned>(size), 16);
+        w.bits(static_cast<unsigned>(~size & 0xFFFF), 16);
+        w.out.insert(w.out.end(), data.begin() + pos, data.begin() + pos + size);
+        w.align();
+        if(size == 0)
+            return w.out;
+    }
+}
+
+std::vector<uint8_t> inflate(const std::vector<uint8_t>& compressed, size_t size, bool* finished = nullptr) {
+    std::vector<uint8_t> out(size + 1); // One more byte to check that nothing follows
+    Inflate              inflate(compressed);
+    const size_t         end = inflate.read(out.data(), 0, size);
+    if(finished)
+        *finished = end == size && inflate.read(out.data(), size, size + 1) == size && inflate.is_finished();
+    out.resize(end);
+    return out;
+}
+
+/// iNES image (mapper 0, 16 KB PRG, 8 KB CHR), with runs and repeated patterns to compress.
+std::vector<uint8_t> make_rom() {
+    std::vector<uint8_t> rom = {'N', 'E', 'S', 0x1A, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+    for(size_t i = 0; i < 0x6000; ++i)
+        rom.push_back(static_cast<uint8_t>((i & 0x100) ? 0xEA : (i % 61) * 37 + (i >> 12)));
+    return rom;
+}
+
+void put16(std::vector<uint8_t>& v, unsigned value) {
+    v.push_back(static_cast<uint8_t>(value));
+    v.push_back(static_cast<uint8_t>(value >> 8));
+}
+
+void put32(std::vector<uint8_t>& v, uint32_t value) {
+    put16(v, value & 0xFFFF);
+    put16(v, value >> 16);
+}
+
+std::vector<uint8_t> make_gzip(const std::vector<uint8_t>& data) {
+    std::vector<uint8_t> gz = {0x1F, 0x8B, 8, 0x04 | 0x08, 0, 0, 0, 0, 0, 3}; // Extra field and name
+    put16(gz, 4);
+    gz.insert(gz.end(), {'N', 'S', 0, 0});
+    for(char c : std::string("game.nes"))
+        gz.push_back(static_cast<uint8_t>(c));
+    gz.push_back(0);
+    const auto deflated = deflate_fixed(data);
+    gz.insert(gz.end(), deflated.begin(), deflated.end());
+    put32(gz, Checksum::crc32(data.data(), data.size()));
+    put32(gz, static_cast<uint32_t>(data.size()));
+    return gz;
+}
+
+struct ZipEntry {
+    std::string          name;
+    std::vector<uint8_t> data;
+    unsigned             method = 8; ///< 0: Stored, 8: Deflated
+    unsigned             flags = 0;
+};
+
+std::vector<uint8_t> make_zip(const std::vector<ZipEntry>& entries) {
+    std::vector<uint8_t> zip, directory;
+    for(const auto& e : entries) {
+        const auto     content = e.method == 8 ? deflate_fixed(e.data) : e.data;
+        const uint32_t crc = Checksum::crc32(e.data.data(), e.data.size());
+        const uint32_t offset = static_cast<uint32_t>(zip.size());
+        put32(zip, 0x04034B50);
+        for(unsigned v : {20u, e.flags, e.method, 0u, 0u})
+            put16(zip, v);
+        put32(zip, crc);
+        put32(zip, static_cast<uint32_t>(content.size()));
+        put32(zip, static_cast<uint32_t>(e.data.size()));
+        put16(zip, static_cast<unsigned>(e.name.size()));
+        put16(zip, 0);
+        zip.insert(zip.end(), e.name.begin(), e.name.end());
+        zip.insert(zip.end(), content.begin(), content.end());
+
+        put32(directory, 0x02014B50);
+        for(unsigned v : {20u, 20u, e.flags, e.method, 0u, 0u})
+            put16(directory, v);
+        put32(directory, crc);
+        put32(directory, static_cast<uint32_t>(content.size()));
+        put32(directory, static_cast<uint32_t>(e.data.size()));
+        for(unsigned v : {static_cast<unsigned>(e.name.size()), 0u, 0u, 0u, 0u})
+            put16(directory, v);
+        put32(directory, 0);
+        put32(directory, offset);
+        directory.insert(directory.end(), e.name.begin(), e.name.end());
+    }
+    const uint32_t directory_offset = static_cast<uint32_t>(zip.size());
+    zip.insert(zip.end(), directory.begin(), directory.end());
+    put32(zip, 0x06054B50);
+    for(unsigned v : {0u, 0u, static_cast<unsigned>(entries.size()), static_cast<unsigned>(entries.size())})
+        put16(zip, v);
+    put32(zip, static_cast<uint32_t>(directory.size()));
+    put32(zip, directory_offset);
+    const std::string comment = "Archive comment";
+    put16(zip, static_cast<unsigned>(comment.size()));
+    zip.insert(zip.end(), comment.begin(), comment.end());
+    return zip;
+}
+
+void test_inflate() {
+    const auto rom = make_rom();
+    bool       finished = false;
+
+    const auto fixed = deflate_fixed(rom);
+    check(fixed.size() < rom.size() / 2, "Test encoder finds matches");
+    check(inflate(fixed, rom.size(), &finished) == rom && finished, "Fixed Huffman round trip");
+
+    check(inflate(deflate_stored(rom, 1000), rom.size(), &finished) == rom && finished, "Stored blocks round trip");
+
+    // Resumed in chunks of varying sizes, back-references crossing the chunk boundaries
+    std::vector<uint8_t> out(rom.size());
+    Inflate              resumed(fixed);
+    size_t               pos = 0;
+    for(size_t chunk = 1; pos < out.size(); chunk = chunk * 3 % 1021 + 1)
+        pos = resumed.read(out.data(), pos, std::min(out.size(), pos + chunk));
+    check(out == rom && !resumed.has_failed(), "Resumed reads");
+
+    // Dynamic Huffman block, from zlib: 24 lines of "NN: The quick brown fox jumps over the lazy dog.\n"
+    const std::vector<uint8_t> dynamic = {
+        0x95, 0xd1, 0xcb, 0x11, 0x82, 0x50, 0x10, 0x05, 0xd1, 0x3d, 0x51, 0x4c, 0x04, 0xd4, 0xbb, 0x83, 0xe2, 0x27, 0x0e, 0x12, 0x40, 0x05, 0x45, 0xd1,
+        0x27, 0x08, 0xa2, 0x44, 0x0f, 0x29, 0xf4, 0xba, 0xab, 0x57, 0x27, 0x84, 0xa3, 0x15, 0xb7, 0xca, 0xba, 0xb1, 0x39, 0x3f, 0xec, 0xd4, 0xc7, 0xe9,
+        0x65, 0x75, 0xfc, 0xd9, 0x7d, 0x7c, 0xbe, 0x3f, 0x16, 0xbf, 0x55, 0x6f, 0xc3, 0x9a, 0xdb, 0x72, 0xfe, 0xdb, 0x25, 0x5e, 0xd3, 0x24, 0x88, 0x0e,
+        0x4e, 0x87, 0x8c, 0x0e, 0x1b, 0x3a, 0x6c, 0xe9, 0x90, 0xd3, 0x61, 0x47, 0x87, 0x3d, 0x1d, 0x0e, 0x70, 0x10, 0x95, 0x16, 0x95, 0x16, 0x95, 0x16,
+        0x95, 0x16, 0x95, 0x16, 0x95, 0x16, 0x95, 0x16, 0x95, 0x16, 0x95, 0x16, 0x95, 0x76, 0x2a, 0xed, 0x54, 0xda, 0xa9, 0xb4, 0x53, 0xe9, 0x05};
+    std::string text;
+    for(int i = 0; i < 24; ++i)
+        text += (i < 10 ? "0" : "") + std::to_string(i) + ": The quick brown fox jumps over the lazy dog.\n";
+    const auto decoded = inflate(dynamic, text.size(), &finished);
+    check(std::string(decoded.begin(), decoded.end()) == text && finished, "Dynamic Huffman block");
+
+    // Corrupt streams fail without reading or writing out of bounds
+    const std::vector<uint8_t> type_3 = {0x07}; // Last block, reserved type
+    Inflate                    reserved(type_3);
+    check(reserved.read(out.data(), 0, 16) == 0 && reserved.has_failed(), "Reserved block type");
+
+    auto stored = deflate_stored(rom, 1000);
+    stored[3] ^= 0x01; // Length complement
+    check(inflate(stored, rom.size()).empty(), "Stored length mismatch");
+
+    BitWriter far;
+    far.bits(1, 1);
+    far.bits(1, 2);
+    far.code(0x30 + 'A', 8);
+    far.code(257 - 256, 7); // Length 3
+    far.code(4, 5);         // Distance 5, before the start of the output
+    far.bits(0, 1);
+    far.code(0, 7);
+    Inflate too_far(far.out);
+    check(too_far.read(out.data(), 0, 16) <= 1 && too_far.has_failed(), "Distance before the start of the output");
+
+    for(size_t size : {size_t(0), size_t(1), fixed.size() / 2, fixed.size() - 1}) {
+        Inflate truncated(std::span<const uint8_t>(fixed.data(), size));
+        truncated.read(out.data(), 0, out.size());
+        check(!truncated.is_finished(), "Truncated stream");
+    }
+
+    size_t mismatches = 0;
+    for(size_t i = 0; i < 200; ++i) {
+        auto damaged = fixed;
+        damaged[(i * 7919) % damaged.size()] ^= static_cast<uint8_t>(1 << (i % 8));
+        mismatches += inflate(damaged, rom.size()) != rom;
+    }
+    check(mismatches > 0, "Damaged streams decode safely");
+}
+
+void test_archives() {
+    const auto     rom = make_rom();
+    RomImage::Info info;
+    uint32_t       crc32, rom_crc32;
+    check(RomImage::inspect(rom, info, rom_crc32).empty(), "Plain image");
+
+    auto gzip = make_gzip(rom);
+    check(RomImage::inspect(gzip, info, crc32).empty() && crc32 == rom_crc32, "gzip with extra field and name");
+    gzip[gzip.size() - 8] ^= 0xFF;
+    check(RomImage::inspect(gzip, info, crc32) == "is corrupted (CRC-32 mismatch).", "gzip CRC-32 mismatch");
+    gzip = make_gzip(rom);
+    gzip.resize(gzip.size() / 2);
+    check(!RomImage::inspect(gzip, info, crc32).empty(), "Truncated gzip");
+    gzip = make_gzip(rom);
+    gzip[2] = 0;
+    check(RomImage::inspect(gzip, info, crc32) == "is not a valid gzip file.", "gzip method other than deflate");
+
+    const std::vector<uint8_t> readme = {'R', 'E', 'A', 'D', 'M', 'E'};
+    check(RomImage::inspect(make_zip({{"readme.txt", readme, 0}, {"Game.NES", rom, 8}}), info, crc32).empty() && crc32 == rom_crc32,
+          "First .nes entry of a zip, deflated");
+    check(RomImage::inspect(make_zip({{"game.nes", rom, 0}}), info, crc32).empty() && crc32 == rom_crc32, "Stored zip entry");
+    check(RomImage::inspect(make_zip({{"readme.txt", readme, 0}}), info, crc32) == "contains no .nes file.", "zip without .nes file");
+    check(RomImage::inspect(make_zip({{"game.nes", rom, 14}}), info, crc32) == "uses an unsupported compression method (14).", "Unsupported zip method");
+    check(RomImage::inspect(make_zip({{"game.nes", rom, 8, 0x01}}), info, crc32) == "is encrypted.", "Encrypted zip entry");
+    auto zip = make_zip({{"game.nes", rom, 0}});
+    zip[14] ^= 0xFF; // Local header CRC-32 isn't used, the central directory one is
+    check(RomImage::inspect(zip, info, crc32).empty(), "Central directory is authoritative");
+    zip = make_zip({{"game.nes", rom, 0}});
+    zip.erase(zip.begin() + 100, zip.begin() + 200);
+    check(!RomImage::inspect(zip, info, crc32).empty(), "Truncated zip");
+    zip.resize(21);
+    check(RomImage::inspect(zip, info, crc32) == "is not a valid zip archive.", "zip without end of central directory");
+
+    // The same game compressed or not shares one image, released with its last user
+    const size_t before = RomImage::cached_count();
+    {
+        auto plain = RomImage::load_from_memory(rom);
+        auto from_gzip = RomImage::load_from_memory(make_gzip(rom));
+        auto from_zip = RomImage::load_from_memory(make_zip({{"game.nes", rom, 8}}));
+        check(plain && plain == from_gzip && plain == from_zip && RomImage::cached_count() == before + 1, "Compressed images share the cache");
+        plain.reset();
+        from_gzip.reset();
+        check(RomImage::load_from_memory(make_gzip(rom)) == from_zip, "Compressed file found in the cache");
+    }
+    check(RomImage::cached_count() == before, "Images released with their last user");
+}
+
+int main(int, char* argv[]) {
+    config::set_folder(argv[0]);
+    test_inflate();
+    test_archives();
+    if(failures > 0) {
+        Log::error(failures, " check(s) failed.");
+        return 1;
+    }
+    Log::success("All archive tests passed.");
+    return 0;
+}
@@ -0,0 +1,134 @@
+/* Battery saves: Save file paths, stores and reloads through the mapped file, speculative frames.
+ *
+ * battery_test
+ */
+
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <core/NES.hpp>
+
+size_t failures = 0;
+
+void check(bool condition, const char* what) {
+    if(!condition) {
+        Log::error("Failed: ", what);
+        ++failures;
+    }
+}
+
+const std::filesystem::path folder = std::filesystem::temp_directory_path() / "nesen_battery_test";
+
+/// NROM image with battery-backed PRG RAM, idling in a loop.
+std::vector<uint8_t> make_rom() {
+    std::vector<uint8_t> rom(RomImage::HeaderSize + 0x4000, 0);
+    const uint8_t        header[] = {'N', 'E', 'S', 0x1A, 1, 0, 0x02};
+    std::memcpy(rom.data(), header, sizeof(header));
+    const uint8_t program[] = {0x4C, 0x00, 0xC0}; // $C000 JMP $C000
+    std::memcpy(rom.data() + RomImage::HeaderSize, program, sizeof(program));
+    for(size_t v = 0x3FFA; v < 0x4000; v += 2) {
+        rom[RomImage::HeaderSize + v] = 0x00;
+        rom[RomImage::HeaderSize + v + 1] = 0xC0;
+    }
+    return rom;
+}
+
+/// Machine running the test ROM with its battery save at path.
+std::unique_ptr<NES> boot(const std::string& path) {
+    auto nes = std::make_unique<NES>(0x800, PPU::RenderMode::StatusOnly);
+    check(nes->load_from_memory(make_rom()), "Test ROM loads");
+    check(nes->cartridge.has_battery() && nes->cartridge.open_battery_save(path), "Battery save opens");
+    nes->power();
+    return nes;
+}
+
+word_t prg_ram(NES& nes, addr_t addr) {
+    return static_cast<word_t>(nes.cartridge.read(addr));
+}
+
+/// Byte of the save file as another process would read it.
+word_t saved(const std::string& path, size_t offset) {
+    std::ifstream file(path, std::ios::binary);
+    file.seekg(static_cast<std::streamoff>(offset));
+    return static_cast<word_t>(file.get());
+}
+
+void test_paths() {
+    check(BatterySave::path_for("roms/game.nes") == std::filesystem::path("roms/game.sav").string(), "Save of a .nes file");
+    check(BatterySave::path_for("roms/game.nes.gz") == std::filesystem::path("roms/game.sav").string(), "Save of a .nes.gz file");
+    check(BatterySave::path_for("roms/game.zip") == std::filesystem::path("roms/game.sav").string(), "Save of a .zip file");
+}
+
+void test_store() {
+    const auto path = (folder / "store.sav").string();
+    {
+        BatterySave save;
+        check(save.open(path, 0x2000), "A new save file is created");
+        check(std::filesystem::file_size(path) == 0x2000, "The save file has the size of the RAM");
+        PagedMemory ram(0x2000);
+        save.load(ram);
+        check(ram[0] == 0 && ram[0x1FFF] == 0, "A new save is empty");
+        for(size_t i = 0; i < ram.size(); i += 0x101)
+            ram.write(i, static_cast<word_t>(i * 7));
+        check(save.store(ram, true), "store");
+    }
+    BatterySave save;
+    check(save.open(path, 0x2000), "An existing save file opens");
+    PagedMemory ram(0x2000);
+    save.load(ram);
+    bool same = true;
+    for(size_t i = 0; i < ram.size(); ++i)
+        same = same && ram[i] == (i % 0x101 == 0 ? static_cast<word_t>(i * 7) : 0);
+    check(same, "A stored save is read back");
+}
+
+void test_cartridge() {
+    const auto path = (folder / "game.sav").string();
+    {
+        auto nes = boot(path);
+        check(prg_ram(*nes, 0x6000) == 0, "A new save is empty");
+        nes->cartridge.write(0x6000, 0x12);
+        nes->cartridge.write(0x7FFF, 0x34);
+        nes->run_frame();
+    }
+    {
+        auto nes = boot(path);
+        check(prg_ram(*nes, 0x6000) == 0x12 && prg_ram(*nes, 0x7FFF) == 0x34, "PRG RAM is restored from the save");
+
+        // Speculative frames are rolled back, and never reach the save
+        SaveState state;
+        nes->save_state(state);
+        nes->cartridge.set_speculative(true);
+        nes->cartridge.write(0x6000, 0x56);
+        nes->run_frame();
+        check(saved(path, 0) == 0x12, "Speculative frames aren't stored");
+        nes->load_state(state);
+        nes->cartridge.set_speculative(false);
+        check(prg_ram(*nes, 0x6000) == 0x12, "Speculative writes are rolled back");
+        nes->cartridge.write(0x6001, 0x78);
+        nes->run_frame();
+        check(saved(path, 1) == 0x78, "Writes after speculative frames are stored at the end of the frame");
+    }
+    auto nes = boot(path);
+    check(prg_ram(*nes, 0x6000) == 0x12 && prg_ram(*nes, 0x6001) == 0x78, "The save only has the non-speculative writes");
+}
+
+int main(int, char* argv[]) {
+    config::set_folder(argv[0]);
+    std::filesystem::remove_all(folder);
+    std::filesystem::create_directories(folder);
+    test_paths();
+    test_store();
+    test_cartridge();
+    std::filesystem::remove_all(folder);
+    if(failures > 0) {
+        Log::error(failures, " check(s) failed.");
+        return 1;
+    }
+    Log::success("All battery save tests passed.");
+    return 0;
+}
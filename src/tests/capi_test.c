@@ -0,0 +1,135 @@
+/* C API (libnesen), from C: Handle and cartridge checks, save states, framebuffers.
+ *
+ * capi_test
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <capi/nesen.h>
+
+static size_t failures = 0;
+
+static void check(int condition, const char* what) {
+    if(!condition) {
+        fprintf(stderr, "Failed: %s\n", what);
+        ++failures;
+    }
+}
+
+#define ROM_SIZE (16 + 0x4000)
+
+/* NROM image with CHR RAM, incrementing $10 in a loop and storing controller 1 at $11 */
+static void make_rom(uint8_t* rom) {
+    static const uint8_t header[] = {'N', 'E', 'S', 0x1A, 1, 0};
+    static const uint8_t program[] = {
+        0x78,             /* $C000 SEI         */
+        0xD8,             /*       CLD         */
+        0xA9, 0x01,       /* $C002 LDA #$01    */
+        0x8D, 0x16, 0x40, /*       STA $4016   */
+        0xA9, 0x00,       /*       LDA #$00    */
+        0x8D, 0x16, 0x40, /*       STA $4016   */
+        0xAD, 0x16, 0x40, /*       LDA $4016   */
+        0x85, 0x11,       /*       STA $11     */
+        0xE6, 0x10,       /*       INC $10     */
+        0x4C, 0x02, 0xC0, /*       JMP $C002   */
+    };
+    memset(rom, 0, ROM_SIZE);
+    memcpy(rom, header, sizeof(header));
+    memcpy(rom + 16, program, sizeof(program));
+    for(size_t v = 0x3FFA; v < 0x4000; v += 2) {
+        rom[16 + v] = 0x00;
+        rom[16 + v + 1] = 0xC0;
+    }
+}
+
+static void test_null_handle(void) {
+    uint8_t buffer[16] = {0};
+    size_t  size = 0;
+    check(nesen_load_rom(NULL, buffer, sizeof(buffer)) == NESEN_ERROR_INVALID_ARGUMENT, "nesen_load_rom checks the handle");
+    check(nesen_power(NULL) == NESEN_ERROR_INVALID_ARGUMENT && nesen_reset(NULL) == NESEN_ERROR_INVALID_ARGUMENT, "nesen_power and nesen_reset check the handle");
+    check(nesen_set_input(NULL, 0, 0) == NESEN_ERROR_INVALID_ARGUMENT, "nesen_set_input checks the handle");
+    check(nesen_run_frame(NULL) == 0 && nesen_state_size(NULL) == 0 && nesen_state_hash(NULL) == 0, "Functions returning a value return 0 without handle");
+    check(nesen_step_frames(NULL, 0, 1, NESEN_FRAME_OBSERVATION_NONE, NULL) == NESEN_ERROR_INVALID_ARGUMENT, "nesen_step_frames checks the handle");
+    check(nesen_set_reward_counter(NULL, NULL, NULL) == NESEN_ERROR_INVALID_ARGUMENT, "nesen_set_reward_counter checks the handle");
+    check(nesen_set_render_mode(NULL, NESEN_RENDER_NONE) == NESEN_ERROR_INVALID_ARGUMENT, "nesen_set_render_mode checks the handle");
+    check(nesen_set_observation(NULL, NULL, 0, 0, NESEN_OBSERVATION_LUMA) == NESEN_ERROR_INVALID_ARGUMENT, "nesen_set_observation checks the handle");
+    check(!nesen_framebuffer_rgba(NULL) && !nesen_framebuffer_indexed(NULL) && !nesen_ram(NULL, &size), "Buffers are NULL without handle");
+    check(nesen_save_state(NULL, buffer, sizeof(buffer), &size) == NESEN_ERROR_INVALID_ARGUMENT, "nesen_save_state checks the handle");
+    check(nesen_load_state(NULL, buffer, sizeof(buffer)) == NESEN_ERROR_INVALID_ARGUMENT, "nesen_load_state checks the handle");
+    nesen_destroy(NULL);
+}
+
+static void test_no_cartridge(void) {
+    nesen_t* nes = nesen_create();
+    uint8_t  buffer[16] = {0};
+    check(nes != NULL, "nesen_create");
+    check(nesen_power(nes) == NESEN_ERROR_INVALID_STATE && nesen_reset(nes) == NESEN_ERROR_INVALID_STATE, "No power or reset without cartridge");
+    check(nesen_run_frame(nes) == 0, "No frame without cartridge");
+    check(nesen_step_frames(nes, 0, 1, NESEN_FRAME_OBSERVATION_NONE, NULL) == NESEN_ERROR_INVALID_STATE, "No step without cartridge");
+    check(nesen_state_size(nes) == 0 && nesen_state_hash(nes) == 0, "No state without cartridge");
+    check(nesen_save_state(nes, buffer, sizeof(buffer), NULL) == NESEN_ERROR_INVALID_STATE, "No save state without cartridge");
+    check(nesen_load_state(nes, buffer, sizeof(buffer)) == NESEN_ERROR_INVALID_STATE, "No load state without cartridge");
+    check(nesen_set_input(nes, 0, NESEN_BUTTON_A) == NESEN_OK, "Inputs can be set before loading a ROM");
+
+    /* A failed load leaves the machine without cartridge */
+    check(nesen_load_rom(nes, buffer, sizeof(buffer)) == NESEN_ERROR_INVALID_ROM, "Invalid ROMs are rejected");
+    check(nesen_run_frame(nes) == 0 && nesen_power(nes) == NESEN_ERROR_INVALID_STATE, "No frame after a failed load");
+    nesen_destroy(nes);
+}
+
+static void test_states(void) {
+    uint8_t* rom = malloc(ROM_SIZE);
+    make_rom(rom);
+    nesen_t* nes = nesen_create();
+    check(nesen_load_rom(nes, rom, ROM_SIZE) == NESEN_OK, "ROM loads");
+    free(rom); /* The machine keeps its own copy */
+    check(nesen_set_input(nes, 2, 0) == NESEN_ERROR_INVALID_ARGUMENT, "Only 2 controllers");
+    check(nesen_set_input(nes, 0, NESEN_BUTTON_A) == NESEN_OK, "Controller 1 input");
+    check(nesen_run_frame(nes) > 0, "nesen_run_frame returns the CPU cycles");
+
+    size_t         ram_size = 0;
+    const uint8_t* ram = nesen_ram(nes, &ram_size);
+    check(ram != NULL && ram_size == 0x800 && (ram[0x11] & 1) == 1, "RAM shows the input read by the game");
+
+    const size_t size = nesen_state_size(nes);
+    check(size > 0, "nesen_state_size");
+    size_t   reported = 0;
+    uint8_t* state = malloc(size);
+    uint8_t  small[8];
+    check(nesen_save_state(nes, small, sizeof(small), &reported) == NESEN_ERROR_BUFFER_TOO_SMALL && reported == size, "Too small buffers are reported with the state size");
+    check(nesen_save_state(nes, NULL, 0, &reported) == NESEN_ERROR_BUFFER_TOO_SMALL && reported == size, "A NULL buffer queries the state size");
+    check(nesen_save_state(nes, state, size, &reported) == NESEN_OK && reported == size, "nesen_save_state");
+    const uint64_t hash = nesen_state_hash(nes);
+    const uint8_t  counter = ram[0x10];
+
+    nesen_set_input(nes, 0, 0);
+    for(int frame = 0; frame < 3; ++frame)
+        nesen_run_frame(nes);
+    check(nesen_state_hash(nes) != hash && (ram[0x11] & 1) == 0, "The machine left the saved state");
+    check(nesen_load_state(nes, state, size) == NESEN_OK, "nesen_load_state");
+    check(nesen_state_hash(nes) == hash && ram[0x10] == counter && (ram[0x11] & 1) == 1, "The saved state is restored, RAM pointer included");
+
+    check(nesen_load_state(nes, NULL, size) == NESEN_ERROR_INVALID_ARGUMENT, "NULL states are rejected");
+    check(nesen_load_state(nes, state, size - 1) == NESEN_ERROR_INVALID_STATE, "Truncated states are rejected");
+    check(nesen_state_hash(nes) == hash, "Rejected states leave the machine untouched");
+
+    check(nesen_set_render_mode(nes, NESEN_RENDER_INDEXED) == NESEN_OK && nesen_run_frame(nes) > 0, "Indexed rendering");
+    check(nesen_framebuffer_indexed(nes) != NULL, "Indexed framebuffer");
+    check(nesen_power(nes) == NESEN_OK && nesen_reset(nes) == NESEN_OK, "nesen_power and nesen_reset");
+    free(state);
+    nesen_destroy(nes);
+}
+
+int main(void) {
+    test_null_handle();
+    test_no_cartridge();
+    test_states();
+    if(failures > 0) {
+        fprintf(stderr, "%zu check(s) failed.\n", failures);
+        return 1;
+    }
+    printf("All C API tests passed.\n");
+    return 0;
+}
@@ -0,0 +1,140 @@
+/* Cheat codes: Game Genie and raw code parsing, ROM patches through the cartridge bank pointers, RAM freezes.
+ *
+ * cheat_test
+ */
+
+#include <array>
+#include <memory>
+#include <vector>
+
+#include <core/NES.hpp>
+#include <core/WideCPU.hpp>
+
+size_t failures = 0;
+
+void check(bool condition, const char* what) {
+    if(!condition) {
+        Log::error("Failed: ", what);
+        ++failures;
+    }
+}
+
+/// iNES image with distinct bytes in each PRG bank, running an infinite loop.
+std::vector<uint8_t> make_rom(int mapper, size_t prg_banks, size_t chr_banks) {
+    std::vector<uint8_t> rom(RomImage::HeaderSize + prg_banks * 0x4000 + chr_banks * 0x2000, 0);
+    rom[0] = 'N';
+    rom[1] = 'E';
+    rom[2] = 'S';
+    rom[3] = 0x1A;
+    rom[4] = static_cast<uint8_t>(prg_banks);
+    rom[5] = static_cast<uint8_t>(chr_banks);
+    rom[6] = static_cast<uint8_t>((mapper & 0x0F) << 4);
+    rom[7] = static_cast<uint8_t>(mapper & 0xF0);
+    for(size_t i = RomImage::HeaderSize; i < rom.size(); ++i)
+        rom[i] = static_cast<uint8_t>(i * 7 + (i >> 13));
+    // The last bank starts with JMP $E000, the vectors point to it
+    const size_t last = RomImage::HeaderSize + prg_banks * 0x4000 - 0x2000;
+    rom[last] = 0x4C;
+    rom[last + 1] = 0x00;
+    rom[last + 2] = 0xE0;
+    for(size_t v = 0x1FFA; v < 0x2000; v += 2) {
+        rom[last + v] = 0x00;
+        rom[last + v + 1] = 0xE0;
+    }
+    return rom;
+}
+
+void test_parse() {
+    auto sxiopo = Cheat::parse("SXIOPO");
+    check(sxiopo && sxiopo->address == 0x91D9 && sxiopo->value == 0xAD && sxiopo->compare == -1, "SXIOPO is $91D9:AD");
+    auto gossip = Cheat::parse("gossip");
+    check(gossip && gossip->address == 0xD1DD && gossip->value == 0x14, "GOSSIP (lowercase) is $D1DD:14");
+    auto yeuzugaa = Cheat::parse("YEUZ-UGAA");
+    check(yeuzugaa && yeuzugaa->address == 0xACB3 && yeuzugaa->value == 0x07 && yeuzugaa->compare == 0x00, "YEUZUGAA is $ACB3:07 if $00");
+
+    auto ram = Cheat::parse("0075:09");
+    check(ram && ram->address == 0x0075 && ram->value == 0x09 && ram->compare == -1 && !ram->patches_rom(), "0075:09 freezes RAM");
+    auto prg_ram = Cheat::parse("6010:ff");
+    check(prg_ram && prg_ram->address == 0x6010 && !prg_ram->patches_rom(), "6010:FF freezes PRG RAM");
+    auto rom = Cheat::parse("C123:AA:0F");
+    check(rom && rom->address == 0xC123 && rom->value == 0x0F && rom->compare == 0xAA && rom->patches_rom(), "C123:AA:0F patches ROM with a compare value");
+
+    check(!Cheat::parse("2002:00") && !Cheat::parse("4016:01") && !Cheat::parse("5FFF:00"), "Registers ($2000-$5FFF) are rejected");
+    check(!Cheat::parse("12345:00") && !Cheat::parse("0000:100") && !Cheat::parse("0000:") && !Cheat::parse("0:1:2:3"), "Malformed raw codes are rejected");
+    check(!Cheat::parse("SXIOP") && !Cheat::parse("SXIOPQ") && !Cheat::parse("SXIOPOAAA") && !Cheat::parse(""), "Malformed Game Genie codes are rejected");
+}
+
+void test_rom_patches() {
+    const auto rom = make_rom(4, 8, 8); // MMC3, 16 8 KB PRG banks
+    auto       prg = [&](size_t bank, addr_t offset) { return rom[RomImage::HeaderSize + bank * 0x2000 + offset]; };
+    auto       read = [](NES& nes, addr_t addr) { return static_cast<word_t>(nes.cpu.read(addr)); };
+    auto       select = [](NES& nes, word_t reg, word_t bank) {
+        nes.cartridge.write(0x8000, reg);
+        nes.cartridge.write(0x8001, bank);
+    };
+
+    NES nes;
+    check(nes.load_from_memory(rom), "MMC3 test ROM loads");
+    nes.power();
+    select(nes, 6, 2); // Bank 2 at $8000
+    select(nes, 7, 5); // Bank 5 at $A000
+
+    const Cheat always{0x8010, 0x42, -1};
+    const Cheat bank_5{0xA020, 0x43, static_cast<int16_t>(prg(5, 0x20))};
+    const Cheat freeze{0x0300, 0x77, -1};
+    nes.set_cheats({always, bank_5, freeze});
+    check(read(nes, 0x8010) == 0x42 && read(nes, 0x8011) == prg(2, 0x11), "Patch applies to its address only");
+    check(read(nes, 0xA020) == 0x43, "Patch applies to the bank holding the compare value");
+    check(read(nes, 0xE000) == prg(15, 0), "Pages without patches are untouched");
+    check(read(nes, 0x0300) == 0x77, "RAM freeze is written right away");
+
+    select(nes, 7, 3);
+    check(prg(3, 0x20) == bank_5.compare || read(nes, 0xA020) == prg(3, 0x20), "Patch doesn't apply to other banks");
+    select(nes, 7, 5);
+    check(read(nes, 0xA020) == 0x43, "Patch applies again once its bank is mapped back");
+
+    // PRG mode 1 swaps $8000 and $C000: Patches follow CPU addresses, not banks
+    nes.cartridge.write(0x8000, 0x46);
+    check(read(nes, 0xC010) == prg(2, 0x10) && read(nes, 0x8010) == 0x42, "Patches are per CPU address");
+    nes.cartridge.write(0x8000, 0x06);
+
+    nes.cpu.write(0x0300, 0x01);
+    nes.run_frame();
+    check(read(nes, 0x0300) == 0x77, "RAM freeze is written after each frame");
+
+    auto child = nes.fork();
+    child->cpu.write(0x0300, 0x02);
+    child->run_frame();
+    check(read(*child, 0x8010) == 0x42 && read(*child, 0x0300) == 0x77, "Forks keep the cheats");
+    child.reset();
+    check(read(nes, 0x8010) == 0x42, "Patched pages outlive forks");
+
+    // Lanes of a WideCPU complete their frames through NES::end_frame as well
+    std::vector<std::unique_ptr<NES>> lanes;
+    std::array<NES*, 8>               lane_ptrs;
+    for(size_t l = 0; l < lane_ptrs.size(); ++l) {
+        lanes.push_back(nes.fork());
+        lanes.back()->cpu.write(0x0300, static_cast<word_t>(l));
+        lane_ptrs[l] = lanes.back().get();
+    }
+    WideCPU<8>(lane_ptrs).run_frame();
+    bool frozen = true;
+    for(auto& lane : lanes)
+        frozen = frozen && read(*lane, 0x0300) == 0x77;
+    check(frozen, "RAM freeze is written after each lockstep frame");
+
+    nes.set_cheats({});
+    check(read(nes, 0x8010) == prg(2, 0x10) && read(nes, 0xA020) == prg(5, 0x20), "Removing cheats restores the ROM");
+}
+
+int main(int, char* argv[]) {
+    config::set_folder(argv[0]);
+    test_parse();
+    test_rom_patches();
+    if(failures > 0) {
+        Log::error(failures, " check(s) failed.");
+        return 1;
+    }
+    Log::success("All cheat tests passed.");
+    return 0;
+}
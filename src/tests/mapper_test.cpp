@@ -0,0 +1,277 @@
+/* Mappers: Bank switching and mirroring of UxROM, CNROM, AxROM, GxROM, MMC1 (SUROM, SXROM) and MMC3, MMC3 scanline IRQs.
+ *
+ * mapper_test
+ */
+
+#include <vector>
+
+#include <core/NES.hpp>
+
+size_t failures = 0;
+
+void check(bool condition, const char* what) {
+    if(!condition) {
+        Log::error("Failed: ", what);
+        ++failures;
+    }
+}
+
+/// iNES image whose 8 KB PRG banks and 1 KB CHR banks start with their index, without CHR ROM if chr_banks is 0.
+/// Every PRG bank ends with an infinite loop and the vectors pointing to it, whatever is mapped at $E000.
+/// A NES 2.0 header is used if prg_ram_shift is not 0, for PRG RAM sizes other than 8 KB.
+std::vector<uint8_t> make_rom(int mapper, size_t prg_banks, size_t chr_banks, uint8_t prg_ram_shift = 0) {
+    std::vector<uint8_t> rom(RomImage::HeaderSize + prg_banks * 0x4000 + chr_banks * 0x2000, 0);
+    rom[0] = 'N';
+    rom[1] = 'E';
+    rom[2] = 'S';
+    rom[3] = 0x1A;
+    rom[4] = static_cast<uint8_t>(prg_banks);
+    rom[5] = static_cast<uint8_t>(chr_banks);
+    rom[6] = static_cast<uint8_t>((mapper & 0x0F) << 4);
+    rom[7] = static_cast<uint8_t>((mapper & 0xF0) | (prg_ram_shift ? 0x08 : 0));
+    rom[10] = prg_ram_shift;
+    for(size_t bank = 0; bank < 2 * prg_banks; ++bank) {
+        uint8_t* prg = rom.data() + RomImage::HeaderSize + bank * 0x2000;
+        prg[0] = static_cast<uint8_t>(bank);
+        prg[0x1F00] = 0x4C; // JMP $FF00
+        prg[0x1F01] = 0x00;
+        prg[0x1F02] = 0xFF;
+        for(size_t v = 0x1FFA; v < 0x2000; v += 2) {
+            prg[v] = 0x00;
+            prg[v + 1] = 0xFF;
+        }
+    }
+    for(size_t bank = 0; bank < 8 * chr_banks; ++bank)
+        rom[RomImage::HeaderSize + prg_banks * 0x4000 + bank * 0x400] = static_cast<uint8_t>(bank);
+    return rom;
+}
+
+word_t prg(NES& nes, addr_t addr) {
+    return static_cast<word_t>(nes.cartridge.read(addr));
+}
+
+word_t chr(NES& nes, addr_t addr) {
+    return static_cast<word_t>(nes.cartridge.read_chr(addr));
+}
+
+/// MMC1 serial port: 5 writes, least significant bit first.
+void mmc1(NES& nes, addr_t addr, word_t value) {
+    for(size_t i = 0; i < 5; ++i)
+        nes.cartridge.write(addr, (value >> i) & 1);
+}
+
+void test_discrete() {
+    NES nes;
+    check(nes.load_from_memory(make_rom(2, 8, 0)), "UxROM loads");
+    check(prg(nes, 0x8000) == 0 && prg(nes, 0xC000) == 14 && prg(nes, 0xE000) == 15, "UxROM power-on banks");
+    nes.cartridge.write(0x8000, 3);
+    check(prg(nes, 0x8000) == 6 && prg(nes, 0xA000) == 7 && prg(nes, 0xC000) == 14, "UxROM switches $8000, $C000 is fixed");
+    nes.cartridge.write_chr(0x1234, 0x5A);
+    check(chr(nes, 0x1234) == 0x5A, "UxROM CHR RAM");
+
+    check(nes.load_from_memory(make_rom(3, 2, 4)), "CNROM loads");
+    nes.cartridge.write(0x8000, 2);
+    check(chr(nes, 0x0000) == 16 && chr(nes, 0x1C00) == 23 && prg(nes, 0x8000) == 0 && prg(nes, 0xC000) == 2, "CNROM switches 8 KB of CHR");
+    nes.cartridge.write_chr(0x0000, 0x5A);
+    check(chr(nes, 0x0000) == 16, "CNROM CHR ROM is read only");
+
+    check(nes.load_from_memory(make_rom(7, 16, 0)), "AxROM loads");
+    nes.cartridge.write(0x8000, 0x13);
+    check(prg(nes, 0x8000) == 12 && prg(nes, 0xE000) == 15, "AxROM switches 32 KB of PRG");
+    check(nes.cartridge.get_mirroring() == Cartridge::SingleScreenUpper && nes.cartridge.nametable(0x2000) == 0x2400 && nes.cartridge.nametable(0x2C00) == 0x2400,
+          "AxROM upper nametable");
+    nes.cartridge.write(0x8000, 0x02);
+    check(prg(nes, 0x8000) == 8 && nes.cartridge.nametable(0x2400) == 0x2000 && nes.cartridge.nametable(0x2C00) == 0x2000, "AxROM lower nametable");
+
+    check(nes.load_from_memory(make_rom(66, 8, 4)), "GxROM loads");
+    nes.cartridge.write(0x8000, 0x21);
+    check(prg(nes, 0x8000) == 8 && prg(nes, 0xE000) == 11 && chr(nes, 0x0000) == 8 && chr(nes, 0x1C00) == 15, "GxROM switches PRG and CHR");
+}
+
+void test_mmc1() {
+    NES nes;
+    check(nes.load_from_memory(make_rom(1, 16, 16)), "MMC1 loads");
+    check(prg(nes, 0x8000) == 0 && prg(nes, 0xC000) == 30, "MMC1 powers on with the last bank fixed at $C000");
+
+    mmc1(nes, 0xE000, 5);
+    check(prg(nes, 0x8000) == 10 && prg(nes, 0xA000) == 11 && prg(nes, 0xC000) == 30, "MMC1 PRG mode 3");
+    mmc1(nes, 0x8000, 0x08);
+    check(prg(nes, 0x8000) == 0 && prg(nes, 0xC000) == 10, "MMC1 PRG mode 2: First bank fixed at $8000");
+    mmc1(nes, 0x8000, 0x00);
+    check(prg(nes, 0x8000) == 8 && prg(nes, 0xC000) == 10 && prg(nes, 0xE000) == 11, "MMC1 PRG mode 0: 32 KB, ignoring the lowest bit");
+
+    mmc1(nes, 0xA000, 5);
+    mmc1(nes, 0xC000, 9);
+    check(chr(nes, 0x0000) == 16 && chr(nes, 0x1000) == 20, "MMC1 8 KB CHR mode ignores the lowest bit and CHR bank 1");
+    mmc1(nes, 0x8000, 0x10);
+    check(chr(nes, 0x0000) == 20 && chr(nes, 0x1000) == 36, "MMC1 4 KB CHR mode");
+
+    const Cartridge::Mirroring mirrorings[4] = {Cartridge::SingleScreenLower, Cartridge::SingleScreenUpper, Cartridge::Vertical, Cartridge::Horizontal};
+    bool                       mirroring = true;
+    for(word_t m = 0; m < 4; ++m) {
+        mmc1(nes, 0x8000, 0x10 | m);
+        mirroring = mirroring && nes.cartridge.get_mirroring() == mirrorings[m];
+    }
+    check(mirroring && nes.cartridge.nametable(0x2400) == 0x2000 && nes.cartridge.nametable(0x2800) == 0x2400, "MMC1 mirroring");
+
+    nes.cartridge.write(0x8000, 0x01);
+    nes.cartridge.write(0x8000, 0x00);
+    nes.cartridge.write(0xA000, 0x80);
+    check(prg(nes, 0x8000) == 10 && prg(nes, 0xC000) == 30, "MMC1 reset bit clears the shift register and sets PRG mode 3");
+
+    // Read-modify-write instructions write twice on consecutive cycles: Only the first write counts
+    nes.cartridge.write(0xE000, 0x01);
+    nes.cartridge.write_rmw(0xE000, 0x80, 0x01);
+    mmc1(nes, 0xE000, 7);
+    check(prg(nes, 0x8000) == 14, "MMC1 ignores the second write of a read-modify-write");
+
+    nes.cartridge.write(0x6000, 0x55);
+    mmc1(nes, 0xE000, 0x17);
+    nes.cartridge.write(0x6000, 0xAA);
+    check(prg(nes, 0x6000) == 0x55 && prg(nes, 0x8000) == 14, "MMC1 PRG RAM write protection");
+
+    // Loading another game starts from the power-on registers, even without powering the cartridge
+    mmc1(nes, 0x8000, 0x02);
+    mmc1(nes, 0xE000, 4);
+    check(prg(nes, 0x8000) == 8 && nes.cartridge.get_mirroring() == Cartridge::Vertical, "MMC1 32 KB mode on bank 2");
+    check(nes.load_from_memory(make_rom(1, 8, 16)), "Another MMC1 game loads");
+    nes.reset();
+    check(prg(nes, 0x8000) == 0 && prg(nes, 0xC000) == 14 && nes.cartridge.get_mirroring() == Cartridge::Horizontal, "Mapper registers are cleared on load");
+    nes.cartridge.write(0x6000, 0x66);
+    check(prg(nes, 0x6000) == 0x66, "PRG RAM is writable after a load");
+}
+
+void test_mmc1_boards() {
+    // SUROM: 512 KB of PRG ROM, the CHR bank 0 register selects the 256 KB half
+    NES nes;
+    check(nes.load_from_memory(make_rom(1, 32, 0)), "SUROM loads");
+    check(prg(nes, 0x8000) == 0 && prg(nes, 0xC000) == 30, "SUROM powers on in the first half");
+    mmc1(nes, 0xE000, 2);
+    mmc1(nes, 0xA000, 0x10);
+    check(prg(nes, 0x8000) == 36 && prg(nes, 0xC000) == 62, "SUROM second half, the last bank of the half is fixed");
+    mmc1(nes, 0x8000, 0x08);
+    check(prg(nes, 0x8000) == 32 && prg(nes, 0xC000) == 36, "SUROM mode 2 fixes the first bank of the half");
+    mmc1(nes, 0xA000, 0x00);
+    check(prg(nes, 0x8000) == 0 && prg(nes, 0xC000) == 4, "SUROM back to the first half");
+
+    // SXROM: 32 KB of PRG RAM, banked by the CHR bank 0 register
+    check(nes.load_from_memory(make_rom(1, 16, 0, 9)), "SXROM loads");
+    for(word_t bank = 0; bank < 4; ++bank) {
+        mmc1(nes, 0xA000, static_cast<word_t>(bank << 2));
+        nes.cartridge.write(0x6000, static_cast<word_t>(0x10 + bank));
+        nes.cartridge.write(0x7FFF, static_cast<word_t>(0x20 + bank));
+    }
+    bool banked = true;
+    for(word_t bank = 0; bank < 4; ++bank) {
+        mmc1(nes, 0xA000, static_cast<word_t>(bank << 2));
+        banked = banked && prg(nes, 0x6000) == 0x10 + bank && prg(nes, 0x7FFF) == 0x20 + bank;
+    }
+    check(banked, "SXROM PRG RAM banks");
+
+    // PRG RAM smaller than 8 KB is mirrored
+    check(nes.load_from_memory(make_rom(0, 1, 1, 5)), "2 KB PRG RAM board loads");
+    nes.cartridge.write(0x6001, 0x77);
+    check(prg(nes, 0x6801) == 0x77 && prg(nes, 0x7801) == 0x77, "2 KB PRG RAM is mirrored");
+}
+
+void test_mmc3() {
+    NES nes;
+    auto select = [&](word_t reg, word_t bank) {
+        nes.cartridge.write(0x8000, reg);
+        nes.cartridge.write(0x8001, bank);
+    };
+    check(nes.load_from_memory(make_rom(4, 16, 32)), "MMC3 loads");
+    nes.power();
+    check(prg(nes, 0x8000) == 0 && prg(nes, 0xA000) == 0 && prg(nes, 0xC000) == 30 && prg(nes, 0xE000) == 31, "MMC3 power-on banks");
+    select(6, 4);
+    select(7, 5);
+    check(prg(nes, 0x8000) == 4 && prg(nes, 0xA000) == 5 && prg(nes, 0xC000) == 30, "MMC3 PRG mode 0");
+    nes.cartridge.write(0x8000, 0x40);
+    check(prg(nes, 0x8000) == 30 && prg(nes, 0xA000) == 5 && prg(nes, 0xC000) == 4 && prg(nes, 0xE000) == 31, "MMC3 PRG mode 1 swaps $8000 and $C000");
+
+    select(0, 9);
+    select(1, 12);
+    select(2, 20);
+    select(5, 200);
+    check(chr(nes, 0x0000) == 8 && chr(nes, 0x0400) == 9 && chr(nes, 0x0800) == 12 && chr(nes, 0x1000) == 20 && chr(nes, 0x1C00) == 200,
+          "MMC3 2 KB and 1 KB CHR banks");
+    nes.cartridge.write(0x8000, 0x80);
+    check(chr(nes, 0x1000) == 8 && chr(nes, 0x1800) == 12 && chr(nes, 0x0000) == 20 && chr(nes, 0x0C00) == 200, "MMC3 CHR A12 inversion");
+
+    nes.cartridge.write(0xA000, 0);
+    check(nes.cartridge.get_mirroring() == Cartridge::Vertical, "MMC3 vertical mirroring");
+    nes.cartridge.write(0xA000, 1);
+    check(nes.cartridge.get_mirroring() == Cartridge::Horizontal, "MMC3 horizontal mirroring");
+
+    nes.cartridge.write(0xA001, 0x80);
+    nes.cartridge.write(0x6000, 0x55);
+    nes.cartridge.write(0xA001, 0xC0);
+    nes.cartridge.write(0x6000, 0xAA);
+    check(prg(nes, 0x6000) == 0x55, "MMC3 PRG RAM write protection");
+}
+
+/// IRQs raised by the MMC3 over the frame following a counter reload, with the CPU cycles between them.
+/// The CPU never acknowledges them (interrupts stay disabled), the test does it through the mapper registers.
+size_t count_irqs(NES& nes, word_t ppu_control, word_t latch, std::vector<uint64_t>& periods) {
+    nes.cpu.write(0x2000, ppu_control);
+    nes.run_frame();
+    nes.cartridge.write(0xE000, 0); // Acknowledges the IRQs of the previous frame
+    nes.cartridge.write(0xC000, latch);
+    nes.cartridge.write(0xC001, 0);
+    nes.cartridge.write(0xE001, 0);
+    size_t   irqs = 0;
+    uint64_t last = 0;
+    periods.clear();
+    do {
+        nes.step();
+        if(nes.cartridge.irq()) {
+            if(irqs++ > 0)
+                periods.push_back(nes.cpu.get_total_cycles() - last);
+            last = nes.cpu.get_total_cycles();
+            nes.cartridge.write(0xE000, 0);
+            nes.cartridge.write(0xE001, 0);
+        }
+    } while(!nes.ppu.completed_frame);
+    return irqs;
+}
+
+void test_mmc3_irq() {
+    NES nes(0x800, PPU::RenderMode::StatusOnly);
+    check(nes.load_from_memory(make_rom(4, 16, 32)), "MMC3 loads");
+    nes.power();
+    nes.run_frame();
+    nes.run_frame();
+
+    std::vector<uint64_t> periods;
+    check(count_irqs(nes, 0x08, 20, periods) == 0, "No scanline IRQs while rendering is disabled");
+
+    // A12 rises once per rendered line, whichever pattern table is at $1000. The counter is reloaded on the pre-render line,
+    // then the IRQ fires every latch + 1 lines: 11 times before the next VBlank for a latch of 20.
+    nes.cpu.write(0x2001, 0x18);
+    const uint64_t period = 21 * 341 / 3; // 21 lines of 341 dots, in CPU cycles
+    for(word_t ppu_control : {word_t(0x08), word_t(0x10)}) {
+        const size_t irqs = count_irqs(nes, ppu_control, 20, periods);
+        bool         regular = !periods.empty();
+        for(auto p : periods)
+            regular = regular && p + 8 >= period && p <= period + 8;
+        check(irqs == 11, ppu_control == 0x08 ? "MMC3 IRQ count, sprites at $1000" : "MMC3 IRQ count, background at $1000");
+        check(regular, ppu_control == 0x08 ? "MMC3 IRQ every 21 lines, sprites at $1000" : "MMC3 IRQ every 21 lines, background at $1000");
+    }
+
+    check(count_irqs(nes, 0x08, 0, periods) == 241, "A latch of 0 fires on every line");
+}
+
+int main(int, char* argv[]) {
+    config::set_folder(argv[0]);
+    test_discrete();
+    test_mmc1();
+    test_mmc1_boards();
+    test_mmc3();
+    test_mmc3_irq();
+    if(failures > 0) {
+        Log::error(failures, " check(s) failed.");
+        return 1;
+    }
+    Log::success("All mapper tests passed.");
+    return 0;
+}
@@ -0,0 +1,105 @@
+/* Replays a movie headless at maximum speed, for benchmarking and regression testing.
+ *
+ * movie_replay <rom> $movie <file> [$expect <state hash>] [-render] [-determinism]
+ *   $movie        NESen movie, or FCEUX movie (.fm2) streamed from disk
+ *   -render       Rasterize every frame (default: status only)
+ *   $expect       Fails if the final machine state hash differs
+ *   -determinism  Replays the movie a second time and fails on the first frame whose state hash differs
+ */
+
+#include <chrono>
+#include <iomanip>
+#include <sstream>
+
+#include <core/FM2.hpp>
+#include <core/Movie.hpp>
+#include <tools/CommandLine.hpp>
+
+int main(int argc, char* argv[]) {
+    config::set_folder(argv[0]);
+
+    const char* rom_path = get_file(argc, argv);
+    const char* movie_path = get_option(argc, argv, "$movie");
+    if(!rom_path || !movie_path) {
+        Log::error("Usage: movie_replay <rom> $movie <file> [$expect <state hash>] [-render] [-determinism]");
+        return 1;
+    }
+
+    NES nes;
+    if(!nes.load(rom_path)) {
+        Log::error("Error loading '", rom_path, "'. Exiting...");
+        return 1;
+    }
+
+    Movie                        movie;
+    std::unique_ptr<MovieSource> source;
+    if(std::string(movie_path).ends_with(".fm2")) {
+        auto fm2 = std::make_unique<FM2Reader>();
+        if(!fm2->open(movie_path))
+            return 1;
+        source = std::move(fm2);
+    } else {
+        if(!movie.load(movie_path))
+            return 1;
+        source = std::make_unique<MovieReader>(movie);
+    }
+
+    MoviePlayer player(nes, *source);
+    if(!player.matches_rom())
+        Log::warn("Warning: Movie was recorded on another ROM.");
+
+    nes.ppu.set_render_mode(has_option(argc, argv, "-render") ? PPU::RenderMode::Full : PPU::RenderMode::StatusOnly);
+
+    const bool            determinism = has_option(argc, argv, "-determinism");
+    std::vector<uint64_t> frame_hashes;
+    const auto            movie_start = source->tell();
+
+    const auto start = std::chrono::steady_clock::now();
+    size_t     cycles = 0;
+    if(determinism) {
+        size_t frame_cycles;
+        while((frame_cycles = player.step_frame()) > 0) {
+            cycles += frame_cycles;
+            frame_hashes.push_back(nes.state_hash());
+        }
+    } else {
+        cycles = player.run();
+    }
+    const auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    const auto state_hash = nes.state_hash();
+
+    std::stringstream hash_ss;
+    hash_ss << std::hex << std::setw(16) << std::setfill('0') << state_hash;
+    Log::print("Replayed ", player.get_frame(), " frames in ", seconds, "s (", player.get_frame() / seconds, " fps, ",
+               (static_cast<double>(cycles) / CPU::ClockRate) / seconds, "x real time)");
+    Log::print("State hash: ", hash_ss.str());
+
+    if(determinism) {
+        if(!source->seek(movie_start)) {
+            Log::error("Error: Could not rewind the movie.");
+            return 1;
+        }
+        NES second;
+        second.load(rom_path);
+        second.ppu.set_render_mode(PPU::RenderMode::StatusOnly);
+        MoviePlayer second_player(second, *source);
+        for(size_t frame = 0; frame < frame_hashes.size(); ++frame) {
+            second_player.step_frame();
+            if(second.state_hash() != frame_hashes[frame]) {
+                Log::error("Desync on frame ", frame, ".");
+                return 1;
+            }
+        }
+        Log::success("Second replay is identical on all ", frame_hashes.size(), " frames.");
+    }
+
+    if(const char* expected = get_option(argc, argv, "$expect")) {
+        if(std::stoull(expected, nullptr, 16) != state_hash) {
+            Log::error("State hash mismatch, expected ", expected);
+            return 1;
+        }
+        Log::success("State hash matches.");
+    }
+    return 0;
+}
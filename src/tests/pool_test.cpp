@@ -0,0 +1,177 @@
+/* NESPool: Stepped instances against single machines, auto-reset, lockstep and pinned pools, start snapshots.
+ *
+ * pool_test
+ */
+
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <core/NESPool.hpp>
+
+size_t failures = 0;
+
+void check(bool condition, const char* what) {
+    if(!condition) {
+        Log::error("Failed: ", what);
+        ++failures;
+    }
+}
+
+/// NROM image counting frames at $00 (NMI), reading both controllers into $01 and $03 and summing the first one into $02.
+std::vector<uint8_t> make_rom() {
+    std::vector<uint8_t> rom(RomImage::HeaderSize + 0x4000 + 0x2000, 0);
+    const uint8_t        header[] = {'N', 'E', 'S', 0x1A, 1, 1};
+    std::memcpy(rom.data(), header, sizeof(header));
+    const uint8_t program[] = {
+        0x78,             // $C000 SEI
+        0xD8,             //       CLD
+        0xA2, 0xFF,       //       LDX #$FF
+        0x9A,             //       TXS
+        0xA9, 0x80,       //       LDA #$80
+        0x8D, 0x00, 0x20, //       STA $2000
+        0xA9, 0x01,       // $C00A LDA #$01
+        0x8D, 0x16, 0x40, //       STA $4016
+        0xA9, 0x00,       //       LDA #$00
+        0x8D, 0x16, 0x40, //       STA $4016
+        0xA2, 0x08,       //       LDX #$08
+        0xAD, 0x16, 0x40, // $C016 LDA $4016
+        0x4A,             //       LSR A
+        0x26, 0x01,       //       ROL $01
+        0xAD, 0x17, 0x40, //       LDA $4017
+        0x4A,             //       LSR A
+        0x26, 0x03,       //       ROL $03
+        0xCA,             //       DEX
+        0xD0, 0xF1,       //       BNE $C016
+        0xA5, 0x01,       //       LDA $01
+        0x18,             //       CLC
+        0x65, 0x02,       //       ADC $02
+        0x85, 0x02,       //       STA $02
+        0x4C, 0x0A, 0xC0, //       JMP $C00A
+        0xE6, 0x00,       // $C02F INC $00
+        0x40,             //       RTI
+    };
+    std::memcpy(rom.data() + RomImage::HeaderSize, program, sizeof(program));
+    const uint8_t vectors[] = {0x2F, 0xC0, 0x00, 0xC0, 0x00, 0xC0}; // NMI, Reset, IRQ
+    std::memcpy(rom.data() + RomImage::HeaderSize + 0x3FFA, vectors, sizeof(vectors));
+    return rom;
+}
+
+const std::string rom_path = (std::filesystem::temp_directory_path() / "nesen_pool_test.nes").string();
+
+/// Odd instances go back to the start state on their 4th frame.
+bool game_over(NES& nes, size_t index) {
+    return index % 2 == 1 && nes.cpu.read(0x0000) >= 4;
+}
+
+/// Single machine doing what the pool does to one of its instances.
+struct Reference {
+    NES       nes;
+    SaveState start;
+
+    Reference(const SaveState& state) : nes(0x800, PPU::RenderMode::StatusOnly), start(state) {
+        nes.cpu.set_input_mode(CPU::InputMode::Direct);
+        nes.load(rom_path);
+        nes.load_state(start);
+    }
+
+    bool step(const word_t* inputs, size_t frames, size_t index) {
+        nes.cpu.set_controller_input(0, inputs[0]);
+        nes.cpu.set_controller_input(1, inputs[1]);
+        for(size_t f = 0; f < frames; ++f) {
+            nes.run_frame();
+            if(game_over(nes, index)) {
+                nes.load_state(start);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool same_ram(const word_t* observation) {
+        for(addr_t addr = 0; addr < 0x800; ++addr)
+            if(nes.cpu.read(addr) != observation[addr])
+                return false;
+        return true;
+    }
+};
+
+void test_pool(size_t count, bool lockstep, bool pinned, const char* what) {
+    NESPool pool(count, 3, pinned);
+    pool.set_observation(NESPool::Observation::RAM);
+    check(pool.load(rom_path), "Pool loads the ROM");
+    pool.set_lockstep(lockstep);
+    pool.set_auto_reset(game_over);
+    check(pool.observation_size() == 0x800, "RAM observation size");
+
+    SaveState start;
+    pool[0].save_state(start);
+    std::vector<std::unique_ptr<Reference>> references;
+    for(size_t i = 0; i < count; ++i)
+        references.push_back(std::make_unique<Reference>(start));
+
+    std::vector<word_t>  inputs(2 * count);
+    std::vector<word_t>  observations(count * pool.observation_size());
+    std::vector<uint8_t> resets(count);
+    bool                 same = true, reset_reported = true, reset_seen = false;
+    for(size_t step = 0; step < 4; ++step) {
+        for(size_t i = 0; i < count; ++i) {
+            inputs[2 * i] = static_cast<word_t>(i * 7 + step);
+            inputs[2 * i + 1] = static_cast<word_t>(0xFF - i);
+        }
+        pool.step(inputs, 3, observations, resets);
+        for(size_t i = 0; i < count; ++i) {
+            const bool reset = references[i]->step(&inputs[2 * i], 3, i);
+            same = same && references[i]->same_ram(&observations[i * pool.observation_size()]);
+            reset_reported = reset_reported && resets[i] == reset;
+            reset_seen = reset_seen || reset;
+        }
+    }
+    check(same, what);
+    check(reset_seen && reset_reported, "Instances reset during a step are reported");
+    check(observations[0x02] != observations[2 * pool.observation_size() + 0x02], "Instances read their own inputs");
+}
+
+void test_start_snapshot() {
+    NESPool pool(4, 2);
+    pool.set_observation(NESPool::Observation::RAM, 0, 4);
+    check(pool.load(rom_path), "Pool loads the ROM");
+    std::vector<word_t>  inputs(2 * pool.size(), 0x42);
+    std::vector<word_t>  observations(pool.size() * pool.observation_size());
+    std::vector<uint8_t> resets(pool.size());
+    pool.step(inputs, 2, observations, resets);
+    const auto id = pool[0].record_snapshot();
+    const auto frames = pool[0].cpu.read(0x0000);
+
+    check(pool.set_start_snapshot(id), "A recorded snapshot becomes the start state");
+    check(!pool.set_start_snapshot(id + 1), "Unknown snapshots are rejected");
+    pool.set_auto_reset([](NES&, size_t) { return true; });
+    pool.step(inputs, 5, observations, resets);
+    bool from_snapshot = true;
+    for(size_t i = 0; i < pool.size(); ++i)
+        from_snapshot = from_snapshot && resets[i] == 1 && observations[i * pool.observation_size()] == frames;
+    check(from_snapshot, "Instances are reset to the snapshot");
+}
+
+int main(int, char* argv[]) {
+    config::set_folder(argv[0]);
+    {
+        const auto    rom = make_rom();
+        std::ofstream file(rom_path, std::ios::binary);
+        file.write(reinterpret_cast<const char*>(rom.data()), static_cast<std::streamsize>(rom.size()));
+    }
+    test_pool(13, false, false, "Instances match single machines");
+    test_pool(19, true, false, "Lockstep instances match single machines");
+    test_pool(13, false, true, "Pinned instances match single machines");
+    test_pool(24, true, true, "Pinned lockstep instances match single machines");
+    test_start_snapshot();
+    std::filesystem::remove(rom_path);
+    if(failures > 0) {
+        Log::error(failures, " check(s) failed.");
+        return 1;
+    }
+    Log::success("All pool tests passed.");
+    return 0;
+}
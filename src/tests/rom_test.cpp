@@ -0,0 +1,158 @@
+/* ROM images: CRC-32 and SHA-1, iNES and NES 2.0 header parsing, ROM database lookups.
+ *
+ * rom_test
+ */
+
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <core/Checksum.hpp>
+#include <core/RomDatabase.hpp>
+#include <core/RomImage.hpp>
+
+size_t failures = 0;
+
+void check(bool condition, const char* what) {
+    if(!condition) {
+        Log::error("Failed: ", what);
+        ++failures;
+    }
+}
+
+/// Header followed by PRG and CHR ROMs filled with seed dependent bytes.
+std::vector<uint8_t> make_rom(const uint8_t (&header)[RomImage::HeaderSize], size_t prg_size, size_t chr_size, uint8_t seed) {
+    std::vector<uint8_t> rom(header, header + RomImage::HeaderSize);
+    rom.resize(RomImage::HeaderSize + prg_size + chr_size);
+    for(size_t i = RomImage::HeaderSize; i < rom.size(); ++i)
+        rom[i] = static_cast<uint8_t>(i * 13 + seed);
+    return rom;
+}
+
+template<size_t Size>
+std::string to_hex(const std::array<uint8_t, Size>& digest) {
+    std::string str;
+    char        byte[3];
+    for(auto b : digest) {
+        std::snprintf(byte, sizeof(byte), "%02x", b);
+        str += byte;
+    }
+    return str;
+}
+
+void test_checksums() {
+    const std::string digits = "123456789";
+    check(Checksum::crc32(digits.data(), digits.size()) == 0xCBF43926, "CRC-32 check value");
+    check(Checksum::crc32(digits.data() + 4, 5, Checksum::crc32(digits.data(), 4)) == 0xCBF43926, "CRC-32 continues from a previous CRC");
+    check(to_hex(Checksum::sha1("abc", 3)) == "a9993e364706816aba3e25717850c26c9cd0d89d", "SHA-1 of 'abc'");
+    const std::string two_blocks = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+    check(to_hex(Checksum::sha1(two_blocks.data(), two_blocks.size())) == "84983e441c3bd26ebaae4aa1f95129e5e54670f1", "SHA-1 spanning two blocks");
+    check(to_hex(Checksum::md5("", 0)) == "d41d8cd98f00b204e9800998ecf8427e", "MD5 of ''");
+    check(to_hex(Checksum::md5("abc", 3)) == "900150983cd24fb0d6963f7d28e17f72", "MD5 of 'abc'");
+    const std::string eighty_digits = "12345678901234567890123456789012345678901234567890123456789012345678901234567890";
+    check(to_hex(Checksum::md5(eighty_digits.data(), eighty_digits.size())) == "57edf4a22be3c955ac49da2e2107b67a", "MD5 spanning two blocks");
+}
+
+void test_headers() {
+    RomImage::Info info;
+    uint32_t       crc32;
+
+    // NES 2.0: Mapper 0x123 submapper 5, 8 KB PRG RAM, 32 KB battery-backed PRG RAM, 8 KB CHR RAM, PAL, vertical mirroring
+    const uint8_t nes2[RomImage::HeaderSize] = {'N', 'E', 'S', 0x1A, 2, 0, 0x33, 0x28, 0x51, 0x00, 0x97, 0x07, 0x01, 0, 0, 0};
+    auto          rom = make_rom(nes2, 2 * 0x4000, 0, 1);
+    check(RomImage::inspect(rom, info, crc32).empty(), "NES 2.0 image is valid");
+    check(info.nes2 && info.mapper == 0x123 && info.submapper == 5, "NES 2.0 mapper and submapper");
+    check(info.prg_ram_size == 0x2000 && info.prg_nvram_size == 0x8000 && info.chr_ram_size == 0x2000 && info.chr_nvram_size == 0, "NES 2.0 RAM sizes");
+    check(info.region == RomImage::Info::PAL && info.mirroring == RomImage::Info::Vertical && info.battery, "NES 2.0 region, mirroring and battery");
+    check(crc32 == Checksum::crc32(rom.data() + RomImage::HeaderSize, rom.size() - RomImage::HeaderSize), "CRC-32 covers PRG and CHR ROMs, not the header");
+
+    // NES 2.0 exponent-multiplier notation: 2^14 * (2 * 1 + 1) bytes of PRG ROM
+    const uint8_t exponent[RomImage::HeaderSize] = {'N', 'E', 'S', 0x1A, (14 << 2) | 1, 1, 0x00, 0x08, 0, 0x0F, 0, 0, 0, 0, 0, 0};
+    rom = make_rom(exponent, 3 * 0x4000, 0x2000, 2);
+    check(RomImage::inspect(rom, info, crc32).empty(), "NES 2.0 exponent-multiplier size");
+    rom.pop_back();
+    check(!RomImage::inspect(rom, info, crc32).empty(), "Truncated NES 2.0 image is rejected");
+
+    // iNES with "DiskDude!" garbage in bytes 7-15: The upper mapper nibble is ignored
+    const uint8_t garbage[RomImage::HeaderSize] = {'N', 'E', 'S', 0x1A, 1, 1, 0x41, 'D', 'i', 's', 'k', 'D', 'u', 'd', 'e', '!'};
+    rom = make_rom(garbage, 0x4000, 0x2000, 3);
+    check(RomImage::inspect(rom, info, crc32).empty() && !info.nes2 && info.mapper == 4, "iNES header with garbage");
+    check(info.prg_ram_size == 0x2000 && info.chr_ram_size == 0 && info.region == RomImage::Info::NTSC, "iNES default RAM sizes");
+
+    const uint8_t wrong[RomImage::HeaderSize] = {'N', 'E', 'Z', 0x1A, 1, 1};
+    rom = make_rom(wrong, 0x4000, 0x2000, 4);
+    check(!RomImage::inspect(rom, info, crc32).empty(), "Wrong magic number is rejected");
+
+    // Sizes that can't be mapped through 8 KB PRG and 1 KB CHR pages
+    const uint8_t no_prg[RomImage::HeaderSize] = {'N', 'E', 'S', 0x1A, 0, 1};
+    rom = make_rom(no_prg, 0, 0x2000, 5);
+    check(!RomImage::inspect(rom, info, crc32).empty() && !RomImage::load_from_memory(rom), "Image without PRG ROM is rejected");
+    const uint8_t odd_prg[RomImage::HeaderSize] = {'N', 'E', 'S', 0x1A, (12 << 2) | 0, 0, 0x00, 0x08, 0, 0x0F};
+    rom = make_rom(odd_prg, 0x1000, 0, 6);
+    check(!RomImage::inspect(rom, info, crc32).empty(), "4 KB of PRG ROM is rejected");
+    const uint8_t odd_chr[RomImage::HeaderSize] = {'N', 'E', 'S', 0x1A, 1, (9 << 2) | 0, 0x00, 0x08, 0, 0xF0};
+    rom = make_rom(odd_chr, 0x4000, 0x200, 7);
+    check(!RomImage::inspect(rom, info, crc32).empty(), "512 B of CHR ROM is rejected");
+}
+
+void test_database() {
+    // Several records per CRC-32, as for colliding dumps: The SHA-1 tells them apart
+    const uint8_t ines[RomImage::HeaderSize] = {'N', 'E', 'S', 0x1A, 1, 1, 0x00, 0x00};
+    const auto    rom = make_rom(ines, 0x4000, 0x2000, 5);
+    const auto    other = make_rom(ines, 0x4000, 0x2000, 6);
+    const auto    unknown = make_rom(ines, 0x4000, 0x2000, 7);
+    const auto    sha1 = Checksum::sha1(rom.data() + RomImage::HeaderSize, rom.size() - RomImage::HeaderSize);
+    const auto    crc = Checksum::crc32(rom.data() + RomImage::HeaderSize, rom.size() - RomImage::HeaderSize);
+    const auto    other_crc = Checksum::crc32(other.data() + RomImage::HeaderSize, other.size() - RomImage::HeaderSize);
+    const auto    unknown_crc = Checksum::crc32(unknown.data() + RomImage::HeaderSize, unknown.size() - RomImage::HeaderSize);
+
+    char crc_hex[9], other_crc_hex[9], unknown_crc_hex[9];
+    std::snprintf(crc_hex, sizeof(crc_hex), "%08x", crc);
+    std::snprintf(other_crc_hex, sizeof(other_crc_hex), "%08x", other_crc);
+    std::snprintf(unknown_crc_hex, sizeof(unknown_crc_hex), "%08x", unknown_crc);
+    Checksum::sha1_t wrong_sha1 = sha1;
+    wrong_sha1[0] ^= 0xFF;
+
+    const auto path = (std::filesystem::temp_directory_path() / "nesen_rom_test_db.txt").string();
+    {
+        std::ofstream file(path);
+        file << "# Test database\n";
+        file << crc_hex << ' ' << to_hex(wrong_sha1) << " 2 0 0 0 7 0 0 H\n";
+        file << crc_hex << ' ' << to_hex(sha1) << " 4 1 0 7 0 0 1 4\n";
+        file << crc_hex << " - 3 0 0 0 0 0 0 V\n";
+        file << other_crc_hex << ' ' << to_hex(wrong_sha1) << " 2 0 0 0 7 0 0 H\n";
+        file << other_crc_hex << " - 1 0 7 0 0 0 2 V\n";
+        file << unknown_crc_hex << ' ' << to_hex(wrong_sha1) << " 2 0 0 0 7 0 0 H\n";
+        file << "0badc0de - 4096 0 0 0 0 0 0 H\n"; // Invalid: Mapper out of range
+        file << "not a record\n";
+    }
+    const size_t before = RomDatabase::size();
+    check(RomDatabase::load(path) == 6 && RomDatabase::size() == before + 6, "Valid records are loaded, invalid ones skipped");
+    std::filesystem::remove(path);
+    check(RomDatabase::find(crc).size() == 3 && RomDatabase::find(0x0BADC0DE).empty(), "Records are found by CRC-32");
+
+    RomImage::Info info;
+    uint32_t       crc32;
+    check(RomImage::inspect(rom, info, crc32).empty() && info.from_database, "Known dump");
+    check(info.mapper == 4 && info.submapper == 1 && info.prg_nvram_size == 0x2000 && info.battery, "The record with the matching SHA-1 wins");
+    check(info.region == RomImage::Info::PAL && info.mirroring == RomImage::Info::FourScreens, "Database region and mirroring override the header");
+
+    check(RomImage::inspect(other, info, crc32).empty() && info.from_database && info.mapper == 1 && info.prg_ram_size == 0x2000,
+          "A SHA-1 mismatch falls back to the record without SHA-1");
+    check(RomImage::inspect(unknown, info, crc32).empty() && !info.from_database && info.mapper == 0, "Only SHA-1 mismatches: The header is used");
+}
+
+int main(int, char* argv[]) {
+    config::set_folder(argv[0]);
+    test_checksums();
+    test_headers();
+    test_database();
+    if(failures > 0) {
+        Log::error(failures, " check(s) failed.");
+        return 1;
+    }
+    Log::success("All ROM tests passed.");
+    return 0;
+}
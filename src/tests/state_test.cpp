@@ -0,0 +1,250 @@
+/* Machine states: Copy-on-write forks, incremental state hashes, reset snapshots, lockstep CPU lanes against scalar machines.
+ *
+ * state_test
+ */
+
+#include <array>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include <core/NES.hpp>
+#include <core/WideCPU.hpp>
+
+size_t failures = 0;
+
+void check(bool condition, const char* what) {
+    if(!condition) {
+        Log::error("Failed: ", what);
+        ++failures;
+    }
+}
+
+/// NROM image with 8 KB of PRG RAM and CHR RAM. The program mixes RAM and PRG RAM writes, indexed by the value at $11,
+/// and branches on the results: Machines starting with different values at $11 take different paths.
+std::vector<uint8_t> make_rom() {
+    std::vector<uint8_t> rom(RomImage::HeaderSize + 0x4000, 0);
+    const uint8_t        header[] = {'N', 'E', 'S', 0x1A, 1, 0};
+    std::memcpy(rom.data(), header, sizeof(header));
+    const uint8_t program[] = {
+        0x78,             // $C000 SEI
+        0xD8,             //       CLD
+        0xA2, 0xFF,       //       LDX #$FF
+        0x9A,             //       TXS
+        0xA6, 0x11,       // $C005 LDX $11
+        0xFE, 0x00, 0x03, //       INC $0300,X
+        0xA5, 0x10,       //       LDA $10
+        0x18,             //       CLC
+        0x65, 0x11,       //       ADC $11
+        0x85, 0x10,       //       STA $10
+        0x8D, 0x00, 0x60, //       STA $6000
+        0x29, 0x07,       //       AND #$07
+        0xD0, 0x02,       //       BNE $C01A
+        0xE6, 0x12,       //       INC $12
+        0x4C, 0x05, 0xC0, // $C01A JMP $C005
+    };
+    std::memcpy(rom.data() + RomImage::HeaderSize, program, sizeof(program));
+    for(size_t v = 0x3FFA; v < 0x4000; v += 2) {
+        rom[RomImage::HeaderSize + v] = 0x00;
+        rom[RomImage::HeaderSize + v + 1] = 0xC0;
+    }
+    return rom;
+}
+
+std::unique_ptr<NES> boot() {
+    auto nes = std::make_unique<NES>(0x800, PPU::RenderMode::StatusOnly);
+    check(nes->load_from_memory(make_rom()), "Test ROM loads");
+    nes->power();
+    nes->run_frame();
+    return nes;
+}
+
+bool same_state(const NES& a, const NES& b) {
+    SaveState sa, sb;
+    a.save_state(sa);
+    b.save_state(sb);
+    return sa.size() == sb.size() && std::memcmp(sa.data(), sb.data(), sa.size()) == 0;
+}
+
+bool shares_ram(const NES& a, const NES& b, size_t page) {
+    return a.cpu.get_ram().page(page) == b.cpu.get_ram().page(page);
+}
+
+word_t ram(NES& nes, addr_t addr) {
+    return nes.cpu.read(addr);
+}
+
+void test_fork() {
+    auto parent = boot();
+    auto child = parent->fork();
+    check(same_state(*parent, *child), "A fork starts in the state of its parent");
+    bool shared = true;
+    for(size_t p = 0; p < parent->cpu.get_ram().page_count(); ++p)
+        shared = shared && shares_ram(*parent, *child, p);
+    check(shared, "A fork shares every RAM page with its parent");
+
+    // Pages are only copied by their first write, on the side writing to it
+    const word_t original = ram(*parent, 0x0400);
+    const word_t modified = static_cast<word_t>(original ^ 0xFF);
+    child->cpu.write(0x0400, modified);
+    check(!shares_ram(*parent, *child, 1) && shares_ram(*parent, *child, 0), "Only the page written to is copied");
+    check(ram(*parent, 0x0400) == original && ram(*child, 0x0400) == modified, "Child writes don't reach the parent");
+    const word_t* parent_page = parent->cpu.get_ram().page(1);
+    const word_t  child_value = ram(*child, 0x0401);
+    parent->cpu.write(0x0401, static_cast<word_t>(child_value ^ 0xFF));
+    check(parent->cpu.get_ram().page(1) != parent_page, "The parent copies a page shared with a fork before writing to it");
+    check(ram(*child, 0x0401) == child_value, "Parent writes don't reach the child");
+
+    parent->cartridge.write(0x6100, 0x11);
+    child->cartridge.write(0x6100, 0x22);
+    parent->cartridge.write_chr(0x0100, 0x33);
+    child->cartridge.write_chr(0x0100, 0x44);
+    check(static_cast<word_t>(parent->cartridge.read(0x6100)) == 0x11 && static_cast<word_t>(child->cartridge.read(0x6100)) == 0x22, "PRG RAM is copied on write");
+    check(static_cast<word_t>(parent->cartridge.read_chr(0x0100)) == 0x33 && static_cast<word_t>(child->cartridge.read_chr(0x0100)) == 0x44, "CHR RAM is copied on write");
+
+    // Both sides keep running as if they were independent machines
+    SaveState before;
+    parent->save_state(before);
+    NES reference(0x800, PPU::RenderMode::StatusOnly);
+    reference.load_from_memory(make_rom());
+    check(reference.load_state(before), "Reference machine loads the parent state");
+    child->cpu.write(0x0011, 3);
+    for(size_t frame = 0; frame < 10; ++frame) {
+        parent->run_frame();
+        child->run_frame();
+        reference.run_frame();
+    }
+    check(same_state(*parent, reference), "A running fork doesn't change its parent");
+    check(!same_state(*parent, *child), "A fork diverges from its parent");
+
+    auto grandchild = child->fork();
+    child.reset();
+    grandchild->run_frame();
+    parent->run_frame();
+    reference.run_frame();
+    check(same_state(*parent, reference), "Pages outlive the forks they were shared with");
+}
+
+void test_state_hash() {
+    auto a = boot();
+    auto b = boot();
+    bool equal = true;
+    for(size_t frame = 0; frame < 10; ++frame) {
+        a->run_frame();
+        b->run_frame();
+        equal = equal && a->state_hash() == b->state_hash();
+    }
+    check(equal, "Identical runs have identical hashes");
+    const uint64_t hash = a->state_hash();
+    check(a->state_hash() == hash, "Hashing doesn't change the state");
+
+    // A single byte anywhere changes the hash, writing the previous value back restores it
+    auto changes = [&](auto&& write, const char* what) {
+        write(0x01);
+        const uint64_t one = a->state_hash();
+        write(0x02);
+        const uint64_t two = a->state_hash();
+        check(one != hash && two != hash && one != two, what);
+    };
+    const word_t ram = a->cpu.read(0x0555);
+    changes([&](word_t v) { a->cpu.write(0x0555, static_cast<word_t>(ram ^ v)); }, "A RAM write changes the hash");
+    a->cpu.write(0x0555, ram);
+    check(a->state_hash() == hash, "Restoring RAM restores the hash");
+
+    const word_t prg_ram = static_cast<word_t>(a->cartridge.read(0x7123));
+    changes([&](word_t v) { a->cartridge.write(0x7123, static_cast<word_t>(prg_ram ^ v)); }, "A PRG RAM write changes the hash");
+    a->cartridge.write(0x7123, prg_ram);
+    check(a->state_hash() == hash, "Restoring PRG RAM restores the hash");
+
+    const word_t chr_ram = static_cast<word_t>(a->cartridge.read_chr(0x1ABC));
+    changes([&](word_t v) { a->cartridge.write_chr(0x1ABC, static_cast<word_t>(chr_ram ^ v)); }, "A CHR RAM write changes the hash");
+    a->cartridge.write_chr(0x1ABC, chr_ram);
+    check(a->state_hash() == hash, "Restoring CHR RAM restores the hash");
+
+    // Cached page hashes agree with a machine hashing everything for the first time, forks included
+    auto fork = a->fork();
+    fork->cpu.write(0x0123, 0x42);
+    fork->run_frame();
+    SaveState state;
+    fork->save_state(state);
+    NES fresh(0x800, PPU::RenderMode::StatusOnly);
+    fresh.load_from_memory(make_rom());
+    fresh.load_state(state);
+    check(fork->state_hash() == fresh.state_hash() && fork->state_hash() != a->state_hash(), "Cached hashes match a fresh machine");
+    check(a->state_hash() == hash, "The hash of the parent is unchanged by its fork");
+}
+
+void test_reset_snapshots() {
+    auto       nes = boot();
+    auto&      snapshots = ResetSnapshots::of(nes->cartridge.get_rom_hash());
+    const auto id = nes->record_snapshot();
+    SaveState  recorded;
+    nes->save_state(recorded);
+    const uint64_t hash = nes->state_hash();
+
+    // The machine is restored in place: Same RAM pages, previous content
+    const word_t* page = nes->cpu.get_ram().page(0);
+    const word_t  value = ram(*nes, 0x0011);
+    nes->cpu.write(0x0011, static_cast<word_t>(value + 1));
+    for(size_t frame = 0; frame < 5; ++frame)
+        nes->run_frame();
+    check(nes->state_hash() != hash, "The machine left the snapshot");
+    check(nes->reset_to(id), "reset_to restores a recorded snapshot");
+    SaveState restored;
+    nes->save_state(restored);
+    check(restored.size() == recorded.size() && std::memcmp(restored.data(), recorded.data(), recorded.size()) == 0, "reset_to restores the whole state");
+    check(ram(*nes, 0x0011) == value && nes->cpu.get_ram().page(0) == page, "reset_to restores RAM in place");
+    check(nes->state_hash() == hash, "The hash follows reset_to");
+
+    // Ids outlive clear: A stale id never designates a newer snapshot
+    snapshots.clear();
+    nes->cpu.write(0x0011, static_cast<word_t>(value + 2));
+    const auto new_id = nes->record_snapshot();
+    check(new_id != id, "Ids aren't reused after clear");
+    nes->run_frame();
+    const uint64_t before = nes->state_hash();
+    check(!nes->reset_to(id) && nes->state_hash() == before, "A cleared id is invalid, the machine is left untouched");
+    check(nes->reset_to(new_id) && ram(*nes, 0x0011) == static_cast<word_t>(value + 2), "Snapshots recorded after clear are valid");
+    check(snapshots.size() == 1, "clear removes the snapshots");
+}
+
+void test_wide_cpu() {
+    // Lanes start from the same machine with different values at $11: They share the loop, but not its branches.
+    auto                              base = boot();
+    std::vector<std::unique_ptr<NES>> lanes, scalars;
+    std::array<NES*, 8>               lane_ptrs;
+    const word_t                      values[8] = {1, 1, 2, 3, 5, 8, 13, 21};
+    for(size_t l = 0; l < lane_ptrs.size(); ++l) {
+        base->cpu.write(0x0011, values[l]);
+        lanes.push_back(base->fork());
+        scalars.push_back(base->fork());
+        lane_ptrs[l] = lanes.back().get();
+    }
+
+    WideCPU<8> wide(lane_ptrs);
+    bool       equal = true;
+    for(size_t frame = 0; frame < 20; ++frame) {
+        wide.run_frame();
+        for(size_t l = 0; l < lanes.size(); ++l) {
+            scalars[l]->run_frame();
+            equal = equal && lanes[l]->state_hash() == scalars[l]->state_hash();
+        }
+    }
+    check(equal, "WideCPU lanes match NES::run_frame");
+    check(wide.get_wide_instructions() > 0 && wide.get_scalar_instructions() > 0, "Lanes ran both in lockstep and on their own");
+    check(lanes[0]->state_hash() == lanes[1]->state_hash() && lanes[0]->state_hash() != lanes[2]->state_hash(), "Lanes are independent machines");
+}
+
+int main(int, char* argv[]) {
+    config::set_folder(argv[0]);
+    test_fork();
+    test_state_hash();
+    test_reset_snapshots();
+    test_wide_cpu();
+    if(failures > 0) {
+        Log::error(failures, " check(s) failed.");
+        return 1;
+    }
+    Log::success("All state tests passed.");
+    return 0;
+}
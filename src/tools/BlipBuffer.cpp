@@ -0,0 +1,92 @@
+#include "BlipBuffer.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <numbers>
+
+namespace {
+
+// Windowed-sinc (Blackman) impulses, one per sub-sample phase. Each phase sums exactly to 1 << KernelBits, so that
+// integrating a step gives back its exact amplitude.
+template<size_t Phases, size_t Taps, size_t KernelBits>
+struct Kernel {
+    int32_t taps[Phases][Taps];
+
+    Kernel() {
+        constexpr double cutoff = 0.9; // Of the Nyquist frequency
+        constexpr double half_width = Taps / 2;
+        for(size_t p = 0; p < Phases; ++p) {
+            double values[Taps];
+            double sum = 0;
+            for(size_t j = 0; j < Taps; ++j) {
+                const double x = static_cast<double>(j) - half_width - static_cast<double>(p) / Phases;
+                const double sinc = x == 0 ? 1.0 : std::sin(std::numbers::pi * cutoff * x) / (std::numbers::pi * cutoff * x);
+                const double w = 0.42 + 0.5 * std::cos(std::numbers::pi * x / half_width) + 0.08 * std::cos(2 * std::numbers::pi * x / half_width);
+                values[j] = sinc * std::max(0.0, w);
+                sum += values[j];
+            }
+            int32_t total = 0;
+            for(size_t j = 0; j < Taps; ++j) {
+                taps[p][j] = static_cast<int32_t>(std::lround(values[j] / sum * (1 << KernelBits)));
+                total += taps[p][j];
+            }
+            taps[p][Taps / 2] += (1 << KernelBits) - total;
+        }
+    }
+};
+
+} // namespace
+
+BlipBuffer::BlipBuffer() {
+    clear();
+}
+
+void BlipBuffer::set_rates(double clock_rate, double sample_rate) {
+    adjust_rates(clock_rate, sample_rate);
+    clear();
+}
+
+void BlipBuffer::adjust_rates(double clock_rate, double sample_rate) {
+    _factor = static_cast<uint64_t>(std::ceil(sample_rate / clock_rate * static_cast<double>(uint64_t(1) << FracBits)));
+}
+
+void BlipBuffer::clear() {
+    _offset = 0;
+    _integrator = 0;
+    _buffer.assign(Taps, 0);
+}
+
+void BlipBuffer::add_delta(uint64_t time, int32_t delta) {
+    static const Kernel<Phases, Taps, KernelBits> kernel;
+
+    const uint64_t position = _offset + time * _factor;
+    const size_t   index = static_cast<size_t>(position >> FracBits);
+    const size_t   phase = static_cast<size_t>(position >> (FracBits - PhaseBits)) & (Phases - 1);
+    if(_buffer.size() < index + Taps)
+        _buffer.resize(index + Taps, 0);
+    const int32_t* taps = kernel.taps[phase];
+    int32_t*       out = _buffer.data() + index;
+    for(size_t j = 0; j < Taps; ++j)
+        out[j] += taps[j] * delta;
+}
+
+void BlipBuffer::end_frame(uint64_t time) {
+    _offset += time * _factor;
+    const size_t end = static_cast<size_t>(_offset >> FracBits) + Taps;
+    if(_buffer.size() < end)
+        _buffer.resize(end, 0);
+}
+
+size_t BlipBuffer::read_samples(int16_t* dst, size_t count) {
+    count = std::min(count, samples_available());
+    for(size_t i = 0; i < count; ++i) {
+        _integrator += _buffer[i];
+        const int64_t sample = _integrator >> KernelBits;
+        dst[i] = static_cast<int16_t>(std::clamp<int64_t>(sample, -32768, 32767));
+        _integrator -= sample << (KernelBits - BassShift);
+    }
+    _buffer.erase(_buffer.begin(), _buffer.begin() + count);
+    _offset -= static_cast<uint64_t>(count) << FracBits;
+    return count;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * Band-limited synthesis of a signal described by its steps (blip_buf style).
+ *
+ * Each amplitude change is added at its exact source clock time as a precomputed windowed-sinc impulse, the output
+ * samples are obtained by integrating the buffer. The cost is proportional to the number of steps and output samples,
+ * not to the number of source clocks. Time is counted in source clocks since the start of the current frame.
+ **/
+class BlipBuffer {
+  public:
+    static constexpr size_t HalfWidth = 8; ///< Taps of the kernel on each side of a step
+    static constexpr size_t Taps = 2 * HalfWidth;
+
+    BlipBuffer();
+
+    /// Clears the buffer.
+    void set_rates(double clock_rate, double sample_rate);
+    /// Changes the ratio without clearing the buffer (rate control), steps already added are kept.
+    void adjust_rates(double clock_rate, double sample_rate);
+    void clear();
+
+    /// Adds a step of delta (difference between two values of a 16 bits signal) at time (in clocks).
+    void add_delta(uint64_t time, int32_t delta);
+    /// Ends the frame at time: The samples before it can be read, time 0 is now there.
+    void end_frame(uint64_t time);
+
+    inline size_t samples_available() const { return static_cast<size_t>(_offset >> FracBits); }
+    /// Moves up to count samples to dst.
+    /// @return Number of samples read.
+    size_t read_samples(int16_t* dst, size_t count);
+
+  private:
+    static constexpr size_t  FracBits = 32;    ///< Fixed point sample positions
+    static constexpr size_t  PhaseBits = 6;    ///< Sub-sample positions of the kernel
+    static constexpr size_t  KernelBits = 14;  ///< Each phase of the kernel sums to 1 << KernelBits
+    static constexpr size_t  BassShift = 9;    ///< High-pass removing the DC offset
+    static constexpr size_t  Phases = 1 << PhaseBits;
+
+    uint64_t             _factor = 0; ///< Samples per clock, fixed point
+    uint64_t             _offset = 0; ///< Position of the frame start in the buffer, fixed point
+    int64_t              _integrator = 0;
+    std::vector<int32_t> _buffer;
+};
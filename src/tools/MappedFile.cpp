@@ -0,0 +1,139 @@
+#include "MappedFile.hpp"
+
+#include <utility>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile(MappedFile&& o) noexcept
+    : _data(std::exchange(o._data, nullptr)), _size(std::exchange(o._size, 0)), _writable(std::exchange(o._writable, false)), _handle(std::exchange(o._handle, nullptr)) {}
+
+MappedFile& MappedFile::operator=(MappedFile&& o) noexcept {
+    if(this != &o) {
+        close();
+        _data = std::exchange(o._data, nullptr);
+        _size = std::exchange(o._size, 0);
+        _writable = std::exchange(o._writable, false);
+        _handle = std::exchange(o._handle, nullptr);
+    }
+    return *this;
+}
+
+#ifdef _WIN32
+
+bool MappedFile::open(const std::string& path, Access access, size_t size) {
+    close();
+    const bool writable = access == Access::ReadWrite;
+    HANDLE     file = writable ? CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr)
+                               : CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if(file == INVALID_HANDLE_VALUE)
+        return false;
+    LARGE_INTEGER file_size;
+    if(!GetFileSizeEx(file, &file_size)) {
+        CloseHandle(file);
+        return false;
+    }
+    if(writable && size > 0 && static_cast<size_t>(file_size.QuadPart) != size) {
+        file_size.QuadPart = static_cast<LONGLONG>(size);
+        if(!SetFilePointerEx(file, file_size, nullptr, FILE_BEGIN) || !SetEndOfFile(file)) {
+            CloseHandle(file);
+            return false;
+        }
+    }
+    if(file_size.QuadPart == 0) {
+        CloseHandle(file);
+        return false;
+    }
+    HANDLE mapping = CreateFileMappingA(file, nullptr, writable ? PAGE_READWRITE : PAGE_READONLY, 0, 0, nullptr);
+    if(!mapping) {
+        CloseHandle(file);
+        return false;
+    }
+    // The view keeps the mapping alive
+    _data = static_cast<uint8_t*>(MapViewOfFile(mapping, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, 0));
+    CloseHandle(mapping);
+    if(!_data) {
+        CloseHandle(file);
+        return false;
+    }
+    // FlushViewOfFile only issues the writes, waiting for them takes the file handle (see flush)
+    if(writable)
+        _handle = file;
+    else
+        CloseHandle(file);
+    _size = static_cast<size_t>(file_size.QuadPart);
+    _writable = writable;
+    return true;
+}
+
+bool MappedFile::flush(bool wait) {
+    return _writable && FlushViewOfFile(_data, 0) && (!wait || FlushFileBuffers(static_cast<HANDLE>(_handle)));
+}
+
+void MappedFile::close() {
+    if(_data)
+        UnmapViewOfFile(_data);
+    if(_handle)
+        CloseHandle(static_cast<HANDLE>(_handle));
+    _data = nullptr;
+    _size = 0;
+    _writable = false;
+    _handle = nullptr;
+}
+
+#else
+
+bool MappedFile::open(const std::string& path, Access access, size_t size) {
+    close();
+    const bool writable = access == Access::ReadWrite;
+    int        fd = writable ? ::open(path.c_str(), O_RDWR | O_CREAT, 0644) : ::open(path.c_str(), O_RDONLY);
+    if(fd < 0)
+        return false;
+    struct stat st;
+    if(fstat(fd, &st) != 0) {
+        ::close(fd);
+        return false;
+    }
+    if(writable && size > 0 && static_cast<size_t>(st.st_size) != size) {
+        if(ftruncate(fd, static_cast<off_t>(size)) != 0) {
+            ::close(fd);
+            return false;
+        }
+        st.st_size = static_cast<off_t>(size);
+    }
+    if(st.st_size == 0) {
+        ::close(fd);
+        return false;
+    }
+    // The mapping stays valid after closing the descriptor
+    void* addr = mmap(nullptr, static_cast<size_t>(st.st_size), writable ? PROT_READ | PROT_WRITE : PROT_READ, writable ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if(addr == MAP_FAILED)
+        return false;
+    _data = static_cast<uint8_t*>(addr);
+    _size = static_cast<size_t>(st.st_size);
+    _writable = writable;
+    return true;
+}
+
+bool MappedFile::flush(bool wait) {
+    return _writable && msync(_data, _size, wait ? MS_SYNC : MS_ASYNC) == 0;
+}
+
+void MappedFile::close() {
+    if(_data)
+        munmap(_data, _size);
+    _data = nullptr;
+    _size = 0;
+    _writable = false;
+}
+
+#endif
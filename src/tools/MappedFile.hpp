@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/**
+ * View of a whole file mapped in memory (mmap / MapViewOfFile).
+ *
+ * Pages are loaded lazily by the OS and shared between all the processes mapping the same file.
+ * Read-write views write through to the file: The OS writes modified pages back on its own, flush forces it.
+ **/
+class MappedFile {
+  public:
+    enum class Access {
+        ReadOnly,
+        ReadWrite
+    };
+
+    MappedFile() = default;
+    MappedFile(const std::string& path, Access access = Access::ReadOnly, size_t size = 0) { open(path, access, size); }
+    ~MappedFile() { close(); }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    MappedFile(MappedFile&& o) noexcept;
+    MappedFile& operator=(MappedFile&& o) noexcept;
+
+    /// @param size ReadWrite only: The file is created if needed and resized to size bytes, unless size is 0.
+    /// @return false if the file could not be opened or mapped (an empty file can't be mapped).
+    bool open(const std::string& path, Access access = Access::ReadOnly, size_t size = 0);
+    void close();
+
+    inline bool           is_open() const { return _data != nullptr; }
+    inline bool           is_writable() const { return _writable; }
+    inline const uint8_t* data() const { return _data; }
+    /// nullptr unless the view is read-write.
+    inline uint8_t* writable_data() const { return _writable ? _data : nullptr; }
+    inline size_t   size() const { return _size; }
+
+    /// Writes the modified pages back to the file.
+    /// @param wait false only schedules the writes, true returns once they completed.
+    bool flush(bool wait);
+
+  private:
+    uint8_t* _data = nullptr;
+    size_t   _size = 0;
+    bool     _writable = false;
+    void*    _handle = nullptr; ///< Windows, read-write views only: The file, kept open for flush to wait on it
+};
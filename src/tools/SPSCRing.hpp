@@ -0,0 +1,73 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <type_traits>
+
+/**
+ * Lock-free ring buffer between exactly one producer thread and one consumer thread.
+ *
+ * Neither side ever blocks or allocates: push and pop move as many elements as possible and return how many were
+ * moved. The capacity is rounded up to a power of two.
+ **/
+template<typename T>
+class SPSCRing {
+    static_assert(std::is_trivially_copyable_v<T>, "SPSCRing only holds trivially copyable elements");
+
+  public:
+    explicit SPSCRing(size_t capacity) {
+        _capacity = 1;
+        while(_capacity < capacity)
+            _capacity <<= 1;
+        _data.reset(new T[_capacity]);
+    }
+
+    SPSCRing(const SPSCRing&) = delete;
+    SPSCRing& operator=(const SPSCRing&) = delete;
+
+    inline size_t capacity() const { return _capacity; }
+    /// Elements ready to be popped. Only a lower bound for the producer, an upper bound for the consumer.
+    inline size_t size() const {
+        const size_t tail = _tail.load(std::memory_order_acquire); // First: The head can only be further
+        return _head.load(std::memory_order_acquire) - tail;
+    }
+
+    /// Producer side.
+    /// @return Number of elements pushed, less than count if the ring is full.
+    size_t push(const T* src, size_t count) {
+        const size_t head = _head.load(std::memory_order_relaxed);
+        const size_t tail = _tail.load(std::memory_order_acquire);
+        count = std::min(count, _capacity - (head - tail));
+        const size_t start = head & (_capacity - 1);
+        const size_t first = std::min(count, _capacity - start);
+        std::memcpy(_data.get() + start, src, first * sizeof(T));
+        std::memcpy(_data.get(), src + first, (count - first) * sizeof(T));
+        _head.store(head + count, std::memory_order_release);
+        return count;
+    }
+
+    /// Consumer side.
+    /// @return Number of elements popped, less than count if the ring is empty.
+    size_t pop(T* dst, size_t count) {
+        const size_t tail = _tail.load(std::memory_order_relaxed);
+        const size_t head = _head.load(std::memory_order_acquire);
+        count = std::min(count, head - tail);
+        const size_t start = tail & (_capacity - 1);
+        const size_t first = std::min(count, _capacity - start);
+        std::memcpy(dst, _data.get() + start, first * sizeof(T));
+        std::memcpy(dst + first, _data.get(), (count - first) * sizeof(T));
+        _tail.store(tail + count, std::memory_order_release);
+        return count;
+    }
+
+  private:
+    size_t               _capacity;
+    std::unique_ptr<T[]> _data;
+
+    // Free running indices, on their own cache lines: Each one is only written by one side.
+    alignas(64) std::atomic<size_t> _head{0}; ///< Written by the producer
+    alignas(64) std::atomic<size_t> _tail{0}; ///< Written by the consumer
+};
@@ -0,0 +1,194 @@
+#include "ThreadPool.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <string>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#elif defined(__linux__)
+#include <filesystem>
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace {
+
+struct Core {
+    size_t cpu;
+    size_t node;
+};
+
+/// Cores this process may run on, sorted by NUMA node.
+std::vector<Core> available_cores() {
+    std::vector<Core> cores;
+#ifdef _WIN32
+    DWORD_PTR process_mask, system_mask;
+    if(GetProcessAffinityMask(GetCurrentProcess(), &process_mask, &system_mask))
+        for(size_t cpu = 0; cpu < 8 * sizeof(DWORD_PTR); ++cpu)
+            if(process_mask & (static_cast<DWORD_PTR>(1) << cpu)) {
+                UCHAR node = 0;
+                GetNumaProcessorNode(static_cast<UCHAR>(cpu), &node);
+                cores.push_back({cpu, node == 0xFF ? 0 : node});
+            }
+#elif defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if(sched_getaffinity(0, sizeof(set), &set) == 0)
+        for(size_t cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+            if(CPU_ISSET(cpu, &set)) {
+                // The node of a CPU shows up as a nodeN link in its sysfs directory.
+                size_t          node = 0;
+                std::error_code error;
+                for(const auto& entry : std::filesystem::directory_iterator("/sys/devices/system/cpu/cpu" + std::to_string(cpu), error)) {
+                    const auto name = entry.path().filename().string();
+                    if(name.size() > 4 && name.compare(0, 4, "node") == 0 && std::isdigit(static_cast<unsigned char>(name[4]))) {
+                        node = std::stoul(name.substr(4));
+                        break;
+                    }
+                }
+                cores.push_back({cpu, node});
+            }
+#endif
+    if(cores.empty())
+        for(size_t cpu = 0; cpu < std::max(1u, std::thread::hardware_concurrency()); ++cpu)
+            cores.push_back({cpu, 0});
+    std::stable_sort(cores.begin(), cores.end(), [](const Core& a, const Core& b) { return a.node < b.node; });
+    return cores;
+}
+
+void pin_current_thread(size_t cpu) {
+#ifdef _WIN32
+    SetThreadAffinityMask(GetCurrentThread(), static_cast<DWORD_PTR>(1) << cpu);
+#elif defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+    (void)cpu; // No thread affinity API, the placement is left to the OS.
+#endif
+}
+
+} // namespace
+
+ThreadPool::ThreadPool(size_t workers, bool pinned) : _worker_count(std::max<size_t>(workers, 1)), _pinned(pinned), _ranges(new Range[_worker_count]) {
+    if(!_pinned) {
+        for(size_t w = 1; w < _worker_count; ++w)
+            _threads.emplace_back(&ThreadPool::worker_loop, this, w, 0);
+        return;
+    }
+
+    // More workers than cores: Several workers share a core
+    const auto cores = available_cores();
+    _nodes.resize(_worker_count);
+    for(size_t w = 0; w < _worker_count; ++w) {
+        const auto& core = cores[w % cores.size()];
+        _nodes[w] = core.node;
+        _node_count = std::max(_node_count, core.node + 1);
+        _threads.emplace_back(&ThreadPool::worker_loop, this, w, core.cpu);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+    }
+    _start.notify_all();
+    for(auto& t : _threads)
+        t.join();
+}
+
+void ThreadPool::parallel_for(size_t count, const task_t& task, bool steal) {
+    for(size_t w = 0; w < _worker_count; ++w) {
+        const uint64_t begin = share_begin(count, w);
+        const uint64_t end = share_begin(count, w + 1);
+        _ranges[w].bounds.store((begin << 32) | end, std::memory_order_relaxed);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _task = &task;
+        _steal = steal;
+        _running = _threads.size();
+        ++_batch;
+    }
+    _start.notify_all();
+
+    if(!_pinned)
+        work(0);
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    _finished.wait(lock, [&] { return _running == 0; });
+    _task = nullptr;
+}
+
+void ThreadPool::worker_loop(size_t worker, size_t cpu) {
+    if(_pinned)
+        pin_current_thread(cpu);
+    uint64_t last_batch = 0;
+    while(true) {
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _start.wait(lock, [&] { return _stop || _batch != last_batch; });
+            if(_stop)
+                return;
+            last_batch = _batch;
+        }
+
+        work(worker);
+
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            --_running;
+        }
+        _finished.notify_one();
+    }
+}
+
+void ThreadPool::work(size_t worker) {
+    size_t index;
+    while(pop(worker, index))
+        (*_task)(index, worker);
+    if(!_steal)
+        return;
+    // Own share is done, help the others. Shares only ever shrink, so a single pass over the victims is enough.
+    for(size_t v = 1; v < _worker_count; ++v) {
+        const auto victim = (worker + v) % _worker_count;
+        while(steal(victim, index))
+            (*_task)(index, worker);
+    }
+}
+
+bool ThreadPool::pop(size_t worker, size_t& index) {
+    auto& bounds = _ranges[worker].bounds;
+    auto  current = bounds.load(std::memory_order_acquire);
+    while(true) {
+        const auto begin = current >> 32;
+        const auto end = current & 0xFFFFFFFF;
+        if(begin >= end)
+            return false;
+        if(bounds.compare_exchange_weak(current, ((begin + 1) << 32) | end, std::memory_order_acq_rel)) {
+            index = begin;
+            return true;
+        }
+    }
+}
+
+bool ThreadPool::steal(size_t victim, size_t& index) {
+    auto& bounds = _ranges[victim].bounds;
+    auto  current = bounds.load(std::memory_order_acquire);
+    while(true) {
+        const auto begin = current >> 32;
+        const auto end = current & 0xFFFFFFFF;
+        if(begin >= end)
+            return false;
+        if(bounds.compare_exchange_weak(current, (begin << 32) | (end - 1), std::memory_order_acq_rel)) {
+            index = end - 1;
+            return true;
+        }
+    }
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Fixed set of worker threads running batches of independent tasks.
+ *
+ * Each worker starts on its own contiguous share of the batch (so a given index tends to run on the same worker from
+ * one batch to the next) and steals from the end of the other shares once its own is exhausted: Uneven task costs
+ * do not leave workers idle.
+ * The calling thread takes part in the batch as worker 0.
+ *
+ * Pinned pools instead dedicate one thread per worker, pinned to its own core. Cores are taken node by node: Memory
+ * allocated by a worker is local to its NUMA node (first touch), and batches run without stealing keep each index on
+ * the same worker, hence on the node holding its data.
+ **/
+class ThreadPool {
+  public:
+    /// Called with the task index and the worker running it.
+    using task_t = std::function<void(size_t index, size_t worker)>;
+
+    /// @param workers Total number of workers, calling thread included unless pinned.
+    /// @param pinned  Pins each worker thread to a core. The calling thread then only waits for the batches.
+    ThreadPool(size_t workers = std::thread::hardware_concurrency(), bool pinned = false);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    inline size_t worker_count() const { return _worker_count; }
+    inline bool   is_pinned() const { return _pinned; }
+    /// NUMA node of the core a pinned worker runs on, 0 if the pool isn't pinned.
+    inline size_t worker_node(size_t worker) const { return _nodes.empty() ? 0 : _nodes[worker]; }
+    inline size_t node_count() const { return _node_count; }
+
+    /// Indices run by a worker without stealing, for a batch of count tasks: [share_begin(count, worker), share_begin(count, worker + 1))
+    inline size_t share_begin(size_t count, size_t worker) const { return count * worker / _worker_count; }
+
+    /// Runs task for every index in [0, count) and waits for all of them to complete.
+    /// Not reentrant: Tasks must not call parallel_for on the same pool.
+    /// @param steal false: Each worker only runs its own share, see share_begin.
+    void parallel_for(size_t count, const task_t& task, bool steal = true);
+
+  private:
+    /// Remaining indices of a worker share: begin in the high 32 bits, end in the low 32 bits.
+    /// Owner and thieves both update it with a CAS, so no lock is needed.
+    struct alignas(64) Range {
+        std::atomic<uint64_t> bounds{0};
+    };
+
+    size_t                   _worker_count;
+    bool                     _pinned;
+    std::vector<size_t>      _nodes; ///< Per worker, only if pinned
+    size_t                   _node_count = 1;
+    std::unique_ptr<Range[]> _ranges;
+    std::vector<std::thread> _threads;
+
+    std::mutex              _mutex;
+    std::condition_variable _start;
+    std::condition_variable _finished;
+    uint64_t                _batch = 0;   ///< Incremented to wake up the workers
+    size_t                  _running = 0; ///< Worker threads still busy with the current batch
+    bool                    _stop = false;
+    const task_t*           _task = nullptr;
+    bool                    _steal = true;
+
+    void worker_loop(size_t worker, size_t cpu);
+    void work(size_t worker);
+    bool pop(size_t worker, size_t& index);
+    bool steal(size_t victim, size_t& index);
+};